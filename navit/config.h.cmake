@@ -7,6 +7,7 @@
 #cmakedefine HAVE_API_WIN32 1
 #cmakedefine HAVE_API_WIN32_CE 1
 #cmakedefine HAVE_GLIB 1
+#cmakedefine HAVE_PTHREAD 1
 #cmakedefine HAVE_GMODULE 1
 #cmakedefine HAVE_GETCWD 1
 #define CACHE_SIZE ${CACHE_SIZE}
@@ -26,6 +27,8 @@
 
 #cmakedefine USE_ROUTING 1
 
+#cmakedefine USE_FIBHEAP 1
+
 #cmakedefine HAVE_GTK2 1
 
 #cmakedefine HAVE_FONTCONFIG 1
@@ -58,6 +61,8 @@
 
 #cmakedefine HAVE_SYS_TIME_H 1
 
+#cmakedefine HAVE_SYS_RESOURCE_H 1
+
 #cmakedefine HAVE_POPEN 1
 
 #cmakedefine HAVE_GETOPT_H 1
@@ -193,6 +193,17 @@ ATTR(turn_around_count)
 ATTR(turn_around_penalty)
 ATTR(turn_around_penalty2)
 ATTR(autozoom_max)
+ATTR(route_search)
+ATTR(route_threads)
+ATTR(thread_safe)
+ATTR(cache_hits)
+ATTR(cache_misses)
+ATTR(cache_evictions)
+ATTR(cache_resident)
+ATTR(match_folded)
+ATTR(town_key_index)
+ATTR(draw_threads)
+ATTR(lod_tolerance)
 ATTR2(0x00027500,type_rel_abs_begin)
 /* These attributes are int that can either hold relative		*
  * or absolute values. A relative value is indicated by 		*
@@ -410,6 +421,7 @@ ATTR(ch_edge)
 ATTR(zipfile_ref_block)
 ATTR(item_id)
 ATTR(pdl_gps_update)
+ATTR(tile_index)
 ATTR2(0x0004ffff,type_special_end)
 ATTR2(0x00050000,type_double_begin)
 ATTR(position_height)
@@ -1,15 +1,24 @@
+#include "config.h"
 #include "glib_slice.h"
 #ifdef DEBUG_CACHE
 #include <stdio.h>
 #endif
 #include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "debug.h"
 #include "cache.h"
 
+/* Maximum number of independently locked parts of a cache, a power of 2. Each has an equal share of the cache size. */
+#define CACHE_SHARDS 4
+/* Smallest size of a part, so that it still holds a large tile next to others */
+#define CACHE_SHARD_MIN_SIZE 1048576
+
 struct cache_entry {
 	int usage;
 	int size;
-	struct cache_entry_list *where;
+	struct cache_entry_list *where;		/* NULL if the entry is not (yet) in the cache */
 	struct cache_entry *next;
 	struct cache_entry *prev;
 	int id[0];
@@ -20,15 +29,35 @@ struct cache_entry_list {
 	int size;
 };
 
-struct cache {
-	struct cache_entry_list t1,b1,t2,b2,*insert;
-	int size,id_size,entry_size;
+/* An ARC cache on its own, holding the entries whose id hashes to it */
+struct cache_shard {
+	struct cache_entry_list t1,b1,t2,b2;
+	int size;
 	int t1_target;
 	int misses;
 	int hits;
+	int evictions;
 	GHashTable *hash;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
 };
 
+struct cache {
+	int id_size,entry_size;
+	guint (*hash)(gconstpointer key);
+	int shard_count;
+	struct cache_shard shards[CACHE_SHARDS];
+};
+
+#ifdef HAVE_PTHREAD
+#define cache_shard_lock(shard) pthread_mutex_lock(&(shard)->mutex)
+#define cache_shard_unlock(shard) pthread_mutex_unlock(&(shard)->mutex)
+#else
+#define cache_shard_lock(shard)
+#define cache_shard_unlock(shard)
+#endif
+
 static void
 cache_entry_dump(struct cache *cache, struct cache_entry *entry)
 {
@@ -54,18 +83,34 @@ cache_list_dump(char *str, struct cache *cache, struct cache_entry_list *list)
 	}
 }
 
+/* Mixes the words of an id, so that ids differing in any bit spread over the hash table and the shards */
+static inline guint
+cache_hash_words(const int *id, int count)
+{
+	guint h=0x811c9dc5;
+	while (count--) {
+		h^=(guint)*id++;
+		h*=0x01000193;
+		h^=h >> 15;
+	}
+	h^=h >> 16;
+	h*=0x85ebca6b;
+	h^=h >> 13;
+	h*=0xc2b2ae35;
+	h^=h >> 16;
+	return h;
+}
+
 static guint
 cache_hash4(gconstpointer key)
 {
-	int *id=(int *)key;
-	return id[0];
+	return cache_hash_words(key, 1);
 }
 
 static guint
 cache_hash20(gconstpointer key)
 {
-	int *id=(int *)key;
-	return id[0]^id[1]^id[2]^id[3]^id[4];
+	return cache_hash_words(key, 5);
 }
 
 static gboolean
@@ -90,37 +135,84 @@ cache_equal20(gconstpointer a, gconstpointer b)
 	       ida[4] == idb[4]);
 }
 
+static struct cache_shard *
+cache_get_shard(struct cache *cache, void *id)
+{
+	return &cache->shards[(cache->hash(id) >> 24) & (cache->shard_count-1)];
+}
+
+static struct cache_entry *
+cache_get_entry(struct cache *cache, void *data)
+{
+	return (struct cache_entry *)((char *)data-cache->entry_size);
+}
+
+/**
+ * @brief Creates a new cache
+ *
+ * The cache is split into up to CACHE_SHARDS parts with a lock of their own, so it may be used
+ * from several threads. Caches too small to give each part CACHE_SHARD_MIN_SIZE are split
+ * into fewer parts, down to a single one.
+ *
+ * @param id_size Size of the ids of the entries in bytes, 4 and 20 are supported
+ * @param size Size of the cache in bytes, including the management overhead of the entries
+ * @return The new cache, or NULL if id_size is not supported
+ */
 struct cache *
 cache_new(int id_size, int size)
 {
-	struct cache *cache=g_new0(struct cache, 1);
-	
-	cache->id_size=id_size/4;
-	cache->entry_size=cache->id_size*sizeof(int)+sizeof(struct cache_entry);
-	cache->size=size;
+	struct cache *cache;
+	GEqualFunc equal;
+	int i;
+
 	switch (id_size) {
 	case 4:
-		cache->hash=g_hash_table_new(cache_hash4, cache_equal4);
+		equal=cache_equal4;
 		break;
 	case 20:
-		cache->hash=g_hash_table_new(cache_hash20, cache_equal20);
+		equal=cache_equal20;
 		break;
 	default:
 		dbg(lvl_error,"cache with id_size of %d not supported\n", id_size);
-		g_free(cache);
-		cache=NULL;
+		return NULL;
+	}
+	cache=g_new0(struct cache, 1);
+	cache->id_size=id_size/4;
+	cache->entry_size=cache->id_size*sizeof(int)+sizeof(struct cache_entry);
+	cache->hash=id_size == 4 ? cache_hash4 : cache_hash20;
+	cache->shard_count=CACHE_SHARDS;
+	while (cache->shard_count > 1 && size/cache->shard_count < CACHE_SHARD_MIN_SIZE)
+		cache->shard_count/=2;
+	for (i = 0 ; i < cache->shard_count ; i++) {
+		cache->shards[i].size=size/cache->shard_count;
+		cache->shards[i].hash=g_hash_table_new(cache->hash, equal);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_init(&cache->shards[i].mutex, NULL);
+#endif
 	}
 	return cache;
 }
 
+/**
+ * @brief Changes the size of a cache
+ *
+ * The number of parts stays the one chosen by cache_new(), as the entries are already spread over them.
+ */
 void
 cache_resize(struct cache *cache, int size)
 {
-	cache->size=size;
+	int i;
+	for (i = 0 ; i < cache->shard_count ; i++) {
+		struct cache_shard *shard=&cache->shards[i];
+		cache_shard_lock(shard);
+		shard->size=size/cache->shard_count;
+		shard->t1_target=MIN(shard->t1_target, shard->size);
+		cache_shard_unlock(shard);
+	}
 }
 
 static void
-cache_insert_mru(struct cache *cache, struct cache_entry_list *list, struct cache_entry *entry)
+cache_insert_mru(struct cache_shard *shard, struct cache_entry_list *list, struct cache_entry *entry)
 {
 	entry->prev=NULL;
 	entry->next=list->first;
@@ -131,14 +223,14 @@ cache_insert_mru(struct cache *cache, struct cache_entry_list *list, struct cach
 	if (! list->last)
 		list->last=entry;
 	list->size+=entry->size;
-	if (cache) 
-		g_hash_table_insert(cache->hash, (gpointer)entry->id, entry);
+	if (shard)
+		g_hash_table_insert(shard->hash, (gpointer)entry->id, entry);
 }
 
 static void
 cache_remove_from_list(struct cache_entry_list *list, struct cache_entry *entry)
 {
-	if (entry->prev) 
+	if (entry->prev)
 		entry->prev->next=entry->next;
 	else
 		list->first=entry->next;
@@ -150,10 +242,10 @@ cache_remove_from_list(struct cache_entry_list *list, struct cache_entry *entry)
 }
 
 static void
-cache_remove(struct cache *cache, struct cache_entry *entry)
+cache_remove(struct cache_shard *shard, struct cache_entry *entry)
 {
 	dbg(lvl_debug,"remove 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	g_hash_table_remove(cache->hash, (gpointer)(entry->id));
+	g_hash_table_remove(shard->hash, (gpointer)(entry->id));
 	g_slice_free1(entry->size, entry);
 }
 
@@ -173,7 +265,7 @@ cache_remove_lru_helper(struct cache_entry_list *list)
 }
 
 static struct cache_entry *
-cache_remove_lru(struct cache *cache, struct cache_entry_list *list)
+cache_remove_lru(struct cache_shard *shard, struct cache_entry_list *list)
 {
 	struct cache_entry *last;
 	int seen=0;
@@ -183,23 +275,35 @@ cache_remove_lru(struct cache *cache, struct cache_entry_list *list)
 		seen+=last->size;
 	}
 	last=list->last;
-	if (! last || last->usage || seen >= list->size) 
+	if (! last || last->usage || seen >= list->size)
 		return NULL;
 	dbg(lvl_debug,"removing %d\n", last->id[0]);
 	cache_remove_lru_helper(list);
-	if (cache) {
-		cache_remove(cache, last);
+	if (shard) {
+		if (list == &shard->t1 || list == &shard->t2)
+			shard->evictions++;
+		cache_remove(shard, last);
 		return NULL;
 	}
 	return last;
 }
 
+/**
+ * @brief Allocates an entry, which is not in the cache yet
+ *
+ * The caller fills the data and then adds it with cache_insert(), or drops it with
+ * cache_entry_destroy().
+ *
+ * @param cache The cache
+ * @param id The id of the entry
+ * @param size Size of the data
+ * @return The data of the entry
+ */
 void *
 cache_entry_new(struct cache *cache, void *id, int size)
 {
 	struct cache_entry *ret;
 	size+=cache->entry_size;
-	cache->misses+=size;
 	ret=(struct cache_entry *)g_slice_alloc0(size);
 	ret->size=size;
 	ret->usage=1;
@@ -207,168 +311,219 @@ cache_entry_new(struct cache *cache, void *id, int size)
 	return &ret->id[cache->id_size];
 }
 
+/**
+ * @brief Releases an entry returned by cache_lookup(), cache_entry_new() or cache_insert_new()
+ *
+ * Entries which are not in the cache are freed when their last user releases them.
+ */
 void
 cache_entry_destroy(struct cache *cache, void *data)
 {
-	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
+	struct cache_entry *entry=cache_get_entry(cache, data);
+	struct cache_shard *shard=cache_get_shard(cache, entry->id);
 	dbg(lvl_debug,"destroy 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	entry->usage--;
+	cache_shard_lock(shard);
+	if (!--entry->usage && !entry->where) {
+		cache_shard_unlock(shard);
+		g_slice_free1(entry->size, entry);
+		return;
+	}
+	cache_shard_unlock(shard);
 }
 
 static struct cache_entry *
-cache_trim(struct cache *cache, struct cache_entry *entry)
+cache_trim(struct cache *cache, struct cache_shard *shard, struct cache_entry *entry)
 {
 	struct cache_entry *new_entry;
 	dbg(lvl_debug,"trim 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	dbg(lvl_debug,"Trim %x from %d -> %d\n", entry->id[0], entry->size, cache->size);
+	dbg(lvl_debug,"Trim %x from %d -> %d\n", entry->id[0], entry->size, shard->size);
 	if ( cache->entry_size < entry->size )
 	{
-	    g_hash_table_remove(cache->hash, (gpointer)(entry->id));
+	    g_hash_table_remove(shard->hash, (gpointer)(entry->id));
 
 	    new_entry = g_slice_alloc0(cache->entry_size);
 	    memcpy(new_entry, entry, cache->entry_size);
 	    g_slice_free1( entry->size, entry);
 	    new_entry->size = cache->entry_size;
 
-	    g_hash_table_insert(cache->hash, (gpointer)new_entry->id, new_entry);
+	    g_hash_table_insert(shard->hash, (gpointer)new_entry->id, new_entry);
 	}
 	else
 	{
-	    new_entry = entry; 
+	    new_entry = entry;
 	}
-	
+
 	return new_entry;
 }
 
 static struct cache_entry *
-cache_move(struct cache *cache, struct cache_entry_list *old, struct cache_entry_list *new)
+cache_move(struct cache *cache, struct cache_shard *shard, struct cache_entry_list *old, struct cache_entry_list *new)
 {
 	struct cache_entry *entry;
 	entry=cache_remove_lru(NULL, old);
 	if (! entry)
 		return NULL;
-	entry=cache_trim(cache, entry);
+	shard->evictions++;
+	entry=cache_trim(cache, shard, entry);
 	cache_insert_mru(NULL, new, entry);
 	return entry;
 }
 
 static int
-cache_replace(struct cache *cache)
+cache_replace(struct cache *cache, struct cache_shard *shard)
 {
-	if (cache->t1.size >= MAX(1,cache->t1_target)) {
+	if (shard->t1.size >= MAX(1,shard->t1_target)) {
 		dbg(lvl_debug,"replace 12\n");
-		if (!cache_move(cache, &cache->t1, &cache->b1))
-			cache_move(cache, &cache->t2, &cache->b2);
+		if (!cache_move(cache, shard, &shard->t1, &shard->b1) && !cache_move(cache, shard, &shard->t2, &shard->b2))
+			return 0;
 	} else {
 		dbg(lvl_debug,"replace t2\n");
-		if (!cache_move(cache, &cache->t2, &cache->b2))
-			cache_move(cache, &cache->t1, &cache->b1);
-	}
-#if 0
-	if (! entry) {
-		cache_dump(cache);
-		exit(0);
+		if (!cache_move(cache, shard, &shard->t2, &shard->b2) && !cache_move(cache, shard, &shard->t1, &shard->b1))
+			return 0;
 	}
-#endif
 	return 1;
 }
 
 void
 cache_flush(struct cache *cache, void *id)
 {
-	struct cache_entry *entry=g_hash_table_lookup(cache->hash, id);
+	struct cache_shard *shard=cache_get_shard(cache, id);
+	struct cache_entry *entry;
+	cache_shard_lock(shard);
+	entry=g_hash_table_lookup(shard->hash, id);
 	if (entry) {
 		cache_remove_from_list(entry->where, entry);
-		cache_remove(cache, entry);
+		cache_remove(shard, entry);
 	}
+	cache_shard_unlock(shard);
 }
 
 void
 cache_flush_data(struct cache *cache, void *data)
 {
-	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
-	if (entry) {
+	struct cache_entry *entry=cache_get_entry(cache, data);
+	struct cache_shard *shard=cache_get_shard(cache, entry->id);
+	cache_shard_lock(shard);
+	if (entry->where) {
 		cache_remove_from_list(entry->where, entry);
-		cache_remove(cache, entry);
-	}
+		cache_remove(shard, entry);
+	} else
+		g_slice_free1(entry->size, entry);
+	cache_shard_unlock(shard);
 }
 
 
+/**
+ * @brief Looks up an entry
+ *
+ * A found entry has to be released with cache_entry_destroy(). If the entry is not found,
+ * the caller may create it with cache_entry_new() or cache_insert_new().
+ *
+ * @param cache The cache
+ * @param id The id of the entry
+ * @return The data of the entry, or NULL if it is not in the cache
+ */
 void *
 cache_lookup(struct cache *cache, void *id) {
+	struct cache_shard *shard=cache_get_shard(cache, id);
 	struct cache_entry *entry;
 
 	dbg(lvl_debug,"get %d\n", ((int *)id)[0]);
-	entry=g_hash_table_lookup(cache->hash, id);
-	if (entry == NULL) {
-		cache->insert=&cache->t1;
+	cache_shard_lock(shard);
+	entry=g_hash_table_lookup(shard->hash, id);
+	if (entry && (entry->where == &shard->t1 || entry->where == &shard->t2)) {
+		dbg(lvl_debug,"found 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
+		shard->hits++;
 #ifdef DEBUG_CACHE
-		fprintf(stderr,"-");
-#endif
-		dbg(lvl_debug,"not in cache\n");
-		return NULL;
-	}
-	dbg(lvl_debug,"found 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	if (entry->where == &cache->t1 || entry->where == &cache->t2) {
-		cache->hits+=entry->size;
-#ifdef DEBUG_CACHE
-		if (entry->where == &cache->t1)
+		if (entry->where == &shard->t1)
 			fprintf(stderr,"h");
 		else
 			fprintf(stderr,"H");
 #endif
-		dbg(lvl_debug,"in cache %s\n", entry->where == &cache->t1 ? "T1" : "T2");
+		dbg(lvl_debug,"in cache %s\n", entry->where == &shard->t1 ? "T1" : "T2");
 		cache_remove_from_list(entry->where, entry);
-		cache_insert_mru(NULL, &cache->t2, entry);
+		cache_insert_mru(NULL, &shard->t2, entry);
 		entry->usage++;
+		cache_shard_unlock(shard);
 		return &entry->id[cache->id_size];
-	} else {
-		if (entry->where == &cache->b1) {
-#ifdef DEBUG_CACHE
-			fprintf(stderr,"m");
-#endif
-			dbg(lvl_debug,"in phantom cache B1\n");
-			cache->t1_target=MIN(cache->t1_target+MAX(cache->b2.size/cache->b1.size, 1),cache->size);
-			cache_remove_from_list(&cache->b1, entry);
-		} else if (entry->where == &cache->b2) {
+	}
+	/* Entries in the phantom caches B1 and B2 are handled when the data is inserted again */
+	shard->misses++;
 #ifdef DEBUG_CACHE
-			fprintf(stderr,"M");
+	fprintf(stderr,entry ? (entry->where == &shard->b1 ? "m" : "M") : "-");
 #endif
-			dbg(lvl_debug,"in phantom cache B2\n");
-			cache->t1_target=MAX(cache->t1_target-MAX(cache->b1.size/cache->b2.size, 1),0);
-			cache_remove_from_list(&cache->b2, entry);
-		} else {
-			dbg(lvl_error,"**ERROR** invalid where\n");
-		}
-		cache_replace(cache);
-		cache_remove(cache, entry);
-		cache->insert=&cache->t2;
-		return NULL;
-	}
+	dbg(lvl_debug,"not in cache\n");
+	cache_shard_unlock(shard);
+	return NULL;
+}
+
+/* Checks whether an entry is cached, without counting this as a use of it */
+int
+cache_contains(struct cache *cache, void *id)
+{
+	struct cache_shard *shard=cache_get_shard(cache, id);
+	struct cache_entry *entry;
+	int ret;
+	cache_shard_lock(shard);
+	entry=g_hash_table_lookup(shard->hash, id);
+	ret=entry && (entry->where == &shard->t1 || entry->where == &shard->t2);
+	cache_shard_unlock(shard);
+	return ret;
 }
 
+/**
+ * @brief Adds an entry created with cache_entry_new() to the cache
+ *
+ * If another thread added an entry with the same id in the meantime, the new entry stays
+ * outside of the cache and is freed when it is released.
+ */
 void
 cache_insert(struct cache *cache, void *data)
 {
-	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
+	struct cache_entry *entry=cache_get_entry(cache, data);
+	struct cache_shard *shard=cache_get_shard(cache, entry->id);
+	struct cache_entry *old;
+	struct cache_entry_list *insert=&shard->t1;
 	dbg(lvl_debug,"insert 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	if (cache->insert == &cache->t1) {
-		if (cache->t1.size + cache->b1.size >= cache->size) {
-			if (cache->t1.size < cache->size) {
-				cache_remove_lru(cache, &cache->b1);
-				cache_replace(cache);
+	cache_shard_lock(shard);
+	old=g_hash_table_lookup(shard->hash, entry->id);
+	if (old) {
+		if (old->where == &shard->t1 || old->where == &shard->t2) {
+			dbg(lvl_debug,"already in cache\n");
+			cache_shard_unlock(shard);
+			return;
+		}
+		if (old->where == &shard->b1) {
+			dbg(lvl_debug,"in phantom cache B1\n");
+			shard->t1_target=MIN(shard->t1_target+MAX(shard->b2.size/shard->b1.size, 1),shard->size);
+		} else {
+			dbg(lvl_debug,"in phantom cache B2\n");
+			shard->t1_target=MAX(shard->t1_target-MAX(shard->b1.size/shard->b2.size, 1),0);
+		}
+		cache_remove_from_list(old->where, old);
+		cache_replace(cache, shard);
+		cache_remove(shard, old);
+		insert=&shard->t2;
+	} else {
+		if (shard->t1.size + shard->b1.size >= shard->size) {
+			if (shard->t1.size < shard->size) {
+				cache_remove_lru(shard, &shard->b1);
+				cache_replace(cache, shard);
 			} else {
-				cache_remove_lru(cache, &cache->t1);
+				cache_remove_lru(shard, &shard->t1);
 			}
 		} else {
-			if (cache->t1.size + cache->t2.size + cache->b1.size + cache->b2.size >= cache->size) {
-				if (cache->t1.size + cache->t2.size + cache->b1.size + cache->b2.size >= 2*cache->size) 
-					cache_remove_lru(cache, &cache->b2);
-				cache_replace(cache);
+			if (shard->t1.size + shard->t2.size + shard->b1.size + shard->b2.size >= shard->size) {
+				if (shard->t1.size + shard->t2.size + shard->b1.size + shard->b2.size >= 2*shard->size)
+					cache_remove_lru(shard, &shard->b2);
+				cache_replace(cache, shard);
 			}
 		}
 	}
-	cache_insert_mru(cache, cache->insert, entry);
+	/* ARC replaces one entry per insert, a larger new entry may need more to stay within the size in bytes */
+	while (shard->t1.size+shard->t2.size+entry->size > shard->size && cache_replace(cache, shard));
+	cache_insert_mru(shard, insert, entry);
+	cache_shard_unlock(shard);
 }
 
 void *
@@ -376,26 +531,57 @@ cache_insert_new(struct cache *cache, void *id, int size)
 {
 	void *data=cache_entry_new(cache, id, size);
 	cache_insert(cache, data);
-	return data;	
+	return data;
+}
+
+/**
+ * @brief Gets the statistics of a cache, summed over all of its parts
+ *
+ * @param cache The cache
+ * @param stats Returns the number of hits, misses and evicted entries, and the bytes in the cache
+ */
+void
+cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+	int i;
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0 ; i < cache->shard_count ; i++) {
+		struct cache_shard *shard=&cache->shards[i];
+		cache_shard_lock(shard);
+		stats->hits+=shard->hits;
+		stats->misses+=shard->misses;
+		stats->evictions+=shard->evictions;
+		stats->resident+=shard->t1.size+shard->t2.size;
+		cache_shard_unlock(shard);
+	}
 }
 
 static void
 cache_stats(struct cache *cache)
 {
-	dbg(lvl_debug,"hits %d misses %d hitratio %d size %d entry_size %d id_size %d T1 target %d\n", cache->hits, cache->misses, cache->hits*100/(cache->hits+cache->misses), cache->size, cache->entry_size, cache->id_size, cache->t1_target);
-	dbg(lvl_debug,"T1:%d B1:%d T2:%d B2:%d\n", cache->t1.size, cache->b1.size, cache->t2.size, cache->b2.size);
-	cache->hits=0;
-	cache->misses=0;
+	struct cache_stats stats;
+	int i;
+	cache_get_stats(cache, &stats);
+	dbg(lvl_debug,"hits %d misses %d hitratio %d evictions %d resident %d entry_size %d id_size %d\n", stats.hits, stats.misses, stats.hits*100/MAX(stats.hits+stats.misses,1), stats.evictions, stats.resident, cache->entry_size, cache->id_size);
+	for (i = 0 ; i < cache->shard_count ; i++) {
+		struct cache_shard *shard=&cache->shards[i];
+		dbg(lvl_debug,"%d: size %d T1 target %d T1:%d B1:%d T2:%d B2:%d\n", i, shard->size, shard->t1_target, shard->t1.size, shard->b1.size, shard->t2.size, shard->b2.size);
+	}
 }
 
 void
 cache_dump(struct cache *cache)
 {
+	int i;
 	cache_stats(cache);
-	cache_list_dump("T1", cache, &cache->t1);
-	cache_list_dump("B1", cache, &cache->b1);
-	cache_list_dump("T2", cache, &cache->t2);
-	cache_list_dump("B2", cache, &cache->b2);
+	for (i = 0 ; i < cache->shard_count ; i++) {
+		struct cache_shard *shard=&cache->shards[i];
+		cache_shard_lock(shard);
+		cache_list_dump("T1", cache, &shard->t1);
+		cache_list_dump("B1", cache, &shard->b1);
+		cache_list_dump("T2", cache, &shard->t2);
+		cache_list_dump("B2", cache, &shard->b2);
+		cache_shard_unlock(shard);
+	}
 	dbg(lvl_debug,"dump end\n");
 }
-
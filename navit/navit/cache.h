@@ -1,14 +1,25 @@
 struct cache_entry;
 struct cache;
+
+/** Statistics of a cache, see cache_get_stats() */
+struct cache_stats {
+	int hits;		/**< Number of lookups which found the entry */
+	int misses;		/**< Number of lookups which did not find the entry */
+	int evictions;		/**< Number of entries dropped to make room for others */
+	int resident;		/**< Number of bytes held by the cache */
+};
+
 /* prototypes */
 struct cache *cache_new(int id_size, int size);
 void cache_resize(struct cache *cache, int size);
 void *cache_entry_new(struct cache *cache, void *id, int size);
 void cache_entry_destroy(struct cache *cache, void *data);
 void *cache_lookup(struct cache *cache, void *id);
+int cache_contains(struct cache *cache, void *id);
 void cache_insert(struct cache *cache, void *data);
 void *cache_insert_new(struct cache *cache, void *id, int size);
 void cache_flush(struct cache *cache, void *id);
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
 void cache_dump(struct cache *cache);
 void cache_flush_data(struct cache *cache, void *data);
 /* end of prototypes */
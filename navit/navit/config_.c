@@ -27,6 +27,7 @@
 #include "navit.h"
 #include "config_.h"
 #include "file.h"
+#include "cache.h"
 #ifdef HAVE_API_WIN32_CE
 #include "libc.h"
 #endif
@@ -83,7 +84,28 @@ config_new_int(void)
 int
 config_get_attr(struct config *this_, enum attr_type type, struct attr *attr, struct attr_iter *iter)
 {
-	return attr_generic_get_attr(this_->attrs, NULL, type, attr, iter);
+	struct cache_stats stats;
+
+	switch (type) {
+	case attr_cache_hits:
+	case attr_cache_misses:
+	case attr_cache_evictions:
+	case attr_cache_resident:
+		if (!file_get_cache_stats(&stats))
+			return 0;
+		attr->type=type;
+		if (type == attr_cache_hits)
+			attr->u.num=stats.hits;
+		else if (type == attr_cache_misses)
+			attr->u.num=stats.misses;
+		else if (type == attr_cache_evictions)
+			attr->u.num=stats.evictions;
+		else
+			attr->u.num=stats.resident;
+		return 1;
+	default:
+		return attr_generic_get_attr(this_->attrs, NULL, type, attr, iter);
+	}
 }
 
 static int
@@ -170,7 +192,7 @@ config_new(struct attr *parent, struct attr **attrs)
 struct object_func config_func = {
 	attr_config,
 	(object_func_new)config_new,
-	(object_func_get_attr)navit_object_get_attr,
+	(object_func_get_attr)config_get_attr,
 	(object_func_iter_new)navit_object_attr_iter_new,
 	(object_func_iter_destroy)navit_object_attr_iter_destroy,
 	(object_func_set_attr)config_set_attr,
@@ -43,6 +43,10 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 extern char *version;
 
@@ -59,6 +63,43 @@ static GHashTable *file_name_hash;
 #endif
 
 static struct cache *file_cache;
+static int file_cache_size;
+
+#ifdef HAVE_PTHREAD
+/* Serializes the reads, so maps can be read from several threads. file_cache locks itself. */
+static pthread_mutex_t file_mutex=PTHREAD_MUTEX_INITIALIZER;
+#define file_lock() pthread_mutex_lock(&file_mutex)
+#define file_unlock() pthread_mutex_unlock(&file_mutex)
+
+/** Number of threads inflating data for file_data_prefetch_compressed() */
+#define FILE_PREFETCH_THREADS 2
+/** Maximum number of queued prefetch requests, the oldest ones are dropped when it is exceeded */
+#define FILE_PREFETCH_QUEUE 64
+
+/**
+ * @brief A block of compressed data to be inflated into file_cache by a prefetch thread
+ */
+struct file_prefetch {
+	struct file_prefetch *next;
+	struct file *file;
+	long long offset;
+	int size;
+	int size_uncomp;
+};
+
+/* All of the prefetch state is protected by file_mutex */
+static pthread_cond_t file_prefetch_cond=PTHREAD_COND_INITIALIZER;	/* signalled when a job is queued or finished */
+static struct file_prefetch *file_prefetch_todo,**file_prefetch_todo_last=&file_prefetch_todo;
+static int file_prefetch_todo_count;
+static struct file_prefetch *file_prefetch_running[FILE_PREFETCH_THREADS];
+static int file_prefetch_thread_count;
+/* Uncompressed size of the queued and running jobs, kept below a quarter of the cache size so
+ * prefetching does not evict the data in use */
+static int file_prefetch_bytes;
+#else
+#define file_lock()
+#define file_unlock()
+#endif
 
 #ifdef HAVE_PRAGMA_PACK
 #pragma pack(push)
@@ -333,10 +374,20 @@ file_mmap(struct file *file)
 	return 1;
 }
 
+static void
+file_data_release(struct file *file, unsigned char *data)
+{
+	if (file->cache && data) {
+		cache_entry_destroy(file_cache, data);
+	} else
+		g_free(data);
+}
+
 unsigned char *
 file_data_read(struct file *file, long long offset, int size)
 {
 	void *ret;
+	int ok;
 	if (file->special)
 		return NULL;
 	if (file->begin)
@@ -346,14 +397,19 @@ file_data_read(struct file *file, long long offset, int size)
 		ret=cache_lookup(file_cache,&id); 
 		if (ret)
 			return ret;
-		ret=cache_insert_new(file_cache,&id,size);
+		ret=cache_entry_new(file_cache,&id,size);
 	} else
 		ret=g_malloc(size);
+	file_lock();
 	lseek(file->fd, offset, SEEK_SET);
-	if (read(file->fd, ret, size) != size) {
-		file_data_free(file, ret);
-		ret=NULL;
+	ok=read(file->fd, ret, size) == size;
+	file_unlock();
+	if (!ok) {
+		file_data_release(file, ret);
+		return NULL;
 	}
+	if (file->cache)
+		cache_insert(file_cache, ret);
 	return ret;
 
 }
@@ -522,37 +578,265 @@ uncompress_int(Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLe
 	return err;
 }
 
+#ifdef HAVE_PTHREAD
+static int
+file_prefetch_match(struct file_prefetch *job, struct file *file, long long offset, int size)
+{
+	return job && job->file == file && job->offset == offset && job->size == size;
+}
+
+static int
+file_prefetch_is_running(struct file *file, long long offset, int size)
+{
+	int i;
+	for (i = 0 ; i < file_prefetch_thread_count ; i++) {
+		if (file_prefetch_running[i] && file_prefetch_running[i]->file == file &&
+		    (size == -1 || file_prefetch_match(file_prefetch_running[i], file, offset, size)))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Removes queued prefetch requests, called with file_mutex held
+ *
+ * @param file The file to remove the requests for
+ * @param offset Offset of the data, ignored if size is -1
+ * @param size Size of the data, or -1 to remove all requests for file
+ */
+static void
+file_prefetch_dequeue(struct file *file, long long offset, int size)
+{
+	struct file_prefetch **job=&file_prefetch_todo,*next;
+	while (*job) {
+		if ((*job)->file == file && (size == -1 || file_prefetch_match(*job, file, offset, size))) {
+			next=(*job)->next;
+			file_prefetch_bytes-=(*job)->size_uncomp;
+			g_free(*job);
+			*job=next;
+			file_prefetch_todo_count--;
+		} else
+			job=&(*job)->next;
+	}
+	file_prefetch_todo_last=&file_prefetch_todo;
+	while (*file_prefetch_todo_last)
+		file_prefetch_todo_last=&(*file_prefetch_todo_last)->next;
+}
+
+/**
+ * @brief Makes sure no prefetch thread works on the data, called with file_mutex held
+ *
+ * Queued requests are dropped, as the caller is about to read the data itself. Requests
+ * already being inflated are waited for, after that the data is in file_cache.
+ */
+static void
+file_prefetch_claim(struct file *file, long long offset, int size)
+{
+	if (!file_prefetch_thread_count)
+		return;
+	file_prefetch_dequeue(file, offset, size);
+	while (file_prefetch_is_running(file, offset, size))
+		pthread_cond_wait(&file_prefetch_cond, &file_mutex);
+}
+
+static void *
+file_prefetch_worker(void *data)
+{
+	struct file_prefetch **running=data,*job;
+	struct file_cache_id id;
+	unsigned char *buffer,*ret;
+	uLongf destLen;
+	int ok;
+
+	file_lock();
+	for (;;) {
+		while (!file_prefetch_todo)
+			pthread_cond_wait(&file_prefetch_cond, &file_mutex);
+		job=file_prefetch_todo;
+		file_prefetch_todo=job->next;
+		if (!file_prefetch_todo)
+			file_prefetch_todo_last=&file_prefetch_todo;
+		file_prefetch_todo_count--;
+		*running=job;
+		id.offset=job->offset;
+		id.size=job->size;
+		id.file_name_id=job->file->name_id;
+		id.method=1;
+		if (!cache_contains(file_cache,&id)) {
+			buffer=g_malloc(job->size);
+			lseek(job->file->fd, job->offset, SEEK_SET);
+			ok=read(job->file->fd, buffer, job->size) == job->size;
+			file_unlock();
+			if (ok) {
+				destLen=job->size_uncomp;
+				ret=cache_entry_new(file_cache,&id,job->size_uncomp);
+				if (uncompress_int(ret, &destLen, (Bytef *)buffer, job->size) == Z_OK)
+					cache_insert(file_cache, ret);
+				cache_entry_destroy(file_cache, ret);
+			}
+			g_free(buffer);
+			file_lock();
+		}
+		*running=NULL;
+		file_prefetch_bytes-=job->size_uncomp;
+		g_free(job);
+		pthread_cond_broadcast(&file_prefetch_cond);
+	}
+	file_unlock();
+	return NULL;
+}
+#endif
+
 unsigned char *
 file_data_read_compressed(struct file *file, long long offset, int size, int size_uncomp)
 {
 	void *ret;
 	char *buffer = 0;
 	uLongf destLen=size_uncomp;
+	int ok;
 
 	if (file->cache) {
 		struct file_cache_id id={offset,size,file->name_id,1};
+#ifdef HAVE_PTHREAD
+		file_lock();
+		file_prefetch_claim(file, offset, size);
+		file_unlock();
+#endif
 		ret=cache_lookup(file_cache,&id); 
 		if (ret)
 			return ret;
-		ret=cache_insert_new(file_cache,&id,size_uncomp);
+		ret=cache_entry_new(file_cache,&id,size_uncomp);
 	} else 
 		ret=g_malloc(size_uncomp);
-	lseek(file->fd, offset, SEEK_SET);
 
 	buffer = (char *)g_malloc(size);
-	if (read(file->fd, buffer, size) != size) {
-		g_free(ret);
-		ret=NULL;
-	} else {
-		if (uncompress_int(ret, &destLen, (Bytef *)buffer, size) != Z_OK) {
-			dbg(lvl_error,"uncompress failed\n");
-			g_free(ret);
-			ret=NULL;
-		}
+	file_lock();
+	lseek(file->fd, offset, SEEK_SET);
+	ok=read(file->fd, buffer, size) == size;
+	file_unlock();
+	if (ok && uncompress_int(ret, &destLen, (Bytef *)buffer, size) != Z_OK) {
+		dbg(lvl_error,"uncompress failed\n");
+		ok=0;
 	}
 	g_free(buffer);
+	if (!ok) {
+		file_data_release(file, ret);
+		return NULL;
+	}
+	if (file->cache)
+		cache_insert(file_cache, ret);
+
+	return ret;
+}
+
+/**
+ * @brief Inflates compressed data into the file cache in the background
+ *
+ * A later file_data_read_compressed() with the same parameters finds the data in the cache,
+ * or waits for the prefetch thread if it is still inflating it. Without thread support or
+ * file cache this does nothing.
+ *
+ * @param file The file to read from
+ * @param offset Offset of the compressed data
+ * @param size Size of the compressed data
+ * @param size_uncomp Size of the data after inflating it
+ */
+void
+file_data_prefetch_compressed(struct file *file, long long offset, int size, int size_uncomp)
+{
+#ifdef HAVE_PTHREAD
+	struct file_prefetch *job;
+	struct file_cache_id id={offset,size,file->name_id,1};
+	int i;
+
+	if (!file->cache || file->special || size <= 0 || size_uncomp <= 0)
+		return;
+	file_lock();
+	for (job = file_prefetch_todo ; job ; job=job->next) {
+		if (file_prefetch_match(job, file, offset, size))
+			break;
+	}
+	if (job || file_prefetch_is_running(file, offset, size) || cache_contains(file_cache,&id)) {
+		file_unlock();
+		return;
+	}
+	if (!file_prefetch_thread_count) {
+		pthread_t thread;
+		for (i = 0 ; i < FILE_PREFETCH_THREADS ; i++) {
+			if (pthread_create(&thread, NULL, file_prefetch_worker, &file_prefetch_running[file_prefetch_thread_count]))
+				break;
+			pthread_detach(thread);
+			file_prefetch_thread_count++;
+		}
+		if (!file_prefetch_thread_count) {
+			dbg(lvl_error,"failed to create prefetch threads\n");
+			file_unlock();
+			return;
+		}
+	}
+	while (file_prefetch_todo && (file_prefetch_todo_count >= FILE_PREFETCH_QUEUE ||
+	       file_prefetch_bytes+size_uncomp > file_cache_size/4)) {
+		job=file_prefetch_todo;
+		file_prefetch_todo=job->next;
+		if (!file_prefetch_todo)
+			file_prefetch_todo_last=&file_prefetch_todo;
+		file_prefetch_todo_count--;
+		file_prefetch_bytes-=job->size_uncomp;
+		g_free(job);
+	}
+	if (file_prefetch_bytes+size_uncomp > file_cache_size/4) {
+		file_unlock();
+		return;
+	}
+	job=g_new0(struct file_prefetch, 1);
+	job->file=file;
+	job->offset=offset;
+	job->size=size;
+	job->size_uncomp=size_uncomp;
+	*file_prefetch_todo_last=job;
+	file_prefetch_todo_last=&job->next;
+	file_prefetch_todo_count++;
+	file_prefetch_bytes+=size_uncomp;
+	pthread_cond_broadcast(&file_prefetch_cond);
+	file_unlock();
+#endif
+}
+
+/**
+ * @brief Checks whether compressed data is being inflated by a prefetch thread
+ *
+ * @param file The file the data is read from
+ * @param offset Offset of the compressed data
+ * @param size Size of the compressed data
+ * @param timeout Time in milliseconds to wait for the prefetch to finish
+ * @return 1 if the data is still being inflated after timeout, 0 if reading it does not have to wait for a prefetch thread
+ */
+int
+file_data_prefetch_busy(struct file *file, long long offset, int size, int timeout)
+{
+#ifdef HAVE_PTHREAD
+	struct timeval now;
+	struct timespec until;
+	int ret;
 
+	file_lock();
+	if (timeout > 0 && file_prefetch_is_running(file, offset, size)) {
+		gettimeofday(&now, NULL);
+		until.tv_sec=now.tv_sec+timeout/1000;
+		until.tv_nsec=(now.tv_usec+(timeout%1000)*1000)*1000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec-=1000000000;
+		}
+		while (file_prefetch_is_running(file, offset, size) &&
+		       !pthread_cond_timedwait(&file_prefetch_cond, &file_mutex, &until));
+	}
+	ret=file_prefetch_is_running(file, offset, size);
+	file_unlock();
 	return ret;
+#else
+	return 0;
+#endif
 }
 
 unsigned char *
@@ -562,20 +846,24 @@ file_data_read_encrypted(struct file *file, long long offset, int size, int size
 	void *ret;
 	unsigned char *buffer = 0;
 	uLongf destLen=size_uncomp;
+	int ok;
 
 	if (file->cache) {
 		struct file_cache_id id={offset,size,file->name_id,1};
 		ret=cache_lookup(file_cache,&id); 
 		if (ret)
 			return ret;
-		ret=cache_insert_new(file_cache,&id,size_uncomp);
+		ret=cache_entry_new(file_cache,&id,size_uncomp);
 	} else 
 		ret=g_malloc(size_uncomp);
-	lseek(file->fd, offset, SEEK_SET);
 
 	buffer = (unsigned char *)g_malloc(size);
-	if (read(file->fd, buffer, size) != size) {
-		g_free(ret);
+	file_lock();
+	lseek(file->fd, offset, SEEK_SET);
+	ok=read(file->fd, buffer, size) == size;
+	file_unlock();
+	if (!ok) {
+		file_data_release(file, ret);
 		ret=NULL;
 	} else {
 		unsigned char key[34], salt[8], verify[2], counter[16], xor[16], mac[10], *datap;
@@ -605,7 +893,7 @@ file_data_read_encrypted(struct file *file, long long offset, int size, int size
 			if (compressed) {
 				if (uncompress_int(ret, &destLen, (Bytef *)datap, size) != Z_OK) {
 					dbg(lvl_error,"uncompress failed\n");
-					g_free(ret);
+					file_data_release(file, ret);
 					ret=NULL;
 				}
 			} else {
@@ -613,16 +901,18 @@ file_data_read_encrypted(struct file *file, long long offset, int size, int size
 					memcpy(ret, buffer, destLen);
 				else {
 					dbg(lvl_error,"memcpy failed\n");
-					g_free(ret);
+					file_data_release(file, ret);
 					ret=NULL;
 				}
 			}
 		} else {
-			g_free(ret);
+			file_data_release(file, ret);
 			ret=NULL;
 		}
 	}
 	g_free(buffer);
+	if (ret && file->cache)
+		cache_insert(file_cache, ret);
 
 	return ret;
 #else
@@ -639,10 +929,7 @@ file_data_free(struct file *file, unsigned char *data)
 		if (data >= file->begin && data < file->end)
 			return;
 	}
-	if (file->cache && data) {
-		cache_entry_destroy(file_cache, data);
-	} else
-		g_free(data);
+	file_data_release(file, data);
 }
 
 void
@@ -799,6 +1086,15 @@ file_fsync(struct file *f)
 void
 file_destroy(struct file *f)
 {
+#ifdef HAVE_PTHREAD
+	file_lock();
+	if (file_prefetch_thread_count) {
+		file_prefetch_dequeue(f, 0, -1);
+		while (file_prefetch_is_running(f, 0, -1))
+			pthread_cond_wait(&file_prefetch_cond, &file_mutex);
+	}
+	file_unlock();
+#endif
 	if (f->headers)
 		g_hash_table_destroy(f->headers);
 	switch (f->special) {
@@ -905,19 +1201,38 @@ int
 file_set_cache_size(int cache_size)
 {
 #ifdef CACHE_SIZE
+	file_lock();
 	cache_resize(file_cache, cache_size);
+	file_cache_size=cache_size;
+	file_unlock();
 	return 1;
 #else
 	return 0;
 #endif
 }
 
+/**
+ * @brief Gets the statistics of the cache shared by all files
+ *
+ * @param stats Returns the statistics
+ * @return 1 on success, 0 if there is no cache
+ */
+int
+file_get_cache_stats(struct cache_stats *stats)
+{
+	if (!file_cache)
+		return 0;
+	cache_get_stats(file_cache, stats);
+	return 1;
+}
+
 void
 file_init(void)
 {
 #ifdef CACHE_SIZE
 	file_name_hash=g_hash_table_new(g_str_hash, g_str_equal);
 	file_cache=cache_new(sizeof(struct file_cache_id), CACHE_SIZE);
+	file_cache_size=CACHE_SIZE;
 #endif
 	if(sizeof(off_t)<8)
 		dbg(lvl_error,"Maps larger than 2GB are not supported by this binary, sizeof(off_t)=%zu\n",sizeof(off_t));
@@ -60,6 +60,7 @@ struct file {
 };
 
 struct attr;
+struct cache_stats;
 
 /* prototypes */
 int file_request(struct file *f, struct attr **options);
@@ -76,6 +77,8 @@ void file_data_flush(struct file *file, long long offset, int size);
 int file_data_write(struct file *file, long long offset, int size, const void *data);
 int file_get_contents(char *name, unsigned char **buffer, int *size);
 unsigned char *file_data_read_compressed(struct file *file, long long offset, int size, int size_uncomp);
+void file_data_prefetch_compressed(struct file *file, long long offset, int size, int size_uncomp);
+int file_data_prefetch_busy(struct file *file, long long offset, int size, int timeout);
 unsigned char *file_data_read_encrypted(struct file *file, long long offset, int size, int size_uncomp, int compressed, char *passwd);
 void file_data_free(struct file *file, unsigned char *data);
 int file_exists(char const *name);
@@ -95,6 +98,7 @@ int file_get_param(struct file *file, struct param_list *param, int count);
 int file_version(struct file *file, int byname);
 void *file_get_os_handle(struct file *file);
 int file_set_cache_size(int cache_size);
+int file_get_cache_stats(struct cache_stats *stats);
 void file_init(void);
 int file_is_reg(char *name);
 void file_data_remove(struct file *file, unsigned char *data);
@@ -51,6 +51,10 @@
 #include "callback.h"
 #include "file.h"
 #include "event.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <time.h>
+#endif
 
 
 //##############################################################################################################
@@ -75,6 +79,7 @@ struct graphics
 	int font_size;
 	GList *selection;
 	int disabled;
+	int draw_threads;
 	/*
 	 * Counter for z_order of displayitems;
 	*/
@@ -91,6 +96,7 @@ struct display_context
 	struct graphics_image *img;
 	enum projection pro;
 	int mindist;
+	int lod_dist;		/* Tolerance of the simplified geometry in map units, 0 to draw all coordinates */
 	struct transformation *trans;
 	enum item_type type;
 	int maxlen;
@@ -103,6 +109,25 @@ struct hash_entry
 	struct displayitem *di;
 };
 
+/**
+ * @brief The part of a display list which is kept from one draw to the next
+ *
+ * Items of maps which can't change their content are not freed when the display list is
+ * redrawn, as long as they are still within the new selection. Only the parts of the new
+ * selection which were not covered by the previous one have to be read from these maps.
+ */
+struct displaylist_retained {
+	int valid;				/**< Set if the display list contains all items of maps within sel */
+	int reading;				/**< Set while the current draw only reads delta from maps */
+	GList *maps;				/**< The maps whose items are retained */
+	struct map_selection *sel;		/**< The selection covered by the retained items */
+	struct map_selection *next;		/**< The selection covered once the current draw is finished */
+	struct map_selection *delta;		/**< The parts of next which are not covered by sel */
+	struct mapset *ms;			/**< The mapset of the retained items */
+	struct layout *layout;			/**< The layout the retained items were read for */
+	int order;				/**< The order the retained items were read for */
+	int maxlen;				/**< The maximum number of coordinates the retained items were read with */
+};
 
 struct displaylist {
 	int busy;
@@ -121,6 +146,11 @@ struct displaylist {
 	struct event_idle *idle_ev;
 	unsigned int seq;
 	struct hash_entry hash_entries[HASH_SIZE];
+	struct displaylist_retained retained;
+#ifdef HAVE_PTHREAD
+	struct displaylist_workers *workers;
+#endif
+	long long stage;		/**< When the drawing was requested, for profile_stage_end() */
 };
 
 
@@ -192,6 +222,9 @@ graphics_set_attr_do(struct graphics *gra, struct attr *attr)
 	case attr_font_size:
 		gra->font_size=attr->u.num;
 		return 1;
+	case attr_draw_threads:
+		gra->draw_threads=attr->u.num;
+		return 1;
 	default:
 		return 0;
 	}
@@ -1054,10 +1087,22 @@ struct displayitem {
 	struct item item;
 	char *label;
 	int z_order;
+	struct coord *lod;	/* Simplified coordinates, NULL if c can't be simplified */
+	int lod_count;		/* Number of simplified coordinates, 0 if the item is too small to be drawn */
+	int lod_dist;		/* Tolerance lod was computed for, 0 if it wasn't computed yet */
 	int count;
 	struct coord c[0];
 };
 
+extern void *route_selection;
+
+static void
+displayitem_free(struct displayitem *di)
+{
+	g_free(di->lod);
+	g_free(di);
+}
+
 /**
  * FIXME
  * @param <>
@@ -1071,13 +1116,211 @@ static void xdisplay_free(struct displaylist *dl)
 		struct displayitem *di=dl->hash_entries[i].di;
 		while (di) {
 			struct displayitem *next=di->next;
-			g_free(di);
+			displayitem_free(di);
 			di=next;
 		}
 		dl->hash_entries[i].di=NULL;
 	}
 }
 
+/**
+ * @brief Checks whether the bounding box of some coordinates overlaps a selection
+ *
+ * @param c The coordinates
+ * @param count The number of coordinates
+ * @param sel The selection
+ * @return 1 if one of the rectangles of the selection is overlapped, 0 otherwise
+ */
+static int
+displaylist_coord_overlaps(struct coord *c, int count, struct map_selection *sel)
+{
+	struct coord_rect r,*sr;
+	int i;
+
+	if (count <= 0)
+		return 0;
+	r.lu=r.rl=c[0];
+	for (i = 1 ; i < count ; i++)
+		coord_rect_extend(&r, &c[i]);
+	for ( ; sel ; sel=sel->next) {
+		sr=&sel->u.c_rect;
+		if (r.lu.x <= sr->rl.x && r.rl.x >= sr->lu.x && r.lu.y >= sr->rl.y && r.rl.y <= sr->lu.y)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Checks whether the items of a map are retained between draws
+ *
+ * @param dl The display list
+ * @param m The map
+ * @return 1 if the current draw only reads the items of the map which were not retained, 0 otherwise
+ */
+static int
+displaylist_retains_map(struct displaylist *dl, struct map *m)
+{
+	return dl->retained.reading && g_list_find(dl->retained.maps, m) != NULL;
+}
+
+static void
+displaylist_retained_add_rect(struct map_selection **delta, struct map_selection *sel, int lu_x, int lu_y, int rl_x, int rl_y)
+{
+	struct map_selection *ret=g_new(struct map_selection, 1);
+	*ret=*sel;
+	ret->u.c_rect.lu.x=lu_x;
+	ret->u.c_rect.lu.y=lu_y;
+	ret->u.c_rect.rl.x=rl_x;
+	ret->u.c_rect.rl.y=rl_y;
+	ret->next=*delta;
+	*delta=ret;
+}
+
+/**
+ * @brief Gets the parts of a new selection which are not covered by the old one
+ *
+ * @param old The old selection, a single rectangle
+ * @param sel The new selection, a single rectangle
+ * @return Up to four rectangles covering the parts of sel outside of old, NULL if old covers sel
+ */
+static struct map_selection *
+displaylist_retained_delta(struct map_selection *old, struct map_selection *sel)
+{
+	struct coord_rect *o=&old->u.c_rect,*n=&sel->u.c_rect;
+	struct map_selection *ret=NULL;
+	int top,bottom;
+
+	if (n->lu.x > o->rl.x || n->rl.x < o->lu.x || n->lu.y < o->rl.y || n->rl.y > o->lu.y)
+		return map_selection_dup(sel);
+	if (n->lu.y > o->lu.y)
+		displaylist_retained_add_rect(&ret, sel, n->lu.x, n->lu.y, n->rl.x, o->lu.y);
+	if (n->rl.y < o->rl.y)
+		displaylist_retained_add_rect(&ret, sel, n->lu.x, o->rl.y, n->rl.x, n->rl.y);
+	top=MIN(n->lu.y, o->lu.y);
+	bottom=MAX(n->rl.y, o->rl.y);
+	if (n->lu.x < o->lu.x)
+		displaylist_retained_add_rect(&ret, sel, n->lu.x, top, o->lu.x, bottom);
+	if (n->rl.x > o->rl.x)
+		displaylist_retained_add_rect(&ret, sel, o->rl.x, top, n->rl.x, bottom);
+	return ret;
+}
+
+/**
+ * @brief Forgets the retained items of a display list
+ *
+ * The items themselves are freed by xdisplay_free().
+ *
+ * @param dl The display list
+ */
+static void
+displaylist_retained_clear(struct displaylist *dl)
+{
+	struct displaylist_retained *r=&dl->retained;
+
+	map_selection_destroy(r->sel);
+	map_selection_destroy(r->next);
+	map_selection_destroy(r->delta);
+	g_list_free(r->maps);
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * @brief Prepares the display list for a new draw
+ *
+ * If the previous draw was finished with the same order, layout and mapset, the items of maps
+ * which can't change their content are kept as long as they are within the new selection, and
+ * only the delta to the previous selection will be read from these maps. Otherwise all items are freed.
+ * Only maps which can be read from other threads are known to not change their content, and only
+ * maps in the projection of the display list are retained, since the items are stored in it.
+ *
+ * @param dl The display list, with the new transformation, order and layout already set
+ */
+static void
+displaylist_retain(struct displaylist *dl)
+{
+	struct displaylist_retained *r=&dl->retained;
+	struct displayitem *di,**prev;
+	struct mapset_handle *h;
+	struct map_selection *sel;
+	struct attr thread_safe;
+	enum projection pro;
+	struct map *m;
+	GList *maps=NULL,*l,*l2;
+	int i,keep,kept=0,evicted=0;
+
+	pro=transform_get_projection(dl->dc.trans);
+	sel=transform_get_selection(dl->dc.trans, pro, dl->order);
+	h=mapset_open(dl->ms);
+	while ((m=mapset_next(h, 1))) {
+		if (map_projection(m) == pro && map_get_attr(m, attr_thread_safe, &thread_safe, NULL) && thread_safe.u.num)
+			maps=g_list_append(maps, m);
+	}
+	mapset_close(h);
+	keep=r->valid && r->ms == dl->ms && r->layout == dl->layout && r->order == dl->order && r->maxlen == dl->dc.maxlen
+		&& !route_selection && sel && !sel->next;
+	for (l = maps, l2 = r->maps ; keep && (l || l2) ; l=g_list_next(l), l2=g_list_next(l2))
+		keep=l && l2 && l->data == l2->data;
+	if (!keep) {
+		xdisplay_free(dl);
+		displaylist_retained_clear(dl);
+	} else {
+		for (i = 0 ; i < HASH_SIZE ; i++) {
+			prev=&dl->hash_entries[i].di;
+			while ((di=*prev)) {
+				if (g_list_find(maps, di->item.map) && displaylist_coord_overlaps(di->c, di->count, sel)) {
+					di->z_order=0;
+					prev=&di->next;
+					kept++;
+				} else {
+					*prev=di->next;
+					displayitem_free(di);
+					evicted++;
+				}
+			}
+		}
+		map_selection_destroy(r->next);
+		map_selection_destroy(r->delta);
+		g_list_free(r->maps);
+		r->delta=displaylist_retained_delta(r->sel, sel);
+		r->reading=1;
+		dbg(lvl_debug,"kept %d items, evicted %d items\n", kept, evicted);
+	}
+	r->valid=0;
+	if (maps && !route_selection && sel && !sel->next) {
+		r->maps=maps;
+		r->next=sel;
+		r->ms=dl->ms;
+		r->layout=dl->layout;
+		r->order=dl->order;
+		r->maxlen=dl->dc.maxlen;
+	} else {
+		g_list_free(maps);
+		map_selection_destroy(sel);
+		displaylist_retained_clear(dl);
+	}
+}
+
+/**
+ * @brief Marks the retained items as complete after a draw has read all maps
+ *
+ * @param dl The display list
+ */
+static void
+displaylist_retained_finish(struct displaylist *dl)
+{
+	struct displaylist_retained *r=&dl->retained;
+
+	if (!r->next)
+		return;
+	map_selection_destroy(r->sel);
+	map_selection_destroy(r->delta);
+	r->sel=r->next;
+	r->next=NULL;
+	r->delta=NULL;
+	r->reading=0;
+	r->valid=1;
+}
+
 /**
  * FIXME
  * @param <>
@@ -1105,6 +1348,9 @@ static void display_add(struct hash_entry *entry, struct item *item, int count,
 	p+=sizeof(*di)+count*sizeof(*c);
 	di->item=*item;
 	di->z_order=0;
+	di->lod=NULL;
+	di->lod_count=0;
+	di->lod_dist=0;
 	if (label && label_count) {
 		di->label=p;
 		for (i = 0 ; i < label_count ; i++) {
@@ -2012,6 +2258,54 @@ limit_count(struct coord *c, int count)
 }
 
 
+/**
+ * @brief Gets the simplified coordinates of a display item
+ *
+ * The coordinates are simplified with the Douglas-Peucker algorithm, so that no point
+ * is dropped which is more than the tolerance of the display context away from the
+ * simplified line. Areas which fit within the tolerance are dropped entirely.
+ * The result is kept with the display item, and only computed again if it is drawn
+ * with a smaller tolerance.
+ *
+ * @param di The display item
+ * @param dc The display context
+ * @param count Returns the number of coordinates
+ * @return The coordinates to draw
+ */
+static struct coord *
+displayitem_lod(struct displayitem *di, struct display_context *dc, int *count)
+{
+	struct coord_rect r;
+	struct coord *buffer;
+	int i,dist=dc->lod_dist;
+
+	*count=di->count;
+	if (!dist || di->count < 3)
+		return di->c;
+	if (!di->lod_dist || di->lod_dist > dist) {
+		g_free(di->lod);
+		di->lod=NULL;
+		di->lod_dist=dist;
+		r.lu=r.rl=di->c[0];
+		for (i = 1 ; i < di->count ; i++)
+			coord_rect_extend(&r, &di->c[i]);
+		if (item_type_is_area(di->item.type) && r.rl.x-r.lu.x < dist && r.lu.y-r.rl.y < dist) {
+			di->lod_count=0;
+		} else {
+			buffer=g_new(struct coord, di->count);
+			di->lod_count=transform_douglas_peucker_float(di->c, di->count, (navit_float)dist*dist, buffer);
+			if (di->lod_count < di->count)
+				di->lod=g_renew(struct coord, buffer, di->lod_count);
+			else {
+				g_free(buffer);
+				di->lod_count=di->count;
+			}
+		}
+	}
+	*count=di->lod_count;
+	return di->lod ? di->lod : di->c;
+}
+
 static void
 displayitem_draw(struct displayitem *di, void *dummy, struct display_context *dc)
 {
@@ -2040,6 +2334,13 @@ displayitem_draw(struct displayitem *di, void *dummy, struct display_context *dc
 	if (dc->type == type_poly_water_tiled)
 		mindist=0;
 	c=di->c;
+	if (count == di->count && (e->type == element_polyline || e->type == element_polygon)) {
+		c=displayitem_lod(di, dc, &count);
+		if (!count) {
+			di=di->next;
+			continue;
+		}
+	}
 #if 0
 	if (dc->e->type == element_polygon) {
 		int max=1000;
@@ -2218,6 +2519,7 @@ graphics_draw_itemgra(struct graphics *gra, struct itemgra *itm, struct transfor
 	dc.img=NULL;
 	dc.pro=projection_screen;
 	dc.mindist=0;
+	dc.lod_dist=0;
 	dc.trans=t;
 	dc.type=type_none;
 	dc.maxlen=max_coord;
@@ -2294,8 +2596,6 @@ static void xdisplay_draw(struct displaylist *display_list, struct graphics *gra
  * @returns <>
  * @author Martin Schaller (04/2008)
 */
-extern void *route_selection;
-
 static void
 displaylist_update_layers(struct displaylist *displaylist, GList *layers, int order)
 {
@@ -2380,13 +2680,437 @@ GList *displaylist_get_clicked_list(struct displaylist *displaylist, struct poin
 
 
 
+/**
+ * @brief Adds a map item to a hash entry of a display list
+ *
+ * @param entry The hash entry for the type of the item
+ * @param m The map of the item
+ * @param conv Set if the labels of the map have to be converted
+ * @param item The item
+ * @param ca The coordinates of the item in the projection of the map, converted in place
+ * @param count The number of coordinates
+ * @param from The projection of the map
+ * @param to The projection of the display list
+ */
+static void
+display_add_item(struct hash_entry *entry, struct map *m, int conv, struct item *item, struct coord *ca, int count, enum projection from, enum projection to)
+{
+	struct attr attr,attr2;
+	int label_count=0;
+	char *labels[2];
+
+	if (from != to)
+		transform_from_to_count(ca, from, ca, to, count);
+	if (item_is_custom_poi(*item)) {
+		if (item_attr_get(item, attr_icon_src, &attr2))
+			labels[1]=map_convert_string(m, attr2.u.str);
+		else
+			labels[1]=NULL;
+		label_count=2;
+	} else {
+		labels[1]=NULL;
+		label_count=0;
+	}
+	if (item_attr_get(item, attr_label, &attr)) {
+		labels[0]=attr.u.str;
+		if (!label_count)
+			label_count=2;
+	} else
+		labels[0]=NULL;
+	if (conv && label_count) {
+		labels[0]=map_convert_string(m, labels[0]);
+		display_add(entry, item, count, ca, labels, label_count);
+		map_convert_free(labels[0]);
+	} else
+		display_add(entry, item, count, ca, labels, label_count);
+	if (labels[1])
+		map_convert_free(labels[1]);
+}
+
+#ifdef HAVE_PTHREAD
+/** Time in milliseconds an asynchronous redraw waits for the worker threads before returning to the event loop */
+#define DISPLAYLIST_WORKERS_WAIT 20
+/** Number of items a worker thread reads between checks whether it has been cancelled */
+#define DISPLAYLIST_WORKERS_CANCEL_CHECK 64
+
+/**
+ * @brief One strip of one map which is read into a display list fragment by a worker thread
+ */
+struct displaylist_job {
+	struct displaylist_job *next;			/**< Next job in the same list */
+	struct map *m;					/**< The map to read */
+	enum projection pro;				/**< The projection of the map */
+	int conv;					/**< Set if the labels of the map have to be converted */
+	struct map_selection *sel;			/**< The part of the selection within the strip */
+	struct map_selection *full;			/**< The complete selection of the map, shared by its jobs */
+	struct map_selection *retained;			/**< The selection whose items are already in the display list, or NULL */
+	struct coord_rect r;				/**< The bounding box of full, which is cut into the strips */
+	int strip;					/**< The number of the strip of this job */
+	int strips;					/**< The number of strips */
+	int overflow;					/**< Set if an item had more coordinates than could be read */
+	struct hash_entry hash_entries[HASH_SIZE];	/**< The display items read, at the hash index of the display list */
+	struct displayitem *last[HASH_SIZE];		/**< The last display item of each list in hash_entries */
+};
+
+/**
+ * @brief Worker threads reading the thread safe maps of a mapset into a display list
+ *
+ * The workers only fill the fragments of their jobs. The finished jobs are merged into the
+ * display list by displaylist_workers_merge() on the main thread.
+ */
+struct displaylist_workers {
+	pthread_mutex_t mutex;				/**< Protects todo, done, running and cancel */
+	pthread_cond_t cond;				/**< Signalled whenever a job is finished */
+	pthread_t *threads;				/**< The worker threads */
+	int thread_count;				/**< Number of threads */
+	struct displaylist_job *todo;			/**< Jobs which have not been started yet */
+	struct displaylist_job *done;			/**< Jobs which are finished, but not merged yet */
+	int running;					/**< Number of jobs being read at the moment */
+	int cancel;					/**< Set to make the workers stop as soon as possible */
+	struct displaylist *displaylist;		/**< The display list, the workers only look up its hash entries */
+	enum projection pro;				/**< The projection of the display list */
+	int maxlen;					/**< Maximum number of coordinates read per item */
+	GList *maps;					/**< The maps read by the workers, skipped by do_draw() */
+	GList *sels;					/**< The selections of the maps, destroyed with the workers */
+};
+
+static void
+displaylist_job_destroy(struct displaylist_job *job)
+{
+	struct displayitem *di,*next;
+	int i;
+
+	for (i = 0 ; i < HASH_SIZE ; i++) {
+		for (di = job->hash_entries[i].di ; di ; di=next) {
+			next=di->next;
+			displayitem_free(di);
+		}
+	}
+	map_selection_destroy(job->sel);
+	g_free(job);
+}
+
+static void
+displaylist_job_list_destroy(struct displaylist_job *job)
+{
+	struct displaylist_job *next;
+	while (job) {
+		next=job->next;
+		displaylist_job_destroy(job);
+		job=next;
+	}
+}
+
+/**
+ * @brief Checks whether an item belongs to the strip of a job
+ *
+ * Tiles crossing strips are returned to every job reading one of these strips. An item
+ * only belongs to the leftmost strip its bounding box overlaps within the selection, so
+ * no locking is needed to add it only once.
+ *
+ * @param job The job
+ * @param c The coordinates of the item, in the projection of the map
+ * @param count The number of coordinates
+ * @return 1 if the item belongs to the strip of the job, 0 otherwise
+ */
+static int
+displaylist_job_owns(struct displaylist_job *job, struct coord *c, int count)
+{
+	struct map_selection *sel;
+	struct coord_rect r,*sr;
+	long long width;
+	int i,x=0,found=0;
+
+	if (job->strips == 1)
+		return 1;
+	r.lu=r.rl=c[0];
+	for (i = 1 ; i < count ; i++)
+		coord_rect_extend(&r, &c[i]);
+	for (sel = job->full ; sel ; sel=sel->next) {
+		sr=&sel->u.c_rect;
+		if (r.lu.x <= sr->rl.x && r.rl.x >= sr->lu.x && r.lu.y >= sr->rl.y && r.rl.y <= sr->lu.y) {
+			if (!found || MAX(r.lu.x, sr->lu.x) < x)
+				x=MAX(r.lu.x, sr->lu.x);
+			found=1;
+		}
+	}
+	width=(long long)job->r.rl.x-job->r.lu.x;
+	for (i = 0 ; i < job->strips-1 ; i++) {
+		if (x <= job->r.lu.x+width*(i+1)/job->strips)
+			break;
+	}
+	return i == job->strip;
+}
+
+static int
+displaylist_workers_cancelled(struct displaylist_workers *w)
+{
+	int ret;
+
+	pthread_mutex_lock(&w->mutex);
+	ret=w->cancel;
+	pthread_mutex_unlock(&w->mutex);
+	return ret;
+}
+
+static void
+displaylist_job_read(struct displaylist_workers *w, struct displaylist_job *job)
+{
+	struct coord *ca=g_new(struct coord, w->maxlen);
+	struct hash_entry *entry;
+	struct map_rect *mr;
+	struct item *item;
+	int count,idx,n=0;
+
+	mr=map_rect_new(job->m, job->sel);
+	if (mr) {
+		while ((item=map_rect_get_item(mr))) {
+			if (!(++n % DISPLAYLIST_WORKERS_CANCEL_CHECK) && displaylist_workers_cancelled(w))
+				break;
+			if (item == &busy_item)
+				continue;
+			entry=get_hash_entry(w->displaylist, item->type);
+			if (!entry)
+				continue;
+			count=item_coord_get_within_selection(item, ca, item->type < type_line ? 1: w->maxlen, job->sel);
+			if (!count || (job->retained && displaylist_coord_overlaps(ca, count, job->retained)) || !displaylist_job_owns(job, ca, count))
+				continue;
+			if (count == w->maxlen) {
+				dbg(lvl_error,"point count overflow %d for %s "ITEM_ID_FMT"\n", count,item_to_name(item->type),ITEM_ID_ARGS(*item));
+				job->overflow=1;
+			}
+			idx=entry-w->displaylist->hash_entries;
+			display_add_item(&job->hash_entries[idx], job->m, job->conv, item, ca, count, job->pro, w->pro);
+			if (!job->last[idx])
+				job->last[idx]=job->hash_entries[idx].di;
+		}
+		map_rect_destroy(mr);
+	}
+	g_free(ca);
+}
+
+static void *
+displaylist_worker(void *data)
+{
+	struct displaylist_workers *w=data;
+	struct displaylist_job *job;
+
+	pthread_mutex_lock(&w->mutex);
+	while (w->todo && !w->cancel) {
+		job=w->todo;
+		w->todo=job->next;
+		w->running++;
+		pthread_mutex_unlock(&w->mutex);
+		displaylist_job_read(w, job);
+		pthread_mutex_lock(&w->mutex);
+		w->running--;
+		job->next=w->done;
+		w->done=job;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+/**
+ * @brief Stops the worker threads of a display list and frees all jobs which have not been merged
+ *
+ * @param displaylist The display list
+ */
+static void
+displaylist_workers_stop(struct displaylist *displaylist)
+{
+	struct displaylist_workers *w=displaylist->workers;
+	GList *l;
+	int i;
+
+	if (!w)
+		return;
+	pthread_mutex_lock(&w->mutex);
+	w->cancel=1;
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0 ; i < w->thread_count ; i++)
+		pthread_join(w->threads[i], NULL);
+	displaylist_job_list_destroy(w->todo);
+	displaylist_job_list_destroy(w->done);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	for (l = w->sels ; l ; l=g_list_next(l))
+		map_selection_destroy(l->data);
+	g_list_free(w->sels);
+	g_list_free(w->maps);
+	g_free(w->threads);
+	g_free(w);
+	displaylist->workers=NULL;
+}
+
+/**
+ * @brief Hands the thread safe maps of the mapset to worker threads
+ *
+ * The bounding box of the selection of each map is cut into one vertical strip per thread,
+ * and each strip becomes a job reading the parts of the selection within the strip.
+ *
+ * @param displaylist The display list, the number of threads is taken from the draw_threads attribute of its graphics
+ */
+static void
+displaylist_workers_start(struct displaylist *displaylist)
+{
+	struct displaylist_workers *w;
+	struct displaylist_job *job;
+	struct mapset_handle *h;
+	struct map_selection *full,*sel,**last;
+	struct attr thread_safe;
+	struct coord_rect r;
+	struct map *m;
+	GList *l;
+	long long width;
+	int i,lu_x,rl_x,count=displaylist->dc.gra->draw_threads;
+
+	if (count <= 0)
+		return;
+	w=g_new0(struct displaylist_workers, 1);
+	h=mapset_open(displaylist->ms);
+	while ((m=mapset_next(h, 1))) {
+		if (displaylist_retains_map(displaylist, m) && !displaylist->retained.delta)
+			continue;
+		if (map_get_attr(m, attr_thread_safe, &thread_safe, NULL) && thread_safe.u.num)
+			w->maps=g_list_append(w->maps, m);
+	}
+	mapset_close(h);
+	if (!w->maps) {
+		g_free(w);
+		return;
+	}
+	w->displaylist=displaylist;
+	w->pro=transform_get_projection(displaylist->dc.trans);
+	w->maxlen=displaylist->dc.maxlen;
+	for (l = w->maps ; l ; l=g_list_next(l)) {
+		m=l->data;
+		if (route_selection)
+			full=route_selection;
+		else {
+			if (displaylist_retains_map(displaylist, m))
+				full=map_selection_dup(displaylist->retained.delta);
+			else
+				full=transform_get_selection(displaylist->dc.trans, map_projection(m), displaylist->order);
+			w->sels=g_list_prepend(w->sels, full);
+		}
+		if (!full)
+			continue;
+		r=full->u.c_rect;
+		for (sel = full->next ; sel ; sel=sel->next) {
+			coord_rect_extend(&r, &sel->u.c_rect.lu);
+			coord_rect_extend(&r, &sel->u.c_rect.rl);
+		}
+		width=(long long)r.rl.x-r.lu.x;
+		/* Queued from right to left, so the strips are started from left to right */
+		for (i = count-1 ; i >= 0 ; i--) {
+			job=g_new0(struct displaylist_job, 1);
+			last=&job->sel;
+			lu_x=r.lu.x+width*i/count;
+			rl_x=r.lu.x+width*(i+1)/count;
+			for (sel = full ; sel ; sel=sel->next) {
+				if (sel->u.c_rect.rl.x < lu_x || sel->u.c_rect.lu.x > rl_x)
+					continue;
+				*last=g_new(struct map_selection, 1);
+				**last=*sel;
+				(*last)->next=NULL;
+				if ((*last)->u.c_rect.lu.x < lu_x)
+					(*last)->u.c_rect.lu.x=lu_x;
+				if ((*last)->u.c_rect.rl.x > rl_x)
+					(*last)->u.c_rect.rl.x=rl_x;
+				last=&(*last)->next;
+			}
+			job->m=m;
+			job->pro=map_projection(m);
+			job->conv=map_requires_conversion(m);
+			job->full=full;
+			if (displaylist_retains_map(displaylist, m))
+				job->retained=displaylist->retained.sel;
+			job->r=r;
+			job->strip=i;
+			job->strips=count;
+			job->next=w->todo;
+			w->todo=job;
+		}
+	}
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->threads=g_new(pthread_t, count);
+	displaylist->workers=w;
+	for (i = 0 ; i < count ; i++) {
+		if (!pthread_create(&w->threads[w->thread_count], NULL, displaylist_worker, w))
+			w->thread_count++;
+	}
+	dbg(lvl_debug,"%d threads reading %d maps\n", w->thread_count, g_list_length(w->maps));
+	if (!w->thread_count) {
+		dbg(lvl_error,"failed to create worker threads\n");
+		displaylist_workers_stop(displaylist);
+	}
+}
+
+/**
+ * @brief Adds the display items read by the worker threads to the display list
+ *
+ * The item lists of each finished job are put in front of the lists of the display list.
+ *
+ * @param displaylist The display list
+ * @param wait If set, wait until all jobs are finished, otherwise wait at most DISPLAYLIST_WORKERS_WAIT milliseconds
+ * @return 1 if all jobs have been merged, 0 otherwise
+ */
+static int
+displaylist_workers_merge(struct displaylist *displaylist, int wait)
+{
+	struct displaylist_workers *w=displaylist->workers;
+	struct displaylist_job *job;
+	struct timespec timeout;
+	int i,finished;
+
+	if (!w)
+		return 1;
+	if (!wait) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec+=DISPLAYLIST_WORKERS_WAIT*1000000L;
+		if (timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_sec++;
+			timeout.tv_nsec-=1000000000L;
+		}
+	}
+	for (;;) {
+		pthread_mutex_lock(&w->mutex);
+		while (!w->done && (w->todo || w->running)) {
+			if (wait)
+				pthread_cond_wait(&w->cond, &w->mutex);
+			else if (pthread_cond_timedwait(&w->cond, &w->mutex, &timeout))
+				break;
+		}
+		job=w->done;
+		if (job)
+			w->done=job->next;
+		finished=!job && !w->todo && !w->running;
+		pthread_mutex_unlock(&w->mutex);
+		if (!job)
+			return finished;
+		for (i = 0 ; i < HASH_SIZE ; i++) {
+			if (!job->hash_entries[i].di)
+				continue;
+			job->last[i]->next=displaylist->hash_entries[i].di;
+			displaylist->hash_entries[i].di=job->hash_entries[i].di;
+			job->hash_entries[i].di=NULL;
+		}
+		if (job->overflow)
+			displaylist->dc.maxlen=w->maxlen*2;
+		displaylist_job_destroy(job);
+	}
+}
+#endif
+
 static void
 do_draw(struct displaylist *displaylist, int cancel, int flags)
 {
 	struct item *item;
 	int count,max=displaylist->dc.maxlen,workload=0;
 	struct coord *ca=g_alloca(sizeof(struct coord)*max);
-	struct attr attr,attr2;
 	enum projection pro;
 
 	if (displaylist->order != displaylist->order_hashed || displaylist->layout != displaylist->layout_hashed) {
@@ -2397,27 +3121,45 @@ do_draw(struct displaylist *displaylist, int cancel, int flags)
 	profile(0,NULL);
 	pro=transform_get_projection(displaylist->dc.trans);
 	while (!cancel) {
-		if (!displaylist->msh)
+		if (!displaylist->msh) {
 			displaylist->msh=mapset_open(displaylist->ms);
+#ifdef HAVE_PTHREAD
+			displaylist_workers_start(displaylist);
+#endif
+		}
 		if (!displaylist->m) {
 			displaylist->m=mapset_next(displaylist->msh, 1);
 			if (!displaylist->m) {
+#ifdef HAVE_PTHREAD
+				if (!displaylist_workers_merge(displaylist, !displaylist->workload))
+					return;
+#endif
 				mapset_close(displaylist->msh);
 				displaylist->msh=NULL;
 				break;
 			}
+#ifdef HAVE_PTHREAD
+			if (displaylist->workers && g_list_find(displaylist->workers->maps, displaylist->m)) {
+				displaylist->m=NULL;
+				continue;
+			}
+#endif
+			if (displaylist_retains_map(displaylist, displaylist->m) && !displaylist->retained.delta) {
+				displaylist->m=NULL;
+				continue;
+			}
 			displaylist->dc.pro=map_projection(displaylist->m);
 			displaylist->conv=map_requires_conversion(displaylist->m);
 			if (route_selection)
 				displaylist->sel=route_selection;
+			else if (displaylist_retains_map(displaylist, displaylist->m))
+				displaylist->sel=map_selection_dup(displaylist->retained.delta);
 			else
 				displaylist->sel=displaylist_get_selection(displaylist);
 			displaylist->mr=map_rect_new(displaylist->m, displaylist->sel);
 		}
 		if (displaylist->mr) {
 			while ((item=map_rect_get_item(displaylist->mr))) {
-				int label_count=0;
-				char *labels[2];
 				struct hash_entry *entry;
 				if (item == &busy_item) {
 					if (displaylist->workload)
@@ -2431,39 +3173,16 @@ do_draw(struct displaylist *displaylist, int cancel, int flags)
 				count=item_coord_get_within_selection(item, ca, item->type < type_line ? 1: max, displaylist->sel);
 				if (! count)
 					continue;
+				if (displaylist_retains_map(displaylist, displaylist->m) && displaylist_coord_overlaps(ca, count, displaylist->retained.sel))
+					continue;
 #if 0
 				dbg(lvl_debug,"%s 0x%x 0x%x\n",item_to_name(item->type), item->id_hi, item->id_lo);
 #endif
-				if (displaylist->dc.pro != pro)
-					transform_from_to_count(ca, displaylist->dc.pro, ca, pro, count);
 				if (count == max) {
 					dbg(lvl_error,"point count overflow %d for %s "ITEM_ID_FMT"\n", count,item_to_name(item->type),ITEM_ID_ARGS(*item));
 					displaylist->dc.maxlen=max*2;
 				}
-				if (item_is_custom_poi(*item)) {
-					if (item_attr_get(item, attr_icon_src, &attr2))
-						labels[1]=map_convert_string(displaylist->m, attr2.u.str);
-					else
-						labels[1]=NULL;
-					label_count=2;
-				} else {
-					labels[1]=NULL;
-					label_count=0;
-				}
-				if (item_attr_get(item, attr_label, &attr)) {
-					labels[0]=attr.u.str;
-					if (!label_count)
-						label_count=2;
-				} else
-					labels[0]=NULL;
-				if (displaylist->conv && label_count) {
-					labels[0]=map_convert_string(displaylist->m, labels[0]);
-					display_add(entry, item, count, ca, labels, label_count);
-					map_convert_free(labels[0]);
-				} else
-					display_add(entry, item, count, ca, labels, label_count);
-				if (labels[1])
-					map_convert_free(labels[1]);
+				display_add_item(entry, displaylist->m, displaylist->conv, item, ca, count, displaylist->dc.pro, pro);
 				workload++;
 				if (workload == displaylist->workload)
 					return;
@@ -2483,10 +3202,18 @@ do_draw(struct displaylist *displaylist, int cancel, int flags)
 	callback_destroy(displaylist->idle_cb);
 	displaylist->idle_cb=NULL;
 	displaylist->busy=0;
+#ifdef HAVE_PTHREAD
+	displaylist_workers_stop(displaylist);
+#endif
+	if (! cancel)
+		displaylist_retained_finish(displaylist);
 	graphics_process_selection(displaylist->dc.gra, displaylist);
 	profile(1,"draw\n");
-	if (! cancel)
+	if (! cancel) {
 		graphics_displaylist_draw(displaylist->dc.gra, displaylist, displaylist->dc.trans, displaylist->layout, flags);
+		profile_stage_end(profile_stage_draw, displaylist->stage);
+	}
+	displaylist->stage=0;
 	map_rect_destroy(displaylist->mr);
 	if (!route_selection)
 		map_selection_destroy(displaylist->sel);
@@ -2515,6 +3242,10 @@ void graphics_displaylist_draw(struct graphics *gra, struct displaylist *display
 		displaylist->dc.trans=transform_dup(trans);
 	displaylist->dc.gra=gra;
 	displaylist->dc.mindist=flags&512?15:2;
+	if (l && l->lod_tolerance > 0 && !transform_get_pitch(trans))
+		displaylist->dc.lod_dist=l->lod_tolerance*transform_get_scale(trans)/16;
+	else
+		displaylist->dc.lod_dist=0;
 	// FIXME find a better place to set the background color
 	if (l) {
 		graphics_gc_set_background(gra->gc[0], &l->color);
@@ -2548,7 +3279,6 @@ static void graphics_load_mapset(struct graphics *gra, struct displaylist *displ
 			return;
 		do_draw(displaylist, 1, flags);
 	}
-	xdisplay_free(displaylist);
 	dbg(lvl_debug,"order=%d\n", order);
 
 	displaylist->dc.gra=gra;
@@ -2564,7 +3294,9 @@ static void graphics_load_mapset(struct graphics *gra, struct displaylist *displ
 		order+=l->order_delta;
 	displaylist->order=order>0?order:0;
 	displaylist->busy=1;
+	displaylist->stage=profile_stage_begin();
 	displaylist->layout=l;
+	displaylist_retain(displaylist);
 	if (async) {
 		if (! displaylist->idle_cb)
 			displaylist->idle_cb=callback_new_3(callback_cast(do_draw), displaylist, 0, flags);
@@ -2676,8 +3408,12 @@ struct displaylist * graphics_displaylist_new(void)
 
 void graphics_displaylist_destroy(struct displaylist *displaylist)
 {
+#ifdef HAVE_PTHREAD
+	displaylist_workers_stop(displaylist);
+#endif
 	if(displaylist->dc.trans)
 		transform_destroy(displaylist->dc.trans);
+	displaylist_retained_clear(displaylist);
 	g_free(displaylist);
 	
 }
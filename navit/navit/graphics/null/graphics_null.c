@@ -31,6 +31,7 @@
 #include "debug.h"
 #include "window.h"
 #include "callback.h"
+#include "profile.h"
 #if defined(WINDOWS) || defined(WIN32) || defined (HAVE_API_WIN32_CE)
 #include <windows.h>
 # define sleep(i) Sleep(i * 1000)
@@ -39,7 +40,7 @@
 static struct callback_list* callbacks;
 
 static struct graphics_priv {
-	int dummy;
+	int w,h;
 } graphics_priv;
 
 static struct graphics_font_priv {
@@ -169,8 +170,7 @@ static struct graphics_priv * overlay_new(struct graphics_priv *gr, struct graph
 static void
 resize_callback(int w, int h)
 {
-	callback_list_call_attr_2(callbacks, attr_resize,
-				  GINT_TO_POINTER(1), GINT_TO_POINTER(1));
+	callback_list_call_attr_2(callbacks, attr_resize, (void *)(long)w, (void *)(long)h);
 }
 
 static int
@@ -193,7 +193,7 @@ get_data(struct graphics_priv *this, char const *type)
 		win->priv = this;
 		win->fullscreen = graphics_null_fullscreen;
 		win->disable_suspend = graphics_null_disable_suspend;
-		resize_callback(1,1);
+		resize_callback(graphics_priv.w,graphics_priv.h);
 		return win;
 	}
 	return NULL;
@@ -250,6 +250,7 @@ static struct graphics_priv *
 graphics_null_new(struct navit *nav, struct graphics_methods *meth, struct attr **attrs, struct callback_list *cbl)
 {
 	struct attr *event_loop_system = NULL;
+	struct attr *attr;
 	*meth=graphics_methods;
 
         event_loop_system = attr_search(attrs, NULL, attr_event_loop_system);
@@ -262,8 +263,14 @@ graphics_null_new(struct navit *nav, struct graphics_methods *meth, struct attr
 		if (!event_request_system("null", "graphics_null"))
                         return NULL;
 	}
+	graphics_priv.w=1;
+	if ((attr=attr_search(attrs, NULL, attr_w)))
+		graphics_priv.w=attr->u.num;
+	graphics_priv.h=1;
+	if ((attr=attr_search(attrs, NULL, attr_h)))
+		graphics_priv.h=attr->u.num;
 	callbacks = cbl;
-	resize_callback(1,1);
+	resize_callback(graphics_priv.w,graphics_priv.h);
 	return &graphics_priv;
 }
 
@@ -348,10 +355,205 @@ event_null_new(struct event_methods *meth)
         return NULL;
 }
 
+/*
+ * The "replay" event system runs the watches, timeouts and idles of navit without ever waiting:
+ * timeouts fire in the order of a virtual clock which jumps to the next one due. Together with a
+ * file vehicle this replays a recorded drive as fast as the pipeline can process it.
+ */
+
+enum event_replay_type {
+	event_replay_watch,
+	event_replay_timeout,
+	event_replay_idle,
+};
+
+struct event_replay {
+	enum event_replay_type type;
+	int removed;
+	int multi;
+	int interval;
+	long long due;
+	struct callback *cb;
+};
+
+static GList *event_replay_list;
+static long long event_replay_now;
+static int event_replay_quit;
+
+static struct event_replay *
+event_replay_add(enum event_replay_type type, int interval, int multi, struct callback *cb)
+{
+	struct event_replay *ev=g_new0(struct event_replay, 1);
+	ev->type=type;
+	ev->multi=multi;
+	ev->interval=interval;
+	ev->due=event_replay_now+interval;
+	ev->cb=cb;
+	event_replay_list=g_list_append(event_replay_list, ev);
+	return ev;
+}
+
+static void
+event_replay_remove(struct event_replay *ev)
+{
+	if (ev)
+		ev->removed=1;
+}
+
+/* Events are only marked when removed, so callbacks may remove them while the list is walked */
+static void
+event_replay_sweep(void)
+{
+	GList *l=event_replay_list,*next;
+	while (l) {
+		struct event_replay *ev=l->data;
+		next=g_list_next(l);
+		if (ev->removed) {
+			event_replay_list=g_list_delete_link(event_replay_list, l);
+			g_free(ev);
+		}
+		l=next;
+	}
+}
+
+static int
+event_replay_call(enum event_replay_type type)
+{
+	GList *l;
+	int ret=0;
+	for (l = event_replay_list ; l ; l=g_list_next(l)) {
+		struct event_replay *ev=l->data;
+		if (ev->type == type && !ev->removed) {
+			callback_call_0(ev->cb);
+			ret++;
+		}
+	}
+	return ret;
+}
+
+static struct event_replay *
+event_replay_next_timeout(void)
+{
+	GList *l;
+	struct event_replay *ret=NULL;
+	for (l = event_replay_list ; l ; l=g_list_next(l)) {
+		struct event_replay *ev=l->data;
+		if (ev->type == event_replay_timeout && !ev->removed && (!ret || ev->due < ret->due))
+			ret=ev;
+	}
+	return ret;
+}
+
+/**
+ * @brief Runs the replay until it is quit or no events are left
+ *
+ * Every watch is treated as ready, which holds for the regular files the replay is meant for.
+ * The screen size is announced once more before the first iteration, as navit only registers
+ * for it after the graphics have been created. The loop also enables the per-stage latency
+ * histograms of profile.c, which are reported when navit exits, typically through on_eof="exit"
+ * of the vehicle replayed.
+ */
+static void
+event_replay_main_loop_run(void)
+{
+	struct event_replay *ev;
+	int count;
+
+	dbg(lvl_debug,"enter\n");
+	profile_stage_enable();
+	resize_callback(graphics_priv.w,graphics_priv.h);
+	while (!event_replay_quit) {
+		event_replay_sweep();
+		count=event_replay_call(event_replay_watch);
+		count+=event_replay_call(event_replay_idle);
+		ev=event_replay_next_timeout();
+		if (ev) {
+			if (ev->due > event_replay_now)
+				event_replay_now=ev->due;
+			if (ev->multi)
+				ev->due=event_replay_now+(ev->interval > 0 ? ev->interval : 1);
+			else
+				ev->removed=1;
+			callback_call_0(ev->cb);
+		} else if (!count)
+			break;
+	}
+	event_replay_quit=0;
+}
+
+static void
+event_replay_main_loop_quit(void)
+{
+	dbg(lvl_debug,"enter\n");
+	event_replay_quit=1;
+}
+
+static struct event_watch *
+event_replay_add_watch(int h, enum event_watch_cond cond, struct callback *cb)
+{
+	return (struct event_watch *)event_replay_add(event_replay_watch, 0, 1, cb);
+}
+
+static void
+event_replay_remove_watch(struct event_watch *ev)
+{
+	event_replay_remove((struct event_replay *)ev);
+}
+
+static struct event_timeout *
+event_replay_add_timeout(int timeout, int multi, struct callback *cb)
+{
+	return (struct event_timeout *)event_replay_add(event_replay_timeout, timeout, multi, cb);
+}
+
+static void
+event_replay_remove_timeout(struct event_timeout *to)
+{
+	event_replay_remove((struct event_replay *)to);
+}
+
+static struct event_idle *
+event_replay_add_idle(int priority, struct callback *cb)
+{
+	return (struct event_idle *)event_replay_add(event_replay_idle, 0, 1, cb);
+}
+
+static void
+event_replay_remove_idle(struct event_idle *ev)
+{
+	event_replay_remove((struct event_replay *)ev);
+}
+
+static void
+event_replay_call_callback(struct callback_list *cb)
+{
+	callback_list_call_0(cb);
+}
+
+static struct event_methods event_replay_methods = {
+	event_replay_main_loop_run,
+	event_replay_main_loop_quit,
+	event_replay_add_watch,
+	event_replay_remove_watch,
+	event_replay_add_timeout,
+	event_replay_remove_timeout,
+	event_replay_add_idle,
+	event_replay_remove_idle,
+	event_replay_call_callback,
+};
+
+static struct event_priv *
+event_replay_new(struct event_methods *meth)
+{
+	*meth=event_replay_methods;
+	return NULL;
+}
+
 
 void
 plugin_init(void)
 {
         plugin_register_graphics_type("null", graphics_null_new);
 	plugin_register_event_type("null", event_null_new);
+	plugin_register_event_type("replay", event_replay_new);
 }
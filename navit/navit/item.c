@@ -173,9 +173,13 @@ item_coord_get(struct item *it, struct coord *c, int count)
 int
 item_coord_set(struct item *it, struct coord *c, int count, enum change_mode mode)
 {
+	int ret;
 	if (!it->meth->item_coord_set)
 		return 0;
-	return it->meth->item_coord_set(it->priv_data, c, count, mode);
+	ret=it->meth->item_coord_set(it->priv_data, c, count, mode);
+	if (ret && it->map)
+		map_changed(it->map);
+	return ret;
 }
 
 int
@@ -261,9 +265,13 @@ item_attr_get(struct item *it, enum attr_type attr_type, struct attr *attr)
 int
 item_attr_set(struct item *it, struct attr *attr, enum change_mode mode)
 {
+	int ret;
 	if (!it->meth->item_attr_set)
 		return 0;
-	return it->meth->item_attr_set(it->priv_data, attr, mode);
+	ret=it->meth->item_attr_set(it->priv_data, attr, mode);
+	if (ret && it->map)
+		map_changed(it->map);
+	return ret;
 }
 /**
  * @brief Set map item type. 
@@ -275,9 +283,13 @@ item_attr_set(struct item *it, struct attr *attr, enum change_mode mode)
 int
 item_type_set(struct item *it, enum item_type type)
 {
+	int ret;
 	if (!it->meth->item_type_set)
 		return 0;
-	return it->meth->item_type_set(it->priv_data, type);
+	ret=it->meth->item_type_set(it->priv_data, type);
+	if (ret && it->map)
+		map_changed(it->map);
+	return ret;
 }
 
 struct item * item_new(char *type, int zoom)
@@ -358,6 +358,7 @@ ITEM(nav_exit_left)
 ITEM(nav_exit_right)
 ITEM(nav_keep_left)
 ITEM(nav_keep_right)
+ITEM(tile_index)
 ITEM2(0x7fffffe8,poi_customo)
 ITEM(poi_customp)
 ITEM(poi_customq)
@@ -31,7 +31,7 @@ struct layout * layout_new(struct attr *parent, struct attr **attrs)
 {
 	struct layout *l;
 	struct color def_color = {COLOR_BACKGROUND_};
-	struct attr *name_attr,*color_attr,*order_delta_attr,*font_attr,*day_attr,*night_attr,*active_attr;
+	struct attr *name_attr,*color_attr,*order_delta_attr,*font_attr,*day_attr,*night_attr,*active_attr,*lod_tolerance_attr;
 
 	if (! (name_attr=attr_search(attrs, NULL, attr_name)))
 		return NULL;
@@ -56,6 +56,10 @@ struct layout * layout_new(struct attr *parent, struct attr **attrs)
 		l->order_delta=order_delta_attr->u.num;
 	if ((active_attr=attr_search(attrs, NULL, attr_active)))
 		l->active = active_attr->u.num;
+	if ((lod_tolerance_attr=attr_search(attrs, NULL, attr_lod_tolerance)))
+		l->lod_tolerance = lod_tolerance_attr->u.num;
+	else
+		l->lod_tolerance = 1;
 	l->navit=parent->u.navit;
 	return l;
 }
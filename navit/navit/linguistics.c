@@ -281,19 +281,19 @@ static GHashTable *casefold_hash, *special_hash;
 
 
 /*
- * @brief Prepare an utf-8 string for case insensitive comparison.
- * @param in String to prepeare.
- * @return String prepared for case insensitive search. Result shoud be g_free()d after use.
+ * @brief Casefold an utf-8 string into a caller supplied buffer.
+ * @param in String to prepare.
+ * @param out Buffer receiving the result, at least len+1 bytes long.
+ * @param len Maximum length of the result, not counting the terminating zero.
+ * @return 1 if the whole string was folded, 0 if the result had to be truncated.
  */
-char*
-linguistics_casefold(const char *in)
+static int
+linguistics_casefold_to(const char *in, char *out, int len)
 {
-	int len=strlen(in);
 	const char *src=in;
-	char *ret=g_new(char,len+1);
-	char *dest=ret;
+	char *dest=out;
 	char buf[10];
-	while(*src && dest-ret<len){
+	while(*src && dest-out<len){
 		if(*src>='A' && *src<='Z') {
 			*dest++=*src++ - 'A' + 'a';
 		} else if (!(*src&128)) {
@@ -306,17 +306,30 @@ linguistics_casefold(const char *in)
 			g_strlcpy(buf,src,charlen>10?10:charlen);
 			folded=g_hash_table_lookup(casefold_hash,buf);
 			if(folded) {
-				while(*folded && dest-ret<len)
+				while(*folded && dest-out<len)
 					*dest++=*folded++;
 				src=tmp;
 			} else {
-				while(src<tmp && dest-ret<len)
+				while(src<tmp && dest-out<len)
 					*dest++=*src++;
 			}
 		}
 	}
 	*dest=0;
-	if(*src)
+	return !*src;
+}
+
+/*
+ * @brief Prepare an utf-8 string for case insensitive comparison.
+ * @param in String to prepeare.
+ * @return String prepared for case insensitive search. Result shoud be g_free()d after use.
+ */
+char*
+linguistics_casefold(const char *in)
+{
+	int len=strlen(in);
+	char *ret=g_new(char,len+1);
+	if(!linguistics_casefold_to(in,ret,len))
 		dbg(lvl_error,"Casefolded string for '%s' needs extra space, result is trucated to '%s'.\n",in,ret);
 	return ret;
 }
@@ -335,30 +348,113 @@ linguistics_get_special(const char *str, const char *end)
 }
 
 /**
- * @brief Compare two strings, trying to replace special characters (e.g. umlauts) in first string with plain letters.
+ * @brief Replace special characters in string (e.g. umlauts) with plain letters, writing into a caller supplied buffer.
  *
- * @param s1 First string to process, for example, an item name from the map. Will be linguistics_casefold()ed before comparison.
+ * @param str string to process
+ * @param mode Replacement mode, see linguistics_expand_special()
+ * @param out Buffer receiving the result. Nothing is written beyond size bytes, the result is only complete if
+ * the returned length is below size.
+ * @param size Size of out in bytes
+ * @returns length of the expanded string without the terminating zero, or -1 if no character was replaced
+ */
+static int
+linguistics_expand_special_to(const char *str, int mode, char *out, int size)
+{
+	const char *in=str;
+	int found=0;
+	int pos=0;
+	while (*in) {
+		char *next=g_utf8_find_next_char(in, NULL);
+		int len;
+		const char *replace=NULL;
+
+		if(next)
+			len=next-in;
+		else
+			len=strlen(in);
+
+		if (len > 1) {
+			char **spc=linguistics_get_special(in, next);
+			if (spc)
+				replace=spc[mode];
+		}
+		if (replace) {
+			int replace_len=strlen(replace);
+			dbg(lvl_debug,"found %s %d %s %d\n",in,len,replace,replace_len);
+			if (pos+replace_len < size)
+				memcpy(out+pos, replace, replace_len);
+			pos+=replace_len;
+			found=1;
+		} else {
+			if (pos+len < size)
+				memcpy(out+pos, in, len);
+			pos+=len;
+		}
+		in+=len;
+	}
+	if (pos < size)
+		out[pos]='\0';
+	return found ? pos : -1;
+}
+
+/**
+ * @brief Make sure a scratch buffer holds at least the given number of bytes.
+ */
+static void
+linguistics_scratch_reserve(char **buf, int *size, int needed)
+{
+	if (*size >= needed)
+		return;
+	*size=needed+needed/2;
+	*buf=g_realloc(*buf, *size);
+}
+
+/**
+ * @brief Compare two strings like linguistics_compare(), using a caller supplied scratch buffer.
+ *
+ * The casefolded and expanded variants of s1 are built in *buf, which is grown with g_realloc() when it is too
+ * small. Keeping the buffer across calls makes comparing many candidates against one search string allocation free.
+ *
+ * @param s1 First string to process, for example, an item name from the map. Will be linguistics_casefold()ed
+ * before comparison unless mode contains linguistics_cmp_folded.
  * @param s2 Second string to process, usually user supplied search string. Should be linguistics_casefold()ed before calling this function.
- * @param mode set to composition of linguistics_cmp_mode flags to have s1 linguistics_expand_special()ed, allow matches shorter than whole s1, or 
- * @param let matches start from any word boundary within s1
+ * @param mode set to composition of linguistics_cmp_mode flags
+ * @param buf Pointer to the scratch buffer, may point to NULL initially. Should be g_free()d by the caller when done.
+ * @param size Pointer to the size of the scratch buffer
  * @returns 0 when strings are equal
  */
-int linguistics_compare(const char *s1, const char *s2, enum linguistics_cmp_mode mode)
+int
+linguistics_compare_buf(const char *s1, const char *s2, enum linguistics_cmp_mode mode, char **buf, int *size)
 {
 	int ret=0;
 	int i;
 	int s2len=strlen(s2);
-	char *s1f;
+	int folded_len=0;
+	const char *s1f=s1;
 	/* Calling linguistics_casefold() before linguistics_expand_special() requires that result is independent of calling order. This seems 
  	   to be true at the time of writing this comment. */
-	s1f=linguistics_casefold(s1);
+	if (!(mode & linguistics_cmp_folded)) {
+		int len=strlen(s1);
+		linguistics_scratch_reserve(buf, size, len+1);
+		linguistics_casefold_to(s1, *buf, len);
+		s1f=*buf;
+		folded_len=len+1;
+	}
 	for(i=0; i<3; i++) {
-		char *s, *word;
-		if(i>0)
-			s=linguistics_expand_special(s1f,i);
-		else
-			s=s1f;
-		word=s;
+		char *word;
+		if(i>0) {
+			int len=linguistics_expand_special_to(s1f, i, *buf+folded_len, *size-folded_len);
+			if (len < 0)
+				continue;
+			if (len >= *size-folded_len) {
+				linguistics_scratch_reserve(buf, size, folded_len+len+1);
+				if (!(mode & linguistics_cmp_folded))
+					s1f=*buf;
+				linguistics_expand_special_to(s1f, i, *buf+folded_len, *size-folded_len);
+			}
+			word=*buf+folded_len;
+		} else
+			word=(char *)s1f;
 		while(word) {
 			if(mode & linguistics_cmp_partial)
 				ret=strncmp(word,s2,s2len);
@@ -368,12 +464,27 @@ int linguistics_compare(const char *s1, const char *s2, enum linguistics_cmp_mod
 				break;
 			word=linguistics_next_word(word);
 		}
-		if(i>0)
-			g_free(s);
 		if(!ret || !(mode & linguistics_cmp_expand))
 			break;
 	}
-	g_free(s1f);
+	return ret;
+}
+
+/**
+ * @brief Compare two strings, trying to replace special characters (e.g. umlauts) in first string with plain letters.
+ *
+ * @param s1 First string to process, for example, an item name from the map. Will be linguistics_casefold()ed before comparison.
+ * @param s2 Second string to process, usually user supplied search string. Should be linguistics_casefold()ed before calling this function.
+ * @param mode set to composition of linguistics_cmp_mode flags to have s1 linguistics_expand_special()ed, allow matches shorter than whole s1, or 
+ * @param let matches start from any word boundary within s1
+ * @returns 0 when strings are equal
+ */
+int linguistics_compare(const char *s1, const char *s2, enum linguistics_cmp_mode mode)
+{
+	char *buf=NULL;
+	int size=0;
+	int ret=linguistics_compare_buf(s1, s2, mode, &buf, &size);
+	g_free(buf);
 	return ret;
 }
 
@@ -390,58 +501,20 @@ int linguistics_compare(const char *s1, const char *s2, enum linguistics_cmp_mod
 char *
 linguistics_expand_special(const char *str, int mode)
 {
-	const char *in=str;
-	char *out,*ret;
-	int found=0;
-	int ret_len=strlen(str);
-	int in_rest=ret_len;
-	out=ret=g_strdup(str);
+	int len=strlen(str);
+	char *ret;
+	int ret_len;
 	if (!mode) 
-		return ret;
-	while (*in) {
-		char *next=g_utf8_find_next_char(in, NULL);
-		int len;
-		int match=0;
-
-		if(next)
-			len=next-in;
-		else
-			len=strlen(in);
-
-		in_rest-=len;
-		
-		if (len > 1) {
-			char **spc=linguistics_get_special(in, next);
-			if (spc) {
-				const char *replace=spc[mode];
-				if (replace) {
-					int replace_len=strlen(replace);
-					if(out-ret+replace_len+in_rest>ret_len) {
-						char *new_ret;
-						ret_len+=(replace_len-len)*10;
-						new_ret=g_realloc(ret,ret_len+1);
-						out=new_ret+(out-ret);
-						ret=new_ret;
-					}
-					dbg(lvl_debug,"found %s %s %d %s %d\n",in,spc[0],len,replace,replace_len);
-					strcpy(out, replace);
-					out+=replace_len;
-					match=1;
-				}
-			}
-		}
-		if (match) {
-			found=1;
-			in+=len;
-		} else {
-			while (len-- > 0) 
-				*out++=*in++;
-		}
-	}
-	*out++='\0';
-	if (!found) {
+		return g_strdup(str);
+	ret=g_malloc(len+1);
+	ret_len=linguistics_expand_special_to(str, mode, ret, len+1);
+	if (ret_len < 0) {
 		g_free(ret);
-		ret=NULL;
+		return NULL;
+	}
+	if (ret_len > len) {
+		ret=g_realloc(ret, ret_len+1);
+		linguistics_expand_special_to(str, mode, ret, ret_len+1);
 	}
 	return ret;
 }
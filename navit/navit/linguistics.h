@@ -11,9 +11,11 @@ int linguistics_search(const char *str);
 enum linguistics_cmp_mode {
 	linguistics_cmp_expand=1,
 	linguistics_cmp_partial=2,
-	linguistics_cmp_words=4
+	linguistics_cmp_words=4,
+	linguistics_cmp_folded=8
 };
 int linguistics_compare(const char *s1, const char *s2, enum linguistics_cmp_mode mode);
+int linguistics_compare_buf(const char *s1, const char *s2, enum linguistics_cmp_mode mode, char **buf, int *size);
 #ifdef __cplusplus
 }
 #endif
@@ -62,6 +62,7 @@ struct map {
 	struct map_methods meth;			/**< Structure with pointers to the map plugin's functions */
 	struct map_priv *priv;				/**< Private data of the map, only known to the map plugin */
 	struct callback_list *attr_cbl;		/**< List of callbacks that are called when attributes change */
+	int change;				/**< Incremented whenever the items of the map may have changed, see map_changed() */
 };
 
 /**
@@ -160,10 +161,38 @@ map_set_attr(struct map *this_, struct attr *attr)
 	this_->attrs=attr_generic_set_attr(this_->attrs, attr);
 	if (this_->meth.map_set_attr)
 		this_->meth.map_set_attr(this_->priv, attr);
+	map_changed(this_);
 	callback_list_call_attr_2(this_->attr_cbl, attr->type, this_, attr);
 	return 1;
 }
 
+/**
+ * @brief Records that the items of a map may have changed
+ *
+ * This is done for items created or changed through map_rect_create_item() and the item_*_set() functions,
+ * and when an attribute of the map is set. Map plugins whose items change on their own have to call it as well.
+ * Users which keep data read from a map, like the route graph, compare map_get_change() to read it again.
+ *
+ * @param this_ The map
+ */
+void
+map_changed(struct map *this_)
+{
+	this_->change++;
+}
+
+/**
+ * @brief Gets the change count of a map
+ *
+ * @param this_ The map
+ * @return A number which is different whenever the items of the map may have changed, see map_changed()
+ */
+int
+map_get_change(struct map *this_)
+{
+	return this_->change;
+}
+
 /**
  * @brief Registers a new callback for attribute-change
  *
@@ -725,7 +754,12 @@ struct item *
 map_rect_create_item(struct map_rect *mr, enum item_type type_)
 {
 	if(mr && mr->priv && mr->m) {
-		return mr->m->meth.map_rect_create_item(mr->priv, type_) ;
+		struct item *ret=mr->m->meth.map_rect_create_item(mr->priv, type_);
+		if (ret) {
+			ret->map=mr->m;
+			map_changed(mr->m);
+		}
+		return ret;
 	}
 	else {
 		return NULL;
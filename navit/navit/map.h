@@ -244,6 +244,8 @@ struct map *map_ref(struct map* m);
 void map_unref(struct map* m);
 int map_get_attr(struct map *this_, enum attr_type type, struct attr *attr, struct attr_iter *iter);
 int map_set_attr(struct map *this_, struct attr *attr);
+void map_changed(struct map *this_);
+int map_get_change(struct map *this_);
 void map_add_callback(struct map *this_, struct callback *cb);
 void map_remove_callback(struct map *this_, struct callback *cb);
 int map_requires_conversion(struct map *this_);
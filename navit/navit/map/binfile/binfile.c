@@ -39,9 +39,32 @@
 #include "callback.h"
 #include "types.h"
 #include "geom.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 static int map_id;
 
+#ifdef HAVE_PTHREAD
+/** Maximum number of tiles handed to the prefetch threads per map rect */
+#define BINFILE_PREFETCH_TILES 16
+/** Number of selection moves to look ahead when predicting the tiles needed next */
+#define BINFILE_PREFETCH_AHEAD 4
+/** Time in milliseconds to wait for a tile being prefetched before returning busy_item */
+#define BINFILE_PREFETCH_WAIT 5
+
+/**
+ * @brief Position of a zip member in the tile hierarchy, used to predict the tiles needed next
+ */
+struct binfile_prefetch_tile {
+	struct coord_rect r;		/**< Bounding box of the tile */
+	long long offset;		/**< Offset of the local file header */
+	int zipfile;			/**< Number of the zip member */
+	unsigned short zipdsk;		/**< Disk (file of a split map) the member is on */
+	unsigned char depth;		/**< Depth of the tile in the tile hierarchy */
+};
+#endif
+
 
 /**
  * @brief A map tile, a rectangular region of the world.
@@ -82,6 +105,9 @@ struct tile {
 	struct file *fi;        //!< The file from which this tile was loaded.
 	int zipfile_num;
 	int mode;
+	int *index;             //!< Next group of the tile index to check, or NULL if the items are read one by one.
+	int *index_end;         //!< First memory address after the tile index.
+	int *group_end;         //!< First memory address after the items of the current group of the tile index.
 };
 
 
@@ -120,6 +146,9 @@ struct map_priv {
 	int version;
 	int check_version;
 	int map_version;
+	int match_folded;	/**< The *_match attributes of the search index are already casefolded */
+	int *town_key_index;	/**< Town key index of the last searched country, kept for the following searches */
+	int town_key_index_zipfile;
 	GHashTable *changes;
 	char *passwd;
 	char *map_release;
@@ -133,6 +162,15 @@ struct map_priv {
 	long download_enabled;
 	int last_searched_town_id_hi;	
 	int last_searched_town_id_lo;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t prefetch_mutex;			/**< Protects the prefetch members, map rects may be used from several threads */
+	struct binfile_prefetch_tile *prefetch_tiles;	/**< The tiles of the map, built on first use */
+	int prefetch_tile_count;			/**< Number of prefetch_tiles, -1 if they could not be read */
+	struct coord_rect prefetch_rect;		/**< First rectangle of the previous selection */
+	int prefetch_order;				/**< Order of the previous selection, -1 if there was none */
+	unsigned int prefetch_depths[32];		/**< Per order, bit mask of the tile depths map rects have pushed */
+	pthread_t prefetch_thread;			/**< The thread which opened the map, only its selections show the movement */
+#endif
 };
 
 struct map_rect_priv {
@@ -155,6 +193,12 @@ struct map_rect_priv {
 #ifdef DEBUG_SIZE
 	int size;
 #endif
+#ifdef HAVE_PTHREAD
+	unsigned int depths;		/**< Bit mask of the depths of the tiles pushed */
+	int order;			/**< Order of the selection, which may already be freed when the map rect is destroyed */
+	struct zip_cd *pending_cd;	/**< Tile still being inflated by a prefetch thread, pushed once it is ready */
+	int pending_zipfile,pending_offset,pending_length;
+#endif
 };
 
 /**
@@ -175,6 +219,34 @@ struct map_search_priv {
 	struct coord_rect rect_new;
 	char *parent_name;
 	GHashTable *search_results;
+	char *scratch; /**< Scratch buffer for linguistics_compare_buf(), reused for all candidates */
+	int scratch_size;
+	struct town_key_run *key_runs; /**< Runs of town items matching the search, found with the town key index */
+	int key_run_count;
+	int key_run_pos; /**< Next run to push */
+};
+
+/**
+ * @brief One entry of the town key index written by maptool --key-index.
+ *
+ * The index tile holds the number of entries, the entries sorted by key and then the zero terminated
+ * casefolded keys.
+ */
+struct town_key_index_entry {
+	int key;	/**< Offset of the key, relative to the first key */
+	int zipfile;	/**< Zip member holding the town item */
+	int offset;	/**< Offset of the town item within its tile, in ints */
+};
+
+/**
+ * @brief Items of one country index tile that match a search.
+ *
+ * The tiles are sorted by key, so the matching items of a tile are next to each other.
+ */
+struct town_key_run {
+	int zipfile;
+	int first;	/**< Offset of the first matching item, in ints */
+	int last;	/**< Offset of the last matching item, in ints */
 };
 
 
@@ -894,6 +966,7 @@ push_tile(struct map_rect_priv *mr, struct tile *t, int offset, int length)
 	dbg_assert(mr->tile_depth < 8);
 	mr->t=&mr->tiles[mr->tile_depth++];
 	*(mr->t)=*t;
+	mr->t->index=NULL;
 	mr->t->pos=mr->t->pos_next=mr->t->start+offset;
 	if (length == -1)
 		length=le32_to_cpu(mr->t->pos[0])+1;
@@ -1289,6 +1362,26 @@ download_initial_finish(struct map_download *download)
 	return 1;
 }
 
+/**
+ * @brief Gets the depth of a tile from the name of its zip member
+ *
+ * @param cd The central directory entry of the member
+ * @return The number of quadrants in the name, -1 if the member is not a tile
+ */
+static int
+binfile_tile_depth(struct zip_cd *cd)
+{
+	char *name=cd->zipcfn;
+	int depth=0,i;
+	while (depth < cd->zipcfnl && name[depth] >= 'a' && name[depth] <= 'd')
+		depth++;
+	for (i = depth ; i < cd->zipcfnl ; i++) {
+		if (name[i] != '_')
+			return -1;
+	}
+	return depth < 32 ? depth : -1;
+}
+
 static void
 push_zipfile_tile_do(struct map_rect_priv *mr, struct zip_cd *cd, int zipfile, int offset, int length)
 
@@ -1310,11 +1403,53 @@ push_zipfile_tile_do(struct map_rect_priv *mr, struct zip_cd *cd, int zipfile, i
 	mr->size+=cd->zipcunc;
 #endif
 	t.zipfile_num=zipfile;
-	if (zipfile_to_tile(m, cd, &t))
+	if (zipfile_to_tile(m, cd, &t)) {
 		push_tile(mr, &t, offset, length);
+#ifdef HAVE_PTHREAD
+		if (binfile_tile_depth(cd) >= 0)
+			mr->depths|=1u << binfile_tile_depth(cd);
+#endif
+	}
 	file_data_free(f, (unsigned char *)cd);
 }
 
+#ifdef HAVE_PTHREAD
+/**
+ * @brief Checks whether a tile is still being inflated by a prefetch thread
+ *
+ * Waits up to BINFILE_PREFETCH_WAIT milliseconds for the prefetch to finish.
+ *
+ * @param m The map
+ * @param cd The central directory entry of the tile
+ * @return 1 if the tile is not ready yet, 0 if it can be pushed without waiting for a prefetch thread
+ */
+static int
+binfile_prefetch_busy(struct map_priv *m, struct zip_cd *cd)
+{
+	struct file *fi=m->fis ? m->fis[cd->zipdsk] : m->fi;
+	long long offset=binfile_cd_offset(cd);
+	struct zip_lfh *lfh=binfile_read_lfh(fi, offset);
+	int ret=0;
+
+	if (!lfh)
+		return 0;
+	if (lfh->zipmthd == 8)
+		ret=file_data_prefetch_busy(fi, offset+sizeof(*lfh)+lfh->zipfnln+lfh->zipxtraln, lfh->zipsize,
+			BINFILE_PREFETCH_WAIT);
+	file_data_free(fi, (unsigned char *)lfh);
+	return ret;
+}
+
+static void
+binfile_prefetch_drop_pending(struct map_rect_priv *mr)
+{
+	if (mr->pending_cd) {
+		file_data_free(mr->m->fi, (unsigned char *)mr->pending_cd);
+		mr->pending_cd=NULL;
+	}
+}
+#endif
+
 
 static struct zip_cd *
 download(struct map_priv *m, struct map_rect_priv *mr, struct zip_cd *cd, int zipfile, int offset, int length, int async)
@@ -1469,6 +1604,15 @@ push_zipfile_tile(struct map_rect_priv *mr, int zipfile, int offset, int length,
 		if (!cd)
 			return 1;
 	}
+#ifdef HAVE_PTHREAD
+	if (async == 1 && binfile_prefetch_busy(m, cd)) {
+		mr->pending_cd=cd;
+		mr->pending_zipfile=zipfile;
+		mr->pending_offset=offset;
+		mr->pending_length=length;
+		return 1;
+	}
+#endif
 	push_zipfile_tile_do(mr, cd, zipfile, offset, length);
 	return 0;
 }
@@ -1486,6 +1630,9 @@ map_rect_new_binfile_int(struct map_priv *map, struct map_selection *sel)
 	mr=g_new0(struct map_rect_priv, 1);
 	mr->m=map;
 	mr->sel=sel;
+#ifdef HAVE_PTHREAD
+	mr->order=sel ? sel->order : -1;
+#endif
 	mr->item.id_hi=0;
 	mr->item.id_lo=0;
 	mr->item.meth=&methods_binfile;
@@ -1562,6 +1709,135 @@ map_download_selection(struct map_priv *m, struct map_rect_priv *mr, struct map_
 	}
 }
 
+#ifdef HAVE_PTHREAD
+/**
+ * @brief Reads the bounding boxes of all tiles of the map from the central directory
+ *
+ * Called with prefetch_mutex held.
+ *
+ * @param m The map
+ */
+static void
+binfile_prefetch_tiles_read(struct map_priv *m)
+{
+	long long cdoffset=m->eoc64?m->eoc64->zip64eofst:m->eoc->zipeofst;
+	unsigned char *cds=file_data_read(m->fi, cdoffset, m->zip_members*m->cde_size);
+	struct binfile_prefetch_tile *tile;
+	struct zip_cd *cd;
+	int i,depth;
+
+	m->prefetch_tile_count=-1;
+	if (!cds)
+		return;
+	m->prefetch_tiles=g_new(struct binfile_prefetch_tile, m->zip_members);
+	m->prefetch_tile_count=0;
+	for (i = 0 ; i < m->zip_members ; i++) {
+		cd=(struct zip_cd *)(cds+i*m->cde_size);
+		cd_to_cpu(cd);
+		if (cd->zipcensig != zip_cd_sig)
+			break;
+		depth=binfile_tile_depth(cd);
+		if (depth < 0 || !cd->zipcunc)
+			continue;
+		tile=&m->prefetch_tiles[m->prefetch_tile_count++];
+		tile_bbox(cd->zipcfn, depth, &tile->r);
+		tile->offset=binfile_cd_offset(cd);
+		tile->zipfile=i;
+		tile->zipdsk=cd->zipdsk;
+		tile->depth=depth;
+	}
+	/* The central directory can be large, don't keep it in the file cache */
+	file_data_remove(m->fi, cds);
+	dbg(lvl_debug,"%d of %d members are tiles\n", m->prefetch_tile_count, m->zip_members);
+}
+
+/**
+ * @brief Hands the tiles a map rect will probably need next to the prefetch threads
+ *
+ * The map driver does not know where the vehicle is heading, so the movement is taken
+ * from consecutive selections of the same size and order, which is how the selection of
+ * a moving or panned view changes. The tiles along the extrapolated path which do not
+ * overlap the current selection are inflated into the file cache in the background,
+ * nearest ones first. Only tiles of depths which map rects of the same order have used
+ * before are considered. Selections of other threads are ignored: the display list workers
+ * read the view in strips, which would look like a movement to the right.
+ *
+ * @param m The map
+ * @param sel The selection of the new map rect
+ */
+static void
+binfile_prefetch(struct map_priv *m, struct map_selection *sel)
+{
+	struct binfile_prefetch_tile *tile,cand[BINFILE_PREFETCH_TILES];
+	long long dist[BINFILE_PREFETCH_TILES],d,cx,cy;
+	struct coord_rect r=sel->u.c_rect,ahead;
+	struct zip_lfh *lfh;
+	struct file *fi;
+	int order=sel->order,w,h,dx=0,dy=0,i,j,count=0;
+	unsigned int depths;
+
+	if (order < 0 || order >= 32)
+		return;
+	w=r.rl.x-r.lu.x;
+	h=r.lu.y-r.rl.y;
+	pthread_mutex_lock(&m->prefetch_mutex);
+	if (m->prefetch_order == order && abs(m->prefetch_rect.rl.x-m->prefetch_rect.lu.x-w) <= w/16 &&
+	    abs(m->prefetch_rect.lu.y-m->prefetch_rect.rl.y-h) <= h/16) {
+		dx=r.lu.x-m->prefetch_rect.lu.x;
+		dy=r.lu.y-m->prefetch_rect.lu.y;
+	}
+	m->prefetch_rect=r;
+	m->prefetch_order=order;
+	depths=m->prefetch_depths[order];
+	if ((!dx && !dy) || !depths || abs(dx) > w || abs(dy) > h) {
+		pthread_mutex_unlock(&m->prefetch_mutex);
+		return;
+	}
+	if (!m->prefetch_tile_count)
+		binfile_prefetch_tiles_read(m);
+	ahead=r;
+	if (dx > 0)
+		ahead.rl.x+=dx*BINFILE_PREFETCH_AHEAD;
+	else
+		ahead.lu.x+=dx*BINFILE_PREFETCH_AHEAD;
+	if (dy > 0)
+		ahead.lu.y+=dy*BINFILE_PREFETCH_AHEAD;
+	else
+		ahead.rl.y+=dy*BINFILE_PREFETCH_AHEAD;
+	cx=((long long)r.lu.x+r.rl.x)/2;
+	cy=((long long)r.lu.y+r.rl.y)/2;
+	for (i = 0 ; i < m->prefetch_tile_count ; i++) {
+		tile=&m->prefetch_tiles[i];
+		if (!(depths & (1u << tile->depth)) || !coord_rect_overlap(&tile->r, &ahead) || coord_rect_overlap(&tile->r, &r))
+			continue;
+		d=(((long long)tile->r.lu.x+tile->r.rl.x)/2-cx)*(((long long)tile->r.lu.x+tile->r.rl.x)/2-cx)+
+		  (((long long)tile->r.lu.y+tile->r.rl.y)/2-cy)*(((long long)tile->r.lu.y+tile->r.rl.y)/2-cy);
+		if (count == BINFILE_PREFETCH_TILES && d >= dist[count-1])
+			continue;
+		if (count < BINFILE_PREFETCH_TILES)
+			count++;
+		for (j = count-1 ; j > 0 && dist[j-1] > d ; j--) {
+			dist[j]=dist[j-1];
+			cand[j]=cand[j-1];
+		}
+		dist[j]=d;
+		cand[j]=*tile;
+	}
+	pthread_mutex_unlock(&m->prefetch_mutex);
+	dbg(lvl_debug,"moved %d,%d, prefetching %d tiles\n", dx, dy, count);
+	for (i = 0 ; i < count ; i++) {
+		fi=m->fis ? m->fis[cand[i].zipdsk] : m->fi;
+		lfh=binfile_read_lfh(fi, cand[i].offset);
+		if (!lfh)
+			continue;
+		if (lfh->zipmthd == 8)
+			file_data_prefetch_compressed(fi, cand[i].offset+sizeof(*lfh)+lfh->zipfnln+lfh->zipxtraln, lfh->zipsize,
+				lfh->zipuncmp);
+		file_data_free(fi, (unsigned char *)lfh);
+	}
+}
+#endif
+
 static struct map_rect_priv *
 map_rect_new_binfile(struct map_priv *map, struct map_selection *sel)
 {
@@ -1571,6 +1847,10 @@ map_rect_new_binfile(struct map_priv *map, struct map_selection *sel)
 	if (map->url && map->fi && sel && sel->order == 255) {
 		map_download_selection(map, mr, sel);
 	}
+#ifdef HAVE_PTHREAD
+	if (map->eoc && sel && !map->url && pthread_equal(pthread_self(), map->prefetch_thread))
+		binfile_prefetch(map, sel);
+#endif
 	if (map->eoc)
 		mr->status=1;
 	else {
@@ -1650,6 +1930,14 @@ static void
 map_rect_destroy_binfile(struct map_rect_priv *mr)
 {
 	write_changes(mr->m);
+#ifdef HAVE_PTHREAD
+	binfile_prefetch_drop_pending(mr);
+	if (mr->depths && mr->order >= 0 && mr->order < 32) {
+		pthread_mutex_lock(&mr->m->prefetch_mutex);
+		mr->m->prefetch_depths[mr->order]|=mr->depths;
+		pthread_mutex_unlock(&mr->m->prefetch_mutex);
+	}
+#endif
 	while (pop_tile(mr));
 #ifdef DEBUG_SIZE
 	dbg(lvl_debug,"size=%d kb\n",mr->size/1024);
@@ -1701,6 +1989,129 @@ selection_contains(struct map_selection *sel, struct coord_rect *r, struct range
 	return 0;
 }
 
+static int
+binmap_search_key_compare(struct map_search_priv *msp, const char *key)
+{
+	if (msp->partial)
+		return strncmp(key, msp->search.u.str, strlen(msp->search.u.str));
+	return strcmp(key, msp->search.u.str);
+}
+
+/**
+ * @brief Find the first entry of the key index for which binmap_search_key_compare() is not below limit
+ */
+static int
+binmap_search_key_bound(struct map_search_priv *msp, struct town_key_index_entry *e, char *keys, int count, int limit)
+{
+	int lo=0, hi=count;
+	while (lo < hi) {
+		int mid=lo+(hi-lo)/2;
+		if (binmap_search_key_compare(msp, keys+le32_to_cpu(e[mid].key)) < limit)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo;
+}
+
+static int
+binmap_search_key_run_compare(const void *p1, const void *p2)
+{
+	const struct town_key_run *r1=p1, *r2=p2;
+	if (r1->zipfile != r2->zipfile)
+		return r1->zipfile-r2->zipfile;
+	return r1->first-r2->first;
+}
+
+/**
+ * @brief Look up the towns matching the search in the town key index of a country
+ *
+ * The matching entries are merged into one run of items per country index tile, in the order the
+ * tiles would have been scanned.
+ *
+ * @param mr The map rect of the search
+ * @param zipfile Zip member of the key index
+ * @return 1 if the key index is used, 0 if the country index has to be scanned
+ */
+static int
+binmap_search_key_index_setup(struct map_rect_priv *mr, int zipfile)
+{
+	struct map_search_priv *msp=mr->msp;
+	struct map_priv *m=mr->m;
+	struct town_key_index_entry *e;
+	struct town_key_run *runs;
+	int count,first,end,i,n;
+
+	if (msp->key_runs)
+		return 1;
+	if (!m->town_key_index || m->town_key_index_zipfile != zipfile) {
+		long long cdoffset=m->eoc64?m->eoc64->zip64eofst:m->eoc->zipeofst;
+		struct zip_cd *cd=(struct zip_cd *)(file_data_read(m->fi, cdoffset + zipfile*m->cde_size, m->cde_size));
+		struct tile t;
+		cd_to_cpu(cd);
+		t.start=NULL;
+		if (cd->zipcunc)
+			zipfile_to_tile(m, cd, &t);
+		file_data_free(m->fi, (unsigned char *)cd);
+		if (!t.start)
+			return 0;
+		count=le32_to_cpu(t.start[0]);
+		if (count < 0 || 1+count*3 > t.end-t.start) {
+			dbg(lvl_error,"invalid town key index with %d entries\n", count);
+			file_data_free(m->fi, (unsigned char *)t.start);
+			return 0;
+		}
+		/* The key index of a large country does not fit into the file cache next to the index parts
+		 * it points to, so it is kept in memory of its own */
+		g_free(m->town_key_index);
+		m->town_key_index=g_memdup(t.start, (t.end-t.start)*sizeof(int));
+		m->town_key_index_zipfile=zipfile;
+		file_data_remove(m->fi, (unsigned char *)t.start);
+	}
+	count=le32_to_cpu(m->town_key_index[0]);
+	e=(struct town_key_index_entry *)(m->town_key_index+1);
+	first=binmap_search_key_bound(msp, e, (char *)(e+count), count, 0);
+	end=binmap_search_key_bound(msp, e, (char *)(e+count), count, 1);
+	dbg(lvl_debug,"%d of %d keys match '%s'\n", end-first, count, msp->search.u.str);
+	runs=g_new(struct town_key_run, end-first+1);
+	for (i = first ; i < end ; i++) {
+		runs[i-first].zipfile=le32_to_cpu(e[i].zipfile);
+		runs[i-first].first=runs[i-first].last=le32_to_cpu(e[i].offset);
+	}
+	qsort(runs, end-first, sizeof(*runs), binmap_search_key_run_compare);
+	for (i = 0, n = 0 ; i < end-first ; i++) {
+		if (n && runs[n-1].zipfile == runs[i].zipfile)
+			runs[n-1].last=runs[i].first;
+		else
+			runs[n++]=runs[i];
+	}
+	msp->key_runs=runs;
+	msp->key_run_count=n;
+	msp->key_run_pos=0;
+	return 1;
+}
+
+/**
+ * @brief Push the next run of town items found with the town key index
+ *
+ * @return 0 if there are no more runs
+ */
+static int
+binmap_search_key_index_next(struct map_search_priv *msp)
+{
+	struct town_key_run *run;
+	struct map_rect_priv *mr=msp->mr;
+	int depth=mr->tile_depth;
+
+	if (msp->key_run_pos >= msp->key_run_count)
+		return 0;
+	run=&msp->key_runs[msp->key_run_pos++];
+	push_zipfile_tile(mr, run->zipfile, run->first, 0, 0);
+	if (mr->tile_depth > depth && mr->t->start+run->last < mr->t->end)
+		mr->t->end=mr->t->start+run->last+le32_to_cpu(mr->t->start[run->last])+1;
+	return 1;
+}
+
 static void
 map_parse_country_binfile(struct map_rect_priv *mr)
 {
@@ -1719,15 +2130,17 @@ map_parse_country_binfile(struct map_rect_priv *mr)
 	{
 		struct attr *search=&mr->msp->search;
 		if(search->type==attr_town_name || search->type==attr_district_name || search->type==attr_town_or_district_name) {
-			struct attr af, al;
+			struct attr af, al, ki;
+			if(binfile_attr_get(mr->item.priv_data, attr_town_key_index, &ki) && binmap_search_key_index_setup(mr, ki.u.num))
+				return;
 			if(binfile_attr_get(mr->item.priv_data, attr_first_key, &af)) {
-				if(linguistics_compare(af.u.str,search->u.str,linguistics_cmp_partial)>0) {
+				if(linguistics_compare_buf(af.u.str,search->u.str,linguistics_cmp_partial,&mr->msp->scratch,&mr->msp->scratch_size)>0) {
 					dbg(lvl_debug,"Skipping index item with first_key='%s'\n", af.u.str);
 					return;
 				}
 			}
 			if(binfile_attr_get(mr->item.priv_data, attr_last_key, &al)) {
-				if(linguistics_compare(al.u.str,search->u.str,linguistics_cmp_partial)<0) {
+				if(linguistics_compare_buf(al.u.str,search->u.str,linguistics_cmp_partial,&mr->msp->scratch,&mr->msp->scratch_size)<0) {
 					dbg(lvl_debug,"Skipping index item with first_key='%s', last_key='%s'\n", af.u.str, al.u.str);
 					return;
 				}
@@ -1787,6 +2200,79 @@ push_modified_item(struct map_rect_priv *mr)
 	return 0;
 }
 
+/**
+ * @brief Sets up skipping the items of a tile with a tile index
+ *
+ * Maps written with maptool --tile-index start each tile with an item of type_tile_index.
+ * Its attr_tile_index attribute holds groups of 8 integers: the lowest and highest item type of
+ * the group, its bounding box (lower left and upper right corner) and the start and end offset
+ * of its items in the tile. Groups which can not match the selection are skipped then.
+ * Groups with submaps are only checked against the selection rectangles.
+ * This is not done without a selection, or if there are changed items, as they might have
+ * moved into the selection.
+ *
+ * @param mr The map rect
+ * @param t The tile, positioned at its index item
+ */
+static void
+binfile_tile_index_setup(struct map_rect_priv *mr, struct tile *t)
+{
+	int *attr=t->pos_attr_start;
+	if (!mr->sel || mr->m->changes || t->mode == 2 || t->pos != t->start || attr >= t->pos_next)
+		return;
+	if (le32_to_cpu(attr[1]) != attr_tile_index)
+		return;
+	t->index=attr+2;
+	t->index_end=attr+1+le32_to_cpu(attr[0]);
+	t->group_end=t->pos_next;
+}
+
+static int
+binfile_tile_index_match(struct map_selection *sel, int *group)
+{
+	struct item_range range;
+	struct coord_rect r;
+	range.min=le32_to_cpu(group[0]);
+	range.max=le32_to_cpu(group[1]);
+	r.lu.x=le32_to_cpu(group[2]);
+	r.rl.y=le32_to_cpu(group[3]);
+	r.rl.x=le32_to_cpu(group[4]);
+	r.lu.y=le32_to_cpu(group[5]);
+	/* Submaps lead to further tiles, so they are needed for every item range */
+	if (item_range_contains_item(&range, type_submap)) {
+		range.min=type_none;
+		range.max=type_last;
+	}
+	while (sel) {
+		if (coord_rect_overlap(&r, &sel->u.c_rect) && item_range_intersects_range(&sel->range, &range))
+			return 1;
+		sel=sel->next;
+	}
+	return 0;
+}
+
+/**
+ * @brief Moves to the first item of the next group of the tile index matching the selection
+ *
+ * @param mr The map rect
+ * @param t The tile, whose current group is exhausted
+ */
+static void
+binfile_tile_index_next(struct map_rect_priv *mr, struct tile *t)
+{
+	int *group;
+	while (t->index+8 <= t->index_end) {
+		group=t->index;
+		t->index+=8;
+		if (binfile_tile_index_match(mr->sel, group)) {
+			t->pos=t->start+le32_to_cpu(group[6]);
+			t->group_end=t->start+le32_to_cpu(group[7]);
+			return;
+		}
+	}
+	t->pos=t->end;
+}
+
 static struct item *
 map_rect_get_item_binfile(struct map_rect_priv *mr)
 {
@@ -1796,6 +2282,14 @@ map_rect_get_item_binfile(struct map_rect_priv *mr)
 		download(m, NULL, NULL, 0, 0, 0, 2);
 		return &busy_item;
 	}
+#ifdef HAVE_PTHREAD
+	if (mr->pending_cd) {
+		if (binfile_prefetch_busy(m, mr->pending_cd))
+			return &busy_item;
+		push_zipfile_tile_do(mr, mr->pending_cd, mr->pending_zipfile, mr->pending_offset, mr->pending_length);
+		mr->pending_cd=NULL;
+	}
+#endif
 	if (mr->status == 1) {
 		mr->status=0;
 		if (push_zipfile_tile(mr, m->zip_members-1, 0, 0, 1))
@@ -1806,6 +2300,8 @@ map_rect_get_item_binfile(struct map_rect_priv *mr)
 		if (! t)
 			return NULL;
 		t->pos=t->pos_next;
+		if (t->index && t->pos >= t->group_end)
+			binfile_tile_index_next(mr, t);
 		if (t->pos >= t->end) {
 			if (pop_tile(mr))
 				continue;
@@ -1814,6 +2310,10 @@ map_rect_get_item_binfile(struct map_rect_priv *mr)
 		setup_pos(mr);
 		binfile_coord_rewind(mr);
 		binfile_attr_rewind(mr);
+		if (mr->item.type == type_tile_index) {
+			binfile_tile_index_setup(mr, t);
+			continue;
+		}
 		if ((mr->item.type == type_submap) && (!mr->country_id)) {
 			if (map_parse_submap(mr, 1))
 				return &busy_item;
@@ -1846,6 +2346,9 @@ map_rect_get_item_byid_binfile(struct map_rect_priv *mr, int id_hi, int id_lo)
 {
 	struct tile *t;
 	if (mr->m->eoc) {
+#ifdef HAVE_PTHREAD
+		binfile_prefetch_drop_pending(mr);
+#endif
 		while (pop_tile(mr));
 		push_zipfile_tile(mr, id_hi, 0, 0, 0);
 	}
@@ -2289,6 +2792,24 @@ item_inside_poly_list(struct item *it, GList *l)
 	return 0;
 }
 
+/**
+ * @brief Compare a candidate name against the search string without allocating memory.
+ *
+ * @param map_search The search
+ * @param str The candidate name
+ * @param match_attr Set if str was taken from a *_match attribute, which is already casefolded in maps written with
+ * maptool --fold-match
+ * @param mode linguistics_cmp_mode flags
+ * @returns 0 when the candidate matches
+ */
+static int
+binmap_search_compare(struct map_search_priv *map_search, char *str, int match_attr, enum linguistics_cmp_mode mode)
+{
+	if (match_attr && map_search->mr->m->match_folded)
+		mode|=linguistics_cmp_folded;
+	return linguistics_compare_buf(str, map_search->search.u.str, mode, &map_search->scratch, &map_search->scratch_size);
+}
+
 static struct item *
 binmap_search_get_item(struct map_search_priv *map_search)
 {
@@ -2304,22 +2825,25 @@ binmap_search_get_item(struct map_search_priv *map_search)
 			case attr_district_name:
 			case attr_town_or_district_name:
 				if (map_search->mr->tile_depth > 1 && item_is_town(*it) && map_search->search.type != attr_district_name) {
-					if (binfile_attr_get(it->priv_data, attr_town_name_match, &at) || binfile_attr_get(it->priv_data, attr_town_name, &at)) {
-						if (!linguistics_compare(at.u.str, map_search->search.u.str, mode) && !duplicate(map_search, it, attr_town_name))
+					int match=binfile_attr_get(it->priv_data, attr_town_name_match, &at);
+					if (match || binfile_attr_get(it->priv_data, attr_town_name, &at)) {
+						if (!binmap_search_compare(map_search, at.u.str, match, mode) && !duplicate(map_search, it, attr_town_name))
 							return it;
 					}
 				}
 				if (map_search->mr->tile_depth > 1 && item_is_district(*it) && map_search->search.type != attr_town_name) {
-					if (binfile_attr_get(it->priv_data, attr_district_name_match, &at) || binfile_attr_get(it->priv_data, attr_district_name, &at)) {
-						if (!linguistics_compare(at.u.str, map_search->search.u.str, mode) && !duplicate(map_search, it, attr_town_name))
+					int match=binfile_attr_get(it->priv_data, attr_district_name_match, &at);
+					if (match || binfile_attr_get(it->priv_data, attr_district_name, &at)) {
+						if (!binmap_search_compare(map_search, at.u.str, match, mode) && !duplicate(map_search, it, attr_town_name))
 							return it;
 					}
 				}
 				break;
 			case attr_street_name:
 				if (map_search->mode == 1) {
-					if (binfile_attr_get(it->priv_data, attr_street_name_match, &at) || binfile_attr_get(it->priv_data, attr_street_name, &at)) {
-						if (!linguistics_compare(at.u.str, map_search->search.u.str, mode) && !duplicate(map_search, it, attr_street_name)) {
+					int match=binfile_attr_get(it->priv_data, attr_street_name_match, &at);
+					if (match || binfile_attr_get(it->priv_data, attr_street_name, &at)) {
+						if (!binmap_search_compare(map_search, at.u.str, match, mode) && !duplicate(map_search, it, attr_street_name)) {
 							return it;
 						}
 					}
@@ -2341,7 +2865,7 @@ binmap_search_get_item(struct map_search_priv *map_search)
 						if(!d)
 							break;
 
-						if(linguistics_compare(at.u.str, map_search->search.u.str, mode|linguistics_cmp_expand|linguistics_cmp_words)) {
+						if(binmap_search_compare(map_search, at.u.str, 0, mode|linguistics_cmp_expand|linguistics_cmp_words)) {
 							/* Remember this non-matching street name in duplicate hash to skip name
 							 * comparison for its following segments */
 							duplicate_insert(map_search, d);
@@ -2371,7 +2895,7 @@ binmap_search_get_item(struct map_search_priv *map_search)
 					if (has_house_number)
 					{
 						struct attr at2;
-						if ((binfile_attr_get(it->priv_data, attr_street_name, &at2) || map_search->mode!=2) && !linguistics_compare(at.u.str, map_search->search.u.str, mode)
+						if ((binfile_attr_get(it->priv_data, attr_street_name, &at2) || map_search->mode!=2) && !binmap_search_compare(map_search, at.u.str, 0, mode)
 								&& !strcmp(at2.u.str, map_search->parent_name))
 							{
 								if (!duplicate(map_search, it, attr_house_number))
@@ -2425,6 +2949,8 @@ binmap_search_get_item(struct map_search_priv *map_search)
 				return NULL;
 			}
 		}
+		if (map_search->key_runs && binmap_search_key_index_next(map_search))
+			continue;
 		if(map_search->search.type==attr_house_number && map_search->mode==2 && map_search->parent_name) {
 			/* For unindexed house number search, check if street segments extending possible housenumber locations were found */
 			if(map_search->ms.u.c_rect.lu.x!=map_search->rect_new.lu.x || map_search->ms.u.c_rect.lu.y!=map_search->rect_new.lu.y ||
@@ -2452,6 +2978,8 @@ binmap_search_destroy(struct map_search_priv *ms)
 		g_hash_table_destroy(ms->search_results);
 	if(ATTR_IS_STRING(ms->search.type))
 		g_free(ms->search.u.str);
+	g_free(ms->scratch);
+	g_free(ms->key_runs);
 	if(ms->parent_name)
 		g_free(ms->parent_name);
 	if (ms->mr_item)
@@ -2481,6 +3009,13 @@ binmap_get_attr(struct map_priv *m, enum attr_type type, struct attr *attr)
 			attr->u.str=m->progress;
 			return 1;
 		}
+		break;
+#ifdef HAVE_PTHREAD
+	case attr_thread_safe:
+		/* file.c serializes the reads, map rects only share state when downloading or reopening the map */
+		attr->u.num=!m->url && !m->check_version;
+		return 1;
+#endif
 	default:
 		break;
 	}
@@ -2726,6 +3261,7 @@ map_binfile_open(struct map_priv *m)
 	file_data_free(m->fi, (unsigned char *)magic);
 	m->cachedir=g_strdup("/tmp/navit");
 	m->map_version=0;
+	m->match_folded=0;
 	mr=map_rect_new_binfile(m, NULL);
 	if (mr) {
 		while ((item=map_rect_get_item_binfile(mr)) == &busy_item);
@@ -2734,6 +3270,8 @@ map_binfile_open(struct map_priv *m)
 				m->map_version=attr.u.num;
 			if (binfile_attr_get(item->priv_data, attr_map_release, &attr))
 				m->map_release=g_strdup(attr.u.str);
+			if (binfile_attr_get(item->priv_data, attr_match_folded, &attr))
+				m->match_folded=attr.u.num;
 			if (m->url && binfile_attr_get(item->priv_data, attr_url, &attr)) {
 				dbg(lvl_debug,"url config %s map %s\n",m->url,attr.u.str);
 				if (strcmp(m->url, attr.u.str))
@@ -2759,8 +3297,18 @@ map_binfile_close(struct map_priv *m)
 	file_data_free(m->fi, (unsigned char *)m->index_cd);
 	file_data_free(m->fi, (unsigned char *)m->eoc);
 	file_data_free(m->fi, (unsigned char *)m->eoc64);
+	g_free(m->town_key_index);
+	m->town_key_index=NULL;
 	g_free(m->cachedir);
 	g_free(m->map_release);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&m->prefetch_mutex);
+	g_free(m->prefetch_tiles);
+	m->prefetch_tiles=NULL;
+	m->prefetch_tile_count=0;
+	m->prefetch_order=-1;
+	pthread_mutex_unlock(&m->prefetch_mutex);
+#endif
 	if (m->fis) {
 		for (i = 0 ; i < m->eoc->zipedsk ; i++) {
 			file_destroy(m->fis[i]);
@@ -2775,6 +3323,10 @@ map_binfile_destroy(struct map_priv *m)
 	g_free(m->filename);
 	g_free(m->url);
 	g_free(m->progress);
+#ifdef HAVE_PTHREAD
+	g_free(m->prefetch_tiles);
+	pthread_mutex_destroy(&m->prefetch_mutex);
+#endif
 	g_free(m);
 }
 
@@ -2814,6 +3366,11 @@ map_new_binfile(struct map_methods *meth, struct attr **attrs, struct callback_l
 	m=g_new0(struct map_priv, 1);
 	m->cbl=cbl;
 	m->id=++map_id;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&m->prefetch_mutex, NULL);
+	m->prefetch_order=-1;
+	m->prefetch_thread=pthread_self();
+#endif
 	m->filename=g_strdup(wexp_data[0]);
 	file_wordexp_destroy(wexp);
 	check_version=attr_search(attrs, NULL, attr_check_version);
@@ -17,7 +17,9 @@
  * Boston, MA  02110-1301, USA.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "maptool.h"
 #ifdef _MSC_VER
 #define strcasecmp _stricmp
@@ -157,6 +159,152 @@ process_boundaries_setup(FILE *boundaries, struct relations *relations)
 	return boundaries_list;
 }
 
+/* Boundaries with fewer edges are tested without buckets */
+#define BOUNDARY_EDGES_MIN 64
+/* Average number of edges per bucket */
+#define BOUNDARY_EDGES_PER_BAND 8
+#define BOUNDARY_EDGES_MAX_BANDS 4096
+
+struct boundary_edge {
+	struct coord *cp;	/**< The edge goes from cp[0] to cp[1] */
+	int segment;		/**< The position of the segment in sorted_segments */
+	int closed;		/**< Whether the segment is a closed ring */
+};
+
+/**
+ * @brief The edges of a boundary, bucketed into horizontal bands
+ *
+ * An edge is in every band in which a point could be on its crossing line,
+ * so the point in polygon test only needs to look at one band.
+ */
+struct boundary_edges {
+	int bands;
+	int *start;			/**< The first edge of each band, bands+1 entries */
+	struct boundary_edge *edge;
+};
+
+static int
+boundary_edges_band(struct boundary *b, int y)
+{
+	return ((long long)y-b->r.l.y)*b->edges->bands/((long long)b->r.h.y-b->r.l.y+1);
+}
+
+static void
+boundary_edges_add(struct boundary *b, int *count, int fill)
+{
+	GList *l=b->sorted_segments;
+	int segment=0;
+	while (l) {
+		struct geom_poly_segment *seg=l->data;
+		int closed=coord_is_equal(*seg->first,*seg->last);
+		struct coord *cp;
+		for (cp=seg->first ; cp < seg->last ; cp++) {
+			int band,last;
+			if (cp[0].y == cp[1].y)
+				continue;
+			band=boundary_edges_band(b, cp[0].y < cp[1].y ? cp[0].y : cp[1].y);
+			last=boundary_edges_band(b, (cp[0].y > cp[1].y ? cp[0].y : cp[1].y)-1);
+			for ( ; band <= last ; band++) {
+				if (fill) {
+					struct boundary_edge *e=&b->edges->edge[count[band]++];
+					e->cp=cp;
+					e->segment=segment;
+					e->closed=closed;
+				} else
+					count[band]++;
+			}
+		}
+		segment++;
+		l=g_list_next(l);
+	}
+}
+
+static void
+boundary_edges_build(struct boundary *b)
+{
+	GList *l=b->sorted_segments;
+	int edges=0,i,*pos;
+
+	while (l) {
+		struct geom_poly_segment *seg=l->data;
+		edges+=seg->last-seg->first;
+		l=g_list_next(l);
+	}
+	if (edges < BOUNDARY_EDGES_MIN)
+		return;
+	b->edges=g_new0(struct boundary_edges, 1);
+	b->edges->bands=edges/BOUNDARY_EDGES_PER_BAND;
+	if (b->edges->bands > BOUNDARY_EDGES_MAX_BANDS)
+		b->edges->bands=BOUNDARY_EDGES_MAX_BANDS;
+	b->edges->start=g_new0(int, b->edges->bands+1);
+	boundary_edges_add(b, b->edges->start+1, 0);
+	for (i = 0 ; i < b->edges->bands ; i++)
+		b->edges->start[i+1]+=b->edges->start[i];
+	b->edges->edge=g_new(struct boundary_edge, b->edges->start[b->edges->bands]);
+	pos=g_new(int, b->edges->bands);
+	memcpy(pos, b->edges->start, b->edges->bands*sizeof(int));
+	boundary_edges_add(b, pos, 1);
+	g_free(pos);
+}
+
+static void
+boundary_edges_free(struct boundary *b)
+{
+	if (!b->edges)
+		return;
+	g_free(b->edges->start);
+	g_free(b->edges->edge);
+	g_free(b->edges);
+	b->edges=NULL;
+}
+
+/**
+ * @brief Checks whether a point is inside a boundary
+ *
+ * This gives the same result as geom_poly_segments_point_inside() on the
+ * sorted segments, but only tests the edges in the band of the point.
+ */
+static int
+boundary_point_inside(struct boundary *b, struct coord *c)
+{
+	int open_matches=0,closed_matches=0,inside=0,i,end;
+	struct boundary_edge *e,*prev=NULL;
+
+	if (!b->edges)
+		return geom_poly_segments_point_inside(b->sorted_segments,c);
+	if (c->y < b->r.l.y || c->y > b->r.h.y)
+		return 0;
+	i=b->edges->start[boundary_edges_band(b, c->y)];
+	end=b->edges->start[boundary_edges_band(b, c->y)+1];
+	for ( ; i < end ; i++) {
+		e=&b->edges->edge[i];
+		if (prev && prev->segment != e->segment) {
+			if (inside) {
+				if (prev->closed)
+					closed_matches++;
+				else
+					open_matches++;
+			}
+			inside=0;
+		}
+		if ((e->cp[0].y > c->y) != (e->cp[1].y > c->y) &&
+			c->x < ((long long)e->cp[1].x-e->cp[0].x)*(c->y-e->cp[0].y)/(e->cp[1].y-e->cp[0].y)+e->cp[0].x)
+			inside=!inside;
+		prev=e;
+	}
+	if (inside) {
+		if (prev->closed)
+			closed_matches++;
+		else
+			open_matches++;
+	}
+	if (closed_matches)
+		return closed_matches & 1;
+	if (open_matches)
+		return (open_matches & 1) ? -1 : 0;
+	return 0;
+}
+
 GList *
 boundary_find_matches(GList *l, struct coord *c)
 {
@@ -164,7 +312,7 @@ boundary_find_matches(GList *l, struct coord *c)
 	while (l) {
 		struct boundary *boundary=l->data;
 		if (bbox_contains_coord(&boundary->r, c)) {
-			if (geom_poly_segments_point_inside(boundary->sorted_segments,c) > 0) 
+			if (boundary_point_inside(boundary,c) > 0) 
 				ret=g_list_prepend(ret, boundary);
 			ret=g_list_concat(ret,boundary_find_matches(boundary->children, c));
 		}
@@ -173,6 +321,212 @@ boundary_find_matches(GList *l, struct coord *c)
 	return ret;
 }
 
+/* Number of entries of each R-tree node */
+#define BOUNDARY_INDEX_FANOUT 16
+
+/**
+ * @brief A node of the boundary R-tree
+ *
+ * Nodes with a count of 0 are leaves and refer to a single boundary.
+ */
+struct boundary_index_node {
+	struct rect r;
+	int first;		/**< The first child node, or the boundary of a leaf */
+	int count;		/**< The number of child nodes */
+};
+
+/**
+ * @brief An R-tree over the bounding boxes of all boundaries in a hierarchy
+ */
+struct boundary_index {
+	struct boundary **boundaries;
+	struct boundary_index_node *nodes;
+	int root;		/**< The root node, -1 if there are no boundaries */
+};
+
+static int
+boundary_index_count(GList *l)
+{
+	int count=0;
+	while (l) {
+		struct boundary *boundary=l->data;
+		count+=1+boundary_index_count(boundary->children);
+		l=g_list_next(l);
+	}
+	return count;
+}
+
+static void
+boundary_index_collect(GList *l, struct boundary *parent, struct boundary ***boundaries)
+{
+	int index=0;
+	while (l) {
+		struct boundary *boundary=l->data;
+		boundary->parent=parent;
+		boundary->index=index++;
+		boundary->depth=parent ? parent->depth+1 : 0;
+		if (!boundary->edges)
+			boundary_edges_build(boundary);
+		*(*boundaries)++=boundary;
+		boundary_index_collect(boundary->children, boundary, boundaries);
+		l=g_list_next(l);
+	}
+}
+
+static int
+boundary_index_compare_x(const void *a, const void *b)
+{
+	const struct boundary_index_node *na=a,*nb=b;
+	long long xa=(long long)na->r.l.x+na->r.h.x;
+	long long xb=(long long)nb->r.l.x+nb->r.h.x;
+	return xa < xb ? -1 : xa > xb;
+}
+
+static int
+boundary_index_compare_y(const void *a, const void *b)
+{
+	const struct boundary_index_node *na=a,*nb=b;
+	long long ya=(long long)na->r.l.y+na->r.h.y;
+	long long yb=(long long)nb->r.l.y+nb->r.h.y;
+	return ya < yb ? -1 : ya > yb;
+}
+
+/**
+ * @brief Sorts the nodes of one level so that each group of BOUNDARY_INDEX_FANOUT nodes is compact
+ *
+ * This is the sort tile recursive packing: vertical slabs by x, each sorted by y.
+ */
+static void
+boundary_index_sort(struct boundary_index_node *nodes, int count)
+{
+	int parents=(count+BOUNDARY_INDEX_FANOUT-1)/BOUNDARY_INDEX_FANOUT;
+	int slab=(int)ceil(sqrt(parents))*BOUNDARY_INDEX_FANOUT;
+	int i;
+
+	qsort(nodes, count, sizeof(*nodes), boundary_index_compare_x);
+	for (i = 0 ; i < count ; i+=slab)
+		qsort(nodes+i, count-i < slab ? count-i : slab, sizeof(*nodes), boundary_index_compare_y);
+}
+
+/**
+ * @brief Builds an index over a boundary hierarchy as returned by process_boundaries()
+ *
+ * The boundaries must not be changed while the index is in use. The edge buckets
+ * which are built here are freed with the boundaries.
+ *
+ * @param bl The boundary hierarchy
+ * @return The index
+ */
+struct boundary_index *
+boundary_index_new(GList *bl)
+{
+	struct boundary_index *idx=g_new0(struct boundary_index, 1);
+	struct boundary **boundaries;
+	int start=0,count,i,j;
+
+	count=boundary_index_count(bl);
+	idx->boundaries=boundaries=g_new(struct boundary *, count);
+	boundary_index_collect(bl, NULL, &boundaries);
+	idx->nodes=g_new(struct boundary_index_node, count*2+1);
+	idx->root=count ? 0 : -1;
+	for (i = 0 ; i < count ; i++) {
+		idx->nodes[i].r=idx->boundaries[i]->r;
+		idx->nodes[i].first=i;
+		idx->nodes[i].count=0;
+	}
+	while (count > 1) {
+		int parent=start+count;
+		boundary_index_sort(idx->nodes+start, count);
+		for (i = 0 ; i < count ; i+=BOUNDARY_INDEX_FANOUT) {
+			struct boundary_index_node *node=&idx->nodes[parent++];
+			node->first=start+i;
+			node->count=count-i < BOUNDARY_INDEX_FANOUT ? count-i : BOUNDARY_INDEX_FANOUT;
+			node->r=idx->nodes[node->first].r;
+			for (j = 1 ; j < node->count ; j++) {
+				bbox_extend(&idx->nodes[node->first+j].r.l, &node->r);
+				bbox_extend(&idx->nodes[node->first+j].r.h, &node->r);
+			}
+		}
+		start+=count;
+		count=parent-start;
+		idx->root=start;
+	}
+	return idx;
+}
+
+static void
+boundary_index_query(struct boundary_index *idx, int n, struct coord *c, GList **ret)
+{
+	struct boundary_index_node *node=&idx->nodes[n];
+	int i;
+
+	if (!bbox_contains_coord(&node->r, c))
+		return;
+	if (!node->count) {
+		struct boundary *boundary=idx->boundaries[node->first];
+		if (boundary_point_inside(boundary, c) > 0)
+			*ret=g_list_prepend(*ret, boundary);
+		return;
+	}
+	for (i = 0 ; i < node->count ; i++)
+		boundary_index_query(idx, node->first+i, c, ret);
+}
+
+/**
+ * @brief Orders boundaries the way boundary_find_matches() returns them
+ *
+ * Within one list of siblings, the matching siblings come first in reverse
+ * order, followed by the matches below each sibling in forward order.
+ */
+static gint
+boundary_index_compare_order(gconstpointer a, gconstpointer b)
+{
+	const struct boundary *ba=a,*bb=b;
+	const struct boundary *pa=ba,*pb=bb;
+
+	while (pa->depth > pb->depth)
+		pa=pa->parent;
+	while (pb->depth > pa->depth)
+		pb=pb->parent;
+	if (pa == pb)
+		return ba->depth-bb->depth;
+	while (pa->parent != pb->parent) {
+		pa=pa->parent;
+		pb=pb->parent;
+	}
+	if (pa == ba && pb == bb)
+		return pb->index-pa->index;
+	if (pa == ba)
+		return -1;
+	if (pb == bb)
+		return 1;
+	return pa->index-pb->index;
+}
+
+/**
+ * @brief Finds the boundaries containing a point
+ *
+ * @param idx The index of the boundaries
+ * @param c The point
+ * @return The same list as boundary_find_matches() on the indexed hierarchy would return
+ */
+GList *
+boundary_index_find_matches(struct boundary_index *idx, struct coord *c)
+{
+	GList *ret=NULL;
+	if (idx->root >= 0)
+		boundary_index_query(idx, idx->root, c, &ret);
+	return g_list_sort(ret, boundary_index_compare_order);
+}
+
+void
+boundary_index_destroy(struct boundary_index *idx)
+{
+	g_free(idx->boundaries);
+	g_free(idx->nodes);
+	g_free(idx);
+}
+
 #if 0
 static void
 test(GList *boundaries_list)
@@ -372,6 +726,7 @@ free_boundaries(GList *l)
 		};
 		g_list_free(boundary->segments);
 		g_list_free(boundary->sorted_segments);
+		boundary_edges_free(boundary);
 		g_free(boundary->ib);
 		g_free(boundary->iso2);
 		free_boundaries(boundary->children);
@@ -490,8 +490,16 @@ item_bin_write_match(struct item_bin *ib, enum attr_type type, enum attr_type ma
 			for (i = 0 ; i < 3 ; i++) {
 				char *str=linguistics_expand_special(word, i);
 				if (str) {
+					int add=i || words;
+					if (fold_match) {
+						char *folded=linguistics_casefold(str);
+						g_free(str);
+						str=folded;
+						/* The key is only left out if it equals its folded form, so searches can skip folding */
+						add=add || strcmp(str, word);
+					}
 					ib->len=len;
-					if (i || words)
+					if (add)
 						item_bin_add_attr_string(ib, match, str);
 					item_bin_write(ib, out);
 					g_free(str);
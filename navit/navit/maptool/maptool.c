@@ -69,12 +69,22 @@ int processed_nodes, processed_nodes_out, processed_ways, processed_relations, p
 
 int overlap=1;
 
+int threads=1;
+
+int tile_index;
+
+int spill_slices;
+
+int fold_match;
+
+int town_key_index;
+
 int bytes_read;
 
 static long start_brk;
 static struct timeval start_tv;
 
-static void
+void
 progress_time(void)
 {
 	struct timeval tv;
@@ -194,16 +204,22 @@ usage(FILE *f)
 	fprintf(f,"-e (--end) <phase>                : end at specified phase\n");
 	fprintf(f,"-E (--experimental)               : Enable experimental features (%s)\n",
 		experimental_feature_description ? experimental_feature_description : "-not available in this version-");
+	fprintf(f,"-F (--fold-match)                : store the town and district *_match search keys casefolded, so searching does not need to fold them\n");
 	fprintf(f,"-i (--input-file) <file>          : specify the input file name (OSM), overrules default stdin\n");
+	fprintf(f,"-I (--tile-index)                 : sort the items of each tile by type and add an index of item groups, so readers can skip unneeded items\n");
+	fprintf(f,"-K (--key-index)                 : add a sorted index of the town and district names of each country, so searches look up names instead of scanning\n");
 	fprintf(f,"-k (--keep-tmpfiles)              : do not delete tmp files after processing. useful to reuse them\n");
+	fprintf(f,"-L (--spill-slices)               : when the tiles are written in several slices (see -S), read the items once and spill them to one temporary file per slice\n");
 	fprintf(f,"-M (--o5m)                        : input file os o5m\n");
 	fprintf(f,"-N (--nodes-only)                 : process only nodes\n");
+	fprintf(f,"-C (--node-store) buffer|mmap     : keep nodes in memory slices (default) or in a memory mapped file indexed by node id\n");
 	fprintf(f,"-o (--coverage)                   : map every street to item coverage\n");
 	fprintf(f,"-P (--protobuf)                   : input file is protobuf\n");
 	fprintf(f,"-r (--rule-file) <file>           : read mapping rules from specified file\n");
 	fprintf(f,"-s (--start) <phase>              : start at specified phase\n");
 	fprintf(f,"-S (--slice-size) <size>          : limit memory to use for some large internal buffers, in bytes. Default is %dGB.\n", SLIZE_SIZE_DEFAULT_GB);
 	fprintf(f,"-t (--timestamp) y-m-dTh:m:s      : Set zip timestamp\n");
+	fprintf(f,"-T (--threads) <count>            : number of threads to decode protobuf input and compress tiles with. Default is 1.\n");
 	fprintf(f,"-w (--dedupe-ways)                : ensure no duplicate ways or nodes. useful when using several input files\n");
 	fprintf(f,"-W (--ways-only)                  : process only ways\n");
 	fprintf(f,"-U (--unknown-country)            : add objects with unknown country to index\n");
@@ -273,26 +289,32 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 		{"dump-coordinates", 0, 0, 'c'},
 		{"end", 1, 0, 'e'},
 		{"experimental", 0, 0, 'E'},
+		{"fold-match", 0, 0, 'F'},
 		{"help", 0, 0, 'h'},
 		{"keep-tmpfiles", 0, 0, 'k'},
+		{"key-index", 0, 0, 'K'},
 		{"nodes-only", 0, 0, 'N'},
+		{"node-store", 1, 0, 'C'},
 		{"map", 1, 0, 'm'},
 		{"o5m", 0, 0, 'M'},
 		{"plugin", 1, 0, 'p'},
 		{"protobuf", 0, 0, 'P'},
 		{"start", 1, 0, 's'},
+		{"tile-index", 0, 0, 'I'},
 		{"timestamp", 1, 0, 't'},
+		{"threads", 1, 0, 'T'},
 		{"input-file", 1, 0, 'i'},
 		{"rule-file", 1, 0, 'r'},
 		{"ignore-unknown", 0, 0, 'n'},
 		{"url", 1, 0, 'u'},
 		{"ways-only", 0, 0, 'W'},
 		{"slice-size", 1, 0, 'S'},
+		{"spill-slices", 0, 0, 'L'},
 		{"unknown-country", 0, 0, 'U'},
 		{"index-size", 0, 0, 'x'},
 		{0, 0, 0, 0}
 	};
-	c = getopt_long (argc, argv, "5:6B:DEMNO:PS:Wa:bc"
+	c = getopt_long (argc, argv, "5:6B:C:DEFIKLMNO:PS:T:Wa:bc"
 #ifdef HAVE_POSTGRESQL
 				      "d:"
 #endif
@@ -309,12 +331,34 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 	case 'B':
 		p->protobufdb=optarg;
 		break;
+	case 'C':
+		if (!strcmp(optarg,"mmap"))
+			node_store_type=node_store_mmap;
+		else if (!strcmp(optarg,"buffer"))
+			node_store_type=node_store_buffer;
+		else {
+			fprintf(stderr,"Unknown node store %s\n",optarg);
+			return 0;
+		}
+		break;
 	case 'D':
 		p->output=1;
 		break;
 	case 'E':
 		experimental=1;
 		break;
+	case 'F':
+		fold_match=1;
+		break;
+	case 'I':
+		tile_index=1;
+		break;
+	case 'K':
+		town_key_index=1;
+		break;
+	case 'L':
+		spill_slices=1;
+		break;
 	case 'M':
 		p->o5m=1;
 		break;	
@@ -334,6 +378,11 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 	case 'S':
 		slice_size=atoll(optarg);
 		break;
+	case 'T':
+		threads=atoi(optarg);
+		if (threads < 1)
+			threads=1;
+		break;
 	case 'W':
 		p->process_nodes=0;
 		break;
@@ -456,6 +505,8 @@ static void
 osm_read_input_data(struct maptool_params *p, char *suffix)
 {
 	unlink("coords.tmp");
+	if (node_store_type == node_store_mmap)
+		node_store_open(1);
 	if (p->process_ways)
 		p->osm.ways=tempfile(suffix,"ways",1);
 	if (p->process_nodes) {
@@ -499,7 +550,7 @@ osm_read_input_data(struct maptool_params *p, char *suffix)
 	else
 		map_collect_data_osm(p->input_file,&p->osm);
 
-	if (node_buffer.size==0 && !p->map_handles){
+	if (node_store_is_empty() && !p->map_handles){
 		fprintf(stderr,"No nodes found - looks like an invalid input file.\n");
 		exit(1);
 	}
@@ -716,6 +767,13 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 			map_information_attrs[1].type=attr_url;
 			map_information_attrs[1].u.str=p->url;
 		}
+		if (fold_match) {
+			int i=1;
+			while (map_information_attrs[i].type)
+				i++;
+			map_information_attrs[i].type=attr_match_folded;
+			map_information_attrs[i].u.num=1;
+		}
 		index_init(zip_info, 1);
 	}
 	if (!strcmp(suffix,ch_suffix)) {  /* Makes compiler happy due to bug 35903 in gcc */
@@ -752,6 +810,7 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 		tempfile_unlink(suffix,"coastline_result");
 		tempfile_unlink(suffix,"towns_poly");
 		unlink("coords.tmp");
+		unlink("coords_by_id.tmp");
 	}
 	if (last) {
 		unsigned char md5_data[16];
@@ -782,6 +841,11 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 static void
 maptool_load_node_table(struct maptool_params *p, int last)
 {
+	if (!p->node_table_loaded && node_store_type == node_store_mmap) {
+		node_store_open(0);
+		slices=1;
+		p->node_table_loaded=1;
+	}
 	if (!p->node_table_loaded) {
 		slices=(sizeof_buffer("coords.tmp")+(long long)slice_size-(long long)1)/(long long)slice_size;
 		assert(slices>0);
@@ -901,6 +965,7 @@ int main(int argc, char **argv)
 				osm_resolve_coords_and_split_at_intersections(&p, suffix);
 			}
 		}
+		node_store_close();
 		free(node_buffer.base);
 		node_buffer.base=NULL;
 		node_buffer.malloced=0;
@@ -67,6 +67,7 @@ extern struct tile_head {
 	int total_size_used;
 	int zipnum;
 	int process;
+	int slice;
 	struct tile_head *next;
 	// char subtiles[0];
 } *tile_head_root;
@@ -119,6 +120,7 @@ struct item_bin_sink {
 struct node_item {
 	unsigned int id;
 	char ref_way;
+	unsigned short id_hi;	/* bits 32-47 of the id, checked by the mmap node store */
 	struct coord c;
 };
 
@@ -153,8 +155,14 @@ struct boundary {
 	GList *children;
 	struct rect r;
 	osmid admin_centre;
+	struct boundary *parent;	/**< The boundary whose children list this one is in, NULL at top level */
+	int index;			/**< The position in that list */
+	int depth;			/**< The number of ancestors */
+	struct boundary_edges *edges;	/**< Edges bucketed by y for point in polygon tests, NULL for small boundaries */
 };
 
+struct boundary_index;
+
 char *osm_tag_value(struct item_bin *ib, char *key);
 
 osmid boundary_relid(struct boundary *b);
@@ -163,6 +171,12 @@ GList *process_boundaries(FILE *boundaries, FILE *ways);
 
 GList *boundary_find_matches(GList *bl, struct coord *c);
 
+struct boundary_index *boundary_index_new(GList *bl);
+
+GList *boundary_index_find_matches(struct boundary_index *idx, struct coord *c);
+
+void boundary_index_destroy(struct boundary_index *idx);
+
 void free_boundaries(GList *l);
 
 /* buffer.c */
@@ -248,6 +262,12 @@ extern int bytes_read;
 extern int overlap;
 extern int unknown_country;
 extern int experimental;
+extern int threads;
+extern int tile_index;
+extern int spill_slices;
+extern int fold_match;
+extern int town_key_index;
+void progress_time(void);
 void sig_alrm(int sig);
 void sig_alrm_end(void);
 
@@ -284,6 +304,12 @@ struct maptool_osm {
 	FILE *towns;
 };
 
+/** Backend keeping the node coordinates for resolving ways. */
+enum node_store {
+	node_store_buffer,	/**< in memory, spilled to coords.tmp in slices of slice_size */
+	node_store_mmap,	/**< memory mapped array indexed by node id, see node_store_open() */
+};
+
 /** Type of a relation member. */
 enum relation_member_type {
 	UNUSED,
@@ -305,6 +331,10 @@ void osm_end_node(struct maptool_osm *osm);
 void osm_add_nd(osmid ref);
 osmid item_bin_get_id(struct item_bin *ib);
 void flush_nodes(int final);
+extern enum node_store node_store_type;
+void node_store_open(int create);
+void node_store_close(void);
+int node_store_is_empty(void);
 void sort_countries(int keep_tmpfiles);
 void process_associated_streets(FILE *in, struct files_relation_processing *files_relproc);
 void process_house_number_interpolations(FILE *in, struct files_relation_processing *files_relproc);
@@ -390,6 +420,7 @@ int tile_len(char *tile);
 void load_tilesdir(FILE *in);
 void tile_write_item_to_tile(struct tile_info *info, struct item_bin *ib, FILE *reference, char *name);
 void tile_write_item_minmax(struct tile_info *info, struct item_bin *ib, FILE *reference, int min, int max);
+struct tile_head *tile_find_item_head(struct tile_info *info, struct item_bin *ib, int max);
 int add_aux_tile(struct zip_info *zip_info, char *name, char *filename, int size);
 int write_aux_tiles(struct zip_info *zip_info);
 int create_tile_hash(void);
@@ -398,8 +429,27 @@ void merge_tiles(struct tile_info *info);
 struct attr map_information_attrs[32];
 void index_init(struct zip_info *info, int version);
 void index_submap_add(struct tile_info *info, struct tile_head *th);
+void tile_write_zipmember(struct zip_info *zip_info, struct tile_head *th);
+void tile_write_zipmembers(struct zip_info *zip_info, struct tile_head **ths, int count);
 
 /* zip.c */
+
+/**
+ * @brief A member of a zip file, compressed but not written yet
+ */
+struct zip_member {
+	char *name;		/**< The name of the member */
+	int filelen;		/**< The length the name is padded to */
+	char *data;		/**< The data to store, either the uncompressed data or compbuffer */
+	int data_size;		/**< The size of the uncompressed data */
+	int comp_size;		/**< The size of the data to store */
+	int method;		/**< The compression method, 8 for deflate and 0 for stored */
+	int crc;		/**< The checksum of the uncompressed data */
+	char *compbuffer;	/**< The buffer for the compressed data */
+};
+
+void zip_member_compress(struct zip_info *zip_info, struct zip_member *member, char *name, int filelen, char *data, int data_size);
+void zip_member_write(struct zip_info *zip_info, struct zip_member *member);
 void write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data, int data_size);
 void zip_write_index(struct zip_info *info);
 int zip_write_directory(struct zip_info *info);
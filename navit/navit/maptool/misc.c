@@ -225,26 +225,46 @@ item_order_by_type(enum item_type type)
 	return max;
 }
 
+/**
+ * @brief Header of an item in a slice spill file
+ *
+ * The item itself follows the header. The offset into the reference file
+ * is recorded, because items of the other slices are not in the spill file
+ * and so their reference entries can't be skipped.
+ */
+struct slice_spill_item {
+	int file;		/**< The index of the input file the item was read from */
+	int min,max;		/**< The order range to write the item with */
+	long long reference;	/**< The offset of the item's entry in the reference file */
+};
+
+static int
+phase34_item_max(struct item_bin *ib)
+{
+	struct attr_bin *a;
+	int max;
+
+	max=item_order_by_type(ib->type);
+	a=item_bin_get_attr_bin(ib, attr_order, NULL);
+	if(a) {
+		int max2=((struct range *)(a+1))->max;
+		if(max>max2)
+			max=max2;
+	}
+	return max;
+}
+
 static void
 phase34_process_file(struct tile_info *info, FILE *in, FILE *reference)
 {
 	struct item_bin *ib;
-	struct attr_bin *a;
-	int max;
 
 	while ((ib=read_item(in))) {
 		if (ib->type < 0x80000000)
 			processed_nodes++;
 		else
 			processed_ways++;
-		max=item_order_by_type(ib->type);
-		a=item_bin_get_attr_bin(ib, attr_order, NULL);
-		if(a) {
-			int max2=((struct range *)(a+1))->max;
-			if(max>max2)
-				max=max2;
-		}
-		tile_write_item_minmax(info, ib, reference, 0, max);
+		tile_write_item_minmax(info, ib, reference, 0, phase34_item_max(ib));
 	}
 }
 
@@ -263,8 +283,27 @@ phase34_process_file_range(struct tile_info *info, FILE *in, FILE *reference)
 	}
 }
 
+static void
+phase34_process_spill(struct tile_info *info, FILE *spill, FILE **reference)
+{
+	struct slice_spill_item si;
+	struct item_bin *ib;
+	FILE *ref;
+
+	while (fread(&si, sizeof(si), 1, spill) == 1 && (ib=read_item(spill))) {
+		if (ib->type < 0x80000000)
+			processed_nodes++;
+		else
+			processed_ways++;
+		ref=reference ? reference[si.file] : NULL;
+		if (ref && ftello(ref) != si.reference)
+			fseeko(ref, si.reference, SEEK_SET);
+		tile_write_item_minmax(info, ib, ref, si.min, si.max);
+	}
+}
+
 static int
-phase34(struct tile_info *info, struct zip_info *zip_info, FILE **in, FILE **reference, int in_count, int with_range)
+phase34(struct tile_info *info, struct zip_info *zip_info, FILE **in, FILE **reference, int in_count, int with_range, FILE *spill)
 {
 	int i;
 
@@ -273,7 +312,9 @@ phase34(struct tile_info *info, struct zip_info *zip_info, FILE **in, FILE **ref
 	sig_alrm(0);
 	if (! info->write)
 		tile_hash=g_hash_table_new(g_str_hash, g_str_equal);
-	for (i = 0 ; i < in_count ; i++) {
+	if (spill)
+		phase34_process_spill(info, spill, reference);
+	else for (i = 0 ; i < in_count ; i++) {
 		if (in[i]) {
 			if (with_range)
 				phase34_process_file_range(info, in[i], reference ? reference[i]:NULL);
@@ -310,31 +351,37 @@ phase4(FILE **in, int in_count, int with_range, char *suffix, FILE *tilesdir_out
 	info.suffix=suffix;
 	info.tiles_list=NULL;
 	info.tilesdir_out=tilesdir_out;
-	return phase34(&info, zip_info, in, NULL, in_count, with_range);
+	return phase34(&info, zip_info, in, NULL, in_count, with_range, NULL);
 }
 
 static int
-process_slice(FILE **in, FILE **reference, int in_count, int with_range, long long size, char *suffix, struct zip_info *zip_info)
+process_slice(FILE **in, FILE **reference, int in_count, int with_range, long long size, char *suffix, struct zip_info *zip_info, FILE *spill)
 {
 	struct tile_head *th;
 	char *slice_data,*zip_data;
-	int zipfiles=0;
+	struct tile_head **zipfiles;
+	int zipfiles_count=0;
 	struct tile_info info;
 	int i;
 
 	slice_data=malloc(size);
 	assert(slice_data != NULL);
 	zip_data=slice_data;
+	i=0;
 	th=tile_head_root;
 	while (th) {
 		if (th->process) {
 			th->zip_data=zip_data;
 			zip_data+=th->total_size;
+			i++;
 		}
 		th=th->next;
 	}
+	zipfiles=g_new(struct tile_head *, i);
+	if (spill)
+		fseek(spill, 0, SEEK_SET);
 	for (i = 0 ; i < in_count ; i++) {
-		if (in[i])
+		if (in[i] && !spill)
 			fseek(in[i], 0, SEEK_SET);
 		if (reference && reference[i]) {
 			fseek(reference[i], 0, SEEK_SET);
@@ -345,7 +392,7 @@ process_slice(FILE **in, FILE **reference, int in_count, int with_range, long lo
 	info.suffix=suffix;
 	info.tiles_list=NULL;
 	info.tilesdir_out=NULL;
-	phase34(&info, zip_info, in, reference, in_count, with_range);
+	phase34(&info, zip_info, in, reference, in_count, with_range, spill);
 
 	th=tile_head_root;
 	while (th) {
@@ -355,63 +402,148 @@ process_slice(FILE **in, FILE **reference, int in_count, int with_range, long lo
 					fprintf(stderr,"Size error '%s': %d vs %d\n", th->name, th->total_size, th->total_size_used);
 					exit(1);
 				}
-				write_zipmember(zip_info, th->name, zip_get_maxnamelen(zip_info), th->zip_data, th->total_size);
-				zipfiles++;
+				zipfiles[zipfiles_count++]=th;
 			} else 
 				fwrite(th->zip_data, th->total_size, 1, zip_get_index(zip_info));
 		}
 		th=th->next;
 	}
+	tile_write_zipmembers(zip_info, zipfiles, zipfiles_count);
+	g_free(zipfiles);
 	free(slice_data);
 
-	return zipfiles;
+	return zipfiles_count;
 }
 
-int
-phase5(FILE **in, FILE **references, int in_count, int with_range, char *suffix, struct zip_info *zip_info)
+/**
+ * @brief Assigns the tiles to the slices they are written in
+ *
+ * Consecutive tiles are put into one slice as long as their total size stays
+ * below slice_size. A tile which is larger than slice_size gets a slice of its own.
+ *
+ * @return The number of slices
+ */
+static int
+phase5_assign_slices(void)
 {
-	long long size;
-	int slices;
-	int zipnum,written_tiles;
-	struct tile_head *th,*th2;
-	create_tile_hash();
+	struct tile_head *th;
+	long long size=0;
+	int slices=0;
 
-	th=tile_head_root;
-	size=0;
-	slices=0;
 	fprintf(stderr, "Maximum slice size "LONGLONG_FMT"\n", slice_size);
+	th=tile_head_root;
 	while (th) {
-		if (size + th->total_size > slice_size) {
+		if (size && size+th->total_size >= slice_size) {
 			fprintf(stderr,"Slice %d is of size "LONGLONG_FMT"\n", slices, size);
 			size=0;
 			slices++;
 		}
+		th->slice=slices;
 		size+=th->total_size;
 		th=th->next;
 	}
-	if (size)
-		fprintf(stderr,"Slice %d is of size "LONGLONG_FMT"\n", slices, size);
-	th=tile_head_root;
-	size=0;
-	slices=0;
-	while (th) {
-		th2=tile_head_root;
-		while (th2) {
-			th2->process=0;
-			th2=th2->next;
+	if (!tile_head_root)
+		return 0;
+	fprintf(stderr,"Slice %d is of size "LONGLONG_FMT"\n", slices, size);
+	return slices+1;
+}
+
+static char *
+phase5_spill_name(int slice)
+{
+	static char name[32];
+	sprintf(name,"slice%d",slice);
+	return name;
+}
+
+/**
+ * @brief Distributes the items of all input files to one spill file per slice
+ *
+ * This reads the input once, so the slices don't have to read all of it again.
+ *
+ * @param in The input files
+ * @param in_count The number of input files
+ * @param with_range Whether each item is preceded by its order range
+ * @param suffix The suffix of the tiles and the temporary files
+ * @param slices The number of slices, as returned by phase5_assign_slices()
+ * @return The spill files, one per slice
+ */
+static FILE **
+phase5_spill(FILE **in, int in_count, int with_range, char *suffix, int slices)
+{
+	struct slice_spill_item si;
+	struct tile_info info;
+	struct tile_head *th;
+	struct item_bin *ib;
+	FILE **spill;
+	int i;
+
+	spill=g_new(FILE *, slices);
+	for (i = 0 ; i < slices ; i++) {
+		spill[i]=tempfile(suffix, phase5_spill_name(i), 1);
+		assert(spill[i] != NULL);
+	}
+	info.suffix=suffix;
+	fprintf(stderr,"Distributing items to %d slices\n", slices);
+	for (i = 0 ; i < in_count ; i++) {
+		if (!in[i])
+			continue;
+		fseek(in[i], 0, SEEK_SET);
+		si.file=i;
+		si.reference=0;
+		for (;;) {
+			si.min=0;
+			if (with_range)
+				ib=read_item_range(in[i], &si.min, &si.max);
+			else if ((ib=read_item(in[i])))
+				si.max=phase34_item_max(ib);
+			if (!ib)
+				break;
+			th=tile_find_item_head(&info, ib, si.max);
+			if (!th) {
+				fprintf(stderr,"no tile hash found for item 0x%x\n", ib->type);
+				exit(1);
+			}
+			fwrite(&si, sizeof(si), 1, spill[th->slice]);
+			item_bin_write(ib, spill[th->slice]);
+			si.reference+=8;
 		}
+	}
+	return spill;
+}
+
+int
+phase5(FILE **in, FILE **references, int in_count, int with_range, char *suffix, struct zip_info *zip_info)
+{
+	long long size;
+	int slice,slices;
+	int zipnum,written_tiles;
+	struct tile_head *th;
+	FILE **spill=NULL;
+	create_tile_hash();
+
+	slices=phase5_assign_slices();
+	if (spill_slices && slices > 1)
+		spill=phase5_spill(in, in_count, with_range, suffix, slices);
+	for (slice = 0 ; slice < slices ; slice++) {
 		size=0;
-		while (th && size+th->total_size < slice_size) {
-			size+=th->total_size;
-			th->process=1;
+		th=tile_head_root;
+		while (th) {
+			th->process=(th->slice == slice);
+			if (th->process)
+				size+=th->total_size;
 			th=th->next;
 		}
 		/* process_slice() modifies zip_info, but need to retain old info */
 		zipnum=zip_get_zipnum(zip_info);
-		written_tiles=process_slice(in, references, in_count, with_range, size, suffix, zip_info);
+		written_tiles=process_slice(in, references, in_count, with_range, size, suffix, zip_info, spill ? spill[slice] : NULL);
 		zip_set_zipnum(zip_info, zipnum+written_tiles);
-		slices++;
+		if (spill) {
+			fclose(spill[slice]);
+			tempfile_unlink(suffix, phase5_spill_name(slice));
+		}
 	}
+	g_free(spill);
 	return 0;
 }
 
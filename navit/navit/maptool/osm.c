@@ -23,6 +23,10 @@
 #else
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
@@ -1303,6 +1307,182 @@ static struct node_item *current_node;
 osmid id_last_node;
 GHashTable *node_hash,*way_hash;
 
+/** Where node coordinates are kept between phase 1 and the splitting at intersections. */
+enum node_store node_store_type=node_store_buffer;
+
+#ifndef _WIN32
+/** Number of node ids the mmap node store reserves address space for. Ways reference nodes by
+ * the lower 32 bits of their id (see GET_REF()), so that is what the store is indexed by, too. */
+#define NODE_STORE_MAX_IDS (sizeof(void *) > 4 ? (1ll << 32) : (1ll << 26))
+/** Step in bytes by which the file behind the mmap node store grows. */
+#define NODE_STORE_GROW (64*1024*1024)
+
+static int node_store_fd=-1;
+/** Mapping of coords_by_id.tmp, the node with id n lives at node_store_base[(unsigned int)n]. */
+static struct node_item *node_store_base;
+/** Current size of coords_by_id.tmp in bytes. */
+static long long node_store_size;
+#endif
+/** Number of nodes added to the mmap node store. */
+static long long node_store_count;
+/** Compact copy of the nodes in input order, for the relation passes reading coords.tmp. */
+static FILE *node_store_coords;
+/** Receives the coordinates of duplicate nodes, which are not stored. */
+static struct node_item node_store_duplicate;
+
+/**
+ * @brief Opens the mmap node store.
+ *
+ * The store is a sparse file holding one struct node_item per possible node id, mapped
+ * in one piece so node lookups are a single array access independent of the amount of RAM.
+ *
+ * @param create 1 to start a new, empty store in phase 1, 0 to reopen the store of an earlier run
+ */
+void
+node_store_open(int create)
+{
+#ifndef _WIN32
+	if (node_store_base)
+		return;
+	node_store_fd=open("coords_by_id.tmp", O_RDWR|O_CREAT|(create ? O_TRUNC : 0), 0644);
+	if (node_store_fd == -1) {
+		perror("coords_by_id.tmp");
+		exit(1);
+	}
+	node_store_size=lseek(node_store_fd, 0, SEEK_END);
+	node_store_base=mmap(NULL, NODE_STORE_MAX_IDS*sizeof(struct node_item), PROT_READ|PROT_WRITE, MAP_SHARED,
+		node_store_fd, 0);
+	if (node_store_base == MAP_FAILED) {
+		perror("mmap of node store");
+		exit(1);
+	}
+	if (create) {
+		node_store_coords=fopen("coords.tmp","wb");
+		dbg_assert(node_store_coords != NULL);
+		node_store_count=0;
+	}
+#else
+	fprintf(stderr,"ERROR: the mmap node store is not supported on this platform\n");
+	exit(1);
+#endif
+}
+
+/**
+ * @brief Unmaps the mmap node store. The file is kept until the temporary files are removed.
+ */
+void
+node_store_close(void)
+{
+#ifndef _WIN32
+	if (!node_store_base)
+		return;
+	munmap(node_store_base, NODE_STORE_MAX_IDS*sizeof(struct node_item));
+	close(node_store_fd);
+	node_store_base=NULL;
+	node_store_fd=-1;
+#endif
+}
+
+/**
+ * @brief Checks whether phase 1 has seen any node.
+ *
+ * @return 1 if no node was stored, 0 otherwise
+ */
+int
+node_store_is_empty(void)
+{
+	if (node_store_type == node_store_mmap)
+		return node_store_count == 0;
+	return node_buffer.size == 0;
+}
+
+#ifndef _WIN32
+static struct node_item *
+node_store_slot(osmid id)
+{
+	unsigned int idx=id;
+	struct node_item *ni;
+	if ((idx+1ll)*sizeof(struct node_item) > node_store_size)
+		return NULL;
+	ni=node_store_base+idx;
+	/* Unused slots are holes of the sparse file and read as zero. */
+	if (!ni->id && !ni->c.x && !ni->c.y)
+		return NULL;
+	return ni;
+}
+
+static osmid
+node_store_id(struct node_item *ni)
+{
+	return (osmid)ni->id_hi << 32 | ni->id;
+}
+
+static void
+node_store_mismatch(osmid id, struct node_item *ni)
+{
+	fprintf(stderr,"ERROR: node ids " OSMID_FMT " and " OSMID_FMT " share a slot of the mmap node store, use the default node store for this input\n", node_store_id(ni), id);
+	exit(1);
+}
+
+/**
+ * @brief Looks up a node in the mmap node store
+ *
+ * References of ways only keep the lower 32 bits of a node id, so an id below 2^32 matches the
+ * node stored in its slot. Full ids have to match exactly.
+ *
+ * @param id The node id
+ * @return The node, or NULL if there is none
+ */
+static struct node_item *
+node_store_get(osmid id)
+{
+	struct node_item *ni=node_store_slot(id);
+	if (ni && node_store_id(ni) != id && (id >> 32))
+		node_store_mismatch(id, ni);
+	return ni;
+}
+
+static struct node_item *
+node_store_allocate(osmid id)
+{
+	unsigned int idx=id;
+	struct node_item *ni;
+	long long size;
+	/* Only 32 bit builds reserve address space for less than the whole 32 bit index range */
+	if ((sizeof(void *) == 4 && idx >= NODE_STORE_MAX_IDS) || (id >> 48)) {
+		fprintf(stderr,"ERROR: node id " OSMID_FMT " is out of the range of the mmap node store\n", id);
+		exit(1);
+	}
+	if ((ni=node_store_slot(id))) {
+		if (node_store_id(ni) != id)
+			node_store_mismatch(id, ni);
+		return NULL;
+	}
+	size=(idx+1ll)*sizeof(struct node_item);
+	if (size > node_store_size) {
+		size=(size+NODE_STORE_GROW-1)/NODE_STORE_GROW*NODE_STORE_GROW;
+		if (ftruncate(node_store_fd, size)) {
+			perror("growing coords_by_id.tmp");
+			exit(1);
+		}
+		node_store_size=size;
+	}
+	return node_store_base+idx;
+}
+#else
+static struct node_item *
+node_store_get(osmid id)
+{
+	return NULL;
+}
+
+static struct node_item *
+node_store_allocate(osmid id)
+{
+	return NULL;
+}
+#endif
+
 static void
 node_buffer_to_hash(void)
 {
@@ -1316,6 +1496,14 @@ void
 flush_nodes(int final)
 {
 	fprintf(stderr,"flush_nodes %d\n",final);
+	if (node_store_type == node_store_mmap) {
+		if (node_store_coords) {
+			fclose(node_store_coords);
+			node_store_coords=NULL;
+		}
+		slices=1;
+		return;
+	}
 	save_buffer("coords.tmp",&node_buffer,slices*slice_size);
 	if (!final) {
 		node_buffer.size=0;
@@ -1356,12 +1544,25 @@ osm_add_node(osmid id, double lat, double lon)
       osmid_attr.len=3;
       osmid_attr_value=id;
 
-      current_node=allocate_node_item_in_buffer();
+      if (node_store_type == node_store_mmap) {
+	      current_node=node_store_allocate(id);
+	      if (!current_node) {
+		      current_node=&node_store_duplicate;
+		      nodeid=0;
+	      }
+      } else
+	      current_node=allocate_node_item_in_buffer();
       current_node->id=id;
+      current_node->id_hi=id >> 32;
       current_node->ref_way=0;
       current_node->c.x=lon*6371000.0*M_PI/180;
       current_node->c.y=log(tan(M_PI_4+lat*M_PI/360))*6371000.0;
-      if (! node_hash) {
+      if (node_store_type == node_store_mmap) {
+	      if (nodeid) {
+		      fwrite(current_node, sizeof(*current_node), 1, node_store_coords);
+		      node_store_count++;
+	      }
+      } else if (! node_hash) {
 	      if (current_node->id > id_last_node) {
 		      id_last_node=current_node->id;
 	      } else {
@@ -1441,6 +1642,8 @@ node_item_get(osmid id)
 {
       struct node_item *node_buffer_base=(struct node_item *)(node_buffer.base);
       long long result_index;
+      if (node_store_type == node_store_mmap)
+	      return node_store_get(id);
       if (node_hash) {
             // Use g_hash_table_lookup_extended instead of g_hash_table_lookup
             // to distinguish a key with a value 0 from a missing key.
@@ -1935,9 +2138,9 @@ osm_process_town_by_is_in(struct item_bin *ib,char *is_in, struct attr *attrs, G
 }
 
 static struct country_table *
-osm_process_town_by_boundary(GList *bl, struct item_bin *ib, struct coord *c, struct attr *attrs)
+osm_process_town_by_boundary(struct boundary_index *bi, struct item_bin *ib, struct coord *c, struct attr *attrs)
 {
-	GList *l,*matches=boundary_find_matches(bl, c);
+	GList *l,*matches=boundary_index_find_matches(bi, c);
 	struct boundary *match=NULL;
 	
 	l=matches;
@@ -2058,6 +2261,7 @@ osm_process_towns(FILE *in, FILE *boundaries, FILE *ways, char *suffix)
 {
 	struct item_bin *ib;
 	GList *bl;
+	struct boundary_index *bi;
 	GHashTable *town_hash;
 	struct attr attrs[11];
 	FILE *towns_poly;
@@ -2067,6 +2271,10 @@ osm_process_towns(FILE *in, FILE *boundaries, FILE *ways, char *suffix)
 
 	profile(1,"processed boundaries\n");
 
+	bi=boundary_index_new(bl);
+
+	profile(1,"indexed boundaries\n");
+
 	town_hash=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	while ((ib=read_item(in)))  {
 		if (!item_is_district(*ib))
@@ -2086,7 +2294,7 @@ osm_process_towns(FILE *in, FILE *boundaries, FILE *ways, char *suffix)
 		int i;
 
 		memset(attrs, 0, sizeof(attrs));
-		result=osm_process_town_by_boundary(bl, ib, c, attrs);
+		result=osm_process_town_by_boundary(bi, ib, c, attrs);
 		if (!result)
 			result=osm_process_town_by_is_in(ib, is_in, attrs, town_hash);
 		else if (item_is_district(*ib)) // just for the town name
@@ -2143,6 +2351,7 @@ osm_process_towns(FILE *in, FILE *boundaries, FILE *ways, char *suffix)
 	fclose(towns_poly);
 	
 	g_hash_table_destroy(town_hash);
+	boundary_index_destroy(bi);
 	free_boundaries(bl);
 
 	profile(0, "Finished processing towns\n");
@@ -3134,19 +3343,26 @@ map_resolve_coords_and_split_at_intersections(FILE *in, FILE *out, FILE *out_ind
 	return 0;
 }
 
-static void
-index_country_add(struct zip_info *info, int country_id, char*first_key, char *last_key, char *tile, char *filename, int size, FILE *out)
+static int
+index_country_add_tile(struct zip_info *info, char *tile, char type, char *filename, int size)
 {
-	struct item_bin *item_bin=init_item(type_countryindex);
 	int num=0, zip_num;
 	char tilename[32];
 
 	do {
-		snprintf(tilename,sizeof(tilename),"%ss%d", tile, num);
+		snprintf(tilename,sizeof(tilename),"%s%c%d", tile, type, num);
 		num++;
 		zip_num=add_aux_tile(info, tilename, filename, size);
 	} while (zip_num == -1);
-	
+	return zip_num;
+}
+
+static int
+index_country_add(struct zip_info *info, int country_id, char*first_key, char *last_key, char *tile, char *filename, int size, int key_index, FILE *out)
+{
+	struct item_bin *item_bin=init_item(type_countryindex);
+	int zip_num=index_country_add_tile(info, tile, 's', filename, size);
+
 	item_bin_add_attr_int(item_bin, attr_country_id, country_id);
 
 	if(first_key)
@@ -3155,8 +3371,136 @@ index_country_add(struct zip_info *info, int country_id, char*first_key, char *l
 	if(last_key)
 		item_bin_add_attr_string(item_bin, attr_last_key, last_key);
 
+	if(key_index != -1)
+		item_bin_add_attr_int(item_bin, attr_town_key_index, key_index);
+
 	item_bin_add_attr_int(item_bin, attr_zipfile_ref, zip_num);
 	item_bin_write(item_bin, out);
+	return zip_num;
+}
+
+/* One entry of the town key index, as stored in the key index tile.
+ * The tile holds the number of entries, the entries sorted by key and then the zero terminated keys. */
+struct town_key_index_entry {
+	int key;	/* Offset of the casefolded key, relative to the first key */
+	int zipfile;	/* Index part holding the town item */
+	int offset;	/* Offset of the town item within the part, in ints */
+};
+
+struct town_key {
+	char *key;
+	int part;
+	int offset;
+};
+
+struct town_keys {
+	struct town_key *keys;
+	int count, size;
+	int *zipfiles;	/* zip member of each index part, indexed by part number */
+	int parts;
+};
+
+static void
+town_keys_add(struct town_keys *keys, char *key, int part, int offset)
+{
+	struct town_key *k;
+	if (keys->count == keys->size) {
+		keys->size=keys->size ? keys->size*2 : 1024;
+		keys->keys=g_renew(struct town_key, keys->keys, keys->size);
+	}
+	k=&keys->keys[keys->count++];
+	k->key=linguistics_casefold(key);
+	k->part=part;
+	k->offset=offset;
+}
+
+/**
+ * @brief Remember the search keys of a town index item
+ *
+ * These are the names navit compares against the search string. Districts are also found by the name of the
+ * town they belong to, so they can have two keys.
+ */
+static void
+town_keys_add_item(struct town_keys *keys, struct item_bin *ib, int part, int offset)
+{
+	char *town=item_bin_get_attr(ib, attr_town_name_match, NULL);
+	char *district=NULL;
+
+	if (!town)
+		town=item_bin_get_attr(ib, attr_town_name, NULL);
+	if (item_is_district(*ib)) {
+		district=item_bin_get_attr(ib, attr_district_name_match, NULL);
+		if (!district)
+			district=item_bin_get_attr(ib, attr_district_name, NULL);
+	}
+	if (town)
+		town_keys_add(keys, town, part, offset);
+	if (district && (!town || strcmp(town, district)))
+		town_keys_add(keys, district, part, offset);
+}
+
+static void
+town_keys_set_part(struct town_keys *keys, int part, int zipfile)
+{
+	if (part >= keys->parts) {
+		keys->parts=part+16;
+		keys->zipfiles=g_renew(int, keys->zipfiles, keys->parts);
+	}
+	keys->zipfiles[part]=zipfile;
+}
+
+static int
+town_keys_compare(const void *p1, const void *p2)
+{
+	const struct town_key *k1=p1, *k2=p2;
+	int ret=strcmp(k1->key, k2->key);
+	if (ret)
+		return ret;
+	if (k1->part != k2->part)
+		return k1->part-k2->part;
+	return k1->offset-k2->offset;
+}
+
+/**
+ * @brief Write the sorted town key index of a country and add it to the map
+ *
+ * @return zip member of the key index, -1 if there are no keys
+ */
+static int
+town_keys_write(struct town_keys *keys, struct zip_info *info, char *countrypart, char *tile)
+{
+	FILE *f;
+	char *filename;
+	struct town_key_index_entry e;
+	int i,keys_size=0,size,ret;
+	static const char pad[4];
+
+	if (!keys->count)
+		return -1;
+	qsort(keys->keys, keys->count, sizeof(struct town_key), town_keys_compare);
+	f=tempfile("k",countrypart,1);
+	filename=tempfile_name("k",countrypart);
+	fwrite(&keys->count, sizeof(keys->count), 1, f);
+	for (i = 0 ; i < keys->count ; i++) {
+		e.key=keys_size;
+		e.zipfile=keys->zipfiles[keys->keys[i].part];
+		e.offset=keys->keys[i].offset;
+		fwrite(&e, sizeof(e), 1, f);
+		keys_size+=strlen(keys->keys[i].key)+1;
+	}
+	for (i = 0 ; i < keys->count ; i++)
+		fwrite(keys->keys[i].key, strlen(keys->keys[i].key)+1, 1, f);
+	if (keys_size % 4)
+		fwrite(pad, 4-keys_size%4, 1, f);
+	size=ftello(f);
+	fclose(f);
+	ret=index_country_add_tile(info, tile, 'k', filename, size);
+	g_free(filename);
+	for (i = 0 ; i < keys->count ; i++)
+		g_free(keys->keys[i].key);
+	g_free(keys->keys);
+	g_free(keys->zipfiles);
+	return ret;
 }
 
 void
@@ -3184,6 +3528,7 @@ write_countrydir(struct zip_info *zip_info, int max_index_size)
 			char *countryindexname;
 			FILE *countryindex;
 			char key[1024]="",first_key[1024]="",last_key[1024]="";
+			struct town_keys keys={NULL,};
 			
 			tile(&co->r, "", tileco, max, overlap, NULL);
 			
@@ -3222,10 +3567,13 @@ write_countrydir(struct zip_info *zip_info, int max_index_size)
 				     - item just read belongs to a different tile than the previous one,
 				    then close existing output file, put reference to the country index tile.*/
 				if(out && (!r || (partsize && ((partsize+ibsize)>max_index_size)) || strcmp(tileprev,tilecur)) ) {
+					int zip_num;
 					partsize=ftello(out);
 					fclose(out);
 					out=NULL;
-					index_country_add(zip_info,co->countryid,first_key,last_key,strlen(tileco)>strlen(tileprev)?tileco:tileprev,outname,partsize,countryindex);
+					zip_num=index_country_add(zip_info,co->countryid,first_key,last_key,strlen(tileco)>strlen(tileprev)?tileco:tileprev,outname,partsize,-1,countryindex);
+					if (town_key_index)
+						town_keys_set_part(&keys, co->nparts, zip_num);
 					g_free(outname);
 					outname=NULL;
 					g_strlcpy(first_key,key,sizeof(first_key));
@@ -3244,14 +3592,18 @@ write_countrydir(struct zip_info *zip_info, int max_index_size)
 					partsize=0;
 				}
 
+				if (town_key_index)
+					town_keys_add_item(&keys, ib, co->nparts, ftello(out)/4);
 				item_bin_write(ib,out);
 				partsize+=ibsize;
 				g_strlcpy(last_key,key,sizeof(last_key));
 			}
 			
 			partsize=ftello(countryindex);
-			if(partsize)
-				index_country_add(zip_info,co->countryid,NULL,NULL,tileco,countryindexname, partsize, zip_get_index(zip_info));
+			if(partsize) {
+				int key_index=town_key_index ? town_keys_write(&keys, zip_info, countrypart, tileco) : -1;
+				index_country_add(zip_info,co->countryid,NULL,NULL,tileco,countryindexname, partsize, key_index, zip_get_index(zip_info));
+			}
 			fclose(countryindex);
 			g_free(countryindexname);
 			fclose(in);
@@ -3312,6 +3664,7 @@ remove_countryfiles(void)
 			sprintf(partsuffix,"%d",j);
 			tempfile_unlink(partsuffix,filename);
 		}
+		tempfile_unlink("k",filename);
 	}
 }
 
@@ -21,8 +21,12 @@
 #include <math.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <zlib.h>
 #include "maptool.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "debug.h"
 #include "linguistics.h"
 #include "file.h"
@@ -63,20 +67,64 @@ read_header(FILE *f)
 }
 
 
-static OSMPBF__Blob *
-read_blob(OSMPBF__BlobHeader *header, FILE *f, unsigned char *buffer)
+/**
+ * @brief A file block of the input, passed from the reader over the decoder to the delivery stage
+ */
+struct protobuf_block {
+	struct protobuf_block *next;			/**< Next block waiting for a decoder */
+	int seq;					/**< Position of the block in the file */
+	OSMPBF__BlobHeader *header;			/**< The header of the block */
+	unsigned char *buffer;				/**< The blob as read from the file, freed once it is unpacked */
+	OSMPBF__PrimitiveBlock *primitive_block;	/**< The decoded data of an OSMData block */
+	int error;					/**< Set if the block could not be decoded */
+};
+
+/**
+ * @brief Statistics of the stages reading a protobuf file
+ *
+ * The busy times are the seconds spent working in each stage, summed over all threads of a stage.
+ */
+struct protobuf_stats {
+	int blocks;
+	long long bytes_read;
+	long long bytes_inflated;
+	double read_time;
+	double decode_time;
+	double deliver_time;
+};
+
+static double
+protobuf_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static unsigned char *
+read_blob(OSMPBF__BlobHeader *header, FILE *f)
 {
 	int len=header->datasize;
+	unsigned char *buffer;
 	SANITY_CHECK_LENGTH(len, MAX_BLOB_LENGTH)
-	if (fread(buffer, len, 1, f) != 1)
+	buffer=malloc(len);
+	if (!buffer)
+		return NULL;
+	if (fread(buffer, len, 1, f) != 1) {
+		free(buffer);
 		return NULL;
-	return osmpbf__blob__unpack(&protobuf_c_system_allocator, len, buffer);
+	}
+	return buffer;
 }
 
 static unsigned char *
 uncompress_blob(OSMPBF__Blob *blob)
 {
-	unsigned char *ret=malloc(blob->raw_size);
+	unsigned char *ret;
+
+	if (!blob->has_zlib_data || blob->raw_size <= 0 || blob->raw_size > MAX_BLOB_LENGTH)
+		return NULL;
+	ret=malloc(blob->raw_size);
 	int zerr;
 	z_stream strm;
 
@@ -142,12 +190,15 @@ get_string(char *buffer, int buffer_size, OSMPBF__PrimitiveBlock *primitive_bloc
 }
 
 
-static void
+static int
 process_osmheader(OSMPBF__Blob *blob, unsigned char *data)
 {
 	OSMPBF__HeaderBlock *header_block;
 	header_block=osmpbf__header_block__unpack(&protobuf_c_system_allocator, blob->raw_size, data);
+	if (!header_block)
+		return 0;
 	osmpbf__header_block__free_unpacked(header_block, &protobuf_c_system_allocator);
+	return 1;
 }
 
 #if 0
@@ -329,11 +380,9 @@ process_relation(OSMPBF__PrimitiveBlock *primitive_block, OSMPBF__Relation *rela
 }
 
 static void
-process_osmdata(OSMPBF__Blob *blob, unsigned char *data, struct maptool_osm *osm)
+process_osmdata(OSMPBF__PrimitiveBlock *primitive_block, struct maptool_osm *osm)
 {
 	int i,j;
-	OSMPBF__PrimitiveBlock *primitive_block;
-	primitive_block=osmpbf__primitive_block__unpack(&protobuf_c_system_allocator, blob->raw_size, data);
 	for (i = 0 ; i < primitive_block->n_primitivegroup ; i++) {
 		OSMPBF__PrimitiveGroup *primitive_group=primitive_block->primitivegroup[i];
 		process_dense(primitive_block, primitive_group->dense, osm);
@@ -345,41 +394,307 @@ process_osmdata(OSMPBF__Blob *blob, unsigned char *data, struct maptool_osm *osm
 		printf("Group %p %d %d %d %d\n",primitive_group->dense,primitive_group->n_nodes,primitive_group->n_ways,primitive_group->n_relations,primitive_group->n_changesets);
 #endif
 	}
-	osmpbf__primitive_block__free_unpacked(primitive_block, &protobuf_c_system_allocator);
 }
 
 
-int
-map_collect_data_osm_protobuf(FILE *in, struct maptool_osm *osm)
+/**
+ * @brief Reads the next block of a protobuf file, without decoding it
+ *
+ * @param in The file to read from
+ * @param stats The statistics to update
+ * @return The block, or NULL at the end of the file
+ */
+static struct protobuf_block *
+protobuf_block_read(FILE *in, struct protobuf_stats *stats)
 {
+	struct protobuf_block *block;
 	OSMPBF__BlobHeader *header;
+	double start=protobuf_now();
+
+	header=read_header(in);
+	if (!header)
+		return NULL;
+	block=g_new0(struct protobuf_block, 1);
+	block->header=header;
+	block->buffer=read_blob(header, in);
+	if (!block->buffer)
+		block->error=1;
+	else
+		stats->bytes_read+=header->datasize;
+	stats->blocks++;
+	stats->read_time+=protobuf_now()-start;
+	return block;
+}
+
+/**
+ * @brief Inflates and unpacks a block read by protobuf_block_read()
+ *
+ * This only touches the block itself, so it may run in any thread.
+ *
+ * @param block The block to decode
+ * @param bytes_inflated Set to the size of the inflated data
+ */
+static void
+protobuf_block_decode(struct protobuf_block *block, int *bytes_inflated)
+{
 	OSMPBF__Blob *blob;
 	unsigned char *data;
-	unsigned char *buffer=malloc(MAX_BLOB_LENGTH);
 
-#if 0
-	printf("<?xml version='1.0' encoding='UTF-8'?>\n");
-	printf("<osm version=\"0.6\" generator=\"pbf2osm\">\n");
-#endif
-	while ((header=read_header(in))) {
-		blob=read_blob(header, in, buffer);
-		data=uncompress_blob(blob);
-		if (!strcmp(header->type,"OSMHeader")) {
-			process_osmheader(blob, data);
-		} else if (!strcmp(header->type,"OSMData")) {
-			process_osmdata(blob, data, osm);
-		} else {
-			printf("skipping fileblock of unknown type '%s'\n", header->type);
-			free(buffer);
-			return 0;
+	*bytes_inflated=0;
+	if (block->error)
+		return;
+	blob=osmpbf__blob__unpack(&protobuf_c_system_allocator, block->header->datasize, block->buffer);
+	free(block->buffer);
+	block->buffer=NULL;
+	if (!blob) {
+		block->error=1;
+		return;
+	}
+	data=uncompress_blob(blob);
+	if (!data) 
+		block->error=1;
+	else {
+		*bytes_inflated=blob->raw_size;
+		if (!strcmp(block->header->type,"OSMHeader")) {
+			if (!process_osmheader(blob, data))
+				block->error=1;
+		} else if (!strcmp(block->header->type,"OSMData")) {
+			block->primitive_block=osmpbf__primitive_block__unpack(&protobuf_c_system_allocator, blob->raw_size, data);
+			if (!block->primitive_block)
+				block->error=1;
 		}
 		free(data);
-		osmpbf__blob__free_unpacked(blob, &protobuf_c_system_allocator);
-		osmpbf__blob_header__free_unpacked(header, &protobuf_c_system_allocator);
 	}
-	free(buffer);
-#if 0
-	printf("</osm>\n");
-#endif
+	osmpbf__blob__free_unpacked(blob, &protobuf_c_system_allocator);
+}
+
+/**
+ * @brief Passes the contents of a decoded block to the osm_add_* functions
+ *
+ * @param block The block
+ * @param osm The output files
+ * @param stats The statistics to update
+ * @return 1 on success, 0 if the block is broken or of unknown type
+ */
+static int
+protobuf_block_deliver(struct protobuf_block *block, struct maptool_osm *osm, struct protobuf_stats *stats)
+{
+	double start=protobuf_now();
+
+	if (block->error) {
+		fprintf(stderr,"Not a valid protobuf file. Failed to decode fileblock %d.\n", block->seq);
+		return 0;
+	}
+	if (!strcmp(block->header->type,"OSMData")) 
+		process_osmdata(block->primitive_block, osm);
+	else if (strcmp(block->header->type,"OSMHeader")) {
+		printf("skipping fileblock of unknown type '%s'\n", block->header->type);
+		return 0;
+	}
+	stats->deliver_time+=protobuf_now()-start;
 	return 1;
 }
+
+static void
+protobuf_block_free(struct protobuf_block *block)
+{
+	free(block->buffer);
+	if (block->primitive_block)
+		osmpbf__primitive_block__free_unpacked(block->primitive_block, &protobuf_c_system_allocator);
+	osmpbf__blob_header__free_unpacked(block->header, &protobuf_c_system_allocator);
+	g_free(block);
+}
+
+static void
+protobuf_stats_report(struct protobuf_stats *stats, int thread_count)
+{
+	double mb_read=stats->bytes_read/1024.0/1024.0;
+	double mb_inflated=stats->bytes_inflated/1024.0/1024.0;
+	fprintf(stderr,"PROGRESS: protobuf: %d blocks with %d threads. read %.0f MB in %.1fs (%.1f MB/s), "
+		"decoded %.0f MB in %.1fs (%.1f MB/s), delivered in %.1fs (%.1f MB/s)",
+		stats->blocks, thread_count,
+		mb_read, stats->read_time, stats->read_time > 0 ? mb_read/stats->read_time : 0,
+		mb_inflated, stats->decode_time, stats->decode_time > 0 ? mb_inflated/stats->decode_time : 0,
+		stats->deliver_time, stats->deliver_time > 0 ? mb_inflated/stats->deliver_time : 0);
+	progress_time();
+	fprintf(stderr,"\n");
+}
+
+#ifdef HAVE_PTHREAD
+
+/**
+ * @brief The pipeline reading a protobuf file with several threads
+ *
+ * One thread reads the blocks from the file, the decoder threads inflate and unpack them and the
+ * calling thread delivers them to the osm_add_* functions in file order. At most max_blocks blocks
+ * are between reading and delivery at any time.
+ */
+struct protobuf_pipeline {
+	FILE *in;
+	pthread_mutex_t mutex;				/**< Protects all fields below */
+	pthread_cond_t cond;				/**< Signalled whenever one of the fields below changes */
+	struct protobuf_block *todo;			/**< Blocks waiting for a decoder */
+	struct protobuf_block **todo_last;		/**< Pointer to the next field of the last block in todo */
+	struct protobuf_block **done;			/**< Decoded blocks, indexed by seq modulo max_blocks */
+	int max_blocks;
+	int read;					/**< Number of blocks read */
+	int delivered;					/**< Number of blocks delivered or being delivered */
+	int eof;					/**< The reader has finished */
+	int abort;					/**< The delivery stopped, the other threads should stop as well */
+	struct protobuf_stats stats;
+};
+
+static void *
+protobuf_reader(void *data)
+{
+	struct protobuf_pipeline *pl=data;
+	struct protobuf_block *block;
+	struct protobuf_stats stats;
+	int stop;
+
+	memset(&stats, 0, sizeof(stats));
+	for (;;) {
+		pthread_mutex_lock(&pl->mutex);
+		while (pl->read-pl->delivered >= pl->max_blocks && !pl->abort)
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		stop=pl->abort;
+		pthread_mutex_unlock(&pl->mutex);
+		if (stop)
+			break;
+		block=protobuf_block_read(pl->in, &stats);
+		if (!block)
+			break;
+		pthread_mutex_lock(&pl->mutex);
+		block->seq=pl->read++;
+		*pl->todo_last=block;
+		pl->todo_last=&block->next;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+	}
+	pthread_mutex_lock(&pl->mutex);
+	pl->eof=1;
+	pl->stats.blocks=stats.blocks;
+	pl->stats.bytes_read=stats.bytes_read;
+	pl->stats.read_time=stats.read_time;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+	return NULL;
+}
+
+static void *
+protobuf_decoder(void *data)
+{
+	struct protobuf_pipeline *pl=data;
+	struct protobuf_block *block;
+	double start;
+	int bytes_inflated;
+
+	pthread_mutex_lock(&pl->mutex);
+	for (;;) {
+		while (!pl->todo && !pl->eof && !pl->abort)
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		if (!pl->todo || pl->abort)
+			break;
+		block=pl->todo;
+		pl->todo=block->next;
+		if (!pl->todo)
+			pl->todo_last=&pl->todo;
+		pthread_mutex_unlock(&pl->mutex);
+		start=protobuf_now();
+		protobuf_block_decode(block, &bytes_inflated);
+		pthread_mutex_lock(&pl->mutex);
+		pl->stats.decode_time+=protobuf_now()-start;
+		pl->stats.bytes_inflated+=bytes_inflated;
+		pl->done[block->seq % pl->max_blocks]=block;
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->mutex);
+	return NULL;
+}
+
+static int
+map_collect_data_osm_protobuf_threaded(FILE *in, struct maptool_osm *osm, int thread_count)
+{
+	struct protobuf_pipeline pl;
+	struct protobuf_block *block;
+	pthread_t reader,*decoders=g_new(pthread_t, thread_count);
+	int i,ret=1;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.in=in;
+	pthread_mutex_init(&pl.mutex, NULL);
+	pthread_cond_init(&pl.cond, NULL);
+	pl.todo_last=&pl.todo;
+	pl.max_blocks=thread_count*2;
+	pl.done=g_new0(struct protobuf_block *, pl.max_blocks);
+	pthread_create(&reader, NULL, protobuf_reader, &pl);
+	for (i = 0 ; i < thread_count ; i++)
+		pthread_create(&decoders[i], NULL, protobuf_decoder, &pl);
+	for (;;) {
+		pthread_mutex_lock(&pl.mutex);
+		while (!(block=pl.done[pl.delivered % pl.max_blocks]) && !(pl.eof && pl.delivered == pl.read))
+			pthread_cond_wait(&pl.cond, &pl.mutex);
+		if (block) {
+			pl.done[pl.delivered % pl.max_blocks]=NULL;
+			pl.delivered++;
+			pthread_cond_broadcast(&pl.cond);
+		}
+		pthread_mutex_unlock(&pl.mutex);
+		if (!block)
+			break;
+		ret=protobuf_block_deliver(block, osm, &pl.stats);
+		protobuf_block_free(block);
+		if (!ret) {
+			pthread_mutex_lock(&pl.mutex);
+			pl.abort=1;
+			pthread_cond_broadcast(&pl.cond);
+			pthread_mutex_unlock(&pl.mutex);
+			break;
+		}
+	}
+	pthread_join(reader, NULL);
+	for (i = 0 ; i < thread_count ; i++)
+		pthread_join(decoders[i], NULL);
+	while ((block=pl.todo)) {
+		pl.todo=block->next;
+		protobuf_block_free(block);
+	}
+	for (i = 0 ; i < pl.max_blocks ; i++) {
+		if (pl.done[i])
+			protobuf_block_free(pl.done[i]);
+	}
+	protobuf_stats_report(&pl.stats, thread_count);
+	g_free(pl.done);
+	g_free(decoders);
+	pthread_cond_destroy(&pl.cond);
+	pthread_mutex_destroy(&pl.mutex);
+	return ret;
+}
+#endif
+
+int
+map_collect_data_osm_protobuf(FILE *in, struct maptool_osm *osm)
+{
+	struct protobuf_block *block;
+	struct protobuf_stats stats;
+	int bytes_inflated,ret=1;
+	double start;
+
+#ifdef HAVE_PTHREAD
+	if (threads > 1)
+		return map_collect_data_osm_protobuf_threaded(in, osm, threads);
+#endif
+	memset(&stats, 0, sizeof(stats));
+	while ((block=protobuf_block_read(in, &stats))) {
+		start=protobuf_now();
+		protobuf_block_decode(block, &bytes_inflated);
+		stats.decode_time+=protobuf_now()-start;
+		stats.bytes_inflated+=bytes_inflated;
+		ret=protobuf_block_deliver(block, osm, &stats);
+		protobuf_block_free(block);
+		if (!ret)
+			break;
+	}
+	protobuf_stats_report(&stats, 1);
+	return ret;
+}
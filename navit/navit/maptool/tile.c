@@ -43,6 +43,9 @@
 #include "config.h"
 #include "linguistics.h"
 #include "plugin.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "maptool.h"
 
@@ -357,17 +360,44 @@ tile_write_item_to_tile(struct tile_info *info, struct item_bin *ib, FILE *refer
 		tile_extend(name, ib, info->tiles_list);
 }
 
-void
-tile_write_item_minmax(struct tile_info *info, struct item_bin *ib, FILE *reference, int min, int max)
+static void
+tile_item_name(struct tile_info *info, struct item_bin *ib, int max, char *buffer)
 {
 	struct rect r;
-	char buffer[1024];
 	bbox((struct coord *)(ib+1), ib->clen/2, &r);
 	buffer[0]='\0';
 	tile(&r, info->suffix, buffer, max, overlap, NULL);
+}
+
+void
+tile_write_item_minmax(struct tile_info *info, struct item_bin *ib, FILE *reference, int min, int max)
+{
+	char buffer[1024];
+	tile_item_name(info, ib, max, buffer);
 	tile_write_item_to_tile(info, ib, reference, buffer);
 }
 
+/**
+ * @brief Finds the tile an item is written to by tile_write_item_minmax()
+ *
+ * @param info The tile info, only the suffix is used
+ * @param ib The item
+ * @param max The maximum order of the item
+ * @return The (possibly merged) tile, or NULL if there is none
+ */
+struct tile_head *
+tile_find_item_head(struct tile_info *info, struct item_bin *ib, int max)
+{
+	struct tile_head *th=NULL;
+	char buffer[1024];
+	tile_item_name(info, ib, max, buffer);
+	if (tile_hash2)
+		th=g_hash_table_lookup(tile_hash2, buffer);
+	if (!th)
+		th=g_hash_table_lookup(tile_hash, buffer);
+	return th;
+}
+
 int
 add_aux_tile(struct zip_info *zip_info, char *name, char *filename, int size)
 {
@@ -416,6 +446,271 @@ write_aux_tiles(struct zip_info *zip_info)
 	return count;
 }
 
+/* Maximum number of items in one group of the tile index */
+#define TILE_INDEX_GROUP_ITEMS 16
+
+struct tile_index_item {
+	struct item_bin *ib;
+	struct rect r;
+	unsigned long long key;
+	int offset;
+};
+
+/* One group of the tile index, as stored in the attr_tile_index attribute */
+struct tile_index_group {
+	int type_min,type_max;
+	struct rect r;
+	int start,end;
+};
+
+static unsigned long long
+tile_index_interleave(unsigned int v)
+{
+	unsigned long long x=v;
+	x=(x | (x << 16)) & 0x0000ffff0000ffffULL;
+	x=(x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+	x=(x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	x=(x | (x << 2)) & 0x3333333333333333ULL;
+	x=(x | (x << 1)) & 0x5555555555555555ULL;
+	return x;
+}
+
+static int
+tile_index_item_cmp(const void *p1, const void *p2)
+{
+	const struct tile_index_item *i1=p1,*i2=p2;
+	if ((unsigned int)i1->ib->type != (unsigned int)i2->ib->type)
+		return (unsigned int)i1->ib->type < (unsigned int)i2->ib->type ? -1:1;
+	if (i1->key != i2->key)
+		return i1->key < i2->key ? -1:1;
+	return i1->offset - i2->offset;
+}
+
+/**
+ * @brief Builds the data of a tile with an index in front of its items
+ *
+ * The items are sorted by type and, within a type, along a z-order curve, and cut into
+ * groups of at most TILE_INDEX_GROUP_ITEMS items. A group only gets several types if it
+ * would be very small otherwise. The index is an item of type_tile_index with an
+ * attr_tile_index attribute, holding a struct tile_index_group per group. Its offsets are
+ * in 32 bit words from the tile start. Readers not knowing the index just see one more
+ * item without coordinates.
+ *
+ * @param th The tile
+ * @param size Returns the size of the new tile data
+ * @return The new tile data, to be freed with g_free, or NULL if an index is not worth it
+ */
+static char *
+tile_index_build(struct tile_head *th, int *size)
+{
+	struct tile_index_item *items;
+	struct tile_index_group *groups,*group=NULL;
+	struct item_bin *ib;
+	struct attr_bin *ab;
+	struct rect tr;
+	char *p,*end,*ret,*out;
+	int count=0,group_count=0,group_items=0,header,i;
+
+	end=th->zip_data+th->total_size;
+	for (p = th->zip_data ; p < end ; p+=(((struct item_bin *)p)->len+1)*4)
+		count++;
+	if (count <= TILE_INDEX_GROUP_ITEMS)
+		return NULL;
+	tile_bbox(th->name, &tr, overlap);
+	items=g_new(struct tile_index_item, count);
+	for (p = th->zip_data, i = 0 ; p < end ; p+=(ib->len+1)*4, i++) {
+		ib=(struct item_bin *)p;
+		items[i].ib=ib;
+		items[i].offset=i;
+		if (ib->clen >= 2)
+			bbox((struct coord *)(ib+1), ib->clen/2, &items[i].r);
+		else
+			items[i].r=tr;
+		items[i].key=tile_index_interleave((unsigned int)(items[i].r.l.x/2+items[i].r.h.x/2)+0x80000000U) |
+			tile_index_interleave((unsigned int)(items[i].r.l.y/2+items[i].r.h.y/2)+0x80000000U) << 1;
+	}
+	qsort(items, count, sizeof(*items), tile_index_item_cmp);
+
+	groups=g_new(struct tile_index_group, count);
+	header=(sizeof(struct item_bin)+sizeof(struct attr_bin))/4;
+	for (i = 0 ; i < count ; i++) {
+		ib=items[i].ib;
+		if (!group || group_items == TILE_INDEX_GROUP_ITEMS ||
+		    (ib->type != group->type_max && group_items >= TILE_INDEX_GROUP_ITEMS/4)) {
+			group=&groups[group_count++];
+			group_items=0;
+			group->type_min=ib->type;
+			group->r=items[i].r;
+			group->start=i;
+		} else {
+			bbox_extend(&items[i].r.l, &group->r);
+			bbox_extend(&items[i].r.h, &group->r);
+		}
+		group->type_max=ib->type;
+		group->end=i+1;
+		group_items++;
+	}
+	header+=group_count*sizeof(struct tile_index_group)/4;
+
+	*size=th->total_size+header*4;
+	ret=g_malloc(*size);
+	out=ret+header*4;
+	for (group = groups ; group < groups+group_count ; group++) {
+		i=group->start;
+		group->start=(out-ret)/4;
+		for ( ; i < group->end ; i++) {
+			memcpy(out, items[i].ib, (items[i].ib->len+1)*4);
+			out+=(items[i].ib->len+1)*4;
+		}
+		group->end=(out-ret)/4;
+	}
+	ib=(struct item_bin *)ret;
+	ib->len=header-1;
+	ib->type=type_tile_index;
+	ib->clen=0;
+	ab=(struct attr_bin *)(ib+1);
+	ab->len=group_count*sizeof(struct tile_index_group)/4+1;
+	ab->type=attr_tile_index;
+	memcpy(ab+1, groups, group_count*sizeof(struct tile_index_group));
+	g_free(groups);
+	g_free(items);
+	return ret;
+}
+
+/**
+ * @brief Writes a tile to the map, with an index if requested by --tile-index
+ *
+ * @param zip_info The map being written
+ * @param th The tile
+ */
+void
+tile_write_zipmember(struct zip_info *zip_info, struct tile_head *th)
+{
+	char *data=NULL;
+	int size=th->total_size;
+
+	if (tile_index)
+		data=tile_index_build(th, &size);
+	write_zipmember(zip_info, th->name, zip_get_maxnamelen(zip_info), data ? data : th->zip_data, size);
+	g_free(data);
+}
+
+#ifdef HAVE_PTHREAD
+/** Number of tiles per thread which may be compressed ahead of the tile being written */
+#define TILE_ZIP_AHEAD 4
+
+/**
+ * @brief Threads compressing tiles for tile_write_zipmembers()
+ */
+struct tile_zip_workers {
+	pthread_mutex_t mutex;			/**< Protects next, written and done */
+	pthread_cond_t cond;			/**< Signalled whenever a tile is compressed or written */
+	struct zip_info *zip_info;		/**< The zip file */
+	struct tile_head **ths;			/**< The tiles to write */
+	struct zip_member *members;		/**< The compressed tiles */
+	char **index_data;			/**< The tile data with item index built by tile_index_build(), or NULL */
+	char *done;				/**< Set for each tile which is compressed */
+	int count;				/**< Number of tiles */
+	int next;				/**< The next tile to compress */
+	int written;				/**< Number of tiles written */
+	int ahead;				/**< Maximum number of tiles compressed ahead of the tile being written */
+};
+
+static void *
+tile_zip_worker(void *data)
+{
+	struct tile_zip_workers *w=data;
+	struct tile_head *th;
+	int i,size;
+
+	pthread_mutex_lock(&w->mutex);
+	for (;;) {
+		while (w->next < w->count && w->next >= w->written+w->ahead)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (w->next >= w->count)
+			break;
+		i=w->next++;
+		pthread_mutex_unlock(&w->mutex);
+		th=w->ths[i];
+		size=th->total_size;
+		if (tile_index)
+			w->index_data[i]=tile_index_build(th, &size);
+		zip_member_compress(w->zip_info, &w->members[i], th->name, zip_get_maxnamelen(w->zip_info),
+			w->index_data[i] ? w->index_data[i] : th->zip_data, size);
+		pthread_mutex_lock(&w->mutex);
+		w->done[i]=1;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Writes tiles to a zip file
+ *
+ * With more than one thread, the tiles are compressed by worker threads while the calling
+ * thread writes them in their order, so the zip file is the same as with one thread.
+ *
+ * @param zip_info The zip file
+ * @param ths The tiles, in the order they are written
+ * @param count Number of tiles
+ */
+void
+tile_write_zipmembers(struct zip_info *zip_info, struct tile_head **ths, int count)
+{
+#ifdef HAVE_PTHREAD
+	struct tile_zip_workers w;
+	pthread_t *thread_ids;
+	int i,thread_count=0;
+
+	if (threads > 1 && count > 1) {
+		memset(&w, 0, sizeof(w));
+		pthread_mutex_init(&w.mutex, NULL);
+		pthread_cond_init(&w.cond, NULL);
+		w.zip_info=zip_info;
+		w.ths=ths;
+		w.count=count;
+		w.ahead=threads*TILE_ZIP_AHEAD;
+		w.members=g_new0(struct zip_member, count);
+		w.index_data=g_new0(char *, count);
+		w.done=g_new0(char, count);
+		thread_ids=g_new(pthread_t, threads);
+		for (i = 0 ; i < threads ; i++) {
+			if (!pthread_create(&thread_ids[thread_count], NULL, tile_zip_worker, &w))
+				thread_count++;
+		}
+		if (thread_count) {
+			for (i = 0 ; i < count ; i++) {
+				pthread_mutex_lock(&w.mutex);
+				while (!w.done[i])
+					pthread_cond_wait(&w.cond, &w.mutex);
+				pthread_mutex_unlock(&w.mutex);
+				zip_member_write(zip_info, &w.members[i]);
+				g_free(w.index_data[i]);
+				pthread_mutex_lock(&w.mutex);
+				w.written++;
+				pthread_cond_broadcast(&w.cond);
+				pthread_mutex_unlock(&w.mutex);
+			}
+			for (i = 0 ; i < thread_count ; i++)
+				pthread_join(thread_ids[i], NULL);
+		}
+		g_free(thread_ids);
+		g_free(w.done);
+		g_free(w.index_data);
+		g_free(w.members);
+		pthread_cond_destroy(&w.cond);
+		pthread_mutex_destroy(&w.mutex);
+		if (thread_count)
+			return;
+		fprintf(stderr,"failed to create threads, compressing tiles with one thread\n");
+	}
+#endif
+	while (count-- > 0)
+		tile_write_zipmember(zip_info, *ths++);
+}
+
 static int
 add_tile_hash(struct tile_head *th)
 {
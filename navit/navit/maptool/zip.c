@@ -96,9 +96,73 @@ compress2_int(Byte *dest, uLongf *destLen, const Bytef *source, uLong sourceLen,
 }
 #endif
 
+/**
+ * @brief Prepares a member of a zip file for writing
+ *
+ * Computes the checksum and compresses the data. This only reads the settings of the zip file,
+ * so it can be called from several threads at the same time.
+ *
+ * @param zip_info The zip file
+ * @param member The member to fill
+ * @param name The name of the member
+ * @param filelen The length the name is padded to
+ * @param data The uncompressed data, which has to stay valid until the member is written
+ * @param data_size The size of the uncompressed data
+ */
 void
-write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data, int data_size)
+zip_member_compress(struct zip_info *zip_info, struct zip_member *member, char *name, int filelen, char *data, int data_size)
 {
+	uLongf destlen=data_size+data_size/500+12;
+
+	member->name=name;
+	member->filelen=filelen;
+	member->data=data;
+	member->data_size=data_size;
+	member->comp_size=data_size;
+	member->crc=0;
+	member->compbuffer = malloc(destlen);
+	if (!member->compbuffer) {
+	  fprintf(stderr, "No more memory.\n");
+	  exit (1);
+	}
+	/* Encrypted members carry an authentication code instead of the crc */
+#ifdef HAVE_LIBCRYPTO
+	if (!zip_info->passwd)
+#endif
+	{
+		member->crc=crc32(0, NULL, 0);
+		member->crc=crc32(member->crc, (unsigned char *)data, data_size);
+	}
+	member->method=zip_info->compression_level ? 8:0;
+#ifdef HAVE_ZLIB
+	if (zip_info->compression_level) {
+		int error=compress2_int((Byte *)member->compbuffer, &destlen, (Bytef *)data, data_size, zip_info->compression_level);
+		if (error == Z_OK) {
+			if (destlen < data_size) {
+				member->data=member->compbuffer;
+				member->comp_size=destlen;
+			} else
+				member->method=0;
+		} else {
+			fprintf(stderr,"compress2 returned %d\n", error);
+		}
+	}
+#endif
+}
+
+/**
+ * @brief Writes a member prepared by zip_member_compress() to a zip file
+ *
+ * The members are stored in the order they are written.
+ *
+ * @param zip_info The zip file
+ * @param member The member, its buffers are freed
+ */
+void
+zip_member_write(struct zip_info *zip_info, struct zip_member *member)
+{
+	char *name=member->name,*data=member->data;
+	int filelen=member->filelen,data_size=member->data_size;
 	struct zip_lfh lfh = {
 		0x04034b50,
 		0x0a,
@@ -150,43 +214,17 @@ write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data,
 	unsigned char salt[8], key[34], verify[2], mac[10];
 #endif
 	char *filename;
-	int crc=0,len,comp_size=data_size;
-	uLongf destlen=data_size+data_size/500+12;
-	char *compbuffer;
+	int crc=member->crc,len,comp_size=member->comp_size;
 
-	compbuffer = malloc(destlen);
-	if (!compbuffer) {
-	  fprintf(stderr, "No more memory.\n");
-	  exit (1);
-	}
 #ifdef HAVE_LIBCRYPTO
 	if (zip_info->passwd) {	
 		RAND_bytes(salt, sizeof(salt));
 		PKCS5_PBKDF2_HMAC_SHA1(zip_info->passwd, strlen(zip_info->passwd), salt, sizeof(salt), 1000, sizeof(key), key);
 		verify[0]=key[32];
 		verify[1]=key[33];
-	} else {
-#endif
-		crc=crc32(0, NULL, 0);
-		crc=crc32(crc, (unsigned char *)data, data_size);
-#ifdef HAVE_LIBCRYPTO
-	}
-#endif
-	lfh.zipmthd=zip_info->compression_level ? 8:0;
-#ifdef HAVE_ZLIB
-	if (zip_info->compression_level) {
-		int error=compress2_int((Byte *)compbuffer, &destlen, (Bytef *)data, data_size, zip_info->compression_level);
-		if (error == Z_OK) {
-			if (destlen < data_size) {
-				data=compbuffer;
-				comp_size=destlen;
-			} else
-				lfh.zipmthd=0;
-		} else {
-			fprintf(stderr,"compress2 returned %d\n", error);
-		}
 	}
 #endif
+	lfh.zipmthd=member->method;
 	lfh.zipcrc=crc;
 	lfh.zipsize=comp_size;
 	lfh.zipuncmp=data_size;
@@ -275,7 +313,17 @@ write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data,
 	}
 #endif
 	
-	free(compbuffer);
+	free(member->compbuffer);
+	member->compbuffer=NULL;
+}
+
+void
+write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data, int data_size)
+{
+	struct zip_member member;
+
+	zip_member_compress(zip_info, &member, name, filelen, data, data_size);
+	zip_member_write(zip_info, &member);
 }
 
 void
@@ -3710,7 +3710,7 @@ navigation_call_callbacks(struct navigation *this_, int force_speech)
 }
 
 static void
-navigation_update(struct navigation *this_, struct route *route, struct attr *attr)
+navigation_update_status(struct navigation *this_, struct route *route, struct attr *attr)
 {
 	struct map *map;
 	struct map_rect *mr;
@@ -3785,6 +3785,14 @@ navigation_update(struct navigation *this_, struct route *route, struct attr *at
 	map_rect_destroy(mr);
 }
 
+static void
+navigation_update(struct navigation *this_, struct route *route, struct attr *attr)
+{
+	long long stage=profile_stage_begin();
+	navigation_update_status(this_, route, attr);
+	profile_stage_end(profile_stage_navigation, stage);
+}
+
 static void
 navigation_flush(struct navigation *this_)
 {
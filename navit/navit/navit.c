@@ -2144,9 +2144,6 @@ navit_init(struct navit *this_)
 		navit_draw_async(this_, 1);
 	if (callback)
 		callback_list_call_attr_1(this_->attr_cbl, attr_graphics_ready, this_);
-#if 0
-	routech_test(this_);
-#endif
 }
 
 void
@@ -3044,6 +3041,7 @@ navit_vehicle_update_position(struct navit *this_, struct navit_vehicle *nv) {
 	void *attr_object;
 	char *destination_file;
 	char *description;
+	long long stage;
 
 	profile(0,NULL);
 	if (this_->ready == 3)
@@ -3051,7 +3049,9 @@ navit_vehicle_update_position(struct navit *this_, struct navit_vehicle *nv) {
 	if (this_->vehicle == nv && this_->tracking_flag)
 		tracking=this_->tracking;
 	if (tracking) {
+		stage=profile_stage_begin();
 		tracking_update(tracking, nv->vehicle, this_->vehicleprofile, pro);
+		profile_stage_end(profile_stage_tracking, stage);
 		attr_object=tracking;
 		get_attr=(int (*)(void *, enum attr_type, struct attr *, struct attr_iter *))tracking_get_attr;
 	} else {
@@ -3080,10 +3080,12 @@ navit_vehicle_update_position(struct navit *this_, struct navit_vehicle *nv) {
 	cursor_pc.y = nv->coord.y;
 	cursor_pc.pro = pro;
 	if (this_->route) {
+		stage=profile_stage_begin();
 		if (tracking)
 			route_set_position_from_tracking(this_->route, tracking, pro);
 		else
 			route_set_position(this_->route, &cursor_pc);
+		profile_stage_end(profile_stage_route_position, stage);
 	}
 	callback_list_call_attr_0(this_->attr_cbl, attr_position);
 	navit_textfile_debug_log(this_, "type=trackpoint_tracked");
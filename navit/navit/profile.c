@@ -21,14 +21,42 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "config.h"
 #ifndef _MSC_VER
 #include <sys/time.h>
 #endif /* _MSC_VER */
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 #include "profile.h"
 #include "debug.h"
 
 #define PROFILE_LEVEL_MAX 9
 
+/* Latencies below PROFILE_STAGE_LINEAR usec get a bucket each, above that every power of two
+ * is split into PROFILE_STAGE_SUBBUCKETS buckets, which bounds the error of a percentile to 1/8 */
+#define PROFILE_STAGE_LINEAR 16
+#define PROFILE_STAGE_SUBBITS 3
+#define PROFILE_STAGE_SUBBUCKETS (1 << PROFILE_STAGE_SUBBITS)
+#define PROFILE_STAGE_BUCKETS (PROFILE_STAGE_LINEAR+PROFILE_STAGE_SUBBUCKETS*40)
+
+struct profile_stage_stats {
+	const char *name;
+	long long count;
+	long long max;
+	long long buckets[PROFILE_STAGE_BUCKETS];
+};
+
+static struct profile_stage_stats profile_stages[profile_stage_last] = {
+	{"tracking"},
+	{"route_position"},
+	{"route_path"},
+	{"navigation"},
+	{"draw"},
+};
+
+static int profile_stages_enabled;
+
 void
 profile_timer(int level, const char *module, const char *function, const char *fmt, ...)
 {
@@ -61,3 +89,146 @@ profile_timer(int level, const char *module, const char *function, const char *f
 	}
 #endif /*_MSC_VER*/
 }
+
+#ifndef _MSC_VER
+static int
+profile_stage_bucket(long long usec)
+{
+	int bit=PROFILE_STAGE_SUBBITS+1,ret;
+
+	if (usec < PROFILE_STAGE_LINEAR)
+		return usec;
+	while ((usec >> (bit+1)))
+		bit++;
+	ret=PROFILE_STAGE_LINEAR+(bit-PROFILE_STAGE_SUBBITS-1)*PROFILE_STAGE_SUBBUCKETS+((usec >> (bit-PROFILE_STAGE_SUBBITS)) & (PROFILE_STAGE_SUBBUCKETS-1));
+	if (ret >= PROFILE_STAGE_BUCKETS)
+		ret=PROFILE_STAGE_BUCKETS-1;
+	return ret;
+}
+
+static long long
+profile_stage_bucket_max(int bucket)
+{
+	int bit;
+
+	if (bucket < PROFILE_STAGE_LINEAR)
+		return bucket;
+	bucket-=PROFILE_STAGE_LINEAR;
+	bit=bucket/PROFILE_STAGE_SUBBUCKETS+PROFILE_STAGE_SUBBITS+1;
+	return ((long long)(PROFILE_STAGE_SUBBUCKETS+bucket%PROFILE_STAGE_SUBBUCKETS+1) << (bit-PROFILE_STAGE_SUBBITS))-1;
+}
+
+/**
+ * @brief Returns the latency in usec below which the given per mille of the samples of a stage lie
+ *
+ * The result is the upper bound of the histogram bucket holding that sample, capped by the maximum
+ * seen, so it overestimates the true percentile by at most one bucket width.
+ */
+static long long
+profile_stage_percentile(struct profile_stage_stats *stats, int permille)
+{
+	long long rank=(stats->count*permille+999)/1000,sum=0,ret;
+	int i;
+
+	for (i = 0 ; i < PROFILE_STAGE_BUCKETS ; i++) {
+		sum+=stats->buckets[i];
+		if (sum >= rank && sum) {
+			ret=profile_stage_bucket_max(i);
+			return ret < stats->max ? ret : stats->max;
+		}
+	}
+	return stats->max;
+}
+#endif /*_MSC_VER*/
+
+/**
+ * @brief Starts collecting latency histograms for the stages of the per-fix pipeline
+ *
+ * Collection is off by default, so the timing calls compiled into the pipeline cost a branch
+ * only. Once enabled, the histograms are reported by profile_stage_report() when navit exits.
+ */
+void
+profile_stage_enable(void)
+{
+#ifndef _MSC_VER
+	if (profile_stages_enabled)
+		return;
+	profile_stages_enabled=1;
+	atexit(profile_stage_report);
+#endif /*_MSC_VER*/
+}
+
+/**
+ * @brief Marks the start of a pipeline stage
+ *
+ * @return The current time in usec to pass to profile_stage_end(), or 0 if collection is disabled
+ */
+long long
+profile_stage_begin(void)
+{
+#ifndef _MSC_VER
+	struct timeval curr;
+
+	if (!profile_stages_enabled)
+		return 0;
+	gettimeofday(&curr, NULL);
+	return curr.tv_sec*1000000LL+curr.tv_usec;
+#else
+	return 0;
+#endif /*_MSC_VER*/
+}
+
+/**
+ * @brief Adds the time elapsed since profile_stage_begin() to the histogram of a stage
+ *
+ * Stages may nest, e.g. navigation is updated from within route_path, so every stage
+ * accounts for the time spent in the stages it calls.
+ *
+ * @param stage The stage which just finished
+ * @param begin The value returned by profile_stage_begin()
+ */
+void
+profile_stage_end(enum profile_stage stage, long long begin)
+{
+#ifndef _MSC_VER
+	struct profile_stage_stats *stats=&profile_stages[stage];
+	long long usec;
+
+	if (!begin)
+		return;
+	usec=profile_stage_begin()-begin;
+	if (usec < 0)
+		usec=0;
+	stats->count++;
+	stats->buckets[profile_stage_bucket(usec)]++;
+	if (usec > stats->max)
+		stats->max=usec;
+#endif /*_MSC_VER*/
+}
+
+/**
+ * @brief Prints the p50, p99 and maximum latency of every stage and the peak resident set size
+ */
+void
+profile_stage_report(void)
+{
+#ifndef _MSC_VER
+	struct profile_stage_stats *stats;
+#ifdef HAVE_SYS_RESOURCE_H
+	struct rusage usage;
+#endif
+	int i;
+
+	printf("profile: %-16s %10s %10s %10s %10s\n", "stage", "count", "p50 ms", "p99 ms", "max ms");
+	for (i = 0 ; i < profile_stage_last ; i++) {
+		stats=&profile_stages[i];
+		printf("profile: %-16s %10lld %10.3f %10.3f %10.3f\n", stats->name, stats->count,
+			profile_stage_percentile(stats, 500)/1000.0, profile_stage_percentile(stats, 990)/1000.0, stats->max/1000.0);
+	}
+#ifdef HAVE_SYS_RESOURCE_H
+	if (!getrusage(RUSAGE_SELF, &usage))
+		printf("profile: peak rss %ld kB\n", usage.ru_maxrss);
+#endif
+	fflush(stdout);
+#endif /*_MSC_VER*/
+}
@@ -31,6 +31,20 @@ extern "C" {
 #define profile_module profile_str1(MODULE)
 #define profile(level,...) profile_timer(level,profile_module,__PRETTY_FUNCTION__,__VA_ARGS__)
 void profile_timer(int level, const char *module, const char *function, const char *fmt, ...);
+
+/** Stages of the per-fix pipeline whose latency can be collected with profile_stage_begin()/profile_stage_end() */
+enum profile_stage {
+	profile_stage_tracking,
+	profile_stage_route_position,
+	profile_stage_route_path,
+	profile_stage_navigation,
+	profile_stage_draw,
+	profile_stage_last,
+};
+void profile_stage_enable(void);
+long long profile_stage_begin(void);
+void profile_stage_end(enum profile_stage stage, long long begin);
+void profile_stage_report(void);
 #ifdef __cplusplus
 }
 #endif
@@ -33,7 +33,12 @@
  *
  * After building this graph in route_graph_build(), the function route_graph_flood() assigns every 
  * point and segment a "value" which represents the "costs" of traveling from this point to the
- * destination. This is done by Dijkstra's algorithm.
+ * destination. This is done by Dijkstra's algorithm, or by A* with early termination if the
+ * vehicle profile sets route_search="1".
+ *
+ * With route_search="2" and a map containing a contraction hierarchy, the graph only holds the
+ * streets found by a contraction hierarchy query (see routech.c) instead of all streets around
+ * position and destination.
  *
  * When the graph is built a "route path" is created, which is a path in this graph from a given
  * position to the destination determined at time of building the graph.
@@ -64,13 +69,19 @@
 #include "track.h"
 #include "transform.h"
 #include "plugin.h"
+#ifdef USE_FIBHEAP
 #include "fib.h"
+#endif
 #include "event.h"
 #include "callback.h"
 #include "vehicle.h"
 #include "vehicleprofile.h"
 #include "roadprofile.h"
+#include "routech.h"
 #include "debug.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 struct map_priv {
 	struct route *route;
@@ -92,15 +103,20 @@ enum route_path_flags {
  * but there are also points which don't do that (e.g. at the end of a dead-end).
  */
 struct route_graph_point {
-	struct route_graph_point *hash_next; /**< Pointer to a chained hashlist of all route_graph_points with this hash */
-	struct route_graph_segment *start;	 /**< Pointer to a list of segments of which this point is the start. The links 
-										  *  of this linked-list are in route_graph_segment->start_next.*/
-	struct route_graph_segment *end;	 /**< Pointer to a list of segments of which this pointer is the end. The links
-										  *  of this linked-list are in route_graph_segment->end_next. */
+	struct route_graph_point *hash_next; /**< Pointer to the next route_graph_point with the same coordinates */
+	struct route_graph_segment **adj;	 /**< The segments connected to this point, a slice of route_graph->adj. The first
+										  *  nstart segments start at this point, the following nend segments end at it */
+	int nstart;							 /**< Number of segments starting at this point */
+	int nend;							 /**< Number of segments ending at this point */
 	struct route_graph_segment *seg;	 /**< Pointer to the segment one should use to reach the destination at
 										  *  least costs */
+#ifdef USE_FIBHEAP
 	struct fibheap_el *el;				 /**< When this point is put on a Fibonacci heap, this is a pointer
 										  *  to this point's heap-element */
+#else
+	int el;						 /**< When this point is put on the heap, this is its position
+										  *  in the heap plus one, 0 otherwise */
+#endif
 	int value;							 /**< The cost at which one can reach the destination from this point on */
 	struct coord c;						 /**< Coordinates of this point */
 	int flags;						/**< Flags for this point (eg traffic distortion) */
@@ -158,13 +174,9 @@ struct route_graph_segment_data {
  * This is a segment in the route graph. A segment represents a driveable way.
  */
 struct route_graph_segment {
-	struct route_graph_segment *next;			/**< Linked-list pointer to a list of all route_graph_segments */
-	struct route_graph_segment *start_next;		/**< Pointer to the next element in the list of segments that start at the 
-												 *  same point. Start of this list is in route_graph_point->start. */
-	struct route_graph_segment *end_next;		/**< Pointer to the next element in the list of segments that end at the
-												 *  same point. Start of this list is in route_graph_point->end. */
 	struct route_graph_point *start;			/**< Pointer to the point this segment starts at. */
 	struct route_graph_point *end;				/**< Pointer to the point this segment ends at. */
+	int id;							/**< Index of this segment in route_graph->costs */
 	struct route_segment_data data;				/**< The segment data */
 };
 
@@ -246,6 +258,7 @@ struct route {
 	struct route_info *current_dst;	/**< Current destination */
 
 	struct route_graph *graph;	/**< Pointer to the route graph */
+	struct route_graph *old_graph;	/**< Graph of a previous route, which can be extended for the next one */
 	struct route_path *path2;	/**< Pointer to the route path */
 	struct map *map;
 	struct map *graph_map;
@@ -256,6 +269,7 @@ struct route {
 	struct vehicleprofile *vehicleprofile; /**< Routing preferences */
 	int route_status;		/**< Route Status */
 	int link_path;			/**< Link paths over multiple waypoints together */
+	long long path_stage;		/**< When the pending path update was requested, for profile_stage_end() */
 	struct pcoord pc;
 	struct vehicle *v;
 };
@@ -267,21 +281,137 @@ struct route {
  */
 struct route_graph {
 	int busy;					/**< The graph is being built */
-	struct map_selection *sel;			/**< The rectangle selection for the graph */
+	struct map_selection *sel;			/**< The rectangle selection which is currently read into the graph */
+	struct map_selection *covered;			/**< All rectangles which have been read into the graph */
+	struct mapset *ms;				/**< The mapset the graph is built from */
 	struct mapset_handle *h;			/**< Handle to the mapset */	
 	struct map *m;					/**< Pointer to the currently active map */	
 	struct map_rect *mr;				/**< Pointer to the currently active map rectangle */
-	struct vehicleprofile *vehicleprofile;		/**< The vehicle profile */
+	struct vehicleprofile *vehicleprofile;		/**< The vehicle profile the graph is built for */
+	int profile_change;				/**< The change of the vehicle profile when the graph was built, see vehicleprofile->change */
+	GList *maps;					/**< The maps the graph was built from, as struct route_graph_map_change */
 	struct callback *idle_cb;			/**< Idle callback to process the graph */
 	struct callback *done_cb;			/**< Callback when graph is done */
 	struct event_idle *idle_ev;			/**< The pointer to the idle event */
-   	struct route_graph_segment *route_segments; /**< Pointer to the first route_graph_segment in the linked list of all segments */
 	struct route_graph_segment *avoid_seg;
-#define HASH_SIZE 8192
-	struct route_graph_point *hash[HASH_SIZE];	/**< A hashtable containing all route_graph_points in this graph */
+	int maxspeed;					/**< Highest maxspeed of all segments in the graph, used for the A* estimate */
+	int flood_partial;				/**< The last flood stopped as soon as flood_item was settled */
+	struct item flood_item;				/**< The street the last partial flood was targeted at */
+	struct route_graph_point **hash;		/**< Open addressing hashtable of all route_graph_points in this graph, one slot per coordinate */
+	int hash_size;					/**< Number of slots in hash, always a power of two */
+	int hash_count;					/**< Number of used slots in hash */
+	int hash_lookups;				/**< Number of lookups in hash, for statistics */
+	int hash_probes;				/**< Number of slots probed by these lookups, for statistics */
+	struct route_graph_arena *arena;		/**< Memory blocks the points are allocated from */
+	struct route_graph_arena *seg_arena;		/**< Memory blocks the segments are allocated from, back to back */
+	int arena_size;					/**< Total size of all arena blocks */
+	struct route_graph_segment **adj;		/**< The segments of all points, two entries per segment, see route_graph_compile() */
+	struct route_graph_segment **dup;		/**< Open addressing hashtable of all segments by start point and item while
+							 *  the graph is built, see route_graph_segment_is_duplicate() */
+	int dup_size;					/**< Number of slots in dup, always a power of two */
+	int dup_count;					/**< Number of used slots in dup */
+	struct route_graph_workers *workers;		/**< Worker threads reading thread safe maps, if any */
+	int segment_count;				/**< Number of segments in the graph, the next free segment id */
+	int *costs;					/**< Cached costs of all segments, two per segment id: against and along the segment.
+							 *  COST_UNKNOWN if not computed yet */
+	int costs_size;					/**< Number of segment ids costs has room for */
+	int costs_change;				/**< The change of the vehicle profile the costs are valid for, 0 if none,
+							 *  see vehicleprofile->change */
+};
+
+#define COST_UNKNOWN -1
+
+/**
+ * @brief A map a route graph was built from, and how far its items had changed by then
+ */
+struct route_graph_map_change {
+	struct map *m;					/**< The map */
+	int change;					/**< The change count of the map, see map_get_change() */
+};
+
+/**
+ * @brief A segment read by a worker thread, waiting to be added to the route graph
+ */
+struct route_graph_read_segment {
+	struct item item;				/**< The item the segment belongs to */
+	struct coord c[3];				/**< The coordinates, see route_graph_add_read_segment() */
+	struct route_graph_segment_data data;		/**< The segment data, data.item is pointed to item when merging */
+};
+
+/**
+ * @brief A rectangle of one map which is read by a worker thread
+ */
+struct route_graph_job {
+	struct route_graph_job *next;			/**< Next job in the same list */
+	struct map *m;					/**< The map to read */
+	struct map_selection *sel;			/**< The rectangles to read */
+	struct route_graph_read_segment *segs;		/**< The segments read so far */
+	int count;					/**< Number of segments in segs */
+	int size;					/**< Number of segments segs has room for */
+};
+
+#ifdef HAVE_PTHREAD
+/**
+ * @brief Worker threads reading the thread safe maps of a mapset into a route graph
+ *
+ * The workers only fill the segment buffers of their jobs. The finished jobs are merged
+ * into the route graph by route_graph_build_idle() on the main thread.
+ */
+struct route_graph_workers {
+	pthread_mutex_t mutex;				/**< Protects todo, done, running and cancel */
+	pthread_cond_t cond;				/**< Signalled whenever a job is finished */
+	pthread_t *threads;				/**< The worker threads */
+	int thread_count;				/**< Number of threads */
+	struct route_graph_job *todo;			/**< Jobs which have not been started yet */
+	struct route_graph_job *done;			/**< Jobs which are finished, but not merged yet */
+	int running;					/**< Number of jobs being read at the moment */
+	int cancel;					/**< Set to make the workers stop as soon as possible */
+	struct vehicleprofile *profile;			/**< The vehicle profile to read the streets for */
+	GList *maps;					/**< The maps read by the workers, skipped by route_graph_build_next_map() */
+	struct route_graph_job *merging;		/**< The job being merged into the route graph */
+	int merged;					/**< Number of segments of merging which have been merged */
+	struct route_graph_claim *claimed;		/**< Open addressing table of the items already taken by a job, protected by mutex */
+	int claimed_size;				/**< Number of slots in claimed, a power of two */
+	int claimed_count;				/**< Number of used slots in claimed */
+};
+
+/**
+ * @brief An item which has been taken by one of the worker jobs
+ *
+ * Tiles overlapping several strips are returned to every job reading one of these strips.
+ * Only the first job to see an item reads it.
+ */
+struct route_graph_claim {
+	struct map *m;					/**< The map of the item, NULL for an empty slot */
+	struct item_id id;				/**< The id of the item */
+};
+
+#define CLAIM_SIZE_MIN 16384
+
+#define HASHITEM(m,id,size) ((((unsigned int)(long)(m) >> 4) ^ ((unsigned int)(id)->id_hi * 2654435761U) ^ ((unsigned int)(id)->id_lo * 2246822519U)) & ((size)-1))
+#endif
+
+/**
+ * @brief A block of memory for the points or segments of a route graph
+ *
+ * Points and segments are never freed one by one, so they are taken from these blocks
+ * and released all at once when the graph is destroyed.
+ */
+struct route_graph_arena {
+	struct route_graph_arena *next;			/**< The previously filled block */
+	int size;					/**< Usable size of data */
+	int used;					/**< Bytes of data already handed out */
+	char data[0];
 };
 
-#define HASHCOORD(c) ((((c)->x +(c)->y) * 2654435761UL) & (HASH_SIZE-1))
+#define HASH_SIZE_MIN 4096
+/** Maximum number of rectangles a route graph may cover to be extended for another route */
+#define ROUTE_GRAPH_REUSE_RECTS 32
+#define DUP_SIZE_MIN 4096
+#define ARENA_BLOCK_SIZE (256*1024)
+
+#define HASHCOORD(c,size) ((((unsigned int)(c)->x * 2654435761U) ^ ((unsigned int)(c)->y * 2246822519U) ^ ((unsigned int)(c)->y >> 13)) & ((size)-1))
+#define HASHSEG(p,item,size) ((((unsigned int)(long)(p) >> 4) ^ ((unsigned int)(item)->id_hi * 2654435761U) ^ ((unsigned int)(item)->id_lo * 2246822519U)) & ((size)-1))
 
 /**
  * @brief Iterator to iterate through all route graph segments in a route graph point
@@ -291,8 +421,7 @@ struct route_graph {
  */
 struct route_graph_point_iterator {
 	struct route_graph_point *p;		/**< The route graph point whose segments should be iterated */
-	int end;							/**< Indicates if we have finished iterating through the "start" segments */
-	struct route_graph_segment *next;	/**< The next segment to be returned */
+	int pos;							/**< Position of the next segment to be returned in p->adj */
 };
 
 struct attr_iter {
@@ -302,15 +431,18 @@ struct attr_iter {
 };
 
 static struct route_info * route_find_nearest_street(struct vehicleprofile *vehicleprofile, struct mapset *ms, struct pcoord *c);
-static struct route_graph_point *route_graph_get_point(struct route_graph *this, struct coord *c);
 static void route_graph_update(struct route *this, struct callback *cb, int async);
 static void route_graph_build_done(struct route_graph *rg, int cancel);
 static struct route_path *route_path_new(struct route_graph *this, struct route_path *oldpath, struct route_info *pos, struct route_info *dst, struct vehicleprofile *profile);
-static void route_process_street_graph(struct route_graph *this, struct item *item, struct vehicleprofile *profile);
+static void route_process_street_graph(struct route_graph *this, struct route_graph_job *job, struct item *item, struct vehicleprofile *profile);
 static void route_graph_destroy(struct route_graph *this);
+static GList *route_graph_maps_new(struct mapset *ms);
+static void route_graph_maps_free(GList *maps);
+static void route_graph_retire(struct route *this);
+static void route_graph_set_traffic_distortion(struct route_graph *this, struct route_graph_segment *seg, int delay);
 static void route_path_update(struct route *this, int cancel, int async);
 static int route_time_seg(struct vehicleprofile *profile, struct route_segment_data *over, struct route_traffic_distortion *dist);
-static void route_graph_flood(struct route_graph *this, struct route_info *dst, struct vehicleprofile *profile, struct callback *cb);
+static void route_graph_flood(struct route_graph *this, struct route_info *dst, struct route_info *pos, struct vehicleprofile *profile, struct callback *cb);
 static void route_graph_reset(struct route_graph *this);
 
 
@@ -347,13 +479,7 @@ rp_iterator_new(struct route_graph_point *p)
 	struct route_graph_point_iterator it;
 
 	it.p = p;
-	if (p->start) {
-		it.next = p->start;
-		it.end = 0;
-	} else {
-		it.next = p->end;
-		it.end = 1;
-	}
+	it.pos = 0;
 
 	return it;
 }
@@ -367,25 +493,11 @@ rp_iterator_new(struct route_graph_point *p)
 static struct route_graph_segment
 *rp_iterator_next(struct route_graph_point_iterator *it) 
 {
-	struct route_graph_segment *ret;
-
-	ret = it->next;
-	if (!ret) {
+	if (it->pos >= it->p->nstart+it->p->nend) {
 		return NULL;
 	}
 
-	if (!it->end) {
-		if (ret->start_next) {
-			it->next = ret->start_next;
-		} else {
-			it->next = it->p->end;
-			it->end = 1;
-		}
-	} else {
-		it->next = ret->end_next;
-	}
-
-	return ret;
+	return it->p->adj[it->pos++];
 }
 
 /**
@@ -396,7 +508,7 @@ static struct route_graph_segment
  */
 static int
 rp_iterator_end(struct route_graph_point_iterator *it) {
-	if (it->end && (it->next != it->p->end)) {
+	if (it->pos > it->p->nstart) {
 		return 1;
 	} else {
 		return 0;
@@ -761,8 +873,27 @@ route_previous_destination(struct route *this)
 	return l->data;
 }
 
+/**
+ * @brief Ends the timing of a path update started by route_path_update()
+ *
+ * The path update may finish in a later idle callback, when the graph is built or flooded asynchronously.
+ */
 static void
-route_path_update_done(struct route *this, int new_graph)
+route_path_stage_end(struct route *this)
+{
+	if (this->path_stage) {
+		profile_stage_end(profile_stage_route_path, this->path_stage);
+		this->path_stage=0;
+	}
+}
+
+/**
+ * @brief Builds the route path from the flooded graph
+ *
+ * @return 1 if the path update is finished, 0 if it continues later
+ */
+static int
+route_path_update_path(struct route *this, int new_graph)
 {
 	struct route_path *oldpath=this->path2;
 	struct attr route_status;
@@ -770,11 +901,16 @@ route_path_update_done(struct route *this, int new_graph)
 	route_status.type=attr_route_status;
 	if (this->path2 && (this->path2->in_use>1)) {
 		this->path2->update_required=1+new_graph;
-		return;
+		return 0;
 	}
 	route_status.u.num=route_status_building_path;
 	route_set_attr(this, &route_status);
 	prev_dst=route_previous_destination(this);
+	if (!new_graph && this->graph->flood_partial && prev_dst && prev_dst->street && !item_is_equal(prev_dst->street->item, this->graph->flood_item)) {
+		dbg(lvl_debug,"position left the settled area, flooding again\n");
+		route_graph_reset(this->graph);
+		route_graph_flood(this->graph, this->current_dst, prev_dst, this->vehicleprofile, NULL);
+	}
 	if (this->link_path) {
 		this->path2=route_path_new(this->graph, NULL, prev_dst, this->current_dst, this->vehicleprofile);
 		if (this->path2)
@@ -807,8 +943,8 @@ route_path_update_done(struct route *this, int new_graph)
 			this->link_path=1;
 			this->current_dst=prev_dst;
 			route_graph_reset(this->graph);
-			route_graph_flood(this->graph, this->current_dst, this->vehicleprofile, this->route_graph_flood_done_cb);
-			return;
+			route_graph_flood(this->graph, this->current_dst, route_previous_destination(this), this->vehicleprofile, this->route_graph_flood_done_cb);
+			return 0;
 		}
 		if (!new_graph && this->path2->updated)
 			route_status.u.num=route_status_path_done_incremental;
@@ -818,6 +954,14 @@ route_path_update_done(struct route *this, int new_graph)
 		route_status.u.num=route_status_not_found;
 	this->link_path=0;
 	route_set_attr(this, &route_status);
+	return 1;
+}
+
+static void
+route_path_update_done(struct route *this, int new_graph)
+{
+	if (route_path_update_path(this, new_graph))
+		route_path_stage_end(this);
 }
 
 /**
@@ -834,17 +978,18 @@ route_path_update_done(struct route *this, int new_graph)
 static void
 route_path_update_flags(struct route *this, enum route_path_flags flags)
 {
+	int done=0;
+
 	dbg(lvl_debug,"enter %d\n", flags);
 	if (! this->pos || ! this->destinations) {
 		dbg(lvl_debug,"destroy\n");
 		route_path_destroy(this->path2,1);
 		this->path2 = NULL;
+		route_path_stage_end(this);
 		return;
 	}
-	if (flags & route_path_flag_cancel) {
-		route_graph_destroy(this->graph);
-		this->graph=NULL;
-	}
+	if (flags & route_path_flag_cancel)
+		route_graph_retire(this);
 	/* the graph is destroyed when setting the destination */
 	if (this->graph) {
 		if (this->graph->busy) {
@@ -853,7 +998,7 @@ route_path_update_flags(struct route *this, enum route_path_flags flags)
 		}
 		// we can try to update
 		dbg(lvl_debug,"try update\n");
-		route_path_update_done(this, 0);
+		done=route_path_update_path(this, 0);
 	} else {
 		route_path_destroy(this->path2,1);
 		this->path2 = NULL;
@@ -864,13 +1009,16 @@ route_path_update_flags(struct route *this, enum route_path_flags flags)
 			this->route_graph_flood_done_cb=callback_new_2(callback_cast(route_path_update_done), this, (long)1);
 		dbg(lvl_debug,"route_graph_update\n");
 		route_graph_update(this, this->route_graph_flood_done_cb, !!(flags & route_path_flag_async));
-	}
+	} else if (done)
+		route_path_stage_end(this);
 }
 
 static void
 route_path_update(struct route *this, int cancel, int async)
 {
 	enum route_path_flags flags=(cancel ? route_path_flag_cancel:0)|(async ? route_path_flag_async:0);
+	if (!this->path_stage)
+		this->path_stage=profile_stage_begin();
 	route_path_update_flags(this, flags);
 }
 
@@ -1090,6 +1238,53 @@ route_calc_selection(struct coord *c, int count, struct vehicleprofile *profile)
 	return ret;
 }
 
+/**
+ * @brief Checks if a map selection is already contained in a list of selections
+ *
+ * A rectangle counts as covered if one rectangle of the list contains it completely and
+ * has been read with at least the same order, so it delivered all the items sel would deliver.
+ *
+ * @param covered List of selections already read
+ * @param sel The selection to check (only the first rectangle is checked)
+ * @return 1 if sel is covered, 0 otherwise
+ */
+static int
+route_selection_covers(struct map_selection *covered, struct map_selection *sel)
+{
+	while (covered) {
+		if (covered->order >= sel->order &&
+			coord_rect_contains(&covered->u.c_rect, &sel->u.c_rect.lu) &&
+			coord_rect_contains(&covered->u.c_rect, &sel->u.c_rect.rl))
+			return 1;
+		covered=covered->next;
+	}
+	return 0;
+}
+
+/**
+ * @brief Removes the rectangles already covered by a list of selections from a selection
+ *
+ * @param covered List of selections already read
+ * @param sel The selection to reduce, which is consumed
+ * @return The rectangles of sel which are not covered, or NULL if everything is covered
+ */
+static struct map_selection *
+route_selection_missing(struct map_selection *covered, struct map_selection *sel)
+{
+	struct map_selection *ret=NULL,*next;
+	while (sel) {
+		next=sel->next;
+		if (route_selection_covers(covered, sel))
+			g_free(sel);
+		else {
+			sel->next=ret;
+			ret=sel;
+		}
+		sel=next;
+	}
+	return ret;
+}
+
 /**
  * @brief Destroys a list of map selections
  *
@@ -1154,9 +1349,8 @@ route_set_destinations(struct route *this, struct pcoord *dst, int count, int as
 	route_set_attr(this, &route_status);
 	profile(1,"find_nearest_street");
 
-	/* The graph has to be destroyed and set to NULL, otherwise route_path_update() doesn't work */
-	route_graph_destroy(this->graph);
-	this->graph=NULL;
+	/* The graph has to be set to NULL, otherwise route_path_update() doesn't work */
+	route_graph_retire(this);
 	this->current_dst=route_get_dst(this);
 	route_path_update(this, 1, async);
 	profile(0,"end");
@@ -1283,9 +1477,8 @@ route_append_destination(struct route *this, struct pcoord *dst, int async)
 			route_info_distances(dsti, dst->pro);
 			this->destinations=g_list_append(this->destinations, dsti);
 		}
-		/* The graph has to be destroyed and set to NULL, otherwise route_path_update() doesn't work */
-		route_graph_destroy(this->graph);
-		this->graph=NULL;
+		/* The graph has to be set to NULL, otherwise route_path_update() doesn't work */
+		route_graph_retire(this);
 		this->current_dst=route_get_dst(this);
 		route_path_update(this, 1, async);
 	}else{
@@ -1306,9 +1499,8 @@ route_remove_nth_waypoint(struct route *this, int n)
 	struct route_info *ri=g_list_nth_data(this->destinations, n);
 	this->destinations=g_list_remove(this->destinations,ri);
 	route_info_free(ri);
-	/* The graph has to be destroyed and set to NULL, otherwise route_path_update() doesn't work */
-	route_graph_destroy(this->graph);
-	this->graph=NULL;
+	/* The graph has to be set to NULL, otherwise route_path_update() doesn't work */
+	route_graph_retire(this);
 	this->current_dst=route_get_dst(this);
 	route_path_update(this, 1, 1);
 }
@@ -1331,40 +1523,109 @@ route_remove_waypoint(struct route *this)
 		this->reached_destinations_count++;
 		route_graph_reset(this->graph);
 		this->current_dst = this->destinations->data;
-		route_graph_flood(this->graph, this->current_dst, this->vehicleprofile,	this->route_graph_flood_done_cb);
+		route_graph_flood(this->graph, this->current_dst, route_previous_destination(this), this->vehicleprofile, this->route_graph_flood_done_cb);
 	}
 }
 
 /**
- * @brief Gets the route_graph_point with the specified coordinates
+ * @brief Allocates zeroed memory for a point or segment from an arena of a route graph
  *
- * @param this The route in which to search
+ * @param this The route graph
+ * @param arena The arena to allocate from, this->arena or this->seg_arena
+ * @param size The number of bytes needed, rounded up to a multiple of the pointer size
+ * @return The memory, which is freed by route_graph_free_arena()
+ */
+static void *
+route_graph_alloc(struct route_graph *this, struct route_graph_arena **arena, int size)
+{
+	struct route_graph_arena *a=*arena;
+	void *ret;
+
+	size=(size+sizeof(void *)-1) & ~(sizeof(void *)-1);
+	if (!a || a->used+size > a->size) {
+		int block=size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		a=g_malloc(sizeof(struct route_graph_arena)+block);
+		a->next=*arena;
+		a->size=block;
+		a->used=0;
+		*arena=a;
+		this->arena_size+=block;
+	}
+	ret=a->data+a->used;
+	a->used+=size;
+	memset(ret, 0, size);
+	return ret;
+}
+
+/**
+ * @brief Finds the hash slot for a coordinate
+ *
+ * @param this The route graph
  * @param c Coordinates to search for
- * @param last The last route graph point returned to iterate over multiple points with the same coordinates
- * @return The point at the specified coordinates or NULL if not found
+ * @return The slot holding the points at c, or the empty slot where they would have to be inserted.
+ * NULL if the graph has no hashtable yet.
  */
-static struct route_graph_point *
-route_graph_get_point_next(struct route_graph *this, struct coord *c, struct route_graph_point *last)
+static struct route_graph_point **
+route_graph_hash_slot(struct route_graph *this, struct coord *c)
 {
+	int i;
 	struct route_graph_point *p;
-	int seen=0,hashval=HASHCOORD(c);
-	p=this->hash[hashval];
-	while (p) {
-		if (p->c.x == c->x && p->c.y == c->y) {
-			if (!last || seen)
-				return p;
-			if (p == last)
-				seen=1;
+
+	if (!this->hash_size)
+		return NULL;
+	i=HASHCOORD(c, this->hash_size);
+	this->hash_lookups++;
+	while ((p=this->hash[i])) {
+		this->hash_probes++;
+		if (p->c.x == c->x && p->c.y == c->y)
+			break;
+		i=(i+1) & (this->hash_size-1);
+	}
+	return &this->hash[i];
+}
+
+/**
+ * @brief Doubles the size of the hashtable of a route graph once it is half full
+ *
+ * @param this The route graph
+ */
+static void
+route_graph_hash_grow(struct route_graph *this)
+{
+	struct route_graph_point **old=this->hash;
+	int i,old_size=this->hash_size;
+
+	if (this->hash_count*2 < this->hash_size)
+		return;
+	this->hash_size=old_size ? old_size*2 : HASH_SIZE_MIN;
+	this->hash=g_new0(struct route_graph_point *, this->hash_size);
+	for (i = 0 ; i < old_size ; i++) {
+		if (old[i]) {
+			int j=HASHCOORD(&old[i]->c, this->hash_size);
+			while (this->hash[j])
+				j=(j+1) & (this->hash_size-1);
+			this->hash[j]=old[i];
 		}
-		p=p->hash_next;
 	}
-	return NULL;
+	g_free(old);
 }
 
+/**
+ * @brief Gets the route_graph_point with the specified coordinates
+ *
+ * @param this The route in which to search
+ * @param c Coordinates to search for
+ * @param last The last route graph point returned to iterate over multiple points with the same coordinates
+ * @return The point at the specified coordinates or NULL if not found
+ */
 static struct route_graph_point *
-route_graph_get_point(struct route_graph *this, struct coord *c)
+route_graph_get_point_next(struct route_graph *this, struct coord *c, struct route_graph_point *last)
 {
-	return route_graph_get_point_next(this, c, NULL);
+	struct route_graph_point **slot;
+	if (last)
+		return last->hash_next;
+	slot=route_graph_hash_slot(this, c);
+	return slot ? *slot : NULL;
 }
 
 /**
@@ -1377,15 +1638,10 @@ route_graph_get_point(struct route_graph *this, struct coord *c)
 static struct route_graph_point *
 route_graph_get_point_last(struct route_graph *this, struct coord *c)
 {
-	struct route_graph_point *p,*ret=NULL;
-	int hashval=HASHCOORD(c);
-	p=this->hash[hashval];
-	while (p) {
-		if (p->c.x == c->x && p->c.y == c->y)
-			ret=p;
+	struct route_graph_point *p=route_graph_get_point_next(this, c, NULL);
+	while (p && p->hash_next)
 		p=p->hash_next;
-	}
-	return ret;
+	return p;
 }
 
 
@@ -1401,15 +1657,19 @@ route_graph_get_point_last(struct route_graph *this, struct coord *c)
 static struct route_graph_point *
 route_graph_point_new(struct route_graph *this, struct coord *f)
 {
-	int hashval;
-	struct route_graph_point *p;
+	struct route_graph_point **slot,*p;
 
-	hashval=HASHCOORD(f);
 	if (debug_route)
 		printf("p (0x%x,0x%x)\n", f->x, f->y);
-	p=g_slice_new0(struct route_graph_point);
-	p->hash_next=this->hash[hashval];
-	this->hash[hashval]=p;
+	slot=route_graph_hash_slot(this, f);
+	if (!slot || !*slot) {
+		route_graph_hash_grow(this);
+		slot=route_graph_hash_slot(this, f);
+		this->hash_count++;
+	}
+	p=route_graph_alloc(this, &this->arena, sizeof(struct route_graph_point));
+	p->hash_next=*slot;
+	*slot=p;
 	p->value=INT_MAX;
 	p->c=*f;
 	return p;
@@ -1430,31 +1690,51 @@ route_graph_add_point(struct route_graph *this, struct coord *f)
 {
 	struct route_graph_point *p;
 
-	p=route_graph_get_point(this,f);
+	p=route_graph_get_point_last(this,f);
 	if (!p)
 		p=route_graph_point_new(this,f);
 	return p;
 }
 
 /**
- * @brief Frees all the memory used for points in the route graph passed
+ * @brief Frees all the memory used for points and segments in the route graph passed
  *
- * @param this The route graph to delete all points from
+ * @param this The route graph to delete all points and segments from
  */
 static void
-route_graph_free_points(struct route_graph *this)
+route_graph_free_arena(struct route_graph *this)
 {
-	struct route_graph_point *curr,*next;
-	int i;
-	for (i = 0 ; i < HASH_SIZE ; i++) {
-		curr=this->hash[i];
-		while (curr) {
-			next=curr->hash_next;
-			g_slice_free(struct route_graph_point, curr);
-			curr=next;
-		}
-		this->hash[i]=NULL;
+	struct route_graph_arena *curr,*next;
+	curr=this->arena;
+	while (curr) {
+		next=curr->next;
+		g_free(curr);
+		curr=next;
+	}
+	curr=this->seg_arena;
+	while (curr) {
+		next=curr->next;
+		g_free(curr);
+		curr=next;
 	}
+	this->arena=NULL;
+	this->seg_arena=NULL;
+	this->arena_size=0;
+	g_free(this->hash);
+	this->hash=NULL;
+	this->hash_size=0;
+	this->hash_count=0;
+	g_free(this->adj);
+	this->adj=NULL;
+	g_free(this->dup);
+	this->dup=NULL;
+	this->dup_size=0;
+	this->dup_count=0;
+	this->segment_count=0;
+	g_free(this->costs);
+	this->costs=NULL;
+	this->costs_size=0;
+	this->costs_change=0;
 }
 
 /**
@@ -1467,15 +1747,16 @@ route_graph_reset(struct route_graph *this)
 {
 	struct route_graph_point *curr;
 	int i;
-	for (i = 0 ; i < HASH_SIZE ; i++) {
+	for (i = 0 ; i < this->hash_size ; i++) {
 		curr=this->hash[i];
 		while (curr) {
 			curr->value=INT_MAX;
 			curr->seg=NULL;
-			curr->el=NULL;
+			curr->el=0;
 			curr=curr->hash_next;
 		}
 	}
+	this->flood_partial=0;
 }
 
 /**
@@ -1540,13 +1821,112 @@ route_segment_data_size(int flags)
 }
 
 
+/**
+ * @brief Calculates the size a route graph segment with given flags takes in route_graph->seg_arena
+ *
+ * Only flags which are known when the segment is created may add fields, so this can be used
+ * to step from one segment to the next.
+ *
+ * @param flags The flags of the segment data
+ */
 static int
-route_graph_segment_is_duplicate(struct route_graph_point *start, struct route_graph_segment_data *data)
+route_graph_segment_size(int flags)
 {
-	struct route_graph_segment *s;
-	s=start->start;
-	while (s) {
-		if (item_is_equal(*data->item, s->data.item)) {
+	int size=sizeof(struct route_graph_segment)-sizeof(struct route_segment_data)+route_segment_data_size(flags);
+	return (size+sizeof(void *)-1) & ~(sizeof(void *)-1);
+}
+
+/**
+ * @brief Iterates over all segments of a route graph
+ *
+ * The segments are returned in the order of the arena blocks, not in the order they were added.
+ *
+ * @param this The route graph
+ * @param a Pointer to the arena block of s, set by this function
+ * @param s The segment returned last, NULL to get the first one
+ * @return The next segment or NULL if there are no more segments
+ */
+static struct route_graph_segment *
+route_graph_segment_next(struct route_graph *this, struct route_graph_arena **a, struct route_graph_segment *s)
+{
+	char *next;
+
+	if (s) 
+		next=(char *)s+route_graph_segment_size(s->data.flags);
+	else {
+		*a=this->seg_arena;
+		next=*a ? (*a)->data : NULL;
+	}
+	while (*a && next >= (*a)->data+(*a)->used) {
+		*a=(*a)->next;
+		next=*a ? (*a)->data : NULL;
+	}
+	return (struct route_graph_segment *)next;
+}
+
+/**
+ * @brief Inserts a segment into the duplicate table of a route graph
+ *
+ * @param this The route graph
+ * @param s The segment to insert
+ */
+static void
+route_graph_dup_insert(struct route_graph *this, struct route_graph_segment *s)
+{
+	int i;
+
+	if (this->dup_count*2 >= this->dup_size) {
+		struct route_graph_segment **old=this->dup;
+		int old_size=this->dup_size;
+		this->dup_size=old_size ? old_size*2 : DUP_SIZE_MIN;
+		this->dup=g_new0(struct route_graph_segment *, this->dup_size);
+		for (i = 0 ; i < old_size ; i++) {
+			if (old[i]) {
+				int j=HASHSEG(old[i]->start, &old[i]->data.item, this->dup_size);
+				while (this->dup[j])
+					j=(j+1) & (this->dup_size-1);
+				this->dup[j]=old[i];
+			}
+		}
+		g_free(old);
+	}
+	i=HASHSEG(s->start, &s->data.item, this->dup_size);
+	while (this->dup[i])
+		i=(i+1) & (this->dup_size-1);
+	this->dup[i]=s;
+	this->dup_count++;
+}
+
+/**
+ * @brief Checks if a segment for an item is already in the route graph
+ *
+ * This is checked while the graph is built, when the segments are not yet collected per point.
+ * The table used for this is set up from all segments of the graph on the first call and
+ * freed again by route_graph_compile().
+ *
+ * @param this The route graph
+ * @param start The start point of the new segment
+ * @param data The data of the new segment
+ * @return 1 if the segment is a duplicate, 0 otherwise
+ */
+static int
+route_graph_segment_is_duplicate(struct route_graph *this, struct route_graph_point *start, struct route_graph_segment_data *data)
+{
+	struct route_graph_arena *a=NULL;
+	struct route_graph_segment *s=NULL;
+	int i;
+
+	if (!this->dup) {
+		this->dup_size=DUP_SIZE_MIN;
+		while (this->dup_size < this->segment_count*2)
+			this->dup_size*=2;
+		this->dup=g_new0(struct route_graph_segment *, this->dup_size);
+		while ((s=route_graph_segment_next(this, &a, s)))
+			route_graph_dup_insert(this, s);
+	}
+	i=HASHSEG(start, data->item, this->dup_size);
+	while ((s=this->dup[i])) {
+		if (s->start == start && item_is_equal(*data->item, s->data.item)) {
 			if (data->flags & AF_SEGMENTED) {
 				if (RSD_OFFSET(&s->data) == data->offset) {
 					return 1;
@@ -1554,11 +1934,83 @@ route_graph_segment_is_duplicate(struct route_graph_point *start, struct route_g
 			} else
 				return 1;
 		}
-		s=s->start_next;
-	} 
+		i=(i+1) & (this->dup_size-1);
+	}
 	return 0;
 }
 
+/**
+ * @brief Sorts a slice of route_graph->adj by descending segment id
+ *
+ * @param adj The slice
+ * @param count The number of segments in it, usually only a few
+ */
+static void
+route_graph_sort_adj(struct route_graph_segment **adj, int count)
+{
+	int i,j;
+	for (i = 1 ; i < count ; i++) {
+		struct route_graph_segment *s=adj[i];
+		for (j = i ; j > 0 && adj[j-1]->id < s->id ; j--)
+			adj[j]=adj[j-1];
+		adj[j]=s;
+	}
+}
+
+/**
+ * @brief Collects the segments of all points of a route graph
+ *
+ * The segments of each point are placed into one slice of route_graph->adj, so the flood
+ * and the other users can walk them without following pointers from segment to segment.
+ * Each slice holds the segments starting at the point, then the ones ending at it, newest first.
+ * Segments read afterwards are not seen at their points until the graph is compiled again,
+ * single segments can be added to a compiled graph with route_graph_adj_insert().
+ *
+ * @param this The route graph
+ */
+static void
+route_graph_compile(struct route_graph *this)
+{
+	struct route_graph_arena *a=NULL;
+	struct route_graph_segment *s=NULL;
+	struct route_graph_point *p;
+	int i,pos=0;
+
+	g_free(this->dup);
+	this->dup=NULL;
+	this->dup_size=0;
+	this->dup_count=0;
+	g_free(this->adj);
+	this->adj=g_new(struct route_graph_segment *, this->segment_count*2);
+	for (i = 0 ; i < this->hash_size ; i++) {
+		for (p = this->hash[i] ; p ; p=p->hash_next) {
+			p->nstart=0;
+			p->nend=0;
+		}
+	}
+	while ((s=route_graph_segment_next(this, &a, s))) {
+		s->start->nstart++;
+		s->end->nend++;
+	}
+	/* The slices are filled from their ends, so adj points past the slice until all segments are placed */
+	for (i = 0 ; i < this->hash_size ; i++) {
+		for (p = this->hash[i] ; p ; p=p->hash_next) {
+			pos+=p->nstart+p->nend;
+			p->adj=this->adj+pos;
+		}
+	}
+	while ((s=route_graph_segment_next(this, &a, s))) 
+		*--s->end->adj=s;
+	while ((s=route_graph_segment_next(this, &a, s))) 
+		*--s->start->adj=s;
+	for (i = 0 ; i < this->hash_size ; i++) {
+		for (p = this->hash[i] ; p ; p=p->hash_next) {
+			route_graph_sort_adj(p->adj, p->nstart);
+			route_graph_sort_adj(p->adj+p->nstart, p->nend);
+		}
+	}
+}
+
 /**
  * @brief Inserts a new segment into the route graph
  *
@@ -1573,33 +2025,30 @@ route_graph_segment_is_duplicate(struct route_graph_point *start, struct route_g
  * @param flags Flags for this segment
  * @param offset If the item passed in "item" is segmented (i.e. divided into several segments), this indicates the position of this segment within the item
  * @param maxspeed The maximum speed allowed on this segment in km/h. -1 if not known.
+ * @return The new segment
  */
-static void
+static struct route_graph_segment *
 route_graph_add_segment(struct route_graph *this, struct route_graph_point *start,
 			struct route_graph_point *end, struct route_graph_segment_data *data)
 {
 	struct route_graph_segment *s;
 	int size;
 
-	size = sizeof(struct route_graph_segment)-sizeof(struct route_segment_data)+route_segment_data_size(data->flags);
-	s = g_slice_alloc0(size);
-	if (!s) {
-		printf("%s:Out of memory\n", __FUNCTION__);
-		return;
-	}
+	size = route_graph_segment_size(data->flags);
+	s = route_graph_alloc(this, &this->seg_arena, size);
+	s->id=this->segment_count++;
 	s->start=start;
-	s->start_next=start->start;
-	start->start=s;
 	s->end=end;
-	s->end_next=end->end;
-	end->end=s;
 	dbg_assert(data->len >= 0);
 	s->data.len=data->len;
 	s->data.item=*data->item;
 	s->data.flags=data->flags;
 
-	if (data->flags & AF_SPEED_LIMIT) 
+	if (data->flags & AF_SPEED_LIMIT) {
 		RSD_MAXSPEED(&s->data)=data->maxspeed;
+		if (data->maxspeed > this->maxspeed)
+			this->maxspeed=data->maxspeed;
+	}
 	if (data->flags & AF_SEGMENTED) 
 		RSD_OFFSET(&s->data)=data->offset;
 	if (data->flags & AF_SIZE_OR_WEIGHT_LIMIT) 
@@ -1607,10 +2056,57 @@ route_graph_add_segment(struct route_graph *this, struct route_graph_point *star
 	if (data->flags & AF_DANGEROUS_GOODS) 
 		RSD_DANGEROUS_GOODS(&s->data)=data->dangerous_goods;
 
-	s->next=this->route_segments;
-	this->route_segments=s;
+	if (this->dup)
+		route_graph_dup_insert(this, s);
 	if (debug_route)
 		printf("l (0x%x,0x%x)-(0x%x,0x%x)\n", start->c.x, start->c.y, end->c.x, end->c.y);
+	return s;
+}
+
+/**
+ * @brief Puts a segment in front of one part of the slice of a point
+ *
+ * The point gets a new slice from the point arena. The old one stays valid, so callers can go on
+ * walking it, and is only freed by the next route_graph_compile().
+ *
+ * @param this The route graph
+ * @param p The point
+ * @param s The segment, it has the highest id of all segments of p
+ * @param start 1 if s starts at p, 0 if it ends there
+ */
+static void
+route_graph_point_adj_insert(struct route_graph *this, struct route_graph_point *p, struct route_graph_segment *s, int start)
+{
+	struct route_graph_segment **adj;
+	int pos=start ? 0 : p->nstart;
+
+	adj=route_graph_alloc(this, &this->arena, (p->nstart+p->nend+1)*sizeof(*adj));
+	if (pos)
+		memcpy(adj, p->adj, pos*sizeof(*adj));
+	adj[pos]=s;
+	if (p->nstart+p->nend > pos)
+		memcpy(adj+pos+1, p->adj+pos, (p->nstart+p->nend-pos)*sizeof(*adj));
+	if (start)
+		p->nstart++;
+	else
+		p->nend++;
+	p->adj=adj;
+}
+
+/**
+ * @brief Adds a segment to the slices of its points in a compiled route graph
+ *
+ * Only the two points of the segment are touched, so single segments like turn restriction clones
+ * or traffic distortions can be added without compiling the whole graph again.
+ *
+ * @param this The route graph
+ * @param s The segment, it must be the newest one of the graph
+ */
+static void
+route_graph_adj_insert(struct route_graph *this, struct route_graph_segment *s)
+{
+	route_graph_point_adj_insert(this, s->start, s, 1);
+	route_graph_point_adj_insert(this, s->end, s, 0);
 }
 
 /**
@@ -1876,26 +2372,6 @@ linkold:
 	return ret;
 }
 
-/**
- * @brief Destroys all segments of a route graph
- *
- * @param this The graph to destroy all segments from
- */
-static void
-route_graph_free_segments(struct route_graph *this)
-{
-	struct route_graph_segment *curr,*next;
-	int size;
-	curr=this->route_segments;
-	while (curr) {
-		next=curr->next;
-		size = sizeof(struct route_graph_segment)-sizeof(struct route_segment_data)+route_segment_data_size(curr->data.flags);
-		g_slice_free1(size, curr);
-		curr=next;
-	}
-	this->route_segments=NULL;
-}
-
 /**
  * @brief Destroys a route graph
  * 
@@ -1906,12 +2382,38 @@ route_graph_destroy(struct route_graph *this)
 {
 	if (this) {
 		route_graph_build_done(this, 1);
-		route_graph_free_points(this);
-		route_graph_free_segments(this);
+		route_graph_free_arena(this);
+		route_free_selection(this->covered);
+		route_graph_maps_free(this->maps);
 		g_free(this);
 	}
 }
 
+/**
+ * @brief Removes the route graph from a route when the destinations change
+ *
+ * A complete graph is kept as old_graph, so route_graph_update() can extend it for the new
+ * route instead of reading all the streets again. The traffic distortion route_path_new() put
+ * on the segment to avoid is removed first, it only applies to the path it was made for.
+ * A graph which is still being built is destroyed.
+ *
+ * @param this The route
+ */
+static void
+route_graph_retire(struct route *this)
+{
+	if (this->graph && !this->graph->busy) {
+		if (this->graph->avoid_seg) {
+			route_graph_set_traffic_distortion(this->graph, this->graph->avoid_seg, 0);
+			this->graph->avoid_seg=NULL;
+		}
+		route_graph_destroy(this->old_graph);
+		this->old_graph=this->graph;
+	} else
+		route_graph_destroy(this->graph);
+	this->graph=NULL;
+}
+
 /**
  * @brief Returns the estimated speed on a segment
  *
@@ -1990,17 +2492,16 @@ route_get_traffic_distortion(struct route_graph_segment *seg, struct route_traff
 	struct route_graph_point *start=seg->start;
 	struct route_graph_point *end=seg->end;
 	struct route_graph_segment *tmp,*found=NULL;
-	tmp=start->start;
-	while (tmp && !found) {
+	int i;
+	for (i = 0 ; i < start->nstart && !found ; i++) {
+		tmp=start->adj[i];
 		if (tmp->data.item.type == type_traffic_distortion && tmp->start == start && tmp->end == end)
 			found=tmp;
-		tmp=tmp->start_next;
 	}
-	tmp=start->end;
-	while (tmp && !found) {
+	for (i = 0 ; i < start->nend && !found ; i++) {
+		tmp=start->adj[start->nstart+i];
 		if (tmp->data.item.type == type_traffic_distortion && tmp->end == start && tmp->start == end) 
 			found=tmp;
-		tmp=tmp->end_next;
 	}
 	if (found) {
 		ret->delay=found->data.len;
@@ -2020,19 +2521,17 @@ route_through_traffic_allowed(struct vehicleprofile *profile, struct route_graph
 }
 
 /**
- * @brief Returns the "costs" of driving from point from over segment over in direction dir
+ * @brief Returns the "costs" of driving over segment over in direction dir, without regard to the segment we come from
  *
  * @param profile The routing preferences
- * @param from The point where we are starting
  * @param over The segment we are using
- * @param dir The direction of segment which we are driving
+ * @param dir The direction of segment which we are driving, 2 and -2 ignore traffic distortions
  * @return The "costs" needed to drive len on item
  */  
 
 static int
-route_value_seg(struct vehicleprofile *profile, struct route_graph_point *from, struct route_graph_segment *over, int dir)
+route_seg_cost(struct vehicleprofile *profile, struct route_graph_segment *over, int dir)
 {
-	int ret;
 	struct route_traffic_distortion dist,*distp=NULL;
 #if 0
 	dbg(lvl_debug,"flags 0x%x mask 0x%x flags 0x%x\n", over->flags, dir >= 0 ? profile->flags_forward_mask : profile->flags_reverse_mask, profile->flags);
@@ -2043,13 +2542,86 @@ route_value_seg(struct vehicleprofile *profile, struct route_graph_point *from,
 		return INT_MAX;
 	if (dir < 0 && (over->end->flags & RP_TURN_RESTRICTION))
 		return INT_MAX;
-	if (from && from->seg == over)
-		return INT_MAX;
 	if ((over->start->flags & RP_TRAFFIC_DISTORTION) && (over->end->flags & RP_TRAFFIC_DISTORTION) && 
 		route_get_traffic_distortion(over, &dist) && dir != 2 && dir != -2) {
 			distp=&dist;
 	}
-	ret=route_time_seg(profile, &over->data, distp);
+	return route_time_seg(profile, &over->data, distp);
+}
+
+/**
+ * @brief Invalidates the cached costs of the segments of a point
+ *
+ * This has to be called whenever segments or point flags which are used by route_seg_cost() change.
+ * Segments which are not in the slice of the point yet are new and have no cached costs.
+ *
+ * @param this The route graph
+ * @param p The point
+ * @param other If not NULL, only the costs of the segments between p and other are invalidated
+ */
+static void
+route_graph_invalidate_costs(struct route_graph *this, struct route_graph_point *p, struct route_graph_point *other)
+{
+	struct route_graph_segment *s;
+	int i;
+
+	for (i = 0 ; i < p->nstart+p->nend ; i++) {
+		s=p->adj[i];
+		if (s->id < this->costs_size && (!other || s->start == other || s->end == other)) {
+			this->costs[s->id*2]=COST_UNKNOWN;
+			this->costs[s->id*2+1]=COST_UNKNOWN;
+		}
+	}
+}
+
+/**
+ * @brief Makes sure the cost cache of a route graph covers all segments and belongs to the current state of profile
+ *
+ * @param this The route graph
+ * @param profile The routing preferences
+ */
+static void
+route_graph_prepare_costs(struct route_graph *this, struct vehicleprofile *profile)
+{
+	int i,from=this->costs_size;
+	if (this->costs_change != profile->change)
+		from=0;
+	if (this->segment_count > this->costs_size) {
+		this->costs_size=this->segment_count;
+		this->costs=g_renew(int, this->costs, this->costs_size*2);
+	}
+	for (i = from*2 ; i < this->costs_size*2 ; i++)
+		this->costs[i]=COST_UNKNOWN;
+	this->costs_change=profile->change;
+}
+
+/**
+ * @brief Returns the "costs" of driving from point from over segment over in direction dir
+ *
+ * For the directions 1 and -1, the result of route_seg_cost() is taken from the cost cache of the graph,
+ * route_graph_prepare_costs() has to be called before.
+ *
+ * @param this The route graph
+ * @param profile The routing preferences
+ * @param from The point where we are starting
+ * @param over The segment we are using
+ * @param dir The direction of segment which we are driving
+ * @return The "costs" needed to drive len on item
+ */  
+
+static int
+route_value_seg(struct route_graph *this, struct vehicleprofile *profile, struct route_graph_point *from, struct route_graph_segment *over, int dir)
+{
+	int ret;
+	if (from && from->seg == over)
+		return INT_MAX;
+	if (dir == 1 || dir == -1) {
+		int *cost=&this->costs[over->id*2+(dir > 0)];
+		if (*cost == COST_UNKNOWN)
+			*cost=route_seg_cost(profile, over, dir);
+		ret=*cost;
+	} else
+		ret=route_seg_cost(profile, over, dir);
 	if (ret == INT_MAX)
 		return ret;
 	if (!route_through_traffic_allowed(profile, over) && from && route_through_traffic_allowed(profile, from->seg)) 
@@ -2070,11 +2642,15 @@ static void
 route_graph_set_traffic_distortion(struct route_graph *this, struct route_graph_segment *seg, int delay)
 {
 	struct route_graph_point *start=NULL;
-	struct route_graph_segment *s;
+	struct route_graph_segment *s,**adj;
+	int i,n;
 
 	while ((start=route_graph_get_point_next(this, &seg->start->c, start))) {
-		s=start->start;
-		while (s) {
+		/* route_graph_adj_insert() gives start a new slice, this one stays valid */
+		adj=start->adj;
+		n=start->nstart;
+		for (i = 0 ; i < n ; i++) {
+			s=adj[i];
 			if (route_graph_segment_match(s, seg)) {
 				if (s->data.item.type != type_none && s->data.item.type != type_traffic_distortion && delay) {
 					struct route_graph_segment_data data;
@@ -2086,27 +2662,102 @@ route_graph_set_traffic_distortion(struct route_graph *this, struct route_graph_
 					data.len=delay;
 					s->start->flags |= RP_TRAFFIC_DISTORTION;
 					s->end->flags |= RP_TRAFFIC_DISTORTION;
-					route_graph_add_segment(this, s->start, s->end, &data);
+					route_graph_adj_insert(this, route_graph_add_segment(this, s->start, s->end, &data));
+					route_graph_invalidate_costs(this, s->start, s->end);
 				} else if (s->data.item.type == type_traffic_distortion && !delay) {
 					s->data.item.type = type_none;
+					route_graph_invalidate_costs(this, s->start, s->end);
 				}
 			}
-			s=s->start_next;
 		}
 	}
 }
 
+/**
+ * @brief Adds a segment read from a map to the route graph
+ *
+ * Depending on the type of data->item, c holds the start and end of a street segment or traffic distortion,
+ * or the three points of a turn restriction.
+ *
+ * @param this The route graph to add to
+ * @param c The coordinates of the segment
+ * @param data The segment data
+ */
+static void
+route_graph_add_read_segment(struct route_graph *this, struct coord *c, struct route_graph_segment_data *data)
+{
+	struct route_graph_point *pnt[3];
+
+	pnt[0]=route_graph_add_point(this,&c[0]);
+	pnt[1]=route_graph_add_point(this,&c[1]);
+	if (route_graph_segment_is_duplicate(this, pnt[0], data))
+		return;
+	switch (data->item->type) {
+	case type_traffic_distortion:
+		pnt[0]->flags |= RP_TRAFFIC_DISTORTION;
+		pnt[1]->flags |= RP_TRAFFIC_DISTORTION;
+		route_graph_add_segment(this, pnt[0], pnt[1], data);
+		/* The points may be part of the graph already when it is extended */
+		route_graph_invalidate_costs(this, pnt[0], pnt[1]);
+		break;
+	case type_street_turn_restriction_no:
+	case type_street_turn_restriction_only:
+		pnt[2]=route_graph_add_point(this,&c[2]);
+		dbg(lvl_debug,"%s: (0x%x,0x%x)-(0x%x,0x%x)-(0x%x,0x%x) %p-%p-%p\n",item_to_name(data->item->type),c[0].x,c[0].y,c[1].x,c[1].y,c[2].x,c[2].y,pnt[0],pnt[1],pnt[2]);
+		route_graph_add_segment(this, pnt[0], pnt[1], data);
+		route_graph_add_segment(this, pnt[1], pnt[2], data);
+		pnt[1]->flags |= RP_TURN_RESTRICTION;
+		route_graph_invalidate_costs(this, pnt[1], NULL);
+		break;
+	default:
+		route_graph_add_segment(this, pnt[0], pnt[1], data);
+	}
+}
+
+/**
+ * @brief Passes a segment read from a map on
+ *
+ * The segment is added to the route graph directly, or collected in the buffer of a route graph job
+ * if the map is read by a worker thread.
+ *
+ * @param this The route graph to add to, or NULL if job is given
+ * @param job The job to collect the segment in, or NULL
+ * @param c The coordinates of the segment, see route_graph_add_read_segment()
+ * @param data The segment data
+ */
+static void
+route_graph_emit_segment(struct route_graph *this, struct route_graph_job *job, struct coord *c, struct route_graph_segment_data *data)
+{
+	struct route_graph_read_segment *seg;
+
+	if (!job) {
+		route_graph_add_read_segment(this, c, data);
+		return;
+	}
+	if (job->count == job->size) {
+		job->size=job->size ? job->size*2 : 1024;
+		job->segs=g_renew(struct route_graph_read_segment, job->segs, job->size);
+	}
+	seg=&job->segs[job->count++];
+	seg->item=*data->item;
+	seg->c[0]=c[0];
+	seg->c[1]=c[1];
+	if (data->item->type == type_street_turn_restriction_no || data->item->type == type_street_turn_restriction_only)
+		seg->c[2]=c[2];
+	seg->data=*data;
+}
+
 /**
  * @brief Adds a route distortion item to the route graph
  *
  * @param this The route graph to add to
+ * @param job The job to collect the segment in, or NULL to add it to this
  * @param item The item to add
  */
 static void
-route_process_traffic_distortion(struct route_graph *this, struct item *item)
+route_process_traffic_distortion(struct route_graph *this, struct route_graph_job *job, struct item *item)
 {
-	struct route_graph_point *s_pnt,*e_pnt;
-	struct coord c,l;
+	struct coord c[2],l;
 	struct attr delay_attr, maxspeed_attr;
 	struct route_graph_segment_data data;
 
@@ -2116,21 +2767,17 @@ route_process_traffic_distortion(struct route_graph *this, struct item *item)
 	data.offset=1;
 	data.maxspeed = INT_MAX;
 
-	if (item_coord_get(item, &l, 1)) {
-		s_pnt=route_graph_add_point(this,&l);
-		while (item_coord_get(item, &c, 1)) {
-			l=c;
-		}
-		e_pnt=route_graph_add_point(this,&l);
-		s_pnt->flags |= RP_TRAFFIC_DISTORTION;
-		e_pnt->flags |= RP_TRAFFIC_DISTORTION;
+	if (item_coord_get(item, &c[0], 1)) {
+		c[1]=c[0];
+		while (item_coord_get(item, &l, 1))
+			c[1]=l;
 		if (item_attr_get(item, attr_maxspeed, &maxspeed_attr)) {
 			data.flags |= AF_SPEED_LIMIT;
 			data.maxspeed=maxspeed_attr.u.num;
 		}
 		if (item_attr_get(item, attr_delay, &delay_attr))
 			data.len=delay_attr.u.num;
-		route_graph_add_segment(this, s_pnt, e_pnt, &data);
+		route_graph_emit_segment(this, job, c, &data);
 	}
 }
 
@@ -2138,39 +2785,25 @@ route_process_traffic_distortion(struct route_graph *this, struct item *item)
  * @brief Adds a turn restriction item to the route graph
  *
  * @param this The route graph to add to
+ * @param job The job to collect the restriction in, or NULL to add it to this
  * @param item The item to add
  */
 static void
-route_process_turn_restriction(struct route_graph *this, struct item *item)
+route_process_turn_restriction(struct route_graph *this, struct route_graph_job *job, struct item *item)
 {
-	struct route_graph_point *pnt[4];
 	struct coord c[5];
-	int i,count;
+	int count;
 	struct route_graph_segment_data data;
 
 	count=item_coord_get(item, c, 5);
-	if (count != 3 && count != 4) {
+	if (count != 3) {
 		dbg(lvl_debug,"wrong count %d\n",count);
 		return;
 	}
-	if (count == 4)
-		return;
-	for (i = 0 ; i < count ; i++) 
-		pnt[i]=route_graph_add_point(this,&c[i]);
-	dbg(lvl_debug,"%s: (0x%x,0x%x)-(0x%x,0x%x)-(0x%x,0x%x) %p-%p-%p\n",item_to_name(item->type),c[0].x,c[0].y,c[1].x,c[1].y,c[2].x,c[2].y,pnt[0],pnt[1],pnt[2]);
 	data.item=item;
 	data.flags=0;
 	data.len=0;
-	route_graph_add_segment(this, pnt[0], pnt[1], &data);
-	route_graph_add_segment(this, pnt[1], pnt[2], &data);
-#if 1
-	if (count == 4) {
-		pnt[1]->flags |= RP_TURN_RESTRICTION;
-		pnt[2]->flags |= RP_TURN_RESTRICTION;
-		route_graph_add_segment(this, pnt[2], pnt[3], &data);
-	} else 
-		pnt[1]->flags |= RP_TURN_RESTRICTION;
-#endif	
+	route_graph_emit_segment(this, job, c, &data);
 }
 
 /**
@@ -2180,11 +2813,12 @@ route_process_turn_restriction(struct route_graph *this, struct item *item)
  * segmented item.
  *
  * @param this The route graph to add to
+ * @param job The job to collect the segments in, or NULL to add them to this
  * @param item The item to add
  * @param profile		The vehicle profile currently in use
  */
 static void
-route_process_street_graph(struct route_graph *this, struct item *item, struct vehicleprofile *profile)
+route_process_street_graph(struct route_graph *this, struct route_graph_job *job, struct item *item, struct vehicleprofile *profile)
 {
 #ifdef AVOID_FLOAT
 	int len=0;
@@ -2193,8 +2827,7 @@ route_process_street_graph(struct route_graph *this, struct item *item, struct v
 #endif
 	int segmented = 0;
 	struct roadprofile *roadp;
-	struct route_graph_point *s_pnt,*e_pnt;
-	struct coord c,l;
+	struct coord c[2],l;
 	struct attr attr;
 	struct route_graph_segment_data data;
 	data.flags=0;
@@ -2208,7 +2841,7 @@ route_process_street_graph(struct route_graph *this, struct item *item, struct v
 		return;
 	}
 
-	if (item_coord_get(item, &l, 1)) {
+	if (item_coord_get(item, &c[0], 1)) {
 		int default_flags_value=AF_ALL;
 		int *default_flags=item_get_default_flags(item->type);
 		if (! default_flags)
@@ -2254,69 +2887,299 @@ route_process_street_graph(struct route_graph *this, struct item *item, struct v
 				data.size_weight.axle_weight=-1;
 		}
 
-		s_pnt=route_graph_add_point(this,&l);
+		l=c[0];
 		if (!segmented) {
-			while (item_coord_get(item, &c, 1)) {
-				len+=transform_distance(map_projection(item->map), &l, &c);
-				l=c;
+			while (item_coord_get(item, &c[1], 1)) {
+				len+=transform_distance(map_projection(item->map), &l, &c[1]);
+				l=c[1];
 			}
-			e_pnt=route_graph_add_point(this,&l);
-			dbg_assert(len >= 0);
-			data.len=len;
-			if (!route_graph_segment_is_duplicate(s_pnt, &data))
-				route_graph_add_segment(this, s_pnt, e_pnt, &data);
 		} else {
 			int isseg,rc;
-			int sc = 0;
 			do {
 				isseg = item_coord_is_node(item);
-				rc = item_coord_get(item, &c, 1);
+				rc = item_coord_get(item, &c[1], 1);
 				if (rc) {
-					len+=transform_distance(map_projection(item->map), &l, &c);
-					l=c;
+					len+=transform_distance(map_projection(item->map), &l, &c[1]);
+					l=c[1];
 					if (isseg) {
-						e_pnt=route_graph_add_point(this,&l);
 						data.len=len;
-						if (!route_graph_segment_is_duplicate(s_pnt, &data))
-							route_graph_add_segment(this, s_pnt, e_pnt, &data);
+						route_graph_emit_segment(this, job, c, &data);
 						data.offset++;
-						s_pnt=route_graph_add_point(this,&l);
+						c[0]=l;
 						len = 0;
 					}
 				}
 			} while(rc);
-			e_pnt=route_graph_add_point(this,&l);
-			dbg_assert(len >= 0);
-			sc++;
-			data.len=len;
-			if (!route_graph_segment_is_duplicate(s_pnt, &data))
-				route_graph_add_segment(this, s_pnt, e_pnt, &data);
 		}
+		c[1]=l;
+		dbg_assert(len >= 0);
+		data.len=len;
+		route_graph_emit_segment(this, job, c, &data);
 	}
 }
 
+/**
+ * @brief Adds any item read from a map to the route graph
+ *
+ * @param this The route graph to add to
+ * @param job The job to collect the segments in, or NULL to add them to this
+ * @param item The item to add
+ * @param profile The vehicle profile currently in use
+ */
+static void
+route_process_item(struct route_graph *this, struct route_graph_job *job, struct item *item, struct vehicleprofile *profile)
+{
+	if (item->type == type_traffic_distortion)
+		route_process_traffic_distortion(this, job, item);
+	else if (item->type == type_street_turn_restriction_no || item->type == type_street_turn_restriction_only)
+		route_process_turn_restriction(this, job, item);
+	else
+		route_process_street_graph(this, job, item, profile);
+}
+
 static struct route_graph_segment *
 route_graph_get_segment(struct route_graph *graph, struct street_data *sd, struct route_graph_segment *last)
 {
 	struct route_graph_point *start=NULL;
 	struct route_graph_segment *s;
-	int seen=0;
+	int i,seen=0;
 
 	while ((start=route_graph_get_point_next(graph, &sd->c[0], start))) {
-		s=start->start;
-		while (s) {
+		for (i = 0 ; i < start->nstart ; i++) {
+			s=start->adj[i];
 			if (item_is_equal(sd->item, s->data.item)) {
 				if (!last || seen)
 					return s;
 				if (last == s)
 					seen=1;
 			}
-			s=s->start_next;
 		}
 	}
 	return NULL;
 }
 
+#ifdef USE_FIBHEAP
+/**
+ * @brief The heap used by route_graph_flood(), a Fibonacci heap from fib-1.1
+ */
+struct route_graph_heap {
+	struct fibheap *fh;
+};
+
+static struct route_graph_heap *
+route_graph_heap_new(void)
+{
+	struct route_graph_heap *heap=g_new(struct route_graph_heap, 1);
+	heap->fh=fh_makekeyheap();
+	return heap;
+}
+
+static void
+route_graph_heap_insert(struct route_graph_heap *heap, struct route_graph_point *p, int key)
+{
+	p->el=fh_insertkey(heap->fh, key, p);
+}
+
+static void
+route_graph_heap_update(struct route_graph_heap *heap, struct route_graph_point *p, int key)
+{
+	fh_replacekey(heap->fh, p->el, key);
+}
+
+static struct route_graph_point *
+route_graph_heap_extract_min(struct route_graph_heap *heap)
+{
+	struct route_graph_point *p=fh_extractmin(heap->fh);
+	if (p)
+		p->el=NULL;
+	return p;
+}
+
+static void
+route_graph_heap_destroy(struct route_graph_heap *heap)
+{
+	fh_deleteheap(heap->fh);
+	g_free(heap);
+}
+#else
+/**
+ * @brief The heap used by route_graph_flood(), an array based 4-ary min heap
+ *
+ * Keys are kept in an array of their own, so sifting only touches the points it moves.
+ * Each point stores its position in the heap plus one in its el field, which allows
+ * changing the key of a point without searching for it.
+ */
+struct route_graph_heap {
+	struct route_graph_point **points;	/**< The points on the heap */
+	int *keys;				/**< The keys of the points on the heap */
+	int count;				/**< Number of points on the heap */
+	int size;				/**< Number of points the arrays can hold */
+};
+
+#define ROUTE_GRAPH_HEAP_ARITY 4
+
+static struct route_graph_heap *
+route_graph_heap_new(void)
+{
+	struct route_graph_heap *heap=g_new0(struct route_graph_heap, 1);
+	heap->size=1024;
+	heap->points=g_new(struct route_graph_point *, heap->size);
+	heap->keys=g_new(int, heap->size);
+	return heap;
+}
+
+static void
+route_graph_heap_set(struct route_graph_heap *heap, int pos, struct route_graph_point *p, int key)
+{
+	heap->points[pos]=p;
+	heap->keys[pos]=key;
+	p->el=pos+1;
+}
+
+static void
+route_graph_heap_sift_up(struct route_graph_heap *heap, int pos, struct route_graph_point *p, int key)
+{
+	while (pos) {
+		int parent=(pos-1)/ROUTE_GRAPH_HEAP_ARITY;
+		if (heap->keys[parent] <= key)
+			break;
+		route_graph_heap_set(heap, pos, heap->points[parent], heap->keys[parent]);
+		pos=parent;
+	}
+	route_graph_heap_set(heap, pos, p, key);
+}
+
+static void
+route_graph_heap_sift_down(struct route_graph_heap *heap, int pos, struct route_graph_point *p, int key)
+{
+	for (;;) {
+		int i,child=pos*ROUTE_GRAPH_HEAP_ARITY+1,min=-1,end;
+		if (child >= heap->count)
+			break;
+		end=child+ROUTE_GRAPH_HEAP_ARITY;
+		if (end > heap->count)
+			end=heap->count;
+		for (i = child ; i < end ; i++) {
+			if (heap->keys[i] < key && (min < 0 || heap->keys[i] < heap->keys[min]))
+				min=i;
+		}
+		if (min < 0)
+			break;
+		route_graph_heap_set(heap, pos, heap->points[min], heap->keys[min]);
+		pos=min;
+	}
+	route_graph_heap_set(heap, pos, p, key);
+}
+
+static void
+route_graph_heap_insert(struct route_graph_heap *heap, struct route_graph_point *p, int key)
+{
+	if (heap->count == heap->size) {
+		heap->size*=2;
+		heap->points=g_renew(struct route_graph_point *, heap->points, heap->size);
+		heap->keys=g_renew(int, heap->keys, heap->size);
+	}
+	route_graph_heap_sift_up(heap, heap->count++, p, key);
+}
+
+static void
+route_graph_heap_update(struct route_graph_heap *heap, struct route_graph_point *p, int key)
+{
+	int pos=p->el-1;
+	if (key < heap->keys[pos])
+		route_graph_heap_sift_up(heap, pos, p, key);
+	else
+		route_graph_heap_sift_down(heap, pos, p, key);
+}
+
+static struct route_graph_point *
+route_graph_heap_extract_min(struct route_graph_heap *heap)
+{
+	struct route_graph_point *ret;
+	if (!heap->count)
+		return NULL;
+	ret=heap->points[0];
+	ret->el=0;
+	if (--heap->count)
+		route_graph_heap_sift_down(heap, 0, heap->points[heap->count], heap->keys[heap->count]);
+	return ret;
+}
+
+static void
+route_graph_heap_destroy(struct route_graph_heap *heap)
+{
+	g_free(heap->points);
+	g_free(heap->keys);
+	g_free(heap);
+}
+#endif
+
+static void
+route_graph_max_route_weight(gpointer key, gpointer value, gpointer user_data)
+{
+	struct roadprofile *rp=value;
+	int *max=user_data;
+	if (rp->route_weight > *max)
+		*max=rp->route_weight;
+	if (rp->maxspeed > *max)
+		*max=rp->maxspeed;
+}
+
+/**
+ * @brief Returns the speed used for the A* lower bound
+ *
+ * This is the highest speed any segment of the graph can be driven at with the given profile,
+ * so that distance divided by this speed never overestimates the remaining costs.
+ *
+ * @param this The route graph
+ * @param profile The routing preferences
+ * @return The speed in km/h, 0 if no estimate is possible
+ */
+static int
+route_graph_estimate_speed(struct route_graph *this, struct vehicleprofile *profile)
+{
+	int speed=0;
+	g_hash_table_foreach(profile->roadprofile_hash, route_graph_max_route_weight, &speed);
+	if (profile->maxspeed_handling == 0 && this->maxspeed > speed)
+		speed=this->maxspeed;
+	return speed;
+}
+
+/**
+ * @brief Returns the heap key of a point for route_graph_flood()
+ *
+ * With Dijkstra's algorithm this is the value of the point. With A* the time needed to travel
+ * the straight line to pos at the estimate speed is added. The distance is reduced by 10%
+ * to make up for the rounding in transform_distance(), so the estimate stays a lower bound.
+ */
+static int
+route_graph_flood_key(struct route_graph_point *p, struct route_info *pos, enum projection pro, int speed)
+{
+	if (!speed)
+		return p->value;
+	return p->value+transform_distance(pro, &p->c, &pos->lp)*9*36/(10*speed);
+}
+
+/**
+ * @brief Checks if a point is one of the points the flood has to settle
+ *
+ * Once a point is found it is removed from the list by replacing it with the last one.
+ *
+ * @return The number of points still to be settled
+ */
+static int
+route_graph_flood_settle(struct route_graph_point *p, struct route_graph_point **targets, int count)
+{
+	int i;
+	for (i = 0 ; i < count ; i++) {
+		if (targets[i] == p) {
+			targets[i]=targets[--count];
+			i--;
+		}
+	}
+	return count;
+}
+
 /**
  * @brief Calculates the routing costs for each point
  *
@@ -2327,44 +3190,85 @@ route_graph_get_segment(struct route_graph *graph, struct street_data *sd, struc
  * 
  * This function uses Dijkstra's algorithm to do the routing. To understand it you should have a look
  * at this algorithm.
+ *
+ * If the vehicle profile sets route_search to 1 and a position is given, A* is used instead:
+ * points are taken from the heap ordered by their value plus a lower bound of the time needed to
+ * reach the position, and the search stops as soon as both ends of all segments of the position's
+ * street are settled. Points which were not settled at that time are reset, so the values left in the
+ * graph are exact, but only cover the area between destination and position. route_path_update_done()
+ * floods again when the position moves to another street.
+ *
+ * @param this The route graph
+ * @param dst The destination to flood from
+ * @param pos The position the path will start at, may be NULL to flood the whole graph
+ * @param profile The routing preferences
+ * @param cb The callback to call when done, may be NULL
  */
 static void
-route_graph_flood(struct route_graph *this, struct route_info *dst, struct vehicleprofile *profile, struct callback *cb)
+route_graph_flood(struct route_graph *this, struct route_info *dst, struct route_info *pos, struct vehicleprofile *profile, struct callback *cb)
 {
 	struct route_graph_point *p_min;
 	struct route_graph_segment *s=NULL;
-	int min,new,val;
-	struct fibheap *heap; /* This heap will hold all points with "temporarily" calculated costs */
-
-	heap = fh_makekeyheap();   
-
+	int i,min,new,val;
+	struct route_graph_heap *heap; /* This heap will hold all points with "temporarily" calculated costs */
+	struct route_graph_point **targets=NULL;
+	int targets_count=0,settled=0,speed=0;
+	enum projection pro=projection_none;
+
+	heap = route_graph_heap_new();
+	route_graph_prepare_costs(this, profile);
+
+	if (profile->route_search == 1 && pos && pos->street) {
+		while ((s=route_graph_get_segment(this, pos->street, s))) 
+			targets_count+=2;
+		if (targets_count) {
+			targets=g_new(struct route_graph_point *, targets_count);
+			targets_count=0;
+			while ((s=route_graph_get_segment(this, pos->street, s))) {
+				targets[targets_count++]=s->start;
+				targets[targets_count++]=s->end;
+			}
+			pro=map_projection(pos->street->item.map);
+			speed=route_graph_estimate_speed(this, profile);
+			this->flood_item=pos->street->item;
+		}
+	}
+	this->flood_partial=0;
 	while ((s=route_graph_get_segment(this, dst->street, s))) {
-		val=route_value_seg(profile, NULL, s, -1);
+		val=route_value_seg(this, profile, NULL, s, -1);
 		if (val != INT_MAX) {
 			val=val*(100-dst->percent)/100;
 			s->end->seg=s;
 			s->end->value=val;
-			s->end->el=fh_insertkey(heap, s->end->value, s->end);
+			route_graph_heap_insert(heap, s->end, route_graph_flood_key(s->end, pos, pro, speed));
 		}
-		val=route_value_seg(profile, NULL, s, 1);
+		val=route_value_seg(this, profile, NULL, s, 1);
 		if (val != INT_MAX) {
 			val=val*dst->percent/100;
 			s->start->seg=s;
 			s->start->value=val;
-			s->start->el=fh_insertkey(heap, s->start->value, s->start);
+			route_graph_heap_insert(heap, s->start, route_graph_flood_key(s->start, pos, pro, speed));
 		}
 	}
 	for (;;) {
-		p_min=fh_extractmin(heap); /* Starting Dijkstra by selecting the point with the minimum costs on the heap */
+		p_min=route_graph_heap_extract_min(heap); /* Starting Dijkstra by selecting the point with the minimum costs on the heap */
 		if (! p_min) /* There are no more points with temporarily calculated costs, Dijkstra has finished */
 			break;
 		min=p_min->value;
 		if (debug_route)
-			printf("extract p=%p free el=%p min=%d, 0x%x, 0x%x\n", p_min, p_min->el, min, p_min->c.x, p_min->c.y);
-		p_min->el=NULL; /* This point is permanently calculated now, we've taken it out of the heap */
-		s=p_min->start;
-		while (s) { /* Iterating all the segments leading away from our point to update the points at their ends */
-			val=route_value_seg(profile, p_min, s, -1);
+			printf("extract p=%p min=%d, 0x%x, 0x%x\n", p_min, min, p_min->c.x, p_min->c.y);
+		/* This point is permanently calculated now, we've taken it out of the heap */
+		settled++;
+		if (targets) {
+			targets_count=route_graph_flood_settle(p_min, targets, targets_count);
+			if (!targets_count) { /* The position is settled, the remaining points are not needed for the path */
+				this->flood_partial=1;
+				break;
+			}
+		}
+		for (i = 0 ; i < p_min->nstart ; i++) { /* Iterating all the segments leading away from our point to update the points at their ends */
+			s=p_min->adj[i];
+			val=route_value_seg(this, profile, p_min, s, -1);
 			if (val != INT_MAX && item_is_equal(s->data.item,p_min->seg->data.item)) {
 				if (profile->turn_around_penalty2)
 					val+=profile->turn_around_penalty2;
@@ -2380,25 +3284,24 @@ route_graph_flood(struct route_graph *this, struct route_info *dst, struct vehic
 					s->end->seg=s;
 					if (! s->end->el) {
 						if (debug_route)
-							printf("insert_end p=%p el=%p val=%d ", s->end, s->end->el, s->end->value);
-						s->end->el=fh_insertkey(heap, new, s->end);
+							printf("insert_end p=%p val=%d ", s->end, s->end->value);
+						route_graph_heap_insert(heap, s->end, route_graph_flood_key(s->end, pos, pro, speed));
 						if (debug_route)
-							printf("el new=%p\n", s->end->el);
+							printf("inserted\n");
 					}
 					else {
 						if (debug_route)
-							printf("replace_end p=%p el=%p val=%d\n", s->end, s->end->el, s->end->value);
-						fh_replacekey(heap, s->end->el, new);
+							printf("replace_end p=%p val=%d\n", s->end, s->end->value);
+						route_graph_heap_update(heap, s->end, route_graph_flood_key(s->end, pos, pro, speed));
 					}
 				}
 				if (debug_route)
 					printf("\n");
 			}
-			s=s->start_next;
 		}
-		s=p_min->end;
-		while (s) { /* Doing the same as above with the segments leading towards our point */
-			val=route_value_seg(profile, p_min, s, 1);
+		for (i = 0 ; i < p_min->nend ; i++) { /* Doing the same as above with the segments leading towards our point */
+			s=p_min->adj[p_min->nstart+i];
+			val=route_value_seg(this, profile, p_min, s, 1);
 			if (val != INT_MAX && item_is_equal(s->data.item,p_min->seg->data.item)) {
 				if (profile->turn_around_penalty2)
 					val+=profile->turn_around_penalty2;
@@ -2414,24 +3317,32 @@ route_graph_flood(struct route_graph *this, struct route_info *dst, struct vehic
 					s->start->seg=s;
 					if (! s->start->el) {
 						if (debug_route)
-							printf("insert_start p=%p el=%p val=%d ", s->start, s->start->el, s->start->value);
-						s->start->el=fh_insertkey(heap, new, s->start);
+							printf("insert_start p=%p val=%d ", s->start, s->start->value);
+						route_graph_heap_insert(heap, s->start, route_graph_flood_key(s->start, pos, pro, speed));
 						if (debug_route)
-							printf("el new=%p\n", s->start->el);
+							printf("inserted\n");
 					}
 					else {
 						if (debug_route)
-							printf("replace_start p=%p el=%p val=%d\n", s->start, s->start->el, s->start->value);
-						fh_replacekey(heap, s->start->el, new);
+							printf("replace_start p=%p val=%d\n", s->start, s->start->value);
+						route_graph_heap_update(heap, s->start, route_graph_flood_key(s->start, pos, pro, speed));
 					}
 				}
 				if (debug_route)
 					printf("\n");
 			}
-			s=s->end_next;
 		}
 	}
-	fh_deleteheap(heap);
+	if (this->flood_partial) {
+		/* Points still on the heap only have temporary costs, forget them */
+		while ((p_min=route_graph_heap_extract_min(heap))) {
+			p_min->value=INT_MAX;
+			p_min->seg=NULL;
+		}
+	}
+	route_graph_heap_destroy(heap);
+	dbg(lvl_info,"%s settled %d points\n", targets ? "A*" : "Dijkstra", settled);
+	g_free(targets);
 	callback_call_0(cb);
 	dbg(lvl_debug,"return\n");
 }
@@ -2551,7 +3462,7 @@ route_path_new(struct route_graph *this, struct route_path *oldpath, struct rout
 	if (profile->mode == 2 || (profile->mode == 0 && pos->lenextra + dst->lenextra > transform_distance(map_projection(pos->street->item.map), &pos->c, &dst->c)))
 		return route_path_new_offroad(this, pos, dst);
 	while ((s=route_graph_get_segment(this, pos->street, s))) {
-		val=route_value_seg(profile, NULL, s, 2);
+		val=route_value_seg(this, profile, NULL, s, 2);
 		if (val != INT_MAX && s->end->value != INT_MAX) {
 			val=val*(100-pos->percent)/100;
 			dbg(lvl_debug,"val1 %d\n",val);
@@ -2565,7 +3476,7 @@ route_path_new(struct route_graph *this, struct route_path *oldpath, struct rout
 				s1=s;
 			}
 		}
-		val=route_value_seg(profile, NULL, s, -2);
+		val=route_value_seg(this, profile, NULL, s, -2);
 		if (val != INT_MAX && s->start->value != INT_MAX) {
 			val=val*pos->percent/100;
 			dbg(lvl_debug,"val2 %d\n",val);
@@ -2605,7 +3516,7 @@ route_path_new(struct route_graph *this, struct route_path *oldpath, struct rout
 			this->avoid_seg=s;
 			route_graph_set_traffic_distortion(this, this->avoid_seg, profile->turn_around_penalty);
 			route_graph_reset(this);
-			route_graph_flood(this, dst, profile, NULL);
+			route_graph_flood(this, dst, pos, profile, NULL);
 			return route_path_new(this, oldpath, pos, dst, profile);
 		}
 	}
@@ -2648,22 +3559,293 @@ static int
 route_graph_build_next_map(struct route_graph *rg)
 {
 	do {
+		map_rect_destroy(rg->mr);
+		rg->mr=NULL;
 		rg->m=mapset_next(rg->h, 2);
 		if (! rg->m)
 			return 0;
-		map_rect_destroy(rg->mr);
+#ifdef HAVE_PTHREAD
+		if (rg->workers && g_list_find(rg->workers->maps, rg->m))
+			continue;
+#endif
 		rg->mr=map_rect_new(rg->m, rg->sel);
 	} while (!rg->mr);
 		
 	return 1;
 }
 
+static void
+route_graph_job_destroy(struct route_graph_job *job)
+{
+	route_free_selection(job->sel);
+	g_free(job->segs);
+	g_free(job);
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * @brief Marks an item as taken by the calling worker job
+ *
+ * Has to be called with w->mutex held.
+ *
+ * @param w The workers
+ * @param item The item returned by the map
+ * @return 1 if the item has not been taken before, 0 if another job already reads it
+ */
+static int
+route_graph_workers_claim(struct route_graph_workers *w, struct item *item)
+{
+	struct route_graph_claim *slot;
+	struct item_id id;
+	int i;
+
+	if (w->claimed_count*2 >= w->claimed_size) {
+		struct route_graph_claim *old=w->claimed;
+		int old_size=w->claimed_size;
+		w->claimed_size=old_size ? old_size*2 : CLAIM_SIZE_MIN;
+		w->claimed=g_new0(struct route_graph_claim, w->claimed_size);
+		for (i = 0 ; i < old_size ; i++) {
+			if (!old[i].m)
+				continue;
+			slot=&w->claimed[HASHITEM(old[i].m, &old[i].id, w->claimed_size)];
+			while (slot->m)
+				slot=(slot == w->claimed+w->claimed_size-1) ? w->claimed : slot+1;
+			*slot=old[i];
+		}
+		g_free(old);
+	}
+	id.id_hi=item->id_hi;
+	id.id_lo=item->id_lo;
+	slot=&w->claimed[HASHITEM(item->map, &id, w->claimed_size)];
+	while (slot->m) {
+		if (slot->m == item->map && slot->id.id_hi == id.id_hi && slot->id.id_lo == id.id_lo)
+			return 0;
+		slot=(slot == w->claimed+w->claimed_size-1) ? w->claimed : slot+1;
+	}
+	slot->m=item->map;
+	slot->id=id;
+	w->claimed_count++;
+	return 1;
+}
+
+static void *
+route_graph_worker(void *data)
+{
+	struct route_graph_workers *w=data;
+	struct route_graph_job *job;
+	struct map_rect *mr;
+	struct item *item;
+	int claimed,cancel;
+
+	pthread_mutex_lock(&w->mutex);
+	while (w->todo && !w->cancel) {
+		job=w->todo;
+		w->todo=job->next;
+		w->running++;
+		pthread_mutex_unlock(&w->mutex);
+		mr=map_rect_new(job->m, job->sel);
+		if (mr) {
+			while ((item=map_rect_get_item(mr))) {
+				/* cancel is checked under the mutex taken for every item anyway */
+				pthread_mutex_lock(&w->mutex);
+				cancel=w->cancel;
+				claimed=!cancel && route_graph_workers_claim(w, item);
+				pthread_mutex_unlock(&w->mutex);
+				if (cancel)
+					break;
+				if (claimed)
+					route_process_item(NULL, job, item, w->profile);
+			}
+			map_rect_destroy(mr);
+		}
+		pthread_mutex_lock(&w->mutex);
+		w->running--;
+		job->next=w->done;
+		w->done=job;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+static void
+route_graph_job_list_destroy(struct route_graph_job *job)
+{
+	struct route_graph_job *next;
+	while (job) {
+		next=job->next;
+		route_graph_job_destroy(job);
+		job=next;
+	}
+}
+
+/**
+ * @brief Stops the worker threads of a route graph and frees all jobs which have not been merged
+ *
+ * @param rg The route graph
+ */
+static void
+route_graph_workers_stop(struct route_graph *rg)
+{
+	struct route_graph_workers *w=rg->workers;
+	int i;
+
+	if (!w)
+		return;
+	pthread_mutex_lock(&w->mutex);
+	w->cancel=1;
+	pthread_mutex_unlock(&w->mutex);
+	for (i = 0 ; i < w->thread_count ; i++)
+		pthread_join(w->threads[i], NULL);
+	route_graph_job_list_destroy(w->todo);
+	route_graph_job_list_destroy(w->done);
+	if (w->merging)
+		route_graph_job_destroy(w->merging);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	g_list_free(w->maps);
+	g_free(w->claimed);
+	g_free(w->threads);
+	g_free(w);
+	rg->workers=NULL;
+}
+
+/**
+ * @brief Hands the thread safe maps of the mapset to worker threads
+ *
+ * The bounding box of the selection is cut into one vertical strip per thread, and each
+ * strip of each map becomes a job reading the parts of the selection within the strip.
+ * Tiles crossing strips are returned to more than one job, route_graph_workers_claim()
+ * makes sure only the first one reads an item.
+ *
+ * @param rg The route graph, rg->sel has to be set
+ * @param profile The vehicle profile, profile->route_threads gives the number of threads
+ */
+static void
+route_graph_workers_start(struct route_graph *rg, struct vehicleprofile *profile)
+{
+	struct route_graph_workers *w;
+	struct mapset_handle *h;
+	struct map_selection *sel;
+	struct attr thread_safe;
+	struct coord_rect r;
+	struct map *m;
+	GList *l;
+	long long width;
+	int i,count=profile->route_threads;
+
+	if (count <= 0 || !rg->sel)
+		return;
+	w=g_new0(struct route_graph_workers, 1);
+	h=mapset_open(rg->ms);
+	while ((m=mapset_next(h, 2))) {
+		if (map_get_attr(m, attr_thread_safe, &thread_safe, NULL) && thread_safe.u.num)
+			w->maps=g_list_append(w->maps, m);
+	}
+	mapset_close(h);
+	if (!w->maps) {
+		g_free(w);
+		return;
+	}
+	r=rg->sel->u.c_rect;
+	for (sel = rg->sel->next ; sel ; sel=sel->next) {
+		coord_rect_extend(&r, &sel->u.c_rect.lu);
+		coord_rect_extend(&r, &sel->u.c_rect.rl);
+	}
+	width=(long long)r.rl.x-r.lu.x;
+	for (l = w->maps ; l ; l=g_list_next(l)) {
+		for (i = 0 ; i < count ; i++) {
+			struct route_graph_job *job=g_new0(struct route_graph_job, 1);
+			struct map_selection **last=&job->sel;
+			int lu_x=r.lu.x+width*i/count, rl_x=r.lu.x+width*(i+1)/count;
+			for (sel = rg->sel ; sel ; sel=sel->next) {
+				if (sel->u.c_rect.rl.x < lu_x || sel->u.c_rect.lu.x > rl_x)
+					continue;
+				*last=g_new(struct map_selection, 1);
+				**last=*sel;
+				(*last)->next=NULL;
+				if ((*last)->u.c_rect.lu.x < lu_x)
+					(*last)->u.c_rect.lu.x=lu_x;
+				if ((*last)->u.c_rect.rl.x > rl_x)
+					(*last)->u.c_rect.rl.x=rl_x;
+				last=&(*last)->next;
+			}
+			job->m=l->data;
+			job->next=w->todo;
+			w->todo=job;
+		}
+	}
+	/* The default flags are looked up by the workers, the hash has to exist before */
+	item_get_default_flags(type_none);
+	w->profile=profile;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->threads=g_new(pthread_t, count);
+	rg->workers=w;
+	for (i = 0 ; i < count ; i++) {
+		if (!pthread_create(&w->threads[w->thread_count], NULL, route_graph_worker, w))
+			w->thread_count++;
+	}
+	dbg(lvl_debug,"%d threads reading %d maps\n", w->thread_count, g_list_length(w->maps));
+	if (!w->thread_count) {
+		dbg(lvl_error,"failed to create worker threads\n");
+		route_graph_workers_stop(rg);
+	}
+}
+
+/**
+ * @brief Adds the segments read by the worker threads to the route graph
+ *
+ * @param rg The route graph
+ * @param count Maximum number of segments to add, decremented by the number of segments added
+ * @param wait If set, wait for the workers if no finished job is available
+ * @return 1 if all jobs have been merged, 0 otherwise
+ */
+static int
+route_graph_workers_merge(struct route_graph *rg, int *count, int wait)
+{
+	struct route_graph_workers *w=rg->workers;
+	struct route_graph_read_segment *seg;
+	int finished;
+
+	if (!w)
+		return 1;
+	while (*count > 0) {
+		if (!w->merging) {
+			pthread_mutex_lock(&w->mutex);
+			while (wait && !w->done && (w->todo || w->running))
+				pthread_cond_wait(&w->cond, &w->mutex);
+			w->merging=w->done;
+			if (w->merging)
+				w->done=w->merging->next;
+			w->merged=0;
+			finished=!w->merging && !w->todo && !w->running;
+			pthread_mutex_unlock(&w->mutex);
+			if (!w->merging)
+				return finished;
+		}
+		while (*count > 0 && w->merged < w->merging->count) {
+			seg=&w->merging->segs[w->merged++];
+			seg->data.item=&seg->item;
+			route_graph_add_read_segment(rg, seg->c, &seg->data);
+			(*count)--;
+		}
+		if (w->merged == w->merging->count) {
+			route_graph_job_destroy(w->merging);
+			w->merging=NULL;
+		}
+	}
+	return 0;
+}
+#endif
+
 
 static int
 is_turn_allowed(struct route_graph_point *p, struct route_graph_segment *from, struct route_graph_segment *to)
 {
 	struct route_graph_point *prev,*next;
 	struct route_graph_segment *tmp1,*tmp2;
+	int i,j;
 	if (item_is_equal(from->data.item, to->data.item))
 		return 0;
 	if (from->start == p)
@@ -2674,18 +3856,19 @@ is_turn_allowed(struct route_graph_point *p, struct route_graph_segment *from, s
 		next=to->end;
 	else
 		next=to->start;
-	tmp1=p->end;
-	while (tmp1) {
+	for (i = 0 ; i < p->nend ; i++) {
+		tmp1=p->adj[p->nstart+i];
 		if (tmp1->start->c.x == prev->c.x && tmp1->start->c.y == prev->c.y &&
 			(tmp1->data.item.type == type_street_turn_restriction_no ||
 			tmp1->data.item.type == type_street_turn_restriction_only)) {
-			tmp2=p->start;
+			tmp2=NULL;
 			dbg(lvl_debug,"found %s (0x%x,0x%x) (0x%x,0x%x)-(0x%x,0x%x) %p-%p\n",item_to_name(tmp1->data.item.type),tmp1->data.item.id_hi,tmp1->data.item.id_lo,tmp1->start->c.x,tmp1->start->c.y,tmp1->end->c.x,tmp1->end->c.y,tmp1->start,tmp1->end);
-			while (tmp2) {
-				dbg(lvl_debug,"compare %s (0x%x,0x%x) (0x%x,0x%x)-(0x%x,0x%x) %p-%p\n",item_to_name(tmp2->data.item.type),tmp2->data.item.id_hi,tmp2->data.item.id_lo,tmp2->start->c.x,tmp2->start->c.y,tmp2->end->c.x,tmp2->end->c.y,tmp2->start,tmp2->end);
-				if (item_is_equal(tmp1->data.item, tmp2->data.item)) 
+			for (j = 0 ; j < p->nstart ; j++) {
+				dbg(lvl_debug,"compare %s (0x%x,0x%x) (0x%x,0x%x)-(0x%x,0x%x) %p-%p\n",item_to_name(p->adj[j]->data.item.type),p->adj[j]->data.item.id_hi,p->adj[j]->data.item.id_lo,p->adj[j]->start->c.x,p->adj[j]->start->c.y,p->adj[j]->end->c.x,p->adj[j]->end->c.y,p->adj[j]->start,p->adj[j]->end);
+				if (item_is_equal(tmp1->data.item, p->adj[j]->data.item)) {
+					tmp2=p->adj[j];
 					break;
-				tmp2=tmp2->start_next;
+				}
 			}
 			dbg(lvl_debug,"tmp2=%p\n",tmp2);
 			if (tmp2) {
@@ -2700,7 +3883,6 @@ is_turn_allowed(struct route_graph_point *p, struct route_graph_segment *from, s
 				return 0;
 			}
 		}
-		tmp1=tmp1->end_next;
 	}
 	dbg(lvl_debug,"from 0x%x,0x%x over 0x%x,0x%x to 0x%x,0x%x allowed\n",prev->c.x,prev->c.y,p->c.x,p->c.y,next->c.x,next->c.y);
 	return 1;
@@ -2720,15 +3902,16 @@ route_graph_clone_segment(struct route_graph *this, struct route_graph_segment *
 	if (s->data.flags & AF_SEGMENTED) 
 		data.offset=RSD_OFFSET(&s->data);
 	dbg(lvl_debug,"cloning segment from %p (0x%x,0x%x) to %p (0x%x,0x%x)\n",start,start->c.x,start->c.y, end, end->c.x, end->c.y);
-	route_graph_add_segment(this, start, end, &data);
+	route_graph_adj_insert(this, route_graph_add_segment(this, start, end, &data));
 }
 
 static void
 route_graph_process_restriction_segment(struct route_graph *this, struct route_graph_point *p, struct route_graph_segment *s, int dir)
 {
-	struct route_graph_segment *tmp;
+	struct route_graph_segment *tmp,**adj=p->adj;
 	struct route_graph_point *pn;
 	struct coord c=p->c;
+	int i,nstart=p->nstart,nend=p->nend;
 	int dx=0;
 	int dy=0;
 	c.x+=dx;
@@ -2750,46 +3933,44 @@ route_graph_process_restriction_segment(struct route_graph *this, struct route_g
 		}
 		route_graph_clone_segment(this, s, s->start, pn, AF_ONEWAY);
 	}
-	tmp=p->start;
-	while (tmp) {
+	/* The clones may give p a new slice, the segments are taken from the one p had before */
+	for (i = 0 ; i < nstart ; i++) {
+		tmp=adj[i];
 		if (tmp != s && tmp->data.item.type != type_street_turn_restriction_no &&
 			tmp->data.item.type != type_street_turn_restriction_only &&
 			!(tmp->data.flags & AF_ONEWAYREV) && is_turn_allowed(p, s, tmp)) {
 			route_graph_clone_segment(this, tmp, pn, tmp->end, AF_ONEWAY);
 			dbg(lvl_debug,"To start %s\n",item_to_name(tmp->data.item.type));
 		}
-		tmp=tmp->start_next;
 	}
-	tmp=p->end;
-	while (tmp) {
+	for (i = 0 ; i < nend ; i++) {
+		tmp=adj[nstart+i];
 		if (tmp != s && tmp->data.item.type != type_street_turn_restriction_no &&
 			tmp->data.item.type != type_street_turn_restriction_only &&
 			!(tmp->data.flags & AF_ONEWAY) && is_turn_allowed(p, s, tmp)) {
 			route_graph_clone_segment(this, tmp, tmp->start, pn, AF_ONEWAYREV);
 			dbg(lvl_debug,"To end %s\n",item_to_name(tmp->data.item.type));
 		}
-		tmp=tmp->end_next;
 	}
 }
 
 static void
 route_graph_process_restriction_point(struct route_graph *this, struct route_graph_point *p)
 {
-	struct route_graph_segment *tmp;
-	tmp=p->start;
+	struct route_graph_segment *tmp,**adj=p->adj;
+	int i,nstart=p->nstart,nend=p->nend;
 	dbg(lvl_debug,"node 0x%x,0x%x\n",p->c.x,p->c.y);
-	while (tmp) {
+	for (i = 0 ; i < nstart ; i++) {
+		tmp=adj[i];
 		if (tmp->data.item.type != type_street_turn_restriction_no &&
 			tmp->data.item.type != type_street_turn_restriction_only)
 			route_graph_process_restriction_segment(this, p, tmp, 1);
-		tmp=tmp->start_next;
 	}
-	tmp=p->end;
-	while (tmp) {
+	for (i = 0 ; i < nend ; i++) {
+		tmp=adj[nstart+i];
 		if (tmp->data.item.type != type_street_turn_restriction_no &&
 			tmp->data.item.type != type_street_turn_restriction_only)
 			route_graph_process_restriction_segment(this, p, tmp, -1);
-		tmp=tmp->end_next;
 	}
 	p->flags |= RP_TURN_RESTRICTION_RESOLVED;
 }
@@ -2800,10 +3981,10 @@ route_graph_process_restrictions(struct route_graph *this)
 	struct route_graph_point *curr;
 	int i;
 	dbg(lvl_debug,"enter\n");
-	for (i = 0 ; i < HASH_SIZE ; i++) {
+	for (i = 0 ; i < this->hash_size ; i++) {
 		curr=this->hash[i];
 		while (curr) {
-			if (curr->flags & RP_TURN_RESTRICTION) 
+			if ((curr->flags & (RP_TURN_RESTRICTION|RP_TURN_RESTRICTION_RESOLVED)) == RP_TURN_RESTRICTION)
 				route_graph_process_restriction_point(this, curr);
 			curr=curr->hash_next;
 		}
@@ -2814,20 +3995,40 @@ static void
 route_graph_build_done(struct route_graph *rg, int cancel)
 {
 	dbg(lvl_debug,"cancel=%d\n",cancel);
+#ifdef HAVE_PTHREAD
+	route_graph_workers_stop(rg);
+#endif
 	if (rg->idle_ev)
 		event_remove_idle(rg->idle_ev);
 	if (rg->idle_cb)
 		callback_destroy(rg->idle_cb);
 	map_rect_destroy(rg->mr);
         mapset_close(rg->h);
-	route_free_selection(rg->sel);
+	if (cancel)
+		route_free_selection(rg->sel);
+	else if (rg->sel) {
+		struct map_selection *last=rg->sel;
+		while (last->next)
+			last=last->next;
+		last->next=rg->covered;
+		rg->covered=rg->sel;
+	}
 	rg->idle_ev=NULL;
 	rg->idle_cb=NULL;
 	rg->mr=NULL;
 	rg->h=NULL;
 	rg->sel=NULL;
 	if (! cancel) {
+		route_graph_compile(rg);
 		route_graph_process_restrictions(rg);
+		dbg(lvl_debug,"%d coordinates in %d slots, %d probes for %d lookups, arena %d bytes\n", rg->hash_count, rg->hash_size, rg->hash_probes, rg->hash_lookups, rg->arena_size);
+		if (rg->segment_count) {
+			struct route_graph_arena *a;
+			int bytes=rg->segment_count*2*sizeof(struct route_graph_segment *);
+			for (a = rg->seg_arena ; a ; a=a->next)
+				bytes+=a->used;
+			dbg(lvl_debug,"%d segments, %d bytes per segment including adjacency\n", rg->segment_count, bytes/rg->segment_count);
+		}
 		callback_call_0(rg->done_cb);
 	}
 	rg->busy=0;
@@ -2839,26 +4040,62 @@ route_graph_build_idle(struct route_graph *rg, struct vehicleprofile *profile)
 	int count=1000;
 	struct item *item;
 
+#ifdef HAVE_PTHREAD
+	route_graph_workers_merge(rg, &count, 0);
+#endif
 	while (count > 0) {
 		for (;;) {	
-			item=map_rect_get_item(rg->mr);
+			item=rg->mr ? map_rect_get_item(rg->mr) : NULL;
 			if (item)
 				break;
 			if (!route_graph_build_next_map(rg)) {
+#ifdef HAVE_PTHREAD
+				if (!route_graph_workers_merge(rg, &count, !rg->idle_ev))
+					return;
+#endif
 				route_graph_build_done(rg, 0);
 				return;
 			}
 		}
-		if (item->type == type_traffic_distortion)
-			route_process_traffic_distortion(rg, item);
-		else if (item->type == type_street_turn_restriction_no || item->type == type_street_turn_restriction_only)
-			route_process_turn_restriction(rg, item);
-		else
-			route_process_street_graph(rg, item, profile);
+		route_process_item(rg, NULL, item, profile);
 		count--;
 	}
 }
 
+/**
+ * @brief Starts reading a selection of the mapset into a route graph
+ *
+ * Items which are already in the graph are skipped by route_graph_segment_is_duplicate(),
+ * so this can be used to extend an existing graph as well.
+ *
+ * @param rg The route graph to fill
+ * @param sel The rectangles to read, ownership is passed to the graph. If NULL, the graph is complete at once.
+ * @param done_cb The callback which will be called when graph is complete
+ * @param async If set, the graph is built in idle callbacks
+ * @param profile The vehicle profile to use
+ */
+static void
+route_graph_build_start(struct route_graph *rg, struct map_selection *sel, struct callback *done_cb, int async, struct vehicleprofile *profile)
+{
+	rg->sel=sel;
+	rg->done_cb=done_cb;
+	rg->busy=1;
+	if (sel) {
+#ifdef HAVE_PTHREAD
+		route_graph_workers_start(rg, profile);
+#endif
+		rg->h=mapset_open(rg->ms);
+		if (route_graph_build_next_map(rg) || rg->workers) {
+			if (async) {
+				rg->idle_cb=callback_new_2(callback_cast(route_graph_build_idle), rg, profile);
+				rg->idle_ev=event_add_idle(50, rg->idle_cb);
+			}
+			return;
+		}
+	}
+	route_graph_build_done(rg, 0);
+}
+
 /**
  * @brief Builds a new route graph from a mapset
  *
@@ -2882,25 +4119,245 @@ route_graph_build(struct mapset *ms, struct coord *c, int count, struct callback
 
 	dbg(lvl_debug,"enter\n");
 
-	ret->sel=route_calc_selection(c, count, profile);
-	ret->h=mapset_open(ms);
+	ret->ms=ms;
+	ret->vehicleprofile=profile;
+	ret->profile_change=profile->change;
+	ret->maps=route_graph_maps_new(ms);
+	route_graph_build_start(ret, route_calc_selection(c, count, profile), done_cb, async, profile);
+	return ret;
+}
+
+/**
+ * @brief Gets the maps of a mapset which are read into a route graph, with their change counts
+ *
+ * @param ms The mapset
+ * @return List of struct route_graph_map_change, to be freed with route_graph_maps_free()
+ */
+static GList *
+route_graph_maps_new(struct mapset *ms)
+{
+	struct mapset_handle *h=mapset_open(ms);
+	struct route_graph_map_change *mc;
+	struct map *m;
+	GList *ret=NULL;
+
+	while ((m=mapset_next(h, 2))) {
+		mc=g_new(struct route_graph_map_change, 1);
+		mc->m=m;
+		mc->change=map_get_change(m);
+		ret=g_list_append(ret, mc);
+	}
+	mapset_close(h);
+	return ret;
+}
+
+static void
+route_graph_maps_free(GList *maps)
+{
+	g_list_foreach(maps, (GFunc)g_free, NULL);
+	g_list_free(maps);
+}
+
+/**
+ * @brief Checks whether a route graph still holds what reading its mapset would give now
+ *
+ * Extending a graph does not read the items it already holds again. So it can only be reused while
+ * the same maps are active and none of their items changed, which includes traffic distortions, and
+ * while the vehicle profile is unchanged.
+ *
+ * @param rg The route graph
+ * @param ms The mapset of the route
+ * @param profile The vehicle profile of the route
+ * @return 1 if the graph is up to date, 0 if it has to be read again
+ */
+static int
+route_graph_current(struct route_graph *rg, struct mapset *ms, struct vehicleprofile *profile)
+{
+	GList *maps,*l,*old;
+	int ret;
+
+	if (rg->ms != ms || rg->vehicleprofile != profile || rg->profile_change != profile->change)
+		return 0;
+	maps=route_graph_maps_new(ms);
+	for (l = maps, old=rg->maps ; l && old ; l=g_list_next(l), old=g_list_next(old)) {
+		struct route_graph_map_change *mc=l->data,*old_mc=old->data;
+		if (mc->m != old_mc->m || mc->change != old_mc->change)
+			break;
+	}
+	ret=!l && !old;
+	route_graph_maps_free(maps);
+	dbg(lvl_debug,"graph %p %s\n", rg, ret ? "is up to date" : "has changed");
+	return ret;
+}
+
+/**
+ * @brief Checks whether a route graph should be extended for a new route
+ *
+ * Parts of a graph can't be removed again. So a graph which covers rectangles far away from all
+ * rectangles of the new route, or which has already been extended a lot, is not reused. The
+ * new graph read instead only holds what the new route needs.
+ *
+ * @param rg The route graph
+ * @param c Array containing route points, including start, intermediate and destination ones.
+ * @param count number of route points
+ * @param profile The vehicle profile to use
+ * @return 1 if the graph can be extended, 0 if it should be read again
+ */
+static int
+route_graph_reusable(struct route_graph *rg, struct coord *c, int count, struct vehicleprofile *profile)
+{
+	struct map_selection *sel=route_calc_selection(c, count, profile);
+	struct map_selection *covered,*s;
+	int rects=0,ret=1;
+
+	for (covered = rg->covered ; covered && ret ; covered=covered->next) {
+		for (s = sel ; s ; s=s->next) {
+			if (coord_rect_overlap(&covered->u.c_rect, &s->u.c_rect))
+				break;
+		}
+		if (!s || ++rects > ROUTE_GRAPH_REUSE_RECTS)
+			ret=0;
+	}
+	route_free_selection(sel);
+	dbg(lvl_debug,"graph %p covering %d rectangles %s\n", rg, rects, ret ? "can be reused" : "is read again");
+	return ret;
+}
+
+/**
+ * @brief Extends an existing route graph for a new route
+ *
+ * Only the rectangles of the new route selection which have not been read into the graph
+ * before are read from the mapset. If all of them are covered, the graph is used as it is.
+ *
+ * @param rg The route graph to extend, which must not be busy
+ * @param c Array containing route points, including start, intermediate and destination ones.
+ * @param count number of route points
+ * @param done_cb The callback which will be called when graph is complete
+ * @param async If set, the graph is built in idle callbacks
+ * @param profile The vehicle profile to use
+ */
+static void
+route_graph_extend(struct route_graph *rg, struct coord *c, int count, struct callback *done_cb, int async, struct vehicleprofile *profile)
+{
+	struct map_selection *sel=route_selection_missing(rg->covered, route_calc_selection(c, count, profile));
+
+	dbg(lvl_debug,"reusing graph %p, %s\n", rg, sel ? "reading missing rectangles" : "already covered");
+	route_graph_reset(rg);
+	route_graph_build_start(rg, sel, done_cb, async, profile);
+}
+
+/**
+ * @brief Fills in the contraction hierarchy endpoints for a position or destination
+ *
+ * These are both ends of the street, each with the time needed to get there from the
+ * point on the street, in the units maptool uses for the contraction hierarchy.
+ *
+ * @param ri The position or destination
+ * @param profile The routing preferences
+ * @param endpoints Array of two endpoints to fill in
+ */
+static void
+route_info_ch_endpoints(struct route_info *ri, struct vehicleprofile *profile, struct routech_endpoint *endpoints)
+{
+	struct street_data *sd=ri->street;
+	struct roadprofile *roadprofile=vehicleprofile_get_roadprofile(profile, sd->item.type);
+	double scale=transform_scale(ri->lp.y);
+	int speed=50;
+	if (roadprofile && roadprofile->route_weight)
+		speed=roadprofile->route_weight;
+	endpoints[0].c=sd->c[0];
+	endpoints[0].value=ri->lenneg*scale*36/speed;
+	endpoints[1].c=sd->c[sd->count-1];
+	endpoints[1].value=ri->lenpos*scale*36/speed;
+}
+
+static void
+route_graph_add_street_by_id(struct route_graph *this, struct map_rect *mr, struct item_id *id, struct vehicleprofile *profile)
+{
+	struct item *item=map_rect_get_item_byid(mr, id->id_hi, id->id_lo);
+	if (item)
+		route_process_street_graph(this, NULL, item, profile);
+	else
+		dbg(lvl_error,"street 0x%x,0x%x not found\n", id->id_hi, id->id_lo);
+}
+
+static void
+route_graph_add_street(struct route_graph *this, struct street_data *sd, struct vehicleprofile *profile)
+{
+	struct map_rect *mr=map_rect_new(sd->item.map, NULL);
+	struct item_id id;
+	if (!mr)
+		return;
+	id.id_hi=sd->item.id_hi;
+	id.id_lo=sd->item.id_lo;
+	route_graph_add_street_by_id(this, mr, &id, profile);
+	map_rect_destroy(mr);
+}
+
+/**
+ * @brief Builds a route graph from a contraction hierarchy query
+ *
+ * Instead of reading all streets within the route selection, routech_find_route() is asked for the
+ * streets between each pair of consecutive route points, and only these streets are added to the graph.
+ * The graph is then flooded as usual, so route_path_new() works unchanged. Turn restrictions and traffic
+ * distortions are not part of the contraction hierarchy and therefore not considered.
+ *
+ * The caller has to call route_graph_build_done() once the graph is in place.
+ *
+ * @param ms The mapset to query
+ * @param pos The current position
+ * @param destinations The list of destinations
+ * @param done_cb The callback which will be called when graph is complete
+ * @param profile The routing preferences
+ * @return The new route graph, or NULL if the mapset has no contraction hierarchy covering the route
+ */
+static struct route_graph *
+route_graph_build_ch(struct mapset *ms, struct route_info *pos, GList *destinations, struct callback *done_cb, struct vehicleprofile *profile)
+{
+	struct route_graph *ret;
+	struct route_info *from=pos,*to;
+	struct routech_endpoint src[2],dst[2];
+
+	if (!pos->street)
+		return NULL;
+	ret=g_new0(struct route_graph, 1);
 	ret->done_cb=done_cb;
 	ret->busy=1;
-	if (route_graph_build_next_map(ret)) {
-		if (async) {
-			ret->idle_cb=callback_new_2(callback_cast(route_graph_build_idle), ret, profile);
-			ret->idle_ev=event_add_idle(50, ret->idle_cb);
+	route_graph_add_street(ret, pos->street, profile);
+	while (destinations) {
+		struct map *map;
+		struct map_rect *mr;
+		GList *items,*l;
+		to=destinations->data;
+		if (!to->street) {
+			route_graph_destroy(ret);
+			return NULL;
 		}
-	} else
-		route_graph_build_done(ret, 0);
-
+		route_info_ch_endpoints(from, profile, src);
+		route_info_ch_endpoints(to, profile, dst);
+		map=routech_find_route(ms, src, 2, dst, 2, &items);
+		if (!map) {
+			dbg(lvl_debug,"no contraction hierarchy route\n");
+			route_graph_destroy(ret);
+			return NULL;
+		}
+		mr=map_rect_new(map, NULL);
+		for (l = items ; l ; l=g_list_next(l)) 
+			route_graph_add_street_by_id(ret, mr, l->data, profile);
+		map_rect_destroy(mr);
+		g_list_foreach(items, (GFunc)g_free, NULL);
+		g_list_free(items);
+		route_graph_add_street(ret, to->street, profile);
+		from=to;
+		destinations=g_list_next(destinations);
+	}
 	return ret;
 }
 
 static void
 route_graph_update_done(struct route *this, struct callback *cb)
 {
-	route_graph_flood(this->graph, this->current_dst, this->vehicleprofile, cb);
+	route_graph_flood(this->graph, this->current_dst, route_previous_destination(this), this->vehicleprofile, cb);
 }
 
 /**
@@ -2920,8 +4377,7 @@ route_graph_update(struct route *this, struct callback *cb, int async)
 	GList *tmp;
 
 	route_status.type=attr_route_status;
-	route_graph_destroy(this->graph);
-	this->graph=NULL;
+	route_graph_retire(this);
 	callback_destroy(this->route_graph_done_cb);
 	this->route_graph_done_cb=callback_new_2(callback_cast(route_graph_update_done), this, cb);
 	route_status.u.num=route_status_building_graph;
@@ -2933,7 +4389,23 @@ route_graph_update(struct route *this, struct callback *cb, int async)
 		c[i++]=dst->c;
 		tmp=g_list_next(tmp);
 	}
-	this->graph=route_graph_build(this->ms, c, i, this->route_graph_done_cb, async, this->vehicleprofile);
+	if (this->vehicleprofile->route_search == 2) {
+		this->graph=route_graph_build_ch(this->ms, this->pos, this->destinations, this->route_graph_done_cb, this->vehicleprofile);
+		if (this->graph) {
+			route_graph_build_done(this->graph, 0);
+			return;
+		}
+	}
+	if (this->old_graph && this->old_graph->covered && route_graph_current(this->old_graph, this->ms, this->vehicleprofile) &&
+	    route_graph_reusable(this->old_graph, c, i, this->vehicleprofile)) {
+		this->graph=this->old_graph;
+		this->old_graph=NULL;
+		route_graph_extend(this->graph, c, i, this->route_graph_done_cb, async, this->vehicleprofile);
+	} else {
+		route_graph_destroy(this->old_graph);
+		this->old_graph=NULL;
+		this->graph=route_graph_build(this->ms, c, i, this->route_graph_done_cb, async, this->vehicleprofile);
+	}
 	if (! async) {
 		while (this->graph->busy) 
 			route_graph_build_idle(this->graph, this->vehicleprofile);
@@ -3176,6 +4648,7 @@ struct map_rect_priv {
 	struct route_path_segment *seg,*seg_next;
 	struct route_graph_point *point;
 	struct route_graph_segment *rseg;
+	struct route_graph_arena *arena;	/**< The arena block of rseg, when iterating over all segments */
 	char *str;
 	int hash_bucket;
 	struct coord *coord_sel;	/**< Set this to a coordinate if you want to filter for just a single route graph point */
@@ -3430,20 +4903,7 @@ rp_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
 		switch (mr->item.type) {
 		case type_rg_point:
 		{
-			struct route_graph_segment *tmp;
-			int start=0;
-			int end=0;
-			tmp=p->start;
-			while (tmp) {
-				start++;
-				tmp=tmp->start_next;
-			}
-			tmp=p->end;
-			while (tmp) {
-				end++;
-				tmp=tmp->end_next;
-			}
-			mr->str=g_strdup_printf("%d %d %p (0x%x,0x%x)", start, end, p, p->c.x, p->c.y);
+			mr->str=g_strdup_printf("%d %d %p (0x%x,0x%x)", p->nstart, p->nend, p, p->c.x, p->c.y);
 			attr->u.str = mr->str;
 		}
 			return 1;
@@ -3646,12 +5106,12 @@ rp_get_item(struct map_rect_priv *mr)
 		} else {
 			if (!p) {
 				mr->hash_bucket=0;
-				p = r->graph->hash[0];
+				p = r->graph->hash_size ? r->graph->hash[0] : NULL;
 			} else 
 				p=p->hash_next;
 			while (!p) {
 				mr->hash_bucket++;
-				if (mr->hash_bucket >= HASH_SIZE)
+				if (mr->hash_bucket >= r->graph->hash_size)
 					break;
 				p = r->graph->hash[mr->hash_bucket];
 			}
@@ -3673,10 +5133,7 @@ rp_get_item(struct map_rect_priv *mr)
 		}
 		seg = rp_iterator_next(&(mr->it));
 	} else {
-		if (!seg)
-			seg=r->graph->route_segments;
-		else
-			seg=seg->next;
+		seg=route_graph_segment_next(r->graph, &mr->arena, seg);
 	}
 	
 	if (seg) {
@@ -4068,6 +5525,7 @@ route_destroy(struct route *this_)
 	this_->refcount++; /* avoid recursion */
 	route_path_destroy(this_->path2,1);
 	route_graph_destroy(this_->graph);
+	route_graph_destroy(this_->old_graph);
 	route_clear_destinations(this_);
 	route_info_free(this_->pos);
 	map_destroy(this_->map);
@@ -1,16 +1,23 @@
+/** @file
+ * @brief Routing over the contraction hierarchy stored in binfile maps
+ *
+ * maptool can store a contraction hierarchy as type_ch_node items, each carrying its edges as
+ * attr_ch_edge data. An edge either stands for a street item (its middle is the id of the street)
+ * or is a shortcut over another node (its middle is the id of that node). routech_find_route() runs
+ * a bidirectional Dijkstra with stall-on-demand over these nodes and unpacks the shortcuts of the
+ * best path into the list of street items it consists of.
+ */
+
 #include <glib.h>
 #include <stdio.h>
+#include <limits.h>
 #include "item.h"
 #include "coord.h"
-#include "navit.h"
 #include "transform.h"
-#include "profile.h"
 #include "mapset.h"
 #include "map.h"
-
-FILE *routefile;
-
-void routech_test(struct navit *navit);
+#include "debug.h"
+#include "routech.h"
 
 struct ch_edge {
 	int flags;
@@ -67,6 +74,14 @@ pq_new(void)
 	return ret;
 }
 
+static void
+pq_destroy(struct pq *pq)
+{
+	g_free(pq->elements);
+	g_free(pq->heap_elements);
+	g_free(pq);
+}
+
 static int
 pq_insert(struct pq *pq, int key, struct item_id *node_id)
 {
@@ -191,23 +206,6 @@ pq_is_empty(struct pq *pq)
 	return pq->size <= 1;
 }
 
-static void
-pq_check(struct pq *pq)
-{
-	int i;
-	for (i = 2 ; i < pq->size ; i++) {
-		if (pq->heap_elements[i/2].key > pq->heap_elements[i].key) {
-			printf("%d vs %d\n", pq->heap_elements[i/2].key, pq->heap_elements[i].key);
-			return;
-		}
-	}
-	for (i = 1 ; i < pq->size ; i++) {
-		if (i != pq->elements[pq->heap_elements[i].element].heap_element) {
-			printf("Error: heap_element %d points to element %d, but that points to %d\n",i,pq->heap_elements[i].element,pq->elements[pq->heap_elements[i].element].heap_element);
-		}
-	}
-}
-
 static struct routech_search *
 routech_search_new(int dir)
 {
@@ -220,16 +218,26 @@ routech_search_new(int dir)
 	return ret;
 }
 
+static void
+routech_search_destroy(struct routech_search *search)
+{
+	pq_destroy(search->pq);
+	g_hash_table_destroy(search->hash);
+	g_free(search);
+}
+
 static int
 routech_insert_node(struct routech_search *search, struct item_id **id, int val)
 {
 	struct item_id *ret;
+	gpointer value;
 	int e;
-	if (g_hash_table_lookup_extended(search->hash, *id, (gpointer)&ret, (gpointer)&e)) {
+	if (g_hash_table_lookup_extended(search->hash, *id, (gpointer)&ret, &value)) {
 		int oldval;
+		e=GPOINTER_TO_INT(value);
 		pq_get_key(search->pq, e, &oldval);
 		// printf("Node = %d\n",node);
-		if (oldval > val) {
+		if (oldval > val && !pq_is_deleted(search->pq, e)) {
 			pq_decrease_key(search->pq, e, val);
 			*id=ret;
 			return e;
@@ -264,7 +272,7 @@ routech_find_nearest(struct mapset *ms, struct coord *c, struct item_id *id, str
 	sel.u.c_rect.lu.y=c->y+dst;
 	sel.u.c_rect.rl.x=c->x+dst;
 	sel.u.c_rect.rl.y=c->y-dst;
-	printf("0x%x,0x%x-0x%x,0x%x\n",sel.u.c_rect.lu.x,sel.u.c_rect.lu.y,sel.u.c_rect.rl.x,sel.u.c_rect.rl.y);
+	dbg(lvl_debug,"0x%x,0x%x-0x%x,0x%x\n",sel.u.c_rect.lu.x,sel.u.c_rect.lu.y,sel.u.c_rect.rl.x,sel.u.c_rect.rl.y);
 	msh=mapset_open(ms);
 	while ((map=mapset_next(msh, 1))) {
 		mr=map_rect_new(map, &sel);
@@ -286,7 +294,6 @@ routech_find_nearest(struct mapset *ms, struct coord *c, struct item_id *id, str
 		map_rect_destroy(mr);
 	}
 	mapset_close(msh);
-	dbg_assert(ret==1);
 	return ret;
 }
 
@@ -319,7 +326,7 @@ routech_stall(struct map_rect *mr, struct routech_search *curr, struct item_id *
 		se=list->data;
 		key=se->key;
 		item=map_rect_get_item_byid(mr, se->id.id_hi, se->id.id_lo);
-		while (item_attr_get(item, attr_ch_edge, &edge_attr)) {
+		while (item && item_attr_get(item, attr_ch_edge, &edge_attr)) {
 			struct ch_edge *edge=edge_attr.u.data;
 			if (routech_edge_valid(edge, curr->dir)) {
 				int index=GPOINTER_TO_INT(g_hash_table_lookup(curr->hash, &edge->target));
@@ -339,6 +346,7 @@ routech_stall(struct map_rect *mr, struct routech_search *curr, struct item_id *
 				}
 			}
 		}
+		se=list->data;
 		list=g_list_remove(list, se);
 		g_free(se);
 	}
@@ -356,21 +364,20 @@ routech_relax(struct map_rect **mr, struct routech_search *curr, struct routech_
 	if (!pq_delete_min(curr->pq, &id, &val, &element)) {
 		return;
 	}
-	pq_check(curr->pq);
 	opposite_element=GPOINTER_TO_INT(g_hash_table_lookup(opposite->hash, id));
 	if (opposite_element && pq_is_deleted(opposite->pq, opposite_element)) {
 		int opposite_val;
 		pq_get_key(opposite->pq, opposite_element, &opposite_val);
 		if (val+opposite_val < curr->upper) {
 			curr->upper=opposite->upper=val+opposite_val;
-			printf("%d path found: 0x%x,0x%x ub = %d\n",curr->dir,id->id_hi,id->id_lo,curr->upper);
+			dbg(lvl_debug,"%d path found: 0x%x,0x%x ub = %d\n",curr->dir,id->id_hi,id->id_lo,curr->upper);
 			curr->via=opposite->via=id;
 		}
 	}
 	if (pq_get_stalled(curr->pq, element)) 
 		return;
 	item=map_rect_get_item_byid(mr[0], id->id_hi, id->id_lo);
-	while (item_attr_get(item, attr_ch_edge, &edge_attr)) {
+	while (item && item_attr_get(item, attr_ch_edge, &edge_attr)) {
 		struct ch_edge *edge=edge_attr.u.data;
 		struct item_id *target_id=&edge->target;
 		int element;
@@ -397,58 +404,15 @@ routech_relax(struct map_rect **mr, struct routech_search *curr, struct routech_
 	}
 }
 
-static void
-routech_print_coord(struct coord *c, FILE *out)
-{
-	int x=c->x;
-	int y=c->y;
-	char *sx="";
-	char *sy="";
-	if (x < 0) {
-		sx="-";
-		x=-x;
-	}
-	if (y < 0) {
-		sy="-";
-		y=-y;
-	}
-	fprintf(out,"%s0x%x %s0x%x\n",sx,x,sy,y);
-}
-
-static void
-routech_resolve_route(struct map_rect *mr, struct item_id *id, int flags, int dir)
-{
-	int i,count,max=16384;
-	struct coord *ca=g_alloca(sizeof(struct coord)*(max));
-	struct item *item;
-	int rev=0;
-	if (!(flags & 8) == dir)
-		rev=1;
-	item=map_rect_get_item_byid(mr, id->id_hi, id->id_lo);
-	dbg_assert(item->type >= type_line && item->type < type_area);
-	item->type=type_street_route;
-	
-        count=item_coord_get(item, ca, max);
-        item_dump_attr(item, item->map, routefile);
-	fprintf(routefile,"debug=\"flags=%d dir=%d rev=%d\"",flags,dir,rev);
-        fprintf(routefile,"\n");
-	if (rev) {
-		for (i = count-1 ; i >= 0 ; i--)
-			routech_print_coord(&ca[i], routefile);
-	} else {
-		for (i = 0 ; i < count ; i++)
-			routech_print_coord(&ca[i], routefile);
-	}
-}
-
 static int
 routech_find_edge(struct map_rect *mr, struct item_id *from, struct item_id *to, struct item_id *middle)
 {
 	struct item *item=map_rect_get_item_byid(mr, from->id_hi, from->id_lo);
 	struct attr edge_attr;
-	dbg_assert(item->type == type_ch_node);
-	dbg(lvl_debug,"type %s\n",item_to_name(item->type));
-	dbg(lvl_debug,"segment item=%p\n",item);
+	if (!item || item->type != type_ch_node) {
+		dbg(lvl_error,"node 0x%x,0x%x not found\n", from->id_hi, from->id_lo);
+		return 0;
+	}
 	while (item_attr_get(item, attr_ch_edge, &edge_attr)) {
 		struct ch_edge *edge=edge_attr.u.data;
 		dbg(lvl_debug,"flags=%d\n",edge->flags);
@@ -461,8 +425,20 @@ routech_find_edge(struct map_rect *mr, struct item_id *from, struct item_id *to,
 	return 0;
 }
 
-static void
-routech_resolve(struct map_rect *mr, struct item_id *from, struct item_id *to, int dir)
+/**
+ * @brief Unpacks the edge between two nodes into the street items it consists of
+ *
+ * Shortcuts are resolved recursively over their middle node.
+ *
+ * @param mr Map rect of the map holding the ch_nodes
+ * @param from First node
+ * @param to Second node
+ * @param dir The search which reached the nodes, 1 if the edge is stored at to
+ * @param items List the ids of the street items are appended to
+ * @return 1 on success, 0 if an edge could not be found
+ */
+static int
+routech_resolve(struct map_rect *mr, struct item_id *from, struct item_id *to, int dir, GList **items)
 {
 	struct item_id middle_node;
 	int res;
@@ -471,18 +447,20 @@ routech_resolve(struct map_rect *mr, struct item_id *from, struct item_id *to, i
 	else
 		res=routech_find_edge(mr, from, to, &middle_node);
 	dbg(lvl_debug,"res=%d\n",res);
-	if (res & 4) {
-		routech_resolve(mr, from, &middle_node, 1);
-		routech_resolve(mr, &middle_node, to, 0);
-	} else 
-		routech_resolve_route(mr, &middle_node, res, dir);
+	if (!res)
+		return 0;
+	if (res & 4) 
+		return routech_resolve(mr, from, &middle_node, 1, items) && routech_resolve(mr, &middle_node, to, 0, items);
+	*items=g_list_prepend(*items, g_memdup(&middle_node, sizeof(middle_node)));
+	return 1;
 }
 
-static void
-routech_find_path(struct map_rect *mr, struct routech_search *search)
+static int
+routech_unpack_path(struct map_rect *mr, struct routech_search *search, GList **items)
 {
 	struct item_id *curr_node=search->via;
 	GList *i,*n,*list=NULL;
+	int ret=1;
 	dbg(lvl_debug,"node %p\n",curr_node);
 	for (;;) {
 		int element=GPOINTER_TO_INT(g_hash_table_lookup(search->hash, curr_node));
@@ -498,47 +476,74 @@ routech_find_path(struct map_rect *mr, struct routech_search *search)
 		curr_node=next_node;
 	}
 	i=list;
-	while (i && (n=g_list_next(i))) {
-		routech_resolve(mr, i->data, n->data, search->dir);
+	while (ret && i && (n=g_list_next(i))) {
+		ret=routech_resolve(mr, i->data, n->data, search->dir, items);
 		i=n;
 	}
+	g_list_free(list);
+	return ret;
 }
 
-void
-routech_test(struct navit *navit)
+static int
+routech_search_add_endpoints(struct mapset *ms, struct routech_search *search, struct routech_endpoint *endpoints, int count, struct map **map)
+{
+	struct item_id id,*id_ptr;
+	struct map *m;
+	int i,element,ret=0;
+
+	for (i = 0 ; i < count ; i++) {
+		if (!routech_find_nearest(ms, &endpoints[i].c, &id, &m))
+			continue;
+		if (*map && m != *map)
+			continue;
+		*map=m;
+		id_ptr=&id;
+		element=routech_insert_node(search, &id_ptr, endpoints[i].value);
+		if (element) 
+			pq_set_parent(search->pq, element, NULL, 0);
+		ret=1;
+	}
+	return ret;
+}
+
+/**
+ * @brief Finds a route using the contraction hierarchy of a map
+ *
+ * All endpoints are looked up as ch_nodes, so they should be the ends of the streets the position
+ * and destination are on. The value of an endpoint is taken as initial cost of the search.
+ *
+ * @param ms The mapset to search the contraction hierarchy in
+ * @param src The endpoints at the start of the route
+ * @param src_count Number of start endpoints
+ * @param dst The endpoints at the end of the route
+ * @param dst_count Number of end endpoints
+ * @param items Will be set to a list of the struct item_id of all streets the route uses. The caller has to
+ * free the list and its elements.
+ * @return The map the streets belong to, or NULL if no route was found (e.g. because no map has a contraction
+ * hierarchy)
+ */
+struct map *
+routech_find_route(struct mapset *ms, struct routech_endpoint *src, int src_count, struct routech_endpoint *dst, int dst_count, GList **items)
 {
-	struct attr mapset;
-	struct coord src={0x3fd661,0x727146};
-	struct coord dst={0xfff07fc2,0x4754c9};
-	struct item_id id[2],*id_ptr;
 	struct routech_search *search[2],*curr,*opposite;
-	struct map *map[2];
+	struct map *map=NULL;
 	struct map_rect *mr[2];
-	int element;
-	int k;
 	int search_id=0;
-	int i;
+	int found=0;
 
-	navit_get_attr(navit, attr_mapset, &mapset, NULL);
-	routech_find_nearest(mapset.u.mapset, &src, &id[0], &map[0]);
-	routech_find_nearest(mapset.u.mapset, &dst, &id[1], &map[1]);
-	for (k = 0 ; k < 2 ; k++) {
-	profile(0,"start\n");
+	*items=NULL;
 	search[0]=routech_search_new(0);
 	search[1]=routech_search_new(1);
-	printf("Start 0x%x,0x%x\n",id[0].id_hi,id[0].id_lo);
-	printf("End 0x%x,0x%x\n",id[1].id_hi,id[1].id_lo);
-	id_ptr=&id[0];
-	element=routech_insert_node(search[0], &id_ptr, 0);
-	pq_set_parent(search[0]->pq, element, NULL, 0);
-
-	id_ptr=&id[1];
-	element=routech_insert_node(search[1], &id_ptr, 0);
-	pq_set_parent(search[1]->pq, element, NULL, 0);
-
-	mr[0]=map_rect_new(map[0], NULL);
-	mr[1]=map_rect_new(map[0], NULL);
-	for (i=0 ; i < 5000 ; i++) {
+	if (!routech_search_add_endpoints(ms, search[0], src, src_count, &map) ||
+		!routech_search_add_endpoints(ms, search[1], dst, dst_count, &map)) {
+		dbg(lvl_debug,"no ch_node found\n");
+		routech_search_destroy(search[0]);
+		routech_search_destroy(search[1]);
+		return NULL;
+	}
+	mr[0]=map_rect_new(map, NULL);
+	mr[1]=map_rect_new(map, NULL);
+	for (;;) {
 		if (pq_is_empty(search[0]->pq) && pq_is_empty(search[1]->pq)) 
 			break;
 		if (!pq_is_empty(search[1-search_id]->pq)) {
@@ -555,8 +560,8 @@ routech_test(struct navit *navit)
 			break;
 		}
 		routech_relax(mr, curr, opposite);
-		if (pq_min(curr->pq) > curr->upper) {
-			dbg(lvl_debug,"min %d upper %d\n",pq_min(curr->pq), curr->upper);
+		if (pq_is_empty(curr->pq) || pq_min(curr->pq) > curr->upper) {
+			dbg(lvl_debug,"upper %d\n",curr->upper);
 			curr->finished=1;
 		}
 		if (curr->finished && opposite->finished) {
@@ -564,15 +569,20 @@ routech_test(struct navit *navit)
 			break;
 		}
 	}
-	
-	printf("finished %d\n",search[0]->upper);
-	profile(0,"finished\n");
+	dbg(lvl_debug,"heap size %d vs %d, element size %d vs %d\n",search[0]->pq->size,search[1]->pq->size,search[0]->pq->elements_size,search[1]->pq->elements_size);
+	if (search[0]->via) {
+		found=routech_unpack_path(mr[0], search[0], items) && routech_unpack_path(mr[0], search[1], items);
+		dbg(lvl_info,"route costs %u, %d streets\n",search[0]->upper,g_list_length(*items));
 	}
-	routefile=fopen("route.txt","w");
-	routech_find_path(mr[0], search[0]);
-	routech_find_path(mr[0], search[1]);
-	fclose(routefile);
-        printf("Heap size %d vs %d\n",search[0]->pq->size,search[1]->pq->size);
-        printf("Element size %d vs %d\n",search[0]->pq->elements_size,search[1]->pq->elements_size);
-
+	map_rect_destroy(mr[0]);
+	map_rect_destroy(mr[1]);
+	routech_search_destroy(search[0]);
+	routech_search_destroy(search[1]);
+	if (!found) {
+		g_list_foreach(*items, (GFunc)g_free, NULL);
+		g_list_free(*items);
+		*items=NULL;
+		return NULL;
+	}
+	return map;
 }
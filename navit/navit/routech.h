@@ -0,0 +1,44 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2011 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_ROUTECH_H
+#define NAVIT_ROUTECH_H
+#include <glib.h>
+#include "coord.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief A start or end point of a contraction hierarchy query
+ */
+struct routech_endpoint {
+	struct coord c;		/**< Coordinates, the ch_node nearest to them is used */
+	int value;		/**< Costs between this point and the actual position or destination */
+};
+
+/* prototypes */
+struct map;
+struct mapset;
+struct map *routech_find_route(struct mapset *ms, struct routech_endpoint *src, int src_count, struct routech_endpoint *dst, int dst_count, GList **items);
+/* end of prototypes */
+#ifdef __cplusplus
+}
+#endif
+#endif
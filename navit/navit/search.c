@@ -53,6 +53,10 @@ struct search_list_level {
 	struct attr *attr;
 	int partial;
 	int selected;
+	int complete;
+	int refine;
+	int district_names;
+	char *folded;
 	struct mapset_search *search;
 	GHashTable *hash;
 	GList *list,*curr,*last;
@@ -70,6 +74,8 @@ struct search_list {
 	struct house_number_interpolation inter;
 	int use_address_results;
 	GList *address_results,*address_results_pos;
+	char *scratch;
+	int scratch_size;
 };
 
 static guint
@@ -336,6 +342,44 @@ search_address_results_free(struct search_list *this_)
 	this_->address_results=this_->address_results_pos=NULL;
 }
 
+/**
+ * @brief Mark the cached results of a level and all levels below it as stale.
+ *
+ * Results of a level can only be refined while the levels above it are unchanged.
+ *
+ * @param this_ search_list
+ * @param level first level to invalidate
+ */
+static void
+search_list_invalidate(struct search_list *this_, int level)
+{
+	for ( ; level < 4 ; level++)
+		this_->levels[level].complete=0;
+}
+
+/**
+ * @brief Check whether a search can be answered by filtering the results of the previous search of that level.
+ *
+ * This is the case when the previous partial search of the same town attribute ran to completion and the new
+ * casefolded search string extends its casefolded search string, as the new results are then a subset of the
+ * cached ones. Districts found by their own district name are matched through a separate index whose outcome
+ * depends on the map layout, so results holding them are always searched again.
+ *
+ * @param le search_list_level of the new search
+ * @param search_attr attribute of the new search
+ * @param folded casefolded search string of the new search
+ * @returns 1 if the cached results can be refined, 0 otherwise
+ */
+static int
+search_list_can_refine(struct search_list_level *le, struct attr *search_attr, char *folded)
+{
+	if (!le->complete || !le->partial || !le->folded || le->attr->type != search_attr->type)
+		return 0;
+	if (search_attr->type != attr_town_name && search_attr->type != attr_town_or_district_name)
+		return 0;
+	return !strncmp(folded, le->folded, strlen(le->folded));
+}
+
 /**
  * @brief Start a search.
  *
@@ -348,6 +392,7 @@ search_list_search(struct search_list *this_, struct attr *search_attr, int part
 {
 	struct search_list_level *le;
 	int level;
+	char *folded;
 	dbg(lvl_info,"Starting search for '=%s' of type %s\n", search_attr->u.str, attr_to_name(search_attr->type));
 	search_address_results_free(this_);
 	if (search_attr->type == attr_address) {
@@ -363,8 +408,23 @@ search_list_search(struct search_list *this_, struct attr *search_attr, int part
 		this_->result.id=0;
 		this_->level=level;
 		le=&this_->levels[level];
+		search_list_invalidate(this_, level+1);
+		folded=ATTR_IS_STRING(search_attr->type) ? linguistics_casefold(search_attr->u.str) : NULL;
+		if (folded && search_list_can_refine(le, search_attr, folded)) {
+			dbg(lvl_debug,"refining results of '%s'\n", le->attr->u.str);
+			attr_free(le->attr);
+			g_free(le->folded);
+			le->attr=attr_dup(search_attr);
+			le->folded=folded;
+			le->partial=partial;
+			le->refine=1;
+			le->curr=le->list;
+			le->last=NULL;
+			return;
+		}
 		search_list_search_free(this_, level);
 		le->attr=attr_dup(search_attr);
+		le->folded=folded;
 		le->partial=partial;
 		if (level > 0) {
 			le=&this_->levels[level-1];
@@ -373,6 +433,7 @@ search_list_search(struct search_list *this_, struct attr *search_attr, int part
 	} else if (search_attr->type == attr_postal) {
 		g_free(this_->postal);
 		this_->postal=g_strdup(search_attr->u.str);
+		search_list_invalidate(this_, 0);
 	}
 }
 
@@ -389,6 +450,7 @@ search_list_select(struct search_list *this_, enum attr_type attr_type, int id,
         if (level < 0)
 		return NULL;
 	le=&this_->levels[level];
+	search_list_invalidate(this_, level+1);
 	curr=le->list;
 	if (mode > 0 || !id)
 		le->selected=mode;
@@ -749,10 +811,16 @@ search_list_search_free(struct search_list *sl, int level)
 		curr=next;
 	}
 	attr_free(le->attr);
+	le->attr=NULL;
+	g_free(le->folded);
+	le->folded=NULL;
 	g_list_free(le->list);
 	le->list=NULL;
 	le->curr=NULL;
 	le->last=NULL;
+	le->complete=0;
+	le->refine=0;
+	le->district_names=0;
 }
 
 char *
@@ -792,6 +860,71 @@ search_postal_merge_replace(char *mask, char *new)
 }
 
 
+/**
+ * @brief Check whether a cached town matches the search string of its level.
+ *
+ * This mirrors the comparison the map search did when the town was found: maptool indexes every word of the town
+ * name together with the rest of the name and its spellings without special characters, skipping words like "str"
+ * that should not be searched for.
+ *
+ * @param this_ search_list, provides the scratch buffer for the comparison
+ * @param town town to check
+ * @param folded casefolded search string
+ * @param mode linguistics_cmp_mode flags
+ * @returns 1 if the town matches, 0 otherwise
+ */
+static int
+search_list_town_matches(struct search_list *this_, struct search_list_town *town, char *folded,
+		enum linguistics_cmp_mode mode)
+{
+	char *word=town->common.town_name;
+	while (word) {
+		if (linguistics_search(word)
+				&& !linguistics_compare_buf(word, folded, mode|linguistics_cmp_expand, &this_->scratch, &this_->scratch_size))
+			return 1;
+		word=linguistics_next_word(word);
+	}
+	return 0;
+}
+
+/**
+ * @brief Get the next result of a refined search.
+ *
+ * Walks the cached results of the level, drops the ones no longer matching and returns the others.
+ *
+ * @param this_ search_list
+ * @param le search_list_level being refined
+ * @returns next result or NULL when the cached results are exhausted
+ */
+static struct search_list_result *
+search_list_refine_get_result(struct search_list *this_, struct search_list_level *le)
+{
+	enum linguistics_cmp_mode mode=(le->partial?linguistics_cmp_partial:0);
+	GList *curr;
+	struct search_list_town *town;
+
+	while (le->curr) {
+		curr=le->curr;
+		town=curr->data;
+		le->curr=g_list_next(curr);
+		if (!search_list_town_matches(this_, town, le->folded, mode)) {
+			le->list=g_list_delete_link(le->list, curr);
+			search_list_town_destroy(town);
+			continue;
+		}
+		town->common.selected=0;
+		this_->result.country=town->common.parent;
+		this_->result.town=town;
+		this_->result.street=NULL;
+		this_->result.house_number=NULL;
+		this_->result.c=town->common.c;
+		this_->result.id++;
+		return &this_->result;
+	}
+	le->refine=0;
+	return NULL;
+}
+
 static int
 postal_match(char *postal, char *mask)
 {
@@ -863,6 +996,8 @@ search_list_get_result(struct search_list *this_)
 
 	//dbg(lvl_debug,"enter\n");
 	le=&this_->levels[level];
+	if (le->refine)
+		return search_list_refine_get_result(this_, le);
 	//dbg(lvl_debug,"le=%p\n", le);
 	for (;;)
 	{
@@ -883,6 +1018,7 @@ search_list_get_result(struct search_list *this_)
 					struct search_list_common *slc;
 					if (! leu->curr)
 					{
+						le->complete=!le->district_names;
 						return NULL;
 					}
 					le->parent=leu->curr->data;
@@ -947,6 +1083,8 @@ search_list_get_result(struct search_list *this_)
 				p=search_list_town_new(this_->item);
 				this_->result.town=p;
 				this_->result.town->common.parent=this_->levels[0].last->data;
+				if (item_is_district(*this_->item) && this_->result.town->common.district_name)
+					le->district_names=1;
 				this_->result.country=this_->result.town->common.parent;
 				this_->result.c=this_->result.town->common.c;
 				this_->result.street=NULL;
@@ -1041,6 +1179,7 @@ void
 search_list_destroy(struct search_list *this_)
 {
 	g_free(this_->postal);
+	g_free(this_->scratch);
 	g_free(this_);
 }
 
@@ -20,6 +20,8 @@
 #  define g_private_new(xd) g_private_new_navit()
 #  define g_private_get(xd) pthread_getspecific(xd)
 #  define g_private_set(a,b) pthread_setspecific(a, b)
+pthread_mutex_t *g_mutex_new_navit(void);
+pthread_key_t g_private_new_navit(void);
 #else
 # if HAVE_API_WIN32_BASE
 #  define GMutex CRITICAL_SECTION
@@ -31,6 +33,8 @@
 #  define g_private_new(xd) g_private_new_navit()
 #  define g_private_get(xd) TlsGetValue(xd)
 #  define g_private_set(a,b) TlsSetValue(a, b)
+CRITICAL_SECTION *g_mutex_new_navit(void);
+int g_private_new_navit(void);
 # endif
 #endif
 
@@ -0,0 +1,277 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Behaviour tests of the sharded ARC cache in cache.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "config.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "cache.h"
+
+#ifndef HAVE_GLIB
+void _g_slice_thread_init_nomessage(void);
+#endif
+
+#define cache_test_assert(expr) do { if (!(expr)) { fprintf(stderr,"%s:%d: %s failed\n", __FILE__, __LINE__, #expr); return 1; } } while (0)
+
+/** Size of the data of an entry with the given id */
+#define cache_test_size(id) (64+(id)%64)
+
+/**
+ * @brief Creates an entry whose data is filled with a pattern of its id and releases it
+ */
+static void
+cache_test_insert(struct cache *cache, int id)
+{
+	unsigned char *data=cache_entry_new(cache, &id, cache_test_size(id));
+	memset(data, id & 0xff, cache_test_size(id));
+	cache_insert(cache, data);
+	cache_entry_destroy(cache, data);
+}
+
+/**
+ * @brief Checks that data holds the pattern of its id
+ */
+static int
+cache_test_check(unsigned char *data, int id)
+{
+	int i;
+	for (i = 0 ; i < cache_test_size(id) ; i++) {
+		if (data[i] != (id & 0xff))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Looks up an entry and releases it again
+ *
+ * @return 1 if the entry was found with the right data, 0 if it was not found, -1 if its data was wrong
+ */
+static int
+cache_test_lookup(struct cache *cache, int id)
+{
+	unsigned char *data=cache_lookup(cache, &id);
+	int ret;
+	if (!data)
+		return 0;
+	ret=cache_test_check(data, id) ? 1 : -1;
+	cache_entry_destroy(cache, data);
+	return ret;
+}
+
+/* A lookup finds what was inserted and is counted as hit or miss */
+static int
+cache_test_hit(void)
+{
+	struct cache *cache=cache_new(sizeof(int), 4*4096);
+	struct cache_stats stats;
+	int id=1;
+
+	cache_test_assert(cache_test_lookup(cache, id) == 0);
+	cache_test_insert(cache, id);
+	cache_test_assert(cache_contains(cache, &id));
+	cache_test_assert(cache_test_lookup(cache, id) == 1);
+	cache_test_assert(cache_test_lookup(cache, id+1) == 0);
+	cache_get_stats(cache, &stats);
+	cache_test_assert(stats.hits == 1);
+	cache_test_assert(stats.misses == 2);
+	cache_test_assert(stats.resident > cache_test_size(id));
+	cache_flush(cache, &id);
+	cache_test_assert(!cache_contains(cache, &id));
+	return 0;
+}
+
+/* The cache stays within its size in bytes, dropping the least recently used entries */
+static int
+cache_test_budget(void)
+{
+	struct cache *cache=cache_new(sizeof(int), 4*4096);
+	struct cache_stats stats;
+	int i;
+
+	for (i = 0 ; i < 2000 ; i++) {
+		cache_test_insert(cache, i);
+		cache_get_stats(cache, &stats);
+		cache_test_assert(stats.resident <= 4*4096);
+	}
+	cache_test_assert(stats.evictions > 0);
+	cache_test_assert(cache_test_lookup(cache, 1999) == 1);
+	cache_test_assert(cache_test_lookup(cache, 0) == 0);
+	return 0;
+}
+
+/* Entries used more than once survive a scan of entries which are used only once */
+static int
+cache_test_scan(void)
+{
+	struct cache *cache=cache_new(sizeof(int), 4*8192);
+	int i;
+
+	for (i = 0 ; i < 16 ; i++) {
+		cache_test_insert(cache, i);
+		cache_test_assert(cache_test_lookup(cache, i) == 1);
+	}
+	for (i = 1000 ; i < 5000 ; i++)
+		cache_test_insert(cache, i);
+	for (i = 0 ; i < 16 ; i++)
+		cache_test_assert(cache_test_lookup(cache, i) == 1);
+	return 0;
+}
+
+/* Entries which are in use are neither evicted nor freed */
+static int
+cache_test_in_use(void)
+{
+	struct cache *cache=cache_new(sizeof(int), 4*4096);
+	unsigned char *data,*other;
+	int i,id=7;
+
+	data=cache_entry_new(cache, &id, cache_test_size(id));
+	memset(data, id & 0xff, cache_test_size(id));
+	cache_insert(cache, data);
+	for (i = 1000 ; i < 5000 ; i++)
+		cache_test_insert(cache, i);
+	cache_test_assert(cache_test_check(data, id));
+	cache_test_assert(cache_contains(cache, &id));
+	cache_entry_destroy(cache, data);
+	for (i = 5000 ; i < 9000 ; i++)
+		cache_test_insert(cache, i);
+	cache_test_assert(!cache_contains(cache, &id));
+
+	/* Of two entries inserted with the same id, the second one stays outside the cache and is freed on its last release */
+	id=8;
+	data=cache_entry_new(cache, &id, cache_test_size(id));
+	memset(data, id & 0xff, cache_test_size(id));
+	other=cache_entry_new(cache, &id, cache_test_size(id));
+	memset(other, id & 0xff, cache_test_size(id));
+	cache_insert(cache, data);
+	cache_insert(cache, other);
+	cache_entry_destroy(cache, other);
+	cache_entry_destroy(cache, data);
+	other=cache_lookup(cache, &id);
+	cache_test_assert(other == data);
+	cache_entry_destroy(cache, other);
+	return 0;
+}
+
+/* An entry of a quarter of the cache size fits next to the others, as with the default file cache and a large tile */
+static int
+cache_test_large(void)
+{
+	struct cache *cache=cache_new(sizeof(int), 1048576);
+	unsigned char *data;
+	int i,id=100;
+
+	for (i = 0 ; i < 64 ; i++) {
+		cache_test_insert(cache, i);
+		cache_test_assert(cache_test_lookup(cache, i) == 1);
+	}
+	data=cache_entry_new(cache, &id, 300000);
+	memset(data, id & 0xff, 300000);
+	cache_insert(cache, data);
+	cache_entry_destroy(cache, data);
+	cache_test_assert(cache_contains(cache, &id));
+	for (i = 0 ; i < 64 ; i++)
+		cache_test_assert(cache_contains(cache, &i));
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+#define CACHE_TEST_THREADS 4
+#define CACHE_TEST_OPS 20000
+
+struct cache_test_thread {
+	struct cache *cache;
+	int ids;
+	int seed;
+	int errors;
+};
+
+static void *
+cache_test_worker(void *data)
+{
+	struct cache_test_thread *t=data;
+	unsigned int seed=t->seed;
+	int i,id,ret;
+
+	for (i = 0 ; i < CACHE_TEST_OPS ; i++) {
+		seed=seed*1103515245+12345;
+		id=(seed >> 16)%t->ids;
+		ret=cache_test_lookup(t->cache, id);
+		if (ret < 0)
+			t->errors++;
+		if (!ret)
+			cache_test_insert(t->cache, id);
+	}
+	return NULL;
+}
+
+/* Threads racing on the same ids always see complete data, and every lookup is counted. The ids are chosen to overflow the size. */
+static int
+cache_test_threads(int size, int ids)
+{
+	struct cache *cache=cache_new(sizeof(int), size);
+	struct cache_test_thread t[CACHE_TEST_THREADS];
+	pthread_t thread[CACHE_TEST_THREADS];
+	struct cache_stats stats;
+	int i;
+
+	for (i = 0 ; i < CACHE_TEST_THREADS ; i++) {
+		t[i].cache=cache;
+		t[i].ids=ids;
+		t[i].seed=i;
+		t[i].errors=0;
+		cache_test_assert(!pthread_create(&thread[i], NULL, cache_test_worker, &t[i]));
+	}
+	for (i = 0 ; i < CACHE_TEST_THREADS ; i++) {
+		pthread_join(thread[i], NULL);
+		cache_test_assert(!t[i].errors);
+	}
+	cache_get_stats(cache, &stats);
+	cache_test_assert(stats.hits+stats.misses == CACHE_TEST_THREADS*CACHE_TEST_OPS);
+	cache_test_assert(stats.hits > 0);
+	cache_test_assert(stats.evictions > 0);
+	cache_test_assert(stats.resident <= size);
+	return 0;
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+#ifndef HAVE_GLIB
+	_g_slice_thread_init_nomessage();
+#endif
+	if (cache_test_hit() || cache_test_budget() || cache_test_scan() || cache_test_in_use() || cache_test_large())
+		return 1;
+#ifdef HAVE_PTHREAD
+	/* A small cache in a single part, and a large one split into several */
+	if (cache_test_threads(4*4096, 300) || cache_test_threads(4*1048576, 60000))
+		return 1;
+#endif
+	return 0;
+}
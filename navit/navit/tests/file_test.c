@@ -0,0 +1,204 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Behaviour tests of reading compressed data through the file cache and prefetching it
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <zlib.h>
+#include "config.h"
+#include "cache.h"
+#include "file.h"
+#include "atom.h"
+
+#ifndef HAVE_GLIB
+void _g_slice_thread_init_nomessage(void);
+#endif
+
+#define file_test_assert(expr) do { if (!(expr)) { fprintf(stderr,"%s:%d: %s failed\n", __FILE__, __LINE__, #expr); return 1; } } while (0)
+
+/** Number of compressed blocks in the test file */
+#define FILE_TEST_BLOCKS 16
+/** Size of a block after inflating it */
+#define FILE_TEST_SIZE 8192
+
+/** Compressed blocks of the test file, the way binfile stores the members of a zip file */
+static struct file_test_block {
+	long long offset;
+	int size;
+} file_test_blocks[FILE_TEST_BLOCKS];
+
+/**
+ * @brief Fills the inflated data of a block with a pattern of its own
+ */
+static void
+file_test_pattern(unsigned char *data, int block)
+{
+	int i;
+	for (i = 0 ; i < FILE_TEST_SIZE ; i++)
+		data[i]=(block*7+i/(block+1)) & 0xff;
+}
+
+/**
+ * @brief Writes FILE_TEST_BLOCKS raw deflate streams to a file
+ */
+static int
+file_test_write(char *name)
+{
+	unsigned char data[FILE_TEST_SIZE],buffer[FILE_TEST_SIZE*2];
+	FILE *f=fopen(name, "wb");
+	z_stream stream;
+	long long offset=0;
+	int i;
+
+	if (!f)
+		return 0;
+	for (i = 0 ; i < FILE_TEST_BLOCKS ; i++) {
+		file_test_pattern(data, i);
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			break;
+		stream.next_in=data;
+		stream.avail_in=FILE_TEST_SIZE;
+		stream.next_out=buffer;
+		stream.avail_out=sizeof(buffer);
+		if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+			deflateEnd(&stream);
+			break;
+		}
+		file_test_blocks[i].offset=offset;
+		file_test_blocks[i].size=stream.total_out;
+		deflateEnd(&stream);
+		if (fwrite(buffer, file_test_blocks[i].size, 1, f) != 1)
+			break;
+		offset+=file_test_blocks[i].size;
+	}
+	fclose(f);
+	return i == FILE_TEST_BLOCKS;
+}
+
+/**
+ * @brief Reads a block, checks its data and releases it again
+ *
+ * @return 1 if the block has the right data, 0 otherwise
+ */
+static int
+file_test_read(struct file *file, int block)
+{
+	unsigned char expected[FILE_TEST_SIZE],*data;
+	int ret;
+
+	data=file_data_read_compressed(file, file_test_blocks[block].offset, file_test_blocks[block].size, FILE_TEST_SIZE);
+	if (!data)
+		return 0;
+	file_test_pattern(expected, block);
+	ret=!memcmp(data, expected, FILE_TEST_SIZE);
+	file_data_free(file, data);
+	return ret;
+}
+
+#ifdef HAVE_PTHREAD
+/* A block prefetched in the background is read from the cache */
+static int
+file_test_prefetch_hit(struct file *file)
+{
+	struct cache_stats before,after;
+	int i;
+
+	file_test_assert(file_get_cache_stats(&before));
+	file_data_prefetch_compressed(file, file_test_blocks[0].offset, file_test_blocks[0].size, FILE_TEST_SIZE);
+	for (i = 0 ; i < 5000 ; i++) {
+		file_test_assert(file_get_cache_stats(&after));
+		if (after.resident > before.resident)
+			break;
+		usleep(1000);
+	}
+	file_test_assert(after.resident > before.resident);
+	file_test_assert(!file_data_prefetch_busy(file, file_test_blocks[0].offset, file_test_blocks[0].size, 1000));
+	file_test_assert(file_get_cache_stats(&before));
+	file_test_assert(file_test_read(file, 0));
+	file_test_assert(file_get_cache_stats(&after));
+	file_test_assert(after.hits == before.hits+1);
+	file_test_assert(after.misses == before.misses);
+	return 0;
+}
+#endif
+
+/* Blocks read right after prefetching them have the right data, whether the prefetch is queued, running or done */
+static int
+file_test_prefetch_race(struct file *file)
+{
+	int i;
+
+	for (i = 0 ; i < FILE_TEST_BLOCKS ; i++)
+		file_data_prefetch_compressed(file, file_test_blocks[i].offset, file_test_blocks[i].size, FILE_TEST_SIZE);
+	for (i = FILE_TEST_BLOCKS-1 ; i >= 0 ; i--)
+		file_test_assert(file_test_read(file, i));
+	for (i = 0 ; i < FILE_TEST_BLOCKS ; i++)
+		file_test_assert(file_test_read(file, i));
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *name="file_test.bin";
+	struct file *file;
+	int i,ret=1;
+
+#ifndef HAVE_GLIB
+	_g_slice_thread_init_nomessage();
+#endif
+	atom_init();
+	file_init();
+	if (!file_test_write(name)) {
+		fprintf(stderr,"Failed to write %s\n", name);
+		return 1;
+	}
+	file=file_create(name, NULL);
+	if (!file) {
+		fprintf(stderr,"Failed to open %s\n", name);
+		return 1;
+	}
+#ifdef HAVE_PTHREAD
+	if (file_test_prefetch_hit(file))
+		goto out;
+#endif
+	if (file_test_prefetch_race(file))
+		goto out;
+	file_destroy(file);
+
+	/* Destroying a file waits for or drops its pending prefetches. Opened by another name, its blocks are not cached yet. */
+	file=file_create("./file_test.bin", NULL);
+	if (!file)
+		goto out;
+	for (i = 0 ; i < FILE_TEST_BLOCKS ; i++)
+		file_data_prefetch_compressed(file, file_test_blocks[i].offset, file_test_blocks[i].size, FILE_TEST_SIZE);
+	ret=0;
+out:
+	if (file)
+		file_destroy(file);
+	unlink(name);
+	return ret;
+}
@@ -0,0 +1,189 @@
+# Behaviour tests of maptool, run by ctest as
+#    cmake -D MAPTOOL=<maptool> -D WORK_DIR=<directory> -D MAPTOOL_TEST=<test> -P maptool_test.cmake
+# The tests convert a generated grid of streets:
+#    node_store            the mmap node store writes the same map as the default buffer store
+#    node_store_collision  node ids sharing a slot of the mmap node store are an error, the buffer store takes them
+#    spill_slices          maps written in several slices, with and without -L, equal the map written at once
+#    town_key_index        towns found with the town key index of -K are the towns found by scanning the index,
+#                          this needs -D TOWN_SEARCH=<town_search> -D BINFILE_PLUGIN=<binfile plugin>
+# town_key_index converts TOWNS towns, 3000 by default. With -D REPETITIONS=<n> it times the searches instead.
+
+set(GRID_SIZE 30)
+
+# Writes a GRID_SIZE x GRID_SIZE grid of nodes with a street along every row and column, leaving the osm element open
+function(maptool_test_osm_grid FILE)
+   set(OSM "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<osm version=\"0.6\">\n")
+   math(EXPR LAST "${GRID_SIZE}-1")
+   foreach(I RANGE ${LAST})
+      math(EXPR LAT "100+${I}")
+      foreach(J RANGE ${LAST})
+         math(EXPR ID "${I}*${GRID_SIZE}+${J}+1")
+         math(EXPR LON "100+${J}")
+         set(OSM "${OSM}<node id=\"${ID}\" lat=\"48.${LAT}\" lon=\"11.${LON}\"/>\n")
+      endforeach()
+   endforeach()
+   foreach(I RANGE ${LAST})
+      math(EXPR ROW "2*${I}+1")
+      math(EXPR COLUMN "2*${I}+2")
+      set(ROW_NODES "")
+      set(COLUMN_NODES "")
+      foreach(J RANGE ${LAST})
+         math(EXPR ROW_ID "${I}*${GRID_SIZE}+${J}+1")
+         math(EXPR COLUMN_ID "${J}*${GRID_SIZE}+${I}+1")
+         set(ROW_NODES "${ROW_NODES}<nd ref=\"${ROW_ID}\"/>\n")
+         set(COLUMN_NODES "${COLUMN_NODES}<nd ref=\"${COLUMN_ID}\"/>\n")
+      endforeach()
+      set(OSM "${OSM}<way id=\"${ROW}\">\n${ROW_NODES}<tag k=\"highway\" v=\"residential\"/>\n</way>\n")
+      set(OSM "${OSM}<way id=\"${COLUMN}\">\n${COLUMN_NODES}<tag k=\"highway\" v=\"tertiary\"/>\n</way>\n")
+   endforeach()
+   file(WRITE ${FILE} "${OSM}")
+endfunction()
+
+# Writes the grid followed by EXTRA
+function(maptool_test_osm FILE EXTRA)
+   maptool_test_osm_grid(${FILE})
+   file(APPEND ${FILE} "${EXTRA}</osm>\n")
+endfunction()
+
+set(TOWN_SYLLABLES Ber li ne mün chen Ham burg Ober dorf au Unter bach Öster sen stadt Aal)
+
+# Writes the grid followed by COUNT places in Germany, every tenth of them tagged as suburb and the others as village
+# Their names are made of three syllables, so from 4096 places on names repeat at other places.
+function(maptool_test_osm_towns FILE COUNT)
+   maptool_test_osm_grid(${FILE})
+   set(TOWNS "")
+   math(EXPR LAST "${COUNT}-1")
+   foreach(I RANGE ${LAST})
+      math(EXPR S1 "${I}%16")
+      math(EXPR S2 "${I}/16%16")
+      math(EXPR S3 "${I}/256%16")
+      list(GET TOWN_SYLLABLES ${S1} N1)
+      list(GET TOWN_SYLLABLES ${S2} N2)
+      list(GET TOWN_SYLLABLES ${S3} N3)
+      string(TOLOWER "${N2}${N3}" N23)
+      string(REPLACE "Ö" "ö" N23 "${N23}")
+      math(EXPR ID "1000000+${I}")
+      math(EXPR LAT "100000+${I}*37%100000")
+      math(EXPR LON "100000+${I}*61%100000")
+      set(PLACE village)
+      if(I MATCHES "9$")
+         set(PLACE suburb)
+      endif()
+      set(TOWNS "${TOWNS}<node id=\"${ID}\" lat=\"50.${LAT}\" lon=\"10.${LON}\">\n<tag k=\"place\" v=\"${PLACE}\"/>\n")
+      set(TOWNS "${TOWNS}<tag k=\"name\" v=\"${N1}${N23}\"/>\n<tag k=\"is_in\" v=\"Germany\"/>\n</node>\n")
+      if(I MATCHES "99$")
+         file(APPEND ${FILE} "${TOWNS}")
+         set(TOWNS "")
+      endif()
+   endforeach()
+   file(APPEND ${FILE} "${TOWNS}</osm>\n")
+endfunction()
+
+# Searches PREFIXES in the map converted as NAME with TOWN_SEARCH and stores the output in RESULT_VAR
+function(maptool_test_town_search NAME RESULT_VAR PREFIXES)
+   if(REPETITIONS)
+      set(OPTIONS -r ${REPETITIONS})
+   endif()
+   execute_process(COMMAND ${TOWN_SEARCH} ${OPTIONS} ${BINFILE_PLUGIN} ${WORK_DIR}/${NAME}/out.bin 276 ${PREFIXES}
+      RESULT_VARIABLE RESULT
+      OUTPUT_VARIABLE OUTPUT)
+   if(NOT RESULT EQUAL 0)
+      message(FATAL_ERROR "town_search in the map ${NAME} failed with ${RESULT}")
+   endif()
+   set(${RESULT_VAR} "${OUTPUT}" PARENT_SCOPE)
+endfunction()
+
+# Converts INPUT in a directory of its own named NAME, the exit code goes to RESULT_VAR
+function(maptool_test_run NAME INPUT RESULT_VAR)
+   file(REMOVE_RECURSE ${WORK_DIR}/${NAME})
+   file(MAKE_DIRECTORY ${WORK_DIR}/${NAME})
+   execute_process(COMMAND ${MAPTOOL} -t 2016-01-01T00:00:00 ${ARGN} -i ${INPUT} out.bin
+      WORKING_DIRECTORY ${WORK_DIR}/${NAME}
+      RESULT_VARIABLE RESULT
+      OUTPUT_FILE ${WORK_DIR}/${NAME}/maptool.log
+      ERROR_FILE ${WORK_DIR}/${NAME}/maptool.log)
+   set(${RESULT_VAR} ${RESULT} PARENT_SCOPE)
+endfunction()
+
+# Fails unless NAME converted successfully, and wrote the same map as REFERENCE if that is given
+function(maptool_test_expect_map NAME RESULT REFERENCE)
+   if(NOT RESULT EQUAL 0)
+      message(FATAL_ERROR "maptool ${NAME} failed with ${RESULT}, see ${WORK_DIR}/${NAME}/maptool.log")
+   endif()
+   if(REFERENCE)
+      execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/${REFERENCE}/out.bin ${WORK_DIR}/${NAME}/out.bin
+         RESULT_VARIABLE DIFFERENT)
+      if(DIFFERENT)
+         message(FATAL_ERROR "maptool ${NAME} wrote a different map than ${REFERENCE}")
+      endif()
+   endif()
+endfunction()
+
+if(NOT MAPTOOL OR NOT WORK_DIR)
+   message(FATAL_ERROR "MAPTOOL and WORK_DIR must be set")
+endif()
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+if(MAPTOOL_TEST STREQUAL "node_store")
+   maptool_test_osm(${WORK_DIR}/grid.osm "")
+   maptool_test_run(buffer ${WORK_DIR}/grid.osm RESULT)
+   maptool_test_expect_map(buffer "${RESULT}" "")
+   maptool_test_run(mmap ${WORK_DIR}/grid.osm RESULT -C mmap)
+   maptool_test_expect_map(mmap "${RESULT}" buffer)
+elseif(MAPTOOL_TEST STREQUAL "node_store_collision")
+   # 4294967301 is 5+2^32, the mmap node store indexes nodes by the lower 32 bits of their id
+   maptool_test_osm(${WORK_DIR}/collision.osm "<node id=\"4294967301\" lat=\"48.5\" lon=\"11.5\">\n<tag k=\"amenity\" v=\"cafe\"/>\n</node>\n")
+   maptool_test_run(buffer ${WORK_DIR}/collision.osm RESULT)
+   maptool_test_expect_map(buffer "${RESULT}" "")
+   maptool_test_run(mmap ${WORK_DIR}/collision.osm RESULT -C mmap)
+   if(NOT RESULT EQUAL 1)
+      message(FATAL_ERROR "maptool with the mmap node store returned ${RESULT} for colliding node ids instead of 1")
+   endif()
+   file(READ ${WORK_DIR}/mmap/maptool.log LOG)
+   if(NOT LOG MATCHES "node ids 5 and 4294967301 share a slot")
+      message(FATAL_ERROR "maptool with the mmap node store did not report the colliding node ids")
+   endif()
+elseif(MAPTOOL_TEST STREQUAL "spill_slices")
+   maptool_test_osm(${WORK_DIR}/grid.osm "")
+   maptool_test_run(whole ${WORK_DIR}/grid.osm RESULT)
+   maptool_test_expect_map(whole "${RESULT}" "")
+   maptool_test_run(slices ${WORK_DIR}/grid.osm RESULT -S 2000)
+   maptool_test_expect_map(slices "${RESULT}" whole)
+   file(STRINGS ${WORK_DIR}/slices/maptool.log SLICES REGEX "^slice ")
+   list(LENGTH SLICES COUNT)
+   if(COUNT LESS 2)
+      message(FATAL_ERROR "maptool -S 2000 wrote ${COUNT} slices, the test needs several")
+   endif()
+   maptool_test_run(spill ${WORK_DIR}/grid.osm RESULT -S 2000 -L)
+   maptool_test_expect_map(spill "${RESULT}" whole)
+elseif(MAPTOOL_TEST STREQUAL "town_key_index")
+   if(NOT TOWN_SEARCH OR NOT BINFILE_PLUGIN)
+      message(FATAL_ERROR "TOWN_SEARCH and BINFILE_PLUGIN must be set")
+   endif()
+   if(NOT TOWNS)
+      set(TOWNS 3000)
+   endif()
+   maptool_test_osm_towns(${WORK_DIR}/towns.osm ${TOWNS})
+   # Small index parts, so the country index is split into many parts and the key index points into several of them
+   maptool_test_run(scan ${WORK_DIR}/towns.osm RESULT -x 4096)
+   maptool_test_expect_map(scan "${RESULT}" "")
+   maptool_test_run(key_index ${WORK_DIR}/towns.osm RESULT -x 4096 -K)
+   maptool_test_expect_map(key_index "${RESULT}" "")
+   set(PREFIXES b B be ber berli Berlimün mün Mün muen MÜN ober Oberdorfau öster oester Oster aal aalaal unterstadtsen sen x)
+   maptool_test_town_search(scan SCAN "${PREFIXES}")
+   maptool_test_town_search(key_index KEY_INDEX "${PREFIXES}")
+   if(REPETITIONS)
+      message("Scanning the country index:\n${SCAN}With the town key index:\n${KEY_INDEX}")
+   else()
+      file(WRITE ${WORK_DIR}/scan.txt "${SCAN}")
+      file(WRITE ${WORK_DIR}/key_index.txt "${KEY_INDEX}")
+      if(NOT SCAN MATCHES "\nber: Berliau\\|")
+         message(FATAL_ERROR "town_search did not find the village Berliau, see ${WORK_DIR}/scan.txt")
+      endif()
+      if(NOT SCAN STREQUAL KEY_INDEX)
+         message(FATAL_ERROR "The town key index found other towns than the scan, see ${WORK_DIR}/scan.txt and ${WORK_DIR}/key_index.txt")
+      endif()
+   endif()
+else()
+   message(FATAL_ERROR "Unknown test ${MAPTOOL_TEST}")
+endif()
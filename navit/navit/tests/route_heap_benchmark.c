@@ -0,0 +1,126 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Micro-benchmark of the heap used by route_graph_flood()
+ *
+ * Runs Dijkstra over a square grid of route graph points with pseudo random edge costs,
+ * using the route_graph_heap of route.c. The heap_benchmark target builds this file once
+ * with the default heap and once with USE_FIBHEAP, the checksums of both must match.
+ */
+
+#include "../route.c"
+
+/**
+ * @brief Returns the cost of the edge between two neighbouring grid points
+ */
+static int
+heap_benchmark_cost(int a, int b)
+{
+	unsigned int h;
+
+	if (a > b) {
+		int t=a;
+		a=b;
+		b=t;
+	}
+	h=(unsigned int)a*2654435761U ^ (unsigned int)b*40503U;
+	h^=h >> 13;
+	return 10+(h & 1023);
+}
+
+/**
+ * @brief Settles all points of the grid starting at its center
+ *
+ * @return The sum of the costs of all points
+ */
+static long long
+heap_benchmark_flood(struct route_graph_point *points, int size)
+{
+	struct route_graph_heap *heap=route_graph_heap_new();
+	struct route_graph_point *p;
+	long long sum=0;
+	int i,start=size/2*size+size/2;
+
+	for (i = 0 ; i < size*size ; i++) {
+		points[i].value=INT_MAX;
+		points[i].el=0;
+	}
+	points[start].value=0;
+	route_graph_heap_insert(heap, &points[start], 0);
+	while ((p=route_graph_heap_extract_min(heap))) {
+		int idx=p-points,x=idx%size,y=idx/size,n[4],j;
+		n[0]=x > 0 ? idx-1 : -1;
+		n[1]=x < size-1 ? idx+1 : -1;
+		n[2]=y > 0 ? idx-size : -1;
+		n[3]=y < size-1 ? idx+size : -1;
+		sum+=p->value;
+		for (j = 0 ; j < 4 ; j++) {
+			struct route_graph_point *q;
+			int val;
+			if (n[j] < 0)
+				continue;
+			q=&points[n[j]];
+			val=p->value+heap_benchmark_cost(idx, n[j]);
+			if (val >= q->value)
+				continue;
+			q->value=val;
+			if (!q->el)
+				route_graph_heap_insert(heap, q, val);
+			else
+				route_graph_heap_update(heap, q, val);
+		}
+	}
+	route_graph_heap_destroy(heap);
+	return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+	int size=argc > 1 ? atoi(argv[1]) : 512;
+	int rounds=argc > 2 ? atoi(argv[2]) : 5;
+	struct route_graph_point *points;
+	struct timeval begin,end;
+	long long sum=0,usec,best=-1;
+	int i;
+
+	if (size < 2 || rounds < 1) {
+		fprintf(stderr,"Usage: %s [grid size] [rounds]\n", argv[0]);
+		return 1;
+	}
+	points=g_new0(struct route_graph_point, size*size);
+	for (i = 0 ; i < rounds ; i++) {
+		gettimeofday(&begin, NULL);
+		sum=heap_benchmark_flood(points, size);
+		gettimeofday(&end, NULL);
+		usec=(end.tv_sec-begin.tv_sec)*1000000LL+end.tv_usec-begin.tv_usec;
+		if (best < 0 || usec < best)
+			best=usec;
+	}
+#ifdef USE_FIBHEAP
+	printf("heap=fibheap");
+#else
+	printf("heap=%d-ary", ROUTE_GRAPH_HEAP_ARITY);
+#endif
+	printf(" points=%d best=%lld usec (%.1f ns per point) checksum=%lld\n", size*size, best, best*1000.0/(size*size), sum);
+	g_free(points);
+	return 0;
+}
@@ -0,0 +1,751 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Behaviour tests of the route graph in route.c
+ *
+ * The graphs are square grids of streets, which are added the way route_graph_build_idle()
+ * adds the segments read from a map. A graph which is changed or extended has to give the same
+ * costs at all points as a graph built from scratch with the same streets. route_graph_update()
+ * reads the same grid from a map of the test's own.
+ */
+
+#include "../route.c"
+
+#ifndef HAVE_GLIB
+void _g_slice_thread_init_nomessage(void);
+#endif
+
+#define route_test_assert(expr) do { if (!(expr)) { fprintf(stderr,"%s:%d: %s failed\n", __FILE__, __LINE__, #expr); return 1; } } while (0)
+
+/** Number of points along each side of the grid */
+#define ROUTE_TEST_GRID 8
+/** Distance between two neighbouring points of the grid */
+#define ROUTE_TEST_STEP 1000
+
+/**
+ * @brief Adds a roadprofile for type_street_2_city to a profile, replacing the previous one
+ */
+static void
+route_test_roadprofile(struct vehicleprofile *profile, int route_weight)
+{
+	enum item_type types[]={type_street_2_city,type_none};
+	struct attr item_types={attr_item_types},weight={attr_route_weight},*attrs[]={&item_types,&weight,NULL};
+	struct attr roadprofile={attr_roadprofile};
+
+	item_types.u.item_types=types;
+	weight.u.num=route_weight;
+	roadprofile.u.navit_object=(struct navit_object *)roadprofile_new(NULL, attrs);
+	vehicleprofile_add_attr(profile, &roadprofile);
+}
+
+/**
+ * @brief Creates a car profile with a roadprofile for type_street_2_city
+ */
+static struct vehicleprofile *
+route_test_profile(void)
+{
+	struct attr name={attr_name},flags={attr_flags},forward={attr_flags_forward_mask},reverse={attr_flags_reverse_mask};
+	struct attr *attrs[]={&name,&flags,&forward,&reverse,NULL};
+	struct vehicleprofile *ret;
+
+	name.u.str="car";
+	flags.u.num=AF_CAR;
+	forward.u.num=AF_ONEWAYREV|AF_CAR;
+	reverse.u.num=AF_ONEWAY|AF_CAR;
+	ret=vehicleprofile_new(NULL, attrs);
+	route_test_roadprofile(ret, 50);
+	return ret;
+}
+
+/**
+ * @brief Returns the id of the street between two neighbouring grid points, which is also the index of its first point
+ */
+static int
+route_test_street_id(int x1, int y1, int x2, int y2)
+{
+	return (MIN(y1,y2)*ROUTE_TEST_GRID+MIN(x1,x2))*2+(y1 != y2);
+}
+
+/**
+ * @brief Adds the street between two neighbouring grid points, with a length of its own
+ */
+static void
+route_test_add_street(struct route_graph *rg, int x1, int y1, int x2, int y2)
+{
+	struct route_graph_segment_data data;
+	struct item item;
+	struct coord c[2];
+	int id=route_test_street_id(x1, y1, x2, y2);
+
+	memset(&item, 0, sizeof(item));
+	item.type=type_street_2_city;
+	item.id_lo=id;
+	memset(&data, 0, sizeof(data));
+	data.item=&item;
+	data.flags=AF_CAR;
+	data.len=ROUTE_TEST_STEP/2+(id*7919)%ROUTE_TEST_STEP;
+	c[0].x=x1*ROUTE_TEST_STEP;
+	c[0].y=y1*ROUTE_TEST_STEP;
+	c[1].x=x2*ROUTE_TEST_STEP;
+	c[1].y=y2*ROUTE_TEST_STEP;
+	route_graph_add_read_segment(rg, c, &data);
+}
+
+/**
+ * @brief Adds all streets of the grid between the columns first and last
+ */
+static void
+route_test_add_grid(struct route_graph *rg, int first, int last)
+{
+	int x,y;
+
+	for (y = 0 ; y < ROUTE_TEST_GRID ; y++) {
+		for (x = first ; x <= last ; x++) {
+			if (x < last)
+				route_test_add_street(rg, x, y, x+1, y);
+			if (y < ROUTE_TEST_GRID-1)
+				route_test_add_street(rg, x, y, x, y+1);
+		}
+	}
+}
+
+/**
+ * @brief Finishes reading streets into a graph, as route_graph_build_idle() does at the end of the map
+ *
+ * @param rg The graph
+ * @param first First column of the grid the graph covers
+ * @param last Last column of the grid the graph covers
+ * @param profile The routing preferences
+ */
+static void
+route_test_build_done(struct route_graph *rg, int first, int last, struct vehicleprofile *profile)
+{
+	struct coord c[2];
+
+	c[0].x=first*ROUTE_TEST_STEP;
+	c[0].y=0;
+	c[1].x=last*ROUTE_TEST_STEP;
+	c[1].y=(ROUTE_TEST_GRID-1)*ROUTE_TEST_STEP;
+	rg->sel=route_calc_selection(c, 2, profile);
+	rg->busy=1;
+	route_graph_build_done(rg, 0);
+}
+
+/**
+ * @brief Creates a graph of the grid between the columns first and last
+ */
+static struct route_graph *
+route_test_graph(int first, int last, struct vehicleprofile *profile)
+{
+	struct route_graph *rg=g_new0(struct route_graph, 1);
+
+	rg->vehicleprofile=profile;
+	route_test_add_grid(rg, first, last);
+	route_test_build_done(rg, first, last, profile);
+	return rg;
+}
+
+/**
+ * @brief Returns the first segment of a street of the grid in a graph
+ */
+static struct route_graph_segment *
+route_test_segment(struct route_graph *rg, int x1, int y1, int x2, int y2)
+{
+	struct route_graph_point *p=NULL;
+	struct coord c;
+	int i,id=route_test_street_id(x1, y1, x2, y2);
+
+	c.x=x1*ROUTE_TEST_STEP;
+	c.y=y1*ROUTE_TEST_STEP;
+	while ((p=route_graph_get_point_next(rg, &c, p))) {
+		for (i = 0 ; i < p->nstart+p->nend ; i++) {
+			if (p->adj[i]->data.item.id_lo == id && p->adj[i]->data.item.type == type_street_2_city)
+				return p->adj[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Gets the lowest value of the points at each grid position of a flooded graph
+ */
+static void
+route_test_values(struct route_graph *rg, int *values)
+{
+	struct route_graph_point *p;
+	struct coord c;
+	int x,y;
+
+	for (y = 0 ; y < ROUTE_TEST_GRID ; y++) {
+		for (x = 0 ; x < ROUTE_TEST_GRID ; x++) {
+			c.x=x*ROUTE_TEST_STEP;
+			c.y=y*ROUTE_TEST_STEP;
+			values[y*ROUTE_TEST_GRID+x]=INT_MAX;
+			for (p = route_graph_get_point_next(rg, &c, NULL) ; p ; p=p->hash_next)
+				values[y*ROUTE_TEST_GRID+x]=MIN(values[y*ROUTE_TEST_GRID+x], p->value);
+		}
+	}
+}
+
+/**
+ * @brief Creates the destination of the routes, the middle of the street between the first two points of the grid
+ *
+ * @param dst Returns the destination, its street has to be freed with g_free()
+ * @param m The map the street is read from, NULL for the graphs built by route_test_graph()
+ */
+static void
+route_test_destination(struct route_info *dst, struct map *m)
+{
+	struct street_data *sd=g_malloc0(sizeof(struct street_data)+sizeof(struct coord));
+
+	sd->item.type=type_street_2_city;
+	sd->item.id_lo=route_test_street_id(0, 0, 1, 0);
+	sd->item.map=m;
+	sd->count=1;
+	memset(dst, 0, sizeof(*dst));
+	dst->c.x=ROUTE_TEST_STEP/2;
+	dst->street=sd;
+	dst->percent=50;
+}
+
+/**
+ * @brief Floods a graph towards the middle of the street between the first two points of the grid
+ *
+ * @param rg The graph
+ * @param profile The routing preferences
+ * @param values Returns the lowest value of the points at each grid position
+ */
+static void
+route_test_flood(struct route_graph *rg, struct vehicleprofile *profile, int *values)
+{
+	struct route_info dst;
+
+	route_test_destination(&dst, NULL);
+	route_graph_reset(rg);
+	route_graph_flood(rg, &dst, NULL, profile, NULL);
+	route_test_values(rg, values);
+	g_free(dst.street);
+}
+
+/**
+ * @brief Checks that the flood reached every point of the grid with the same values as ref
+ */
+static int
+route_test_values_equal(int *values, int *ref)
+{
+	int i;
+	for (i = 0 ; i < ROUTE_TEST_GRID*ROUTE_TEST_GRID ; i++) {
+		if (values[i] == INT_MAX || values[i] != ref[i])
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Checks that all costs in the cost cache of a graph are the ones route_seg_cost() returns now
+ */
+static int
+route_test_costs_valid(struct route_graph *rg, struct vehicleprofile *profile)
+{
+	struct route_graph_arena *a=NULL;
+	struct route_graph_segment *s=NULL;
+
+	while ((s=route_graph_segment_next(rg, &a, s))) {
+		if (s->id >= rg->costs_size)
+			continue;
+		if (rg->costs[s->id*2] != COST_UNKNOWN && rg->costs[s->id*2] != route_seg_cost(profile, s, -1))
+			return 0;
+		if (rg->costs[s->id*2+1] != COST_UNKNOWN && rg->costs[s->id*2+1] != route_seg_cost(profile, s, 1))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Returns the number of costs in the cost cache of a graph
+ */
+static int
+route_test_costs_known(struct route_graph *rg)
+{
+	int i,ret=0;
+	for (i = 0 ; i < rg->costs_size*2 ; i++) {
+		if (rg->costs[i] != COST_UNKNOWN)
+			ret++;
+	}
+	return ret;
+}
+
+/**
+ * @brief Checks that the slices of all points of a graph are the ones route_graph_compile() builds
+ *
+ * The graph is compiled again for this.
+ */
+static int
+route_test_adj_compiled(struct route_graph *rg)
+{
+	struct route_graph_point *p;
+	struct route_graph_segment **adj;
+	int i,count=0,pos=0,ret=1;
+
+	for (i = 0 ; i < rg->hash_size ; i++) {
+		for (p = rg->hash[i] ; p ; p=p->hash_next)
+			count+=p->nstart+p->nend+2;
+	}
+	adj=g_new(struct route_graph_segment *, count);
+	for (i = 0 ; i < rg->hash_size ; i++) {
+		for (p = rg->hash[i] ; p ; p=p->hash_next) {
+			adj[pos++]=GINT_TO_POINTER(p->nstart);
+			adj[pos++]=GINT_TO_POINTER(p->nend);
+			memcpy(adj+pos, p->adj, (p->nstart+p->nend)*sizeof(*adj));
+			pos+=p->nstart+p->nend;
+		}
+	}
+	route_graph_compile(rg);
+	pos=0;
+	for (i = 0 ; i < rg->hash_size && ret ; i++) {
+		for (p = rg->hash[i] ; p && ret ; p=p->hash_next) {
+			if (GPOINTER_TO_INT(adj[pos]) != p->nstart || GPOINTER_TO_INT(adj[pos+1]) != p->nend ||
+			    memcmp(adj+pos+2, p->adj, (p->nstart+p->nend)*sizeof(*adj)))
+				ret=0;
+			pos+=p->nstart+p->nend+2;
+		}
+	}
+	g_free(adj);
+	return ret;
+}
+
+/* A graph extended by the missing columns routes like a graph read at once, and does not get the streets it has twice */
+static int
+route_test_extend(struct vehicleprofile *profile)
+{
+	struct route_graph *whole=route_test_graph(0, ROUTE_TEST_GRID-1, profile);
+	struct route_graph *rg=route_test_graph(0, ROUTE_TEST_GRID/2, profile);
+	int ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID],values[ROUTE_TEST_GRID*ROUTE_TEST_GRID];
+
+	route_test_flood(whole, profile, ref);
+	route_test_flood(rg, profile, values);
+	route_test_assert(values[ROUTE_TEST_GRID-1] == INT_MAX);
+	route_graph_reset(rg);
+	route_test_add_grid(rg, 0, ROUTE_TEST_GRID-1);
+	route_test_build_done(rg, 0, ROUTE_TEST_GRID-1, profile);
+	route_test_assert(rg->segment_count == whole->segment_count);
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_values_equal(values, ref));
+	route_graph_destroy(whole);
+	route_graph_destroy(rg);
+	return 0;
+}
+
+/* Only graphs close to the new route and covering a few rectangles are extended, covered rectangles are not read again */
+static int
+route_test_reusable(struct vehicleprofile *profile)
+{
+	struct route_graph *rg=g_new0(struct route_graph, 1);
+	struct map_selection *sel,*last;
+	struct coord near[2],moved[2],far[2];
+	int i;
+
+	near[0].x=near[0].y=0;
+	near[1].x=near[1].y=(ROUTE_TEST_GRID-1)*ROUTE_TEST_STEP;
+	for (i = 0 ; i < 2 ; i++) {
+		moved[i].x=near[i].x+20000;
+		moved[i].y=near[i].y;
+		far[i].x=near[i].x+10000000;
+		far[i].y=near[i].y+10000000;
+	}
+	rg->covered=route_calc_selection(near, 2, profile);
+	route_test_assert(route_graph_reusable(rg, near, 2, profile));
+	route_test_assert(route_graph_reusable(rg, moved, 2, profile));
+	route_test_assert(!route_graph_reusable(rg, far, 2, profile));
+	route_test_assert(!route_selection_missing(rg->covered, route_calc_selection(near, 2, profile)));
+	sel=route_selection_missing(rg->covered, route_calc_selection(moved, 2, profile));
+	route_test_assert(sel != NULL);
+	route_free_selection(sel);
+
+	for (i = 0 ; i < ROUTE_GRAPH_REUSE_RECTS ; i++) {
+		for (last = rg->covered ; last->next ; last=last->next);
+		last->next=route_calc_selection(near, 2, profile);
+	}
+	route_test_assert(!route_graph_reusable(rg, near, 2, profile));
+	route_graph_destroy(rg);
+	return 0;
+}
+
+/* The penalty route_path_new() puts on the street to avoid is gone when the graph is kept for the next route */
+static int
+route_test_retire(struct vehicleprofile *profile)
+{
+	struct route_graph *rg=route_test_graph(0, ROUTE_TEST_GRID-1, profile);
+	int ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID],values[ROUTE_TEST_GRID*ROUTE_TEST_GRID];
+	struct route r;
+
+	route_test_flood(rg, profile, ref);
+	rg->avoid_seg=route_test_segment(rg, 1, 0, 2, 0);
+	route_test_assert(rg->avoid_seg != NULL);
+	route_graph_set_traffic_distortion(rg, rg->avoid_seg, 6000);
+	route_test_flood(rg, profile, values);
+	route_test_assert(!route_test_values_equal(values, ref));
+	memset(&r, 0, sizeof(r));
+	r.graph=rg;
+	route_graph_retire(&r);
+	route_test_assert(!r.graph && r.old_graph == rg && !rg->avoid_seg);
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_values_equal(values, ref));
+	route_graph_destroy(rg);
+	return 0;
+}
+
+/* Traffic distortions only drop the cached costs of their street, a changed profile drops all of them */
+static int
+route_test_costs(struct vehicleprofile *profile)
+{
+	struct route_graph *rg=route_test_graph(0, ROUTE_TEST_GRID-1, profile),*fresh;
+	int ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID],values[ROUTE_TEST_GRID*ROUTE_TEST_GRID];
+	struct route_graph_segment *s;
+	int known;
+
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_costs_valid(rg, profile));
+	known=route_test_costs_known(rg);
+	route_test_assert(known > 0);
+
+	s=route_test_segment(rg, 3, 3, 4, 3);
+	route_graph_set_traffic_distortion(rg, s, 6000);
+	route_test_assert(rg->costs[s->id*2] == COST_UNKNOWN && rg->costs[s->id*2+1] == COST_UNKNOWN);
+	route_test_assert(route_test_costs_known(rg) >= known-2);
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_costs_valid(rg, profile));
+	fresh=route_test_graph(0, ROUTE_TEST_GRID-1, profile);
+	route_graph_set_traffic_distortion(fresh, route_test_segment(fresh, 3, 3, 4, 3), 6000);
+	route_test_flood(fresh, profile, ref);
+	route_test_assert(route_test_values_equal(values, ref));
+
+	route_test_roadprofile(profile, 25);
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_costs_valid(rg, profile));
+	route_test_assert(values[ROUTE_TEST_GRID*ROUTE_TEST_GRID-1] > ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID-1]);
+	route_test_flood(fresh, profile, ref);
+	route_test_assert(route_test_values_equal(values, ref));
+	route_test_roadprofile(profile, 50);
+	route_graph_destroy(fresh);
+	route_graph_destroy(rg);
+	return 0;
+}
+
+/* Turn restriction clones and traffic distortions added to a compiled graph are in the slices of their points */
+static int
+route_test_restriction(struct vehicleprofile *profile)
+{
+	struct route_graph *plain=route_test_graph(0, ROUTE_TEST_GRID-1, profile);
+	struct route_graph *rg=g_new0(struct route_graph, 1);
+	int ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID],values[ROUTE_TEST_GRID*ROUTE_TEST_GRID];
+	struct route_graph_segment_data data;
+	struct route_graph_point *prev;
+	struct item item;
+	struct coord c[3];
+
+	/* No turn from (1,1) over (1,0) into the destination street, which the route from (1,1) takes without it */
+	c[0].x=c[1].x=ROUTE_TEST_STEP;
+	c[0].y=ROUTE_TEST_STEP;
+	c[1].y=c[2].x=c[2].y=0;
+	route_test_flood(plain, profile, ref);
+	prev=route_graph_get_point_next(plain, &c[0], NULL);
+	route_test_assert(prev->seg == route_test_segment(plain, 1, 0, 1, 1));
+
+	rg->vehicleprofile=profile;
+	route_test_add_grid(rg, 0, ROUTE_TEST_GRID-1);
+	memset(&item, 0, sizeof(item));
+	item.type=type_street_turn_restriction_no;
+	item.id_lo=ROUTE_TEST_GRID*ROUTE_TEST_GRID*2;
+	memset(&data, 0, sizeof(data));
+	data.item=&item;
+	route_graph_add_read_segment(rg, c, &data);
+	route_test_build_done(rg, 0, ROUTE_TEST_GRID-1, profile);
+	route_test_assert(rg->segment_count > plain->segment_count+2);
+	route_test_flood(rg, profile, values);
+	route_test_assert(values[ROUTE_TEST_GRID+1] != INT_MAX && values[ROUTE_TEST_GRID+1] > ref[ROUTE_TEST_GRID+1]);
+	route_test_assert(route_test_adj_compiled(rg));
+	route_test_flood(rg, profile, ref);
+	route_test_assert(route_test_values_equal(values, ref));
+
+	route_graph_set_traffic_distortion(rg, route_test_segment(rg, 3, 3, 4, 3), 6000);
+	route_test_flood(rg, profile, values);
+	route_test_assert(route_test_adj_compiled(rg));
+	route_test_flood(rg, profile, ref);
+	route_test_assert(route_test_values_equal(values, ref));
+	route_graph_destroy(plain);
+	route_graph_destroy(rg);
+	return 0;
+}
+
+/**
+ * @brief A street or traffic distortion of the map read by route_graph_update()
+ */
+struct route_test_item {
+	struct item item;
+	struct coord c[2];
+	int delay;			/**< Delay of a traffic distortion */
+	int pos;			/**< Number of coordinates returned since the last rewind */
+};
+
+/**
+ * @brief The map read by route_graph_update(), the streets of the grid and one traffic distortion
+ *
+ * It has no map rect of its own, items are returned in order and only one rect is open at a time.
+ */
+static struct route_test_map {
+	struct route_test_item items[ROUTE_TEST_GRID*ROUTE_TEST_GRID*2+1];
+	int count;
+	int next;			/**< The next item the open map rect returns */
+} route_test_map;
+
+static void
+route_test_coord_rewind(void *priv_data)
+{
+	struct route_test_item *ti=priv_data;
+	ti->pos=0;
+}
+
+static int
+route_test_coord_get(void *priv_data, struct coord *c, int count)
+{
+	struct route_test_item *ti=priv_data;
+	int ret=0;
+	while (ret < count && ti->pos < 2)
+		c[ret++]=ti->c[ti->pos++];
+	return ret;
+}
+
+static void
+route_test_attr_rewind(void *priv_data)
+{
+}
+
+static int
+route_test_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
+{
+	struct route_test_item *ti=priv_data;
+	attr->type=attr_type;
+	if (ti->item.type == type_traffic_distortion && attr_type == attr_delay) {
+		attr->u.num=ti->delay;
+		return 1;
+	}
+	if (ti->item.type == type_street_2_city && attr_type == attr_flags) {
+		attr->u.num=AF_CAR;
+		return 1;
+	}
+	return 0;
+}
+
+static int
+route_test_attr_set(void *priv_data, struct attr *attr, enum change_mode mode)
+{
+	struct route_test_item *ti=priv_data;
+	if (ti->item.type != type_traffic_distortion || attr->type != attr_delay)
+		return 0;
+	ti->delay=attr->u.num;
+	return 1;
+}
+
+static struct item_methods route_test_item_methods = {
+	route_test_coord_rewind,
+	route_test_coord_get,
+	route_test_attr_rewind,
+	route_test_attr_get,
+	NULL,
+	route_test_attr_set,
+};
+
+static struct map_rect_priv *
+route_test_rect_new(struct map_priv *priv, struct map_selection *sel)
+{
+	route_test_map.next=0;
+	return (struct map_rect_priv *)&route_test_map;
+}
+
+static void
+route_test_rect_destroy(struct map_rect_priv *mr)
+{
+}
+
+static struct item *
+route_test_get_item(struct map_rect_priv *mr)
+{
+	struct route_test_item *ti;
+	if (route_test_map.next >= route_test_map.count)
+		return NULL;
+	ti=&route_test_map.items[route_test_map.next++];
+	ti->pos=0;
+	return &ti->item;
+}
+
+static struct item *
+route_test_get_item_byid(struct map_rect_priv *mr, int id_hi, int id_lo)
+{
+	int i;
+	for (i = 0 ; i < route_test_map.count ; i++) {
+		if (route_test_map.items[i].item.id_hi == id_hi && route_test_map.items[i].item.id_lo == id_lo) {
+			route_test_map.items[i].pos=0;
+			return &route_test_map.items[i].item;
+		}
+	}
+	return NULL;
+}
+
+static void
+route_test_map_destroy(struct map_priv *priv)
+{
+}
+
+static struct map_methods route_test_map_methods = {
+	projection_mg,
+	"utf-8",
+	route_test_map_destroy,
+	route_test_rect_new,
+	route_test_rect_destroy,
+	route_test_get_item,
+	route_test_get_item_byid,
+};
+
+/**
+ * @brief Adds an item to the test map
+ */
+static struct route_test_item *
+route_test_map_add(enum item_type type, int id, int x1, int y1, int x2, int y2)
+{
+	struct route_test_item *ti=&route_test_map.items[route_test_map.count++];
+
+	memset(ti, 0, sizeof(*ti));
+	ti->item.type=type;
+	ti->item.id_lo=id;
+	ti->item.meth=&route_test_item_methods;
+	ti->item.priv_data=ti;
+	ti->c[0].x=x1*ROUTE_TEST_STEP;
+	ti->c[0].y=y1*ROUTE_TEST_STEP;
+	ti->c[1].x=x2*ROUTE_TEST_STEP;
+	ti->c[1].y=y2*ROUTE_TEST_STEP;
+	return ti;
+}
+
+static struct map_priv *
+route_test_map_new(struct map_methods *meth, struct attr **attrs, struct callback_list *cbl)
+{
+	int x,y;
+
+	*meth=route_test_map_methods;
+	route_test_map.count=0;
+	for (y = 0 ; y < ROUTE_TEST_GRID ; y++) {
+		for (x = 0 ; x < ROUTE_TEST_GRID ; x++) {
+			if (x < ROUTE_TEST_GRID-1)
+				route_test_map_add(type_street_2_city, route_test_street_id(x, y, x+1, y), x, y, x+1, y);
+			if (y < ROUTE_TEST_GRID-1)
+				route_test_map_add(type_street_2_city, route_test_street_id(x, y, x, y+1), x, y, x, y+1);
+		}
+	}
+	/* Without delay, the distortion does not change the route yet */
+	route_test_map_add(type_traffic_distortion, ROUTE_TEST_GRID*ROUTE_TEST_GRID*2, 2, 0, 1, 0);
+	return (struct map_priv *)&route_test_map;
+}
+
+/**
+ * @brief Routes from the far corner of the grid to the destination of route_test_destination() with route_graph_update()
+ *
+ * @param r The route, its graph is kept as old_graph for the next call
+ * @param values Returns the lowest value of the points at each grid position
+ */
+static void
+route_test_route(struct route *r, int *values)
+{
+	route_graph_retire(r);
+	route_graph_update(r, NULL, 0);
+	route_test_values(r->graph, values);
+}
+
+/* A graph kept for the next route is read again when a traffic distortion of its map changed in between */
+static int
+route_test_distortion_change(struct vehicleprofile *profile)
+{
+	struct attr type={attr_type},*attrs[]={&type,NULL},map={attr_map},delay={attr_delay};
+	int first[ROUTE_TEST_GRID*ROUTE_TEST_GRID],values[ROUTE_TEST_GRID*ROUTE_TEST_GRID],ref[ROUTE_TEST_GRID*ROUTE_TEST_GRID];
+	struct route_info pos,dst;
+	struct route r,fresh;
+	struct route_graph *rg;
+	struct item *distortion;
+	struct map_rect *mr;
+
+	plugin_register_map_type("route_test", route_test_map_new);
+	type.u.str="route_test";
+	map.u.map=map_new(NULL, attrs);
+	route_test_assert(map.u.map != NULL);
+	memset(&r, 0, sizeof(r));
+	r.ms=mapset_new(NULL, NULL);
+	mapset_add_attr(r.ms, &map);
+	r.vehicleprofile=profile;
+	memset(&pos, 0, sizeof(pos));
+	pos.c.x=pos.c.y=(ROUTE_TEST_GRID-1)*ROUTE_TEST_STEP;
+	route_test_destination(&dst, map.u.map);
+	r.pos=&pos;
+	r.destinations=g_list_append(NULL, &dst);
+	r.current_dst=&dst;
+	fresh=r;
+
+	route_test_route(&r, first);
+	rg=r.graph;
+	route_test_route(&r, values);
+	route_test_assert(r.graph == rg);
+	route_test_assert(route_test_values_equal(values, first));
+
+	mr=map_rect_new(map.u.map, NULL);
+	while ((distortion=map_rect_get_item(mr)) && distortion->type != type_traffic_distortion);
+	route_test_assert(distortion != NULL);
+	delay.u.num=6000;
+	route_test_assert(item_attr_set(distortion, &delay, change_mode_modify));
+	map_rect_destroy(mr);
+	route_test_route(&r, values);
+	route_test_assert(!route_test_values_equal(values, first));
+	route_test_route(&fresh, ref);
+	route_test_assert(route_test_values_equal(values, ref));
+
+	route_graph_retire(&r);
+	route_graph_retire(&fresh);
+	route_graph_destroy(r.old_graph);
+	route_graph_destroy(fresh.old_graph);
+	callback_destroy(r.route_graph_done_cb);
+	callback_destroy(fresh.route_graph_done_cb);
+	g_list_free(r.destinations);
+	g_free(dst.street);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vehicleprofile *profile;
+
+#ifndef HAVE_GLIB
+	_g_slice_thread_init_nomessage();
+#endif
+	profile=route_test_profile();
+	if (route_test_extend(profile) || route_test_reusable(profile) || route_test_retire(profile) || route_test_costs(profile) ||
+	    route_test_restriction(profile) || route_test_distortion_change(profile))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Searches towns of a country in a binfile map by prefix
+ *
+ * Prints the towns found for every prefix in the order the search returns them, so the
+ * results of maps written with and without the town key index of maptool -K can be compared.
+ * With -r, every search is repeated and the best time per prefix is printed instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <glib.h>
+#include "config.h"
+#include "debug.h"
+#include "coord.h"
+#include "item.h"
+#include "attr.h"
+#include "map.h"
+#include "plugin.h"
+#include "file.h"
+#include "linguistics.h"
+
+#ifndef HAVE_GLIB
+void _g_slice_thread_init_nomessage(void);
+#endif
+
+/**
+ * @brief Searches the towns of a country starting with prefix
+ *
+ * @param out Where the towns found are printed, NULL to only count them
+ * @return The number of towns found
+ */
+static int
+town_search_run(struct map *map, int country, char *prefix, FILE *out)
+{
+	struct attr search={attr_town_name},town,district;
+	struct item country_item,*item;
+	struct map_search *ms;
+	struct coord c;
+	int count=0;
+
+	memset(&country_item, 0, sizeof(country_item));
+	country_item.id_lo=country;
+	search.u.str=prefix;
+	ms=map_search_new(map, &country_item, &search, 1);
+	if (!ms)
+		return 0;
+	while ((item=map_search_get_item(ms))) {
+		count++;
+		if (!out)
+			continue;
+		if (!item_attr_get(item, attr_town_name, &town))
+			town.u.str="";
+		if (!item_attr_get(item, attr_district_name, &district))
+			district.u.str="";
+		if (!item_coord_get(item, &c, 1))
+			c.x=c.y=0;
+		fprintf(out,"%s: %s|%s|%d,%d\n", prefix, town.u.str, district.u.str, c.x, c.y);
+	}
+	map_search_destroy(ms);
+	return count;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct attr plugin_path={attr_path},plugin_active={attr_active},*plugin_attrs[]={&plugin_path,&plugin_active,NULL};
+	struct attr map_type={attr_type},map_data={attr_data},*map_attrs[]={&map_type,&map_data,NULL};
+	struct timeval begin,end;
+	struct map *map;
+	long long usec,best;
+	int i,j,arg=1,count,country,repetitions=0;
+
+	if (argc > 2 && !strcmp(argv[1],"-r")) {
+		repetitions=atoi(argv[2]);
+		arg=3;
+	}
+	if (argc < arg+4) {
+		fprintf(stderr,"Usage: %s [-r repetitions] binfile_plugin map country_id prefix...\n", argv[0]);
+		return 1;
+	}
+#ifndef HAVE_GLIB
+	_g_slice_thread_init_nomessage();
+#endif
+	debug_init(argv[0]);
+	file_init();
+	linguistics_init();
+	plugin_path.u.str=argv[arg];
+	plugin_active.u.num=1;
+	if (!plugin_new(NULL, plugin_attrs))
+		return 1;
+	map_type.u.str="binfile";
+	map_data.u.str=argv[arg+1];
+	map=map_new(NULL, map_attrs);
+	if (!map) {
+		fprintf(stderr,"Failed to open %s\n", argv[arg+1]);
+		return 1;
+	}
+	country=atoi(argv[arg+2]);
+	for (i = arg+3 ; i < argc ; i++) {
+		if (!repetitions) {
+			town_search_run(map, country, argv[i], stdout);
+			continue;
+		}
+		best=-1;
+		count=0;
+		for (j = 0 ; j < repetitions ; j++) {
+			gettimeofday(&begin, NULL);
+			count=town_search_run(map, country, argv[i], NULL);
+			gettimeofday(&end, NULL);
+			usec=(end.tv_sec-begin.tv_sec)*1000000LL+end.tv_usec-begin.tv_usec;
+			if (best < 0 || usec < best)
+				best=usec;
+		}
+		printf("%s: %d towns, %.3f ms\n", argv[i], count, best/1000.0);
+	}
+	map_destroy(map);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file
+ *
+ * @brief Micro-benchmark of transform() over the polylines and polygons of a binfile map
+ *
+ * Reads the items of a screen sized view of the map the way the display list does, reduces
+ * them with the level of detail the display list would draw them with, then transforms
+ * them with the per point path of transform() and with transform_2d() for several values
+ * of TRANSFORM_BATCH_MIN. The screen points must be identical for all of them.
+ */
+
+#include <limits.h>
+#include <sys/time.h>
+
+static int transform_batch_min;
+#define TRANSFORM_BATCH_MIN transform_batch_min
+
+#include "../transform.c"
+#include "attr.h"
+#include "item.h"
+#include "map.h"
+#include "plugin.h"
+#include "file.h"
+
+#ifndef HAVE_GLIB
+void _g_slice_thread_init_nomessage(void);
+#endif
+
+/** Coordinates of one display item */
+struct transform_benchmark_item {
+	struct coord *c;
+	int count;
+	int area;
+};
+
+/**
+ * @brief Reads the lines and areas of the map within the view of a transformation
+ *
+ * @return The number of items stored in *items
+ */
+static int
+transform_benchmark_read(struct map *map, struct transformation *t, int lod_dist, struct transform_benchmark_item **items)
+{
+	struct map_selection *sel=transform_get_selection(t, map_projection(map), transform_get_order(t));
+	struct map_rect *mr=map_rect_new(map, sel);
+	struct coord *ca=g_new(struct coord, 16384),*buffer;
+	struct item *item;
+	int count,size=1024,ret=0;
+
+	*items=g_new(struct transform_benchmark_item, size);
+	while (mr && (item=map_rect_get_item(mr))) {
+		if (item->type < type_line)
+			continue;
+		count=item_coord_get_within_selection(item, ca, 16384, sel);
+		if (count < 2)
+			continue;
+		if (ret == size) {
+			size*=2;
+			*items=g_renew(struct transform_benchmark_item, *items, size);
+		}
+		buffer=g_new(struct coord, count);
+		if (lod_dist && count > 2)
+			count=transform_douglas_peucker_float(ca, count, (navit_float)lod_dist*lod_dist, buffer);
+		else
+			memcpy(buffer, ca, count*sizeof(struct coord));
+		(*items)[ret].c=buffer;
+		(*items)[ret].count=count;
+		(*items)[ret].area=item_type_is_area(item->type);
+		ret++;
+	}
+	map_rect_destroy(mr);
+	map_selection_destroy(sel);
+	g_free(ca);
+	return ret;
+}
+
+/**
+ * @brief Transforms all items like displayitem_draw() does
+ *
+ * @return A checksum of the screen points and widths
+ */
+static unsigned int
+transform_benchmark_run(struct transformation *t, struct transform_benchmark_item *items, int count, int mindist)
+{
+	struct point *pa=g_alloca(sizeof(struct point)*16384);
+	int *width=g_alloca(sizeof(int)*16384);
+	unsigned int sum=0;
+	int i,j,n;
+
+	for (i = 0 ; i < count ; i++) {
+		if (items[i].area)
+			n=transform(t, projection_mg, items[i].c, pa, items[i].count, mindist, 0, NULL);
+		else
+			n=transform(t, projection_mg, items[i].c, pa, items[i].count, mindist, 4, width);
+		for (j = 0 ; j < n ; j++) {
+			sum=sum*31+pa[j].x;
+			sum=sum*31+pa[j].y;
+			if (!items[i].area)
+				sum+=width[j];
+		}
+	}
+	return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int batch_mins[]={INT_MAX, 16, 8, 4, 3, 2};
+	struct attr plugin_path={attr_path},plugin_active={attr_active},*plugin_attrs[]={&plugin_path,&plugin_active,NULL};
+	struct attr map_type={attr_type},map_data={attr_data},*map_attrs[]={&map_type,&map_data,NULL};
+	struct map_selection screen;
+	struct transformation *t;
+	struct transform_benchmark_item *items;
+	struct coord_geo g;
+	struct coord c;
+	struct pcoord center;
+	struct timeval begin,end;
+	struct map *map;
+	long long usec,best;
+	unsigned int sum,ref=0;
+	int i,j,k,scale,count,coords=0,fast,rounds=50;
+
+	if (argc < 6) {
+		fprintf(stderr,"Usage: %s binfile_plugin map longitude latitude scale\n", argv[0]);
+		return 1;
+	}
+#ifndef HAVE_GLIB
+	_g_slice_thread_init_nomessage();
+#endif
+	debug_init(argv[0]);
+	file_init();
+	plugin_path.u.str=argv[1];
+	plugin_active.u.num=1;
+	if (!plugin_new(NULL, plugin_attrs))
+		return 1;
+	map_type.u.str="binfile";
+	map_data.u.str=argv[2];
+	map=map_new(NULL, map_attrs);
+	if (!map) {
+		fprintf(stderr,"Failed to open %s\n", argv[2]);
+		return 1;
+	}
+	g.lng=atof(argv[3]);
+	g.lat=atof(argv[4]);
+	scale=atoi(argv[5]);
+	transform_from_geo(projection_mg, &g, &c);
+	center.pro=projection_mg;
+	center.x=c.x;
+	center.y=c.y;
+	t=transform_new(&center, scale, 0);
+	memset(&screen, 0, sizeof(screen));
+	screen.u.p_rect.rl.x=800;
+	screen.u.p_rect.rl.y=600;
+	transform_set_screen_selection(t, &screen);
+	transform_setup_source_rect(t);
+
+	/* The display list reduces items with the default lod_tolerance of 1 */
+	count=transform_benchmark_read(map, t, transform_get_scale(t)/16, &items);
+	for (i = 0 ; i < count ; i++)
+		coords+=items[i].count;
+	printf("scale=%d items=%d coords=%d (%.1f per item)\n", scale, count, coords, count ? (double)coords/count : 0);
+	if (!count)
+		return 1;
+	for (i = 0 ; i < sizeof(batch_mins)/sizeof(*batch_mins) ; i++) {
+		transform_batch_min=batch_mins[i];
+		fast=0;
+		for (j = 0 ; j < count ; j++) {
+			if (items[j].count >= transform_batch_min)
+				fast+=items[j].count;
+		}
+		best=-1;
+		sum=0;
+		for (k = 0 ; k < rounds ; k++) {
+			gettimeofday(&begin, NULL);
+			for (j = 0 ; j < 10 ; j++)
+				sum=transform_benchmark_run(t, items, count, 2);
+			gettimeofday(&end, NULL);
+			usec=(end.tv_sec-begin.tv_sec)*1000000LL+end.tv_usec-begin.tv_usec;
+			if (best < 0 || usec < best)
+				best=usec;
+		}
+		if (!i)
+			ref=sum;
+		if (transform_batch_min == INT_MAX)
+			printf("batch_min=off");
+		else
+			printf("batch_min=%d", transform_batch_min);
+		printf(" fast=%.1f%% %.2f ns per coord%s\n", fast*100.0/coords, best*100.0/coords, sum == ref ? "" : " MISMATCH");
+		if (sum != ref)
+			return 1;
+	}
+	for (i = 0 ; i < count ; i++)
+		g_free(items[i].c);
+	g_free(items);
+	map_destroy(map);
+	transform_destroy(t);
+	return 0;
+}
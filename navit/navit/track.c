@@ -46,9 +46,33 @@ struct tracking_line
 {
 	struct street_data *street;
 	struct tracking_line *next;
+	struct coord_rect r;		/**< Bounding box of the street */
+	int refs;			/**< Number of window cells listing this line */
+	int visited;			/**< Number of the last search or cell load which looked at this line */
 	int angle[0];
 };
 
+/* Size of the cells the tracking window is made of, in map units */
+#define TRACKING_CELL_SIZE 500
+/* Number of cells the window extends beyond the cell of the position in each direction */
+#define TRACKING_CELL_RADIUS 2
+#define TRACKING_WINDOW_SIZE (2*TRACKING_CELL_RADIUS+1)
+#define TRACKING_WINDOW_CELLS (TRACKING_WINDOW_SIZE*TRACKING_WINDOW_SIZE)
+
+/**
+ * @brief One cell of the tracking window
+ *
+ * The window is a ring buffer: the cell with index (x,y) is stored in slot
+ * (x mod TRACKING_WINDOW_SIZE, y mod TRACKING_WINDOW_SIZE), so when the window moves,
+ * the cells which enter it replace exactly the cells which leave it.
+ */
+struct tracking_cell {
+	int x,y;			/**< Index of the cell, its area starts at x*TRACKING_CELL_SIZE,y*TRACKING_CELL_SIZE */
+	int loaded;
+	int count,size;
+	struct tracking_line **lines;	/**< The lines whose bounding box overlaps this cell */
+};
+
 
 /**
  * @brief Conatins a list of previous speeds
@@ -90,8 +114,10 @@ struct tracking {
 	struct map *map;
 	struct vehicle *vehicle;
 	struct vehicleprofile *vehicleprofile;
-	struct coord last_updated;
 	struct tracking_line *lines;
+	struct tracking_cell cells[TRACKING_WINDOW_CELLS];
+	struct item_hash *line_hash;	/**< The lines of all cells, by street item */
+	int visit;
 	struct tracking_line *curr_line;
 	int pos;
 	struct coord curr[2], curr_in, curr_out;
@@ -424,43 +450,108 @@ tracking_get_angles(struct tracking_line *tl)
 		tl->angle[i]=transform_get_angle_delta(&sd->c[i], &sd->c[i+1], 0);
 }
 
+static void
+street_data_rect(struct street_data *sd, struct coord_rect *r)
+{
+	int i;
+
+	r->lu=sd->c[0];
+	r->rl=sd->c[0];
+	for (i = 1 ; i < sd->count ; i++) {
+		if (r->lu.x > sd->c[i].x)
+			r->lu.x=sd->c[i].x;
+		if (r->rl.x < sd->c[i].x)
+			r->rl.x=sd->c[i].x;
+		if (r->rl.y > sd->c[i].y)
+			r->rl.y=sd->c[i].y;
+		if (r->lu.y < sd->c[i].y)
+			r->lu.y=sd->c[i].y;
+	}
+}
+
 static int
-street_data_within_selection(struct street_data *sd, struct map_selection *sel)
+street_data_within_selection(struct coord_rect *r, struct map_selection *sel)
 {
-	struct coord_rect r;
 	struct map_selection *curr;
-	int i;
 
 	if (!sel)
 		return 1;
-	r.lu=sd->c[0];
-	r.rl=sd->c[0];
-	for (i = 1 ; i < sd->count ; i++) {
-		if (r.lu.x > sd->c[i].x)
-			r.lu.x=sd->c[i].x;
-		if (r.rl.x < sd->c[i].x)
-			r.rl.x=sd->c[i].x;
-		if (r.rl.y > sd->c[i].y)
-			r.rl.y=sd->c[i].y;
-		if (r.lu.y < sd->c[i].y)
-			r.lu.y=sd->c[i].y;
-	}
         curr=sel;
 	while (curr) {
 		struct coord_rect *sr=&curr->u.c_rect;
-		if (r.lu.x <= sr->rl.x && r.rl.x >= sr->lu.x &&
-		    r.lu.y >= sr->rl.y && r.rl.y <= sr->lu.y)
+		if (r->lu.x <= sr->rl.x && r->rl.x >= sr->lu.x &&
+		    r->lu.y >= sr->rl.y && r->rl.y <= sr->lu.y)
 			return 1;
 		curr=curr->next;
 	}
         return 0;
 }
 
+/**
+ * @brief Returns the squared distance from a point to a rectangle, 0 if the point is inside
+ */
+static long long
+tracking_rect_distance_sq(struct coord_rect *r, struct coord *c)
+{
+	long long dx=0,dy=0;
+
+	if (c->x < r->lu.x)
+		dx=(long long)r->lu.x-c->x;
+	else if (c->x > r->rl.x)
+		dx=(long long)c->x-r->rl.x;
+	if (c->y < r->rl.y)
+		dy=(long long)r->rl.y-c->y;
+	else if (c->y > r->lu.y)
+		dy=(long long)c->y-r->lu.y;
+	return dx*dx+dy*dy;
+}
+
+static int
+tracking_cell_index(int v)
+{
+	if (v >= 0)
+		return v/TRACKING_CELL_SIZE;
+	return -((-v-1)/TRACKING_CELL_SIZE)-1;
+}
+
+static int
+tracking_cell_slot(int v)
+{
+	int ret=v % TRACKING_WINDOW_SIZE;
+	if (ret < 0)
+		ret+=TRACKING_WINDOW_SIZE;
+	return ret;
+}
 
 static void
-tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection pro)
+tracking_cell_rect(struct tracking_cell *cell, struct coord_rect *r)
+{
+	r->lu.x=cell->x*TRACKING_CELL_SIZE;
+	r->rl.x=r->lu.x+TRACKING_CELL_SIZE-1;
+	r->rl.y=cell->y*TRACKING_CELL_SIZE;
+	r->lu.y=r->rl.y+TRACKING_CELL_SIZE-1;
+}
+
+static void
+tracking_cell_add_line(struct tracking_cell *cell, struct tracking_line *tl)
+{
+	if (cell->count == cell->size) {
+		cell->size=cell->size ? cell->size*2 : 16;
+		cell->lines=g_renew(struct tracking_line *, cell->lines, cell->size);
+	}
+	cell->lines[cell->count++]=tl;
+	tl->refs++;
+}
+
+/**
+ * @brief Loads the lines of the streets overlapping a cell
+ *
+ * Streets which are already loaded for another cell are shared, so their
+ * street data is neither fetched nor allocated again.
+ */
+static void
+tracking_cell_load(struct tracking *tr, struct tracking_cell *cell, enum projection pro)
 {
-	int max_dist=1000;
 	struct map_selection *sel;
 	struct mapset_handle *h;
 	struct map *m;
@@ -469,30 +560,51 @@ tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection p
 	struct street_data *street;
 	struct tracking_line *tl;
 	struct coord_geo g;
-	struct coord cc;
+	struct coord_rect cr,sr;
+	struct coord c[2];
+	int i;
 
-	dbg(lvl_debug,"enter\n");
+	tracking_cell_rect(cell, &cr);
+	tr->visit++;
 	h=mapset_open(tr->ms);
 	while ((m=mapset_next(h,2))) {
-		cc.x = pc->x;
-		cc.y = pc->y;
+		c[0]=cr.lu;
+		c[1]=cr.rl;
 		if (map_projection(m) != pro) {
-			transform_to_geo(pro, &cc, &g);
-			transform_from_geo(map_projection(m), &g, &cc);
+			for (i = 0 ; i < 2 ; i++) {
+				transform_to_geo(pro, &c[i], &g);
+				transform_from_geo(map_projection(m), &g, &c[i]);
+			}
 		}
-		sel = route_rect(18, &cc, &cc, 0, max_dist);
+		sel = route_rect(18, &c[0], &c[1], 0, 0);
 		mr=map_rect_new(m, sel);
-		if (!mr)
+		if (!mr) {
+			map_selection_destroy(sel);
 			continue;
+		}
 		while ((item=map_rect_get_item(mr))) {
 			if (item_get_default_flags(item->type)) {
+				tl=item_hash_lookup(tr->line_hash, item);
+				if (tl) {
+					if (tl->visited != tr->visit) {
+						tl->visited=tr->visit;
+						tracking_cell_add_line(cell, tl);
+					}
+					continue;
+				}
 				street=street_get_data(item);
-				if (street_data_within_selection(street, sel)) {
+				street_data_rect(street, &sr);
+				if (street_data_within_selection(&sr, sel)) {
 					tl=g_malloc(sizeof(struct tracking_line)+(street->count-1)*sizeof(int));
 					tl->street=street;
+					tl->r=sr;
+					tl->refs=0;
+					tl->visited=tr->visit;
 					tracking_get_angles(tl);
 					tl->next=tr->lines;
 					tr->lines=tl;
+					item_hash_insert(tr->line_hash, &street->item, tl);
+					tracking_cell_add_line(cell, tl);
 				} else
 					street_data_free(street);
 			}
@@ -501,7 +613,83 @@ tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection p
 		map_rect_destroy(mr);
 	}
 	mapset_close(h);
-	dbg(lvl_debug, "exit\n");
+	cell->loaded=1;
+}
+
+static void
+tracking_cell_evict(struct tracking_cell *cell)
+{
+	int i;
+
+	for (i = 0 ; i < cell->count ; i++)
+		cell->lines[i]->refs--;
+	cell->count=0;
+	cell->loaded=0;
+}
+
+static void
+tracking_line_free(struct tracking *tr, struct tracking_line *tl)
+{
+	if (tr->curr_line == tl)
+		tr->curr_line=NULL;
+	item_hash_remove(tr->line_hash, &tl->street->item);
+	street_data_free(tl->street);
+	g_free(tl);
+}
+
+/**
+ * @brief Checks whether the window was loaded around the cell of a position
+ */
+static int
+tracking_window_centered(struct tracking *tr, struct coord *pc)
+{
+	int cx=tracking_cell_index(pc->x),cy=tracking_cell_index(pc->y);
+	struct tracking_cell *cell=&tr->cells[tracking_cell_slot(cx)*TRACKING_WINDOW_SIZE+tracking_cell_slot(cy)];
+
+	return cell->loaded && cell->x == cx && cell->y == cy;
+}
+
+/**
+ * @brief Moves the window of loaded lines to a position
+ *
+ * Only the cells which enter the window are loaded, and only the lines which
+ * are in none of the remaining cells are freed.
+ */
+static void
+tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection pro)
+{
+	struct tracking_line **tl,*next;
+	int x,y,cx,cy,changed=0;
+
+	dbg(lvl_debug,"enter\n");
+	if (!tr->line_hash)
+		tr->line_hash=item_hash_new();
+	cx=tracking_cell_index(pc->x);
+	cy=tracking_cell_index(pc->y);
+	for (x = cx-TRACKING_CELL_RADIUS ; x <= cx+TRACKING_CELL_RADIUS ; x++) {
+		for (y = cy-TRACKING_CELL_RADIUS ; y <= cy+TRACKING_CELL_RADIUS ; y++) {
+			struct tracking_cell *cell=&tr->cells[tracking_cell_slot(x)*TRACKING_WINDOW_SIZE+tracking_cell_slot(y)];
+			if (cell->loaded && cell->x == x && cell->y == y)
+				continue;
+			tracking_cell_evict(cell);
+			cell->x=x;
+			cell->y=y;
+			tracking_cell_load(tr, cell, pro);
+			changed++;
+		}
+	}
+	if (changed) {
+		tl=&tr->lines;
+		while (*tl) {
+			next=(*tl)->next;
+			if (!(*tl)->refs) {
+				tracking_line_free(tr, *tl);
+				*tl=next;
+			} else
+				tl=&(*tl)->next;
+		}
+	}
+	dbg(lvl_debug, "exit, %d cells loaded\n", changed);
 }
 
 
@@ -509,12 +697,14 @@ void
 tracking_flush(struct tracking *tr)
 {
 	struct tracking_line *tl=tr->lines,*next;
+	int i;
 	dbg(lvl_debug,"enter(tr=%p)\n", tr);
 
+	for (i = 0 ; i < TRACKING_WINDOW_CELLS ; i++)
+		tracking_cell_evict(&tr->cells[i]);
 	while (tl) {
 		next=tl->next;
-		street_data_free(tl->street);
-		g_free(tl);
+		tracking_line_free(tr, tl);
 		tl=next;
 	}
 	tr->lines=NULL;
@@ -638,12 +828,41 @@ tracking_value(struct tracking *tr, struct tracking_line *t, int offset, struct
 	return value;
 }
 
+/**
+ * @brief Orders the cells of the window by their distance to a point
+ *
+ * @param tr The tracking object
+ * @param c The point
+ * @param cells Returns the cells, nearest first
+ * @param dist Returns the squared distances of the cells
+ */
+static void
+tracking_cells_by_distance(struct tracking *tr, struct coord *c, struct tracking_cell **cells, long long *dist)
+{
+	struct coord_rect r;
+	int i,j;
+
+	for (i = 0 ; i < TRACKING_WINDOW_CELLS ; i++) {
+		struct tracking_cell *cell=&tr->cells[i];
+		long long d;
+		tracking_cell_rect(cell, &r);
+		d=tracking_rect_distance_sq(&r, c);
+		for (j = i ; j > 0 && dist[j-1] > d ; j--) {
+			cells[j]=cells[j-1];
+			dist[j]=dist[j-1];
+		}
+		cells[j]=cell;
+		dist[j]=d;
+	}
+}
 
 void
 tracking_update(struct tracking *tr, struct vehicle *v, struct vehicleprofile *vehicleprofile, enum projection pro)
 {
 	struct tracking_line *t;
-	int i,value,min,time;
+	struct tracking_cell *cells[TRACKING_WINDOW_CELLS];
+	long long cell_dist[TRACKING_WINDOW_CELLS];
+	int i,j,k,value,min,time;
 	struct coord lpnt;
 	struct coord cin;
 	struct attr valid,speed_attr,direction_attr,coord_geo,lag,time_attr,static_speed,static_distance;
@@ -737,20 +956,29 @@ tracking_update(struct tracking *tr, struct vehicle *v, struct vehicleprofile *v
 	tr->last_out=tr->curr_out;
 	tr->last[0]=tr->curr[0];
 	tr->last[1]=tr->curr[1];
-	if (!tr->lines || transform_distance(pro, &tr->last_updated, &tr->curr_in) > 500) {
-		dbg(lvl_debug, "update\n");
+	if (!tr->lines && !tracking_window_centered(tr, &tr->curr_in)) {
+		/* Nothing found around the last position, maybe the maps were not available yet.
+		 * Retry once the position enters another cell, not on every fix. */
 		tracking_flush(tr);
-		tracking_doupdate_lines(tr, &tr->curr_in, pro);
-		tr->last_updated=tr->curr_in;
-		dbg(lvl_debug,"update end\n");
 	}
+	tracking_doupdate_lines(tr, &tr->curr_in, pro);
 	
 	tr->street_direction=0;
-	t=tr->lines;
 	tr->curr_line=NULL;
 	min=INT_MAX/2;
-	while (t) {
-		struct street_data *sd=t->street;
+	tracking_cells_by_distance(tr, &tr->curr_in, cells, cell_dist);
+	tr->visit++;
+	for (j = 0 ; j < TRACKING_WINDOW_CELLS && cell_dist[j] < min ; j++) {
+	    for (k = 0 ; k < cells[j]->count ; k++) {
+		struct street_data *sd;
+		t=cells[j]->lines[k];
+		if (t->visited == tr->visit)
+			continue;
+		t->visited=tr->visit;
+		/* No value is lower than the squared distance of the street */
+		if (tracking_rect_distance_sq(&t->r, &tr->curr_in) >= min)
+			continue;
+		sd=t->street;
 		for (i = 0; i < sd->count-1 ; i++) {
 			value=tracking_value(tr,t,i,&lpnt,min,-1);
 			if (value < min) {
@@ -780,7 +1008,7 @@ tracking_update(struct tracking *tr, struct vehicle *v, struct vehicleprofile *v
 				min=value;
 			}
 		}
-		t=t->next;
+	    }
 	}
 	dbg(lvl_debug,"tr->curr_line=%p min=%d\n", tr->curr_line, min);
 	if (!tr->curr_line || min > tr->offroad_limit_pref) {
@@ -921,9 +1149,15 @@ tracking_set_route(struct tracking *this, struct route *rt)
 void
 tracking_destroy(struct tracking *tr)
 {
+	int i;
+
 	if (tr->attr) 
 		attr_free(tr->attr);
 	tracking_flush(tr);
+	for (i = 0 ; i < TRACKING_WINDOW_CELLS ; i++)
+		g_free(tr->cells[i].lines);
+	if (tr->line_hash)
+		item_hash_destroy(tr->line_hash);
 	callback_list_destroy(tr->callback_list);
 	g_free(tr);
 }
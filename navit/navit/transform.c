@@ -35,6 +35,12 @@
 #include "point.h"
 
 #define POST_SHIFT 8
+/* Minimum number of coordinates for which transform() uses transform_2d(). Most drawn lines and areas only have a few
+ * coordinates left after the level of detail reduction, tests/transform_benchmark.c measures them to be faster down to 3
+ * coordinates, while segments of 2 coordinates are faster on the per point path. */
+#ifndef TRANSFORM_BATCH_MIN
+#define TRANSFORM_BATCH_MIN 3
+#endif
 
 /**
  * @brief The parameters needed to transform a map for display.
@@ -520,6 +526,69 @@ transform_z_clip_if_necessary(struct coord_3d coord, int zlimit, struct z_clip_r
 	return clip_result;
 }
 
+/**
+ * @brief Transforms an array of coordinates to screen points without 3d view
+ *
+ * Does the same as transform_shift_by_center_and_scale(), transform_rotate() and the
+ * 2d projection of transform(), but without branches or function calls per point, so the
+ * loop can be vectorized by the compiler.
+ *
+ * @param t The transformation, must not have a 3d view
+ * @param input The coordinates, in the projection of the transformation
+ * @param result The screen points, one per coordinate
+ * @param count The number of coordinates
+ */
+static void
+transform_2d(struct transformation *t, struct coord *input, struct point *result, int count)
+{
+	int cx=t->map_center.x,cy=t->map_center.y,shift=t->scale_shift;
+	int m00=t->m00,m01=t->m01,m10=t->m10,m11=t->m11;
+	int hx=HOG(*t)*t->m02,hy=HOG(*t)*t->m12;
+	int offx=t->offx,offy=t->offy;
+	int i,x,y;
+
+	for (i = 0 ; i < count ; i++) {
+		x=(input[i].x-cx) >> shift;
+		y=(input[i].y-cy) >> shift;
+		result[i].x=((x*m00+y*m01+hx) >> POST_SHIFT)+offx;
+		result[i].y=((x*m10+y*m11+hy) >> POST_SHIFT)+offy;
+	}
+}
+
+/**
+ * @brief Drops the screen points which are too close to their predecessor
+ *
+ * Applies the same rules as transform() to points computed by transform_2d(), in place.
+ *
+ * @return The number of points left
+ */
+static int
+transform_2d_filter(struct coord *input, struct point *result, int count, int mindist, int width, int *width_result)
+{
+	int i,result_idx=0,result_idx_last=0;
+
+	if (!mindist) {
+		if (width_result) {
+			for (i = 0 ; i < count ; i++)
+				width_result[i]=width;
+		}
+		return count;
+	}
+	for (i = 0 ; i < count ; i++) {
+		if (i != 0 && i != count-1 &&
+		    (input[i+1].x != input[0].x || input[i+1].y != input[0].y)) {
+			if (transform_points_too_close(result[i], result[result_idx_last], mindist))
+				continue;
+		}
+		result[result_idx]=result[i];
+		if (width_result)
+			width_result[result_idx]=width;
+		result_idx_last=result_idx;
+		result_idx++;
+	}
+	return result_idx;
+}
+
 int
 transform(struct transformation *t, enum projection required_projection, struct coord *input,
     struct point *result, int count, int mindist, int width, int *width_result)
@@ -531,6 +600,10 @@ transform(struct transformation *t, enum projection required_projection, struct
 	struct z_clip_result clip_result, clip_result_old={{0,0}, -1, 0, 0};
 	int i,result_idx = 0,result_idx_last=0;
 	dbg(lvl_debug,"count=%d\n", count);
+	if (!t->ddd && required_projection == t->pro && count >= TRANSFORM_BATCH_MIN) {
+		transform_2d(t, input, result, count);
+		return transform_2d_filter(input, result, count, mindist, width, width_result);
+	}
 	for (i=0; i < count; i++) {
 		dbg(lvl_debug, "input coord %d: (%d, %d)\n", i, input[i].x, input[i].y);
 #if 0 /* doesn't work as wanted */
@@ -1264,7 +1337,7 @@ transform_douglas_peucker(struct coord *in, int count, int dist_sq, struct coord
 {
 	int ret=0;
 	int i,d,dmax=0, idx=0;
-	for (i = 1; i < count-2 ; i++) {
+	for (i = 1; i < count-1 ; i++) {
 		d=transform_distance_line_sq(&in[0], &in[count-1], &in[i], NULL);
 		if (d > dmax) {
 			idx=i;
@@ -1289,7 +1362,7 @@ transform_douglas_peucker_float(struct coord *in, int count, navit_float dist_sq
 	int ret=0;
 	int i,idx=0;
 	navit_float d,dmax=0;
-	for (i = 1; i < count-2 ; i++) {
+	for (i = 1; i < count-1 ; i++) {
 		d=transform_distance_line_sq_float(&in[0], &in[count-1], &in[i], NULL);
 		if (d > dmax) {
 			idx=i;
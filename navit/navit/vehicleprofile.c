@@ -27,10 +27,19 @@
 #include "vehicleprofile.h"
 #include "callback.h"
 
+static int vehicleprofile_change_count;
+
+static void
+vehicleprofile_changed(struct vehicleprofile *this_)
+{
+	this_->change=++vehicleprofile_change_count;
+}
+
 static void
 vehicleprofile_set_attr_do(struct vehicleprofile *this_, struct attr *attr)
 {
 	dbg(lvl_debug,"%s:%ld\n", attr_to_name(attr->type), attr->u.num);
+	vehicleprofile_changed(this_);
 	switch (attr->type) {
 	case attr_flags:
 		this_->flags=attr->u.num;
@@ -91,6 +100,12 @@ vehicleprofile_set_attr_do(struct vehicleprofile *this_, struct attr *attr)
 	case attr_turn_around_penalty2:
 		this_->turn_around_penalty2=attr->u.num;
 		break;
+	case attr_route_search:
+		this_->route_search=attr->u.num;
+		break;
+	case attr_route_threads:
+		this_->route_threads=attr->u.num;
+		break;
 	default:
 		break;
 	}
@@ -133,14 +148,18 @@ vehicleprofile_clear(struct vehicleprofile *this_)
 	this_->weight=-1;
 	this_->axle_weight=-1;
 	this_->through_traffic_penalty=9000;
+	this_->route_search=0;
+	this_->route_threads=0;
 	vehicleprofile_free_hash(this_);
 	this_->roadprofile_hash=g_hash_table_new(NULL, NULL);
+	vehicleprofile_changed(this_);
 }
 
 static void
 vehicleprofile_apply_roadprofile(struct vehicleprofile *this_, struct navit_object *rp, int is_option)
 {
 	struct attr item_types_attr;
+	vehicleprofile_changed(this_);
 	if (rp->func->get_attr(rp, attr_item_types, &item_types_attr, NULL)) {
 		enum item_type *types=item_types_attr.u.item_types;
 		while (*types != type_none) {
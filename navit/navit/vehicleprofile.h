@@ -43,6 +43,11 @@ struct vehicleprofile {
 	struct attr active_callback;
 	int turn_around_penalty;		/**< Penalty when turning around */
 	int turn_around_penalty2;		/**< Penalty when turning around, for planned turn arounds */
+	int route_search;			/**< 0 = Dijkstra over the whole graph, 1 = A* with early termination,
+						  *  2 = contraction hierarchy of the map if available */
+	int route_threads;			/**< Number of worker threads reading thread safe maps into the route graph, 0 = none */
+	int change;				/**< Number of the last change of this profile, unique among all profiles.
+						  *  Results cached for the profile stay valid as long as it is the same */
 };
 
 struct vehicleprofile * vehicleprofile_new(struct attr *parent, struct attr **attrs);